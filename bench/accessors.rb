@@ -0,0 +1,52 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+# Measures time and allocated objects per call of the header accessors.
+#
+#   ruby -Ilib bench/accessors.rb [path/to/book.azw3] [iterations]
+#
+# Run it on two builds of the extension to compare them, the allocation
+# count does not depend on the machine.
+
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'libmobi'
+require 'benchmark'
+
+path = ARGV[0] || File.expand_path('../../test/fixtures/lorem.azw3', __FILE__)
+iterations = Integer(ARGV[1] || 20_000)
+
+book = MOBI::Book.new(path)
+book.rawml_parts
+
+accessors = {
+  'pdb_header' => -> { book.pdb_header },
+  'record0_header' => -> { book.record0_header },
+  'mobi_header' => -> { book.mobi_header },
+  'exth_header' => -> { book.exth_header },
+  'each_record' => -> { book.each_record(payload: false) { |_| } },
+  'rawml_parts' => -> { book.rawml_parts }
+}
+
+printf("%-16s %12s %14s\n", 'accessor', 'us/call', 'objects/call')
+accessors.each do |name, accessor|
+  accessor.call
+  GC.start
+  before = GC.stat(:total_allocated_objects)
+  elapsed = Benchmark.realtime { iterations.times { accessor.call } }
+  allocated = GC.stat(:total_allocated_objects) - before
+  printf("%-16s %12.3f %14.1f\n", name, elapsed * 1_000_000 / iterations, allocated.to_f / iterations)
+end
@@ -0,0 +1,261 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Builds synthetic MOBI 6 books of the given size and shape for the
+# benchmarks, the text is generated from a fixed vocabulary, so the same
+# options always produce the same file.
+#
+#   ruby bench/generator.rb [options] path/to/book.mobi
+#
+# Hybrid books get the KF8 half of test/fixtures/lorem.azw3 after the
+# boundary record, the generator does not write KF8 indexes itself.
+
+require 'optparse'
+
+class SyntheticBook
+  RECORD_SIZE = 4096
+  # distinct text records, the rest of the text repeats them, so that the
+  # generator does not have to compress every record
+  PAGES = 64
+  WORDS = %w[lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor incididunt ut labore et
+             dolore magna aliqua enim ad minim veniam quis nostrud exercitation ullamco laboris nisi aliquip ex ea
+             commodo consequat duis aute irure in reprehenderit voluptate velit esse cillum fugiat nulla pariatur
+             excepteur sint occaecat cupidatat non proident sunt culpa qui officia deserunt mollit anim id est
+             laborum].freeze
+  KF8_FIXTURE = File.expand_path('../../test/fixtures/lorem.azw3', __FILE__)
+
+  DEFAULTS = {
+    text_size: 1 << 20,
+    compression: :palmdoc,
+    images: 0,
+    image_size: 16 << 10,
+    exth: 0,
+    exth_size: 64,
+    hybrid: false,
+    seed: 1
+  }.freeze
+
+  attr_reader :options
+
+  def initialize(options = {})
+    @options = DEFAULTS.merge(options)
+    unless [:palmdoc, :none].include?(@options[:compression])
+      raise ArgumentError, "unknown compression: #{@options[:compression]}"
+    end
+    raise ArgumentError, 'text_size must be positive' unless @options[:text_size] > 0
+  end
+
+  def write(path)
+    File.binwrite(path, to_s)
+    path
+  end
+
+  def to_s
+    text = text_records
+    images = Array.new(options[:images]) { |i| image(i) }
+    records = [nil, *text.map { |_, data| data }]
+    first_image = records.size
+    records.concat(images)
+    flis = records.size
+    text_length = text.inject(0) { |sum, (length, _)| sum + length }
+    records << flis_record << fcis_record(text_length)
+    records << "\xE9\x8E\r\n".b
+    if options[:hybrid]
+      records << 'BOUNDARY'.b
+      boundary = records.size
+      records.concat(kf8_records)
+    end
+    records[0] = record0(text_length, text.size, first_image, flis, boundary)
+    pdb(records)
+  end
+
+  # Greedy LZ77 as in PalmDOC: back references of 3 to 10 bytes within 2047
+  # bytes, space followed by a letter as one byte, and literal runs for the
+  # bytes above 0x7f.
+  def self.palmdoc(data)
+    out = ''.b
+    table = {}
+    size = data.bytesize
+    i = 0
+    while i < size
+      if i + 3 <= size
+        key = data.byteslice(i, 3)
+        j = table[key]
+        table[key] = i
+        if j && i - j <= 2047
+          length = 3
+          length += 1 while length < 10 && i + length < size && data.getbyte(j + length) == data.getbyte(i + length)
+          out << [0x8000 | ((i - j) << 3) | (length - 3)].pack('n')
+          i += length
+          next
+        end
+      end
+      byte = data.getbyte(i)
+      following = data.getbyte(i + 1)
+      if byte == 0x20 && following && following >= 0x40 && following <= 0x7f
+        out << (following ^ 0x80)
+        i += 2
+      elsif byte.zero? || (byte >= 0x09 && byte <= 0x7f)
+        out << byte
+        i += 1
+      else
+        out << 1 << byte
+        i += 1
+      end
+    end
+    out
+  end
+
+  private
+
+  # [decompressed length, record] of every text record
+  def text_records
+    random = Random.new(options[:seed])
+    size = options[:text_size]
+    head = "<html><head><guide></guide></head><body>\n".b
+    tail = gallery + "</body></html>\n".b
+    body = [size - head.bytesize - tail.bytesize, RECORD_SIZE].max
+    count = (body + RECORD_SIZE - 1) / RECORD_SIZE
+    pages = Array.new([count, PAGES].min) { page(random) }
+    encoded = {}
+    text = head.dup
+    records = []
+    count.times do |i|
+      data = pages[i % pages.size]
+      data = data.byteslice(0, body - i * RECORD_SIZE) if i == count - 1
+      text << data
+      while text.bytesize >= RECORD_SIZE
+        chunk = text.byteslice(0, RECORD_SIZE)
+        text = text.byteslice(chunk.bytesize..-1)
+        records << [chunk.bytesize, encoded[chunk] ||= encode(chunk)]
+      end
+    end
+    text << tail
+    until text.empty?
+      chunk = text.byteslice(0, RECORD_SIZE)
+      text = text.byteslice(chunk.bytesize..-1)
+      records << [chunk.bytesize, encoded[chunk] ||= encode(chunk)]
+    end
+    records
+  end
+
+  # one record of paragraphs
+  def page(random)
+    text = ''.b
+    while text.bytesize < RECORD_SIZE
+      words = Array.new(20 + random.rand(80)) { WORDS[random.rand(WORDS.size)] }
+      text << '<p>' << words.join(' ') << ".</p>\n"
+    end
+    text.byteslice(0, RECORD_SIZE)
+  end
+
+  def gallery
+    Array.new(options[:images]) { |i| format("<p><img recindex=\"%05d\" /></p>\n", i + 1) }.join.b
+  end
+
+  # records without multibyte or TBS trailing entries, extra flags are 0
+  def encode(chunk)
+    options[:compression] == :palmdoc ? self.class.palmdoc(chunk) : chunk
+  end
+
+  def image(index)
+    header = ['GIF89a', 1, 1, 0, 0, 0].pack('a6vvCCC')
+    filler = [index].pack('N') * ((options[:image_size] - header.bytesize) / 4 + 1)
+    (header + filler).byteslice(0, [options[:image_size], header.bytesize].max)
+  end
+
+  def flis_record
+    ['FLIS', 8, 65, 0, 0, 0xffffffff, 1, 3, 3, 1, 0xffffffff].pack('a4NnnNNnnNNN')
+  end
+
+  def fcis_record(text_length)
+    ['FCIS', 20, 16, 1, 0, text_length, 0, 32, 8, 1, 1, 0].pack('a4NNNNNNNNnnN')
+  end
+
+  def exth(boundary)
+    entries = [
+      [503, 'Synthetic Book'],
+      [100, 'libmobi bench'],
+      [103, 'Generated by bench/generator.rb'],
+      [113, format('B%09d', options[:seed])]
+    ]
+    filler = ('x' * options[:exth_size]).b
+    options[:exth].times { entries << [105, filler] }
+    entries << [121, [boundary].pack('N')] if boundary
+    data = entries.map { |tag, value| [tag, value.bytesize + 8].pack('NN') + value.b }.join
+    exth = ['EXTH', data.bytesize + 12, entries.size].pack('a4NN') + data
+    exth + "\0" * (-exth.bytesize % 4)
+  end
+
+  def record0(text_length, text_count, first_image, flis, boundary)
+    name = 'Synthetic Book'.b
+    exth = exth(boundary)
+    header = "\0".b * 248
+    compression = options[:compression] == :palmdoc ? 2 : 1
+    header[0, 16] = [compression, 0, text_length, text_count, RECORD_SIZE, 0, 0].pack('nnNnnnn')
+    header[16, 24] = ['MOBI', 232, 2, 65001, options[:seed], 6].pack('a4NNNNN')
+    header[40, 40] = ([0xffffffff] * 10).pack('N*')
+    header[80, 12] = [first_image, 248 + exth.bytesize, name.bytesize].pack('NNN')
+    header[92, 24] = [9, 0, 0, 6, first_image, 0].pack('N*')
+    header[128, 4] = [0x40].pack('N')
+    header[164, 8] = [0xffffffff, 0xffffffff].pack('NN')
+    header[192, 24] = [1, text_count, 1, flis + 1, 1, flis, 1].pack('nnNNNNN')
+    header[224, 4] = [0xffffffff].pack('N')
+    header[232, 16] = [0xffffffff, 0xffffffff, 0, 0xffffffff].pack('NNNN')
+    record = header + exth + name
+    record + "\0" * (4 - record.bytesize % 4)
+  end
+
+  def kf8_records
+    data = File.binread(KF8_FIXTURE)
+    count = data.unpack('@76n').first
+    offsets = data.unpack("@78#{'Nx4' * count}") << data.bytesize
+    Array.new(count) { |i| data.byteslice(offsets[i], offsets[i + 1] - offsets[i]) }
+  end
+
+  def pdb(records)
+    raise ArgumentError, "too many records: #{records.size}" if records.size > 0xffff
+    name = 'Synthetic_Book'.b
+    offset = 78 + records.size * 8 + 2
+    table = ''.b
+    records.each_with_index do |record, i|
+      table << [offset, i * 2].pack('NN')
+      offset += record.bytesize
+    end
+    now = Time.now.to_i + 2_082_844_800
+    header = [name, 0, 0, now, now, 0, 0, 0, 0, 'BOOK', 'MOBI', records.size * 2 - 1, 0, records.size]
+             .pack('a32nnNNNNNNa4a4NNn')
+    header + table + "\0\0".b + records.join.b
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  options = {}
+  parser = OptionParser.new do |opts|
+    opts.banner = 'Usage: ruby bench/generator.rb [options] path/to/book.mobi'
+    opts.on('--text-size BYTES', Integer, 'size of the decompressed text') { |v| options[:text_size] = v }
+    opts.on('--compression NAME', [:palmdoc, :none], 'palmdoc or none') { |v| options[:compression] = v }
+    opts.on('--images COUNT', Integer, 'number of image records') { |v| options[:images] = v }
+    opts.on('--image-size BYTES', Integer, 'size of every image record') { |v| options[:image_size] = v }
+    opts.on('--exth COUNT', Integer, 'number of extra EXTH records') { |v| options[:exth] = v }
+    opts.on('--exth-size BYTES', Integer, 'size of every extra EXTH record') { |v| options[:exth_size] = v }
+    opts.on('--hybrid', 'append the KF8 half of the fixture') { options[:hybrid] = true }
+    opts.on('--seed NUMBER', Integer, 'seed of the text generator') { |v| options[:seed] = v }
+  end
+  parser.parse!
+  abort parser.banner unless ARGV.size == 1
+  SyntheticBook.new(options).write(ARGV[0])
+end
@@ -0,0 +1,52 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Compares PalmDOC decoders on Book#rawml, libmobi's mobi_get_rawml() is
+# listed as "reference". For HUFF/CDIC books all native rows use the same
+# decoder, with the tables served from MOBI::HuffCDIC cache.
+#
+#   ruby -Ilib bench/palmdoc.rb [path/to/book.azw3] [iterations]
+#
+# Every implementation runs in its own process, because the decoder is
+# chosen with MOBI_PALMDOC environment variable when the extension loads.
+
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'libmobi'
+require 'benchmark'
+require 'rbconfig'
+
+path = ARGV[0] || File.expand_path('../../test/fixtures/lorem.azw3', __FILE__)
+iterations = Integer(ARGV[1] || 2000)
+
+if ENV['MOBI_PALMDOC_CHILD']
+  book = MOBI::Book.new(path)
+  size = book.rawml.bytesize
+  elapsed = Benchmark.realtime do
+    iterations.times do
+      book.release_caches
+      book.rawml
+    end
+  end
+  printf("%-10s %12.3f %12.1f\n", MOBI::PalmDOC.implementation, elapsed * 1_000_000 / iterations,
+         size * iterations / elapsed / 1_000_000)
+  exit
+end
+
+printf("%-10s %12s %12s\n", 'decoder', 'us/rawml', 'MB/s')
+['reference', *MOBI::PalmDOC.implementations].each do |name|
+  env = { 'MOBI_PALMDOC' => name, 'MOBI_PALMDOC_CHILD' => '1' }
+  system(env, RbConfig.ruby, *$LOAD_PATH.map { |dir| "-I#{dir}" }, __FILE__, path, iterations.to_s)
+end
@@ -0,0 +1,173 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Measures loading and the main accessors on the synthetic books of
+# bench/generator.rb: throughput, allocated objects per call and peak RSS.
+#
+#   rake bench
+#   ruby -Ilib bench/suite.rb [book ...]
+#
+# BENCH_SCALE multiplies the size of the books (1 by default), BENCH_TIME is
+# the number of seconds spent on every measurement (1 by default), and the
+# results are written as JSON to BENCH_OUTPUT, or to bench/results/. The
+# books are kept in BENCH_CORPUS, or in the temporary directory, and are
+# generated again when their options change.
+#
+# Every book is measured in its own process, so that peak RSS is of that
+# book alone. It is reset before every operation where Linux allows it, and
+# is null where /proc/self/status is not available.
+
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'libmobi'
+require 'digest'
+require 'json'
+require 'rbconfig'
+require 'tmpdir'
+require 'fileutils'
+require_relative 'generator'
+
+SCALE = Float(ENV['BENCH_SCALE'] || 1)
+DURATION = Float(ENV['BENCH_TIME'] || 1)
+
+BOOKS = {
+  'palmdoc_small' => { text_size: 256 << 10 },
+  'palmdoc_large' => { text_size: 32 << 20 },
+  'uncompressed_large' => { text_size: 32 << 20, compression: :none },
+  'images' => { text_size: 1 << 20, images: 1000, image_size: 32 << 10 },
+  'exth_large' => { text_size: 64 << 10, exth: 4000, exth_size: 256 },
+  'hybrid' => { text_size: 4 << 20, images: 50, hybrid: true }
+}.freeze
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def peak_rss_kb
+  status = File.read('/proc/self/status')
+  status[/^VmHWM:\s*(\d+)/, 1].to_i
+rescue SystemCallError
+  nil
+end
+
+def reset_peak_rss
+  File.write('/proc/self/clear_refs', '5')
+rescue SystemCallError
+  nil
+end
+
+# Calls the block until DURATION has passed, at least three times
+def measure(bytes)
+  yield
+  GC.start
+  reset_peak_rss
+  allocated = GC.stat(:total_allocated_objects)
+  iterations = 0
+  started = now
+  loop do
+    yield
+    iterations += 1
+    break if iterations >= 3 && now - started >= DURATION
+  end
+  elapsed = now - started
+  {
+    'iterations' => iterations,
+    'seconds' => elapsed,
+    'ops_per_sec' => iterations / elapsed,
+    'mb_per_sec' => bytes && bytes * iterations / elapsed / 1_000_000,
+    'objects_per_op' => (GC.stat(:total_allocated_objects) - allocated).to_f / iterations,
+    'peak_rss_kb' => peak_rss_kb
+  }
+end
+
+if ENV['MOBI_BENCH_CHILD']
+  path = ARGV[0]
+  size = File.size(path)
+  book = MOBI::Book.new(path)
+  rawml = book.rawml.bytesize
+  parts = book.rawml_parts
+  parts_size = parts.values_at(:markup, :flow, :resources).compact.flatten.inject(0) { |sum, part| sum + part[:size] }
+  operations = {
+    'load' => measure(size) { MOBI::Book.new(path) },
+    'load_mmap' => measure(size) { MOBI::Book.new(path, mmap: true) },
+    'rawml' => measure(rawml) do
+      book.release_caches
+      book.rawml
+    end,
+    'rawml_parts' => measure(parts_size) do
+      book.release_caches
+      book.rawml_parts
+    end,
+    'records' => measure(size) { book.records },
+    'headers' => measure(nil) do
+      book.pdb_header
+      book.record0_header
+      book.mobi_header
+      book.exth_header
+      book.title
+      book.author
+    end
+  }
+  puts JSON.generate('file_size' => size, 'rawml_size' => rawml, 'records' => book.records.size,
+                     'operations' => operations)
+  exit
+end
+
+names = ARGV.empty? ? BOOKS.keys : ARGV
+unknown = names - BOOKS.keys
+abort "unknown books: #{unknown.join(', ')}, known are: #{BOOKS.keys.join(', ')}" unless unknown.empty?
+
+corpus = ENV['BENCH_CORPUS'] || File.join(Dir.tmpdir, 'libmobi-bench')
+FileUtils.mkdir_p(corpus)
+
+results = {
+  'version' => 1,
+  'library' => MOBI::VERSION,
+  'libmobi' => MOBI::LIB_VERSION,
+  'ruby' => RUBY_DESCRIPTION,
+  'time' => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+  'scale' => SCALE,
+  'duration' => DURATION,
+  'books' => {}
+}
+
+printf("%-20s %-12s %12s %12s %14s %12s\n", 'book', 'operation', 'ops/s', 'MB/s', 'objects/op', 'peak RSS kB')
+names.each do |name|
+  options = BOOKS[name].dup
+  options[:text_size] = (options[:text_size] * SCALE).to_i
+  options[:images] = (options[:images] * SCALE).to_i if options[:images]
+  options[:exth] = (options[:exth] * SCALE).to_i if options[:exth]
+  options = SyntheticBook::DEFAULTS.merge(options)
+  path = File.join(corpus, format('%s-%s.mobi', name, Digest::SHA1.hexdigest(options.inspect)[0, 8]))
+  SyntheticBook.new(options).write(path) unless File.exist?(path)
+
+  env = { 'MOBI_BENCH_CHILD' => '1' }
+  output = IO.popen([env, RbConfig.ruby, *$LOAD_PATH.map { |dir| "-I#{dir}" }, __FILE__, path], &:read)
+  abort "#{name}: the benchmark has failed" unless $?.success?
+  result = JSON.parse(output)
+  result['options'] = options
+  results['books'][name] = result
+  result['operations'].each do |operation, stats|
+    printf("%-20s %-12s %12.1f %12s %14.1f %12s\n", name, operation, stats['ops_per_sec'],
+           stats['mb_per_sec'] ? format('%.1f', stats['mb_per_sec']) : '-', stats['objects_per_op'],
+           stats['peak_rss_kb'] || '-')
+  end
+end
+
+output = ENV['BENCH_OUTPUT'] ||
+         File.expand_path("results/#{Time.now.utc.strftime('%Y%m%d-%H%M%S')}.json", File.dirname(__FILE__))
+FileUtils.mkdir_p(File.dirname(output))
+File.write(output, JSON.pretty_generate(results) + "\n")
+puts "results: #{output}"
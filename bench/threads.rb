@@ -0,0 +1,45 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Compares serial and multi-threaded parsing of the same book.
+#
+#   ruby -Ilib bench/threads.rb [path/to/book.azw3] [threads] [iterations]
+#
+# The parsing runs without GVL, so the threaded run should be close to
+# N times faster on a machine with N free cores.
+
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'libmobi'
+require 'benchmark'
+
+path = ARGV[0] || File.expand_path('../../test/fixtures/lorem.azw3', __FILE__)
+threads = Integer(ARGV[1] || 4)
+iterations = Integer(ARGV[2] || 200)
+
+work = lambda do
+  iterations.times do
+    book = MOBI::Book.new(path)
+    book.rawml
+    book.rawml_parts
+  end
+end
+
+serial = Benchmark.realtime { threads.times { work.call } }
+parallel = Benchmark.realtime { Array.new(threads) { Thread.new(&work) }.each(&:join) }
+
+printf("%-10s %10.3fs\n", 'serial', serial)
+printf("%-10s %10.3fs\n", "#{threads} threads", parallel)
+printf("%-10s %10.2fx\n", 'speedup', serial / parallel)
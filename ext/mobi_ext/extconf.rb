@@ -23,6 +23,15 @@ end
 
 pkg_config('libmobi') || abort('libmobi headers not found. (dnf install libmobi-devel on Fedora)')
 
+have_func('fmemopen', 'stdio.h')
+have_func('mmap', 'sys/mman.h')
+have_func('madvise', 'sys/mman.h')
+have_func('copy_file_range', 'unistd.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+have_header('sys/sdt.h')
+have_header('pthread.h') && have_library('pthread', 'pthread_create')
+have_header('zlib.h') && have_library('z', 'deflate')
+
 $CFLAGS << ' -pedantic -Wall -Wextra -Werror '
 if ENV['DEBUG_BUILD']
   $CFLAGS.gsub!(/\W-Wp,-D_FORTIFY_SOURCE=\d+\W/, ' ')
@@ -0,0 +1,380 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_config.h"
+#include "mobi_cache.h"
+#include "mobi_decode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MB_CACHE_BYTE_ORDER 0x01020304u
+
+/* Record payload, the parts pointing into it are stored as references */
+typedef struct mb_CACHE_SLICE {
+    uintptr_t start;
+    size_t size;
+    uint32_t record;
+} mb_CACHE_SLICE;
+
+static uint64_t mb_cache_mix(uint64_t hash, uint64_t value)
+{
+    return (hash ^ value) * 0x100000001b3ULL;
+}
+
+/*
+ * Hash of the PDB header, the record table, and the payloads of record 0,
+ * the KF8 boundary and the KF8 record 0. The size and modification time of
+ * the file are checked first, so the rest of the records is not read.
+ */
+static uint64_t mb_cache_hash(const MOBIData *m)
+{
+    const MOBIPdbHeader *ph = m->ph;
+    const MOBIPdbRecord *rec;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t seqnumber, i;
+
+    if (ph) {
+        for (i = 0; i < sizeof(ph->name) && ph->name[i]; i++) {
+            hash = mb_cache_mix(hash, (unsigned char)ph->name[i]);
+        }
+        hash = mb_cache_mix(hash, (uint64_t)ph->attributes << 16 | ph->version);
+        hash = mb_cache_mix(hash, (uint64_t)ph->ctime << 32 | ph->mtime);
+        hash = mb_cache_mix(hash, (uint64_t)ph->btime << 32 | ph->mod_num);
+        hash = mb_cache_mix(hash, (uint64_t)ph->appinfo_offset << 32 | ph->sortinfo_offset);
+        for (i = 0; i < 4; i++) {
+            hash = mb_cache_mix(hash, (uint64_t)(unsigned char)ph->type[i] << 8 | (unsigned char)ph->creator[i]);
+        }
+        hash = mb_cache_mix(hash, (uint64_t)ph->uid << 32 | ph->next_rec);
+        hash = mb_cache_mix(hash, ph->rec_count);
+    }
+    for (rec = m->rec, seqnumber = 0; rec != NULL; rec = rec->next, seqnumber++) {
+        hash = mb_cache_mix(hash, (uint64_t)rec->offset << 32 | rec->uid);
+        hash = mb_cache_mix(hash, (uint64_t)rec->size << 8 | rec->attributes);
+        if (rec->data && (seqnumber == 0 || (m->kf8_boundary_offset != MOBI_NOTSET &&
+                                             (seqnumber == m->kf8_boundary_offset ||
+                                              seqnumber == m->kf8_boundary_offset + 1)))) {
+            hash = mb_cache_mix(hash, mb_records_hash(rec, 1));
+        }
+    }
+    return hash;
+}
+
+/* Array of the records by their sequential numbers */
+static const MOBIPdbRecord **mb_cache_records(const MOBIData *m, size_t *count)
+{
+    const MOBIPdbRecord *rec, **records;
+    size_t n = 0;
+
+    for (rec = m->rec; rec != NULL; rec = rec->next) {
+        n++;
+    }
+    records = malloc((n ? n : 1) * sizeof(MOBIPdbRecord *));
+    if (records == NULL) {
+        return NULL;
+    }
+    n = 0;
+    for (rec = m->rec; rec != NULL; rec = rec->next) {
+        records[n++] = rec;
+    }
+    *count = n;
+    return records;
+}
+
+static int mb_cache_slice_cmp(const void *a, const void *b)
+{
+    const mb_CACHE_SLICE *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Find the record holding whole part, returns NULL when it has been built by libmobi */
+static const mb_CACHE_SLICE *mb_cache_slice_find(const mb_CACHE_SLICE *slices, size_t count, const MOBIPart *part)
+{
+    uintptr_t ptr = (uintptr_t)part->data;
+    size_t lo = 0, hi = count, mid;
+
+    /* the last slice starting at or before the part */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (slices[mid].start <= ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || part->data == NULL) {
+        return NULL;
+    }
+    lo--;
+    if (ptr - slices[lo].start > slices[lo].size || part->size > slices[lo].size - (ptr - slices[lo].start)) {
+        return NULL;
+    }
+    return &slices[lo];
+}
+
+static size_t mb_cache_parts_count(const MOBIPart *part)
+{
+    size_t n = 0;
+    for (; part != NULL; part = part->next) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Fill the table entries of the part list. The payload of the parts built by
+ * libmobi is appended at *payload_size.
+ */
+static size_t mb_cache_fill_parts(mb_CACHE_PART *out, uint32_t kind, const MOBIPart *part,
+                                  const mb_CACHE_SLICE *slices, size_t slices_count, uint64_t *payload_size)
+{
+    const mb_CACHE_SLICE *slice;
+    size_t n = 0;
+
+    for (; part != NULL; part = part->next, n++) {
+        out[n].kind = kind;
+        out[n].type = (uint32_t)part->type;
+        out[n].uid = part->uid;
+        out[n].size = part->size;
+        slice = mb_cache_slice_find(slices, slices_count, part);
+        if (slice) {
+            out[n].record = slice->record;
+            out[n].offset = (uintptr_t)part->data - slice->start;
+        } else {
+            out[n].record = MB_CACHE_OWN;
+            out[n].offset = *payload_size;
+            *payload_size += part->size;
+        }
+    }
+    return n;
+}
+
+static int mb_cache_write_parts(FILE *file, const MOBIPart *part)
+{
+    for (; part != NULL; part = part->next) {
+        if (part->size && fwrite(part->data, part->size, 1, file) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Offsets of the text records in the decompressed text, the records are
+ * decompressed once more to learn their lengths. Returns zero count when
+ * they cannot be read natively.
+ */
+static uint64_t *mb_cache_text_offsets(const MOBIData *m, uint32_t *count)
+{
+    mb_TEXT_READER reader;
+    uint64_t *offsets;
+    size_t i, len;
+
+    *count = 0;
+    if (mb_text_reader_init(&reader, m) != MOBI_SUCCESS) {
+        mb_text_reader_free(&reader);
+        return calloc(1, sizeof(uint64_t));
+    }
+    offsets = calloc(reader.count + 1, sizeof(uint64_t));
+    if (offsets == NULL) {
+        mb_text_reader_free(&reader);
+        return NULL;
+    }
+    for (i = 0; i < reader.count; i++) {
+        if (mb_text_reader_read(&reader, i, &len) != MOBI_SUCCESS) {
+            mb_text_reader_free(&reader);
+            memset(offsets, 0, sizeof(uint64_t));
+            return offsets;
+        }
+        offsets[i + 1] = offsets[i] + len;
+    }
+    *count = (uint32_t)reader.count;
+    mb_text_reader_free(&reader);
+    return offsets;
+}
+
+MOBI_RET mb_cache_write(const char *path, const mb_CACHE_KEY *key, const MOBIData *m, const MOBIRawml *rawml)
+{
+    static const unsigned char padding[8] = {0};
+    mb_CACHE_HEADER header;
+    mb_CACHE_SLICE *slices = NULL;
+    mb_CACHE_PART *parts = NULL;
+    const MOBIPdbRecord **records = NULL;
+    uint64_t *offsets = NULL;
+    size_t records_count = 0, slices_count = 0, parts_count, i, tables;
+    char *tmp = NULL;
+    FILE *file = NULL;
+    MOBI_RET rc = MOBI_MALLOC_FAILED;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MB_CACHE_MAGIC, sizeof(MB_CACHE_MAGIC));
+    header.version = MB_CACHE_VERSION;
+    header.byte_order = MB_CACHE_BYTE_ORDER;
+    header.key = *key;
+    header.key.hash = mb_cache_hash(m);
+    header.rawml_version = (uint32_t)rawml->version;
+
+    records = mb_cache_records(m, &records_count);
+    slices = malloc((records_count ? records_count : 1) * sizeof(mb_CACHE_SLICE));
+    parts_count = mb_cache_parts_count(rawml->markup) + mb_cache_parts_count(rawml->flow) +
+                  mb_cache_parts_count(rawml->resources);
+    parts = calloc(parts_count ? parts_count : 1, sizeof(mb_CACHE_PART));
+    offsets = mb_cache_text_offsets(m, &header.text_count);
+    tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (records == NULL || slices == NULL || parts == NULL || offsets == NULL || tmp == NULL) {
+        goto done;
+    }
+    for (i = 0; i < records_count; i++) {
+        if (records[i]->data != NULL && records[i]->size > 0) {
+            slices[slices_count].start = (uintptr_t)records[i]->data;
+            slices[slices_count].size = records[i]->size;
+            slices[slices_count].record = (uint32_t)i;
+            slices_count++;
+        }
+    }
+    if (slices_count > 1) {
+        qsort(slices, slices_count, sizeof(mb_CACHE_SLICE), mb_cache_slice_cmp);
+    }
+    i = mb_cache_fill_parts(parts, MB_CACHE_MARKUP, rawml->markup, slices, slices_count, &header.payload_size);
+    i += mb_cache_fill_parts(parts + i, MB_CACHE_FLOW, rawml->flow, slices, slices_count, &header.payload_size);
+    mb_cache_fill_parts(parts + i, MB_CACHE_RESOURCE, rawml->resources, slices, slices_count, &header.payload_size);
+    header.parts_count = (uint32_t)parts_count;
+    tables = sizeof(header) + (header.text_count + 1) * sizeof(uint64_t) + parts_count * sizeof(mb_CACHE_PART);
+    header.payload_offset = (tables + 7) & ~(size_t)7;
+
+    /* the cache is replaced atomically, so that readers never see it half-written */
+    sprintf(tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        rc = MOBI_WRITE_FAILED;
+        goto done;
+    }
+    file = fdopen(fd, "wb");
+    if (file == NULL) {
+        close(fd);
+        unlink(tmp);
+        rc = MOBI_WRITE_FAILED;
+        goto done;
+    }
+    rc = MOBI_WRITE_FAILED;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(offsets, sizeof(uint64_t), header.text_count + 1, file) != header.text_count + 1 ||
+        (parts_count && fwrite(parts, sizeof(mb_CACHE_PART), parts_count, file) != parts_count) ||
+        (header.payload_offset > tables && fwrite(padding, header.payload_offset - tables, 1, file) != 1) ||
+        !mb_cache_write_parts(file, rawml->markup) || !mb_cache_write_parts(file, rawml->flow) ||
+        !mb_cache_write_parts(file, rawml->resources)) {
+        fclose(file);
+        unlink(tmp);
+        goto done;
+    }
+    if (fclose(file) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        goto done;
+    }
+    rc = MOBI_SUCCESS;
+
+done:
+    free(tmp);
+    free(offsets);
+    free(parts);
+    free(slices);
+    free(records);
+    return rc;
+}
+
+/* Check the cache against the book, and resolve the payload of the parts */
+static MOBI_RET mb_cache_check(mb_CACHE *cache, const mb_CACHE_KEY *key, const MOBIData *m)
+{
+    const mb_CACHE_HEADER *header;
+    const MOBIPdbRecord **records;
+    const unsigned char *payload;
+    size_t records_count = 0, tables, i;
+    MOBI_RET rc = MOBI_SUCCESS;
+
+    if (cache->map.size < sizeof(mb_CACHE_HEADER)) {
+        return MOBI_DATA_CORRUPT;
+    }
+    header = (const mb_CACHE_HEADER *)cache->map.addr;
+    if (memcmp(header->magic, MB_CACHE_MAGIC, sizeof(MB_CACHE_MAGIC)) != 0 || header->version != MB_CACHE_VERSION ||
+        header->byte_order != MB_CACHE_BYTE_ORDER) {
+        return MOBI_DATA_CORRUPT;
+    }
+    if (header->key.size != key->size || header->key.mtime != key->mtime || header->key.hash != mb_cache_hash(m)) {
+        return MOBI_DATA_CORRUPT;
+    }
+    if (header->text_count != 0 && (m->rh == NULL || header->text_count != m->rh->text_record_count)) {
+        return MOBI_DATA_CORRUPT;
+    }
+    /* both counts are 32-bit, so the tables cannot overflow */
+    tables = sizeof(mb_CACHE_HEADER) + ((size_t)header->text_count + 1) * sizeof(uint64_t) +
+             (size_t)header->parts_count * sizeof(mb_CACHE_PART);
+    if (header->payload_offset < tables || header->payload_offset % 8 != 0 ||
+        header->payload_offset > cache->map.size || header->payload_size > cache->map.size - header->payload_offset) {
+        return MOBI_DATA_CORRUPT;
+    }
+    cache->header = header;
+    cache->text_offsets = (const uint64_t *)(cache->map.addr + sizeof(mb_CACHE_HEADER));
+    cache->parts = (const mb_CACHE_PART *)(cache->text_offsets + header->text_count + 1);
+    cache->data = calloc(header->parts_count ? header->parts_count : 1, sizeof(unsigned char *));
+    records = mb_cache_records(m, &records_count);
+    if (cache->data == NULL || records == NULL) {
+        free(records);
+        return MOBI_MALLOC_FAILED;
+    }
+    payload = cache->map.addr + header->payload_offset;
+    for (i = 0; i < header->parts_count && rc == MOBI_SUCCESS; i++) {
+        const mb_CACHE_PART *part = &cache->parts[i];
+
+        if (part->kind > MB_CACHE_RESOURCE) {
+            rc = MOBI_DATA_CORRUPT;
+        } else if (part->record == MB_CACHE_OWN) {
+            if (part->offset > header->payload_size || part->size > header->payload_size - part->offset) {
+                rc = MOBI_DATA_CORRUPT;
+            } else {
+                cache->data[i] = payload + part->offset;
+            }
+        } else {
+            const MOBIPdbRecord *rec = part->record < records_count ? records[part->record] : NULL;
+            if (rec == NULL || rec->data == NULL || part->offset > rec->size || part->size > rec->size - part->offset) {
+                rc = MOBI_DATA_CORRUPT;
+            } else {
+                cache->data[i] = rec->data + part->offset;
+            }
+        }
+    }
+    free(records);
+    return rc;
+}
+
+MOBI_RET mb_cache_open(mb_CACHE **out, const char *path, const mb_CACHE_KEY *key, const MOBIData *m)
+{
+    mb_CACHE *cache;
+    MOBI_RET rc;
+
+    *out = NULL;
+    cache = calloc(1, sizeof(mb_CACHE));
+    if (cache == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    rc = mb_mapping_open(&cache->map, path);
+    if (rc == MOBI_SUCCESS) {
+        rc = mb_cache_check(cache, key, m);
+    }
+    if (rc != MOBI_SUCCESS) {
+        mb_cache_free(cache);
+        return rc;
+    }
+    *out = cache;
+    return MOBI_SUCCESS;
+}
+
+void mb_cache_free(mb_CACHE *cache)
+{
+    if (cache) {
+        mb_mapping_close(&cache->map);
+        free(cache->data);
+        free(cache);
+    }
+}
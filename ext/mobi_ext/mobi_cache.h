@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_CACHE_H
+#define MOBI_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mobi.h>
+
+#include "mobi_loader.h"
+
+/*
+ * Sidecar cache of the reconstructed parts. The file holds the header, the
+ * offsets of the decompressed text records, the part table, and the payload
+ * of the parts libmobi had to build (markup, flows, decoded fonts and
+ * media). Parts which are plain record slices, like images, refer to the
+ * record instead. The cache is mapped into memory, and the table is used in
+ * place, so it is in the native byte order and is rebuilt when opened on
+ * another architecture.
+ */
+
+#define MB_CACHE_MAGIC "MBCACHE"
+#define MB_CACHE_VERSION 2
+/* the part payload is in the cache, not in a record */
+#define MB_CACHE_OWN 0xffffffffu
+
+enum { MB_CACHE_MARKUP, MB_CACHE_FLOW, MB_CACHE_RESOURCE };
+
+/* The book the cache has been built for */
+typedef struct mb_CACHE_KEY {
+    uint64_t size;
+    int64_t mtime;
+    /* hash of the headers, computed from the book by the functions below */
+    uint64_t hash;
+} mb_CACHE_KEY;
+
+typedef struct mb_CACHE_HEADER {
+    char magic[8];
+    uint32_t version;
+    /* 0x01020304 in the byte order of the writer */
+    uint32_t byte_order;
+    mb_CACHE_KEY key;
+    uint32_t rawml_version;
+    uint32_t text_count;
+    uint32_t parts_count;
+    uint32_t reserved;
+    uint64_t payload_offset;
+    uint64_t payload_size;
+} mb_CACHE_HEADER;
+
+typedef struct mb_CACHE_PART {
+    uint32_t kind;
+    uint32_t type;
+    uint64_t uid;
+    uint64_t size;
+    /* offset in the cache payload, or in the record */
+    uint64_t offset;
+    /* sequential number of the record holding the payload, or MB_CACHE_OWN */
+    uint32_t record;
+    uint32_t reserved;
+} mb_CACHE_PART;
+
+typedef struct mb_CACHE {
+    mb_MAPPING map;
+    const mb_CACHE_HEADER *header;
+    /* text_count + 1 offsets of the text records in the decompressed text */
+    const uint64_t *text_offsets;
+    const mb_CACHE_PART *parts;
+    /* payload of every part, resolved against the book */
+    const unsigned char **data;
+} mb_CACHE;
+
+/*
+ * Map the cache, and check it was built for the book with the key. Returns
+ * MOBI_FILE_NOT_FOUND when there is no cache, and MOBI_DATA_CORRUPT when it
+ * is stale or broken.
+ */
+MOBI_RET mb_cache_open(mb_CACHE **out, const char *path, const mb_CACHE_KEY *key, const MOBIData *m);
+void mb_cache_free(mb_CACHE *cache);
+
+/* Write the cache of the parts to a temporary file, and rename it to path */
+MOBI_RET mb_cache_write(const char *path, const mb_CACHE_KEY *key, const MOBIData *m, const MOBIRawml *rawml);
+
+#endif
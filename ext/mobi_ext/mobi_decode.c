@@ -0,0 +1,142 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mobi_decode.h"
+
+MOBI_RET mb_text_reader_init(mb_TEXT_READER *reader, const MOBIData *m)
+{
+    size_t record_size;
+
+    memset(reader, 0, sizeof(*reader));
+    if (m == NULL || m->rh == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    if (m->rh->encryption_type != 0) {
+        return MOBI_FILE_ENCRYPTED;
+    }
+    reader->m = m;
+    reader->first = mobi_get_kf8offset(m) + 1;
+    reader->count = m->rh->text_record_count;
+    reader->compression = m->rh->compression_type;
+    if (m->mh && m->mh->extra_flags) {
+        reader->extra_flags = *m->mh->extra_flags;
+    }
+    reader->multibyte = (reader->extra_flags & 1) && mobi_exists_fdst(m);
+    if (reader->compression != MB_COMPRESSION_NONE && reader->compression != MB_COMPRESSION_PALMDOC &&
+        reader->compression != MB_COMPRESSION_HUFFCDIC) {
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    /* records are usually 4096 bytes, leave room for the ones which are not */
+    record_size = m->rh->text_record_size > 4096 ? m->rh->text_record_size : 4096;
+    reader->cap = record_size * 2;
+    reader->buf = malloc(reader->cap);
+    if (reader->buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    return MOBI_SUCCESS;
+}
+
+static const MOBIPdbRecord *mb_text_reader_record(mb_TEXT_READER *reader, size_t index)
+{
+    if (reader->rec && reader->rec_index + 1 == index) {
+        reader->rec = reader->rec->next;
+    } else if (!reader->rec || reader->rec_index != index) {
+        reader->rec = mobi_get_record_by_seqnumber(reader->m, reader->first + index);
+    }
+    reader->rec_index = index;
+    return reader->rec;
+}
+
+/* Decompress text record into out, on input *len is the capacity of out */
+static MOBI_RET mb_text_reader_decode(mb_TEXT_READER *reader, size_t index, unsigned char *out, size_t *len)
+{
+    const MOBIPdbRecord *rec;
+    size_t size, extra = 0, overlap = 0, cap = *len;
+    MOBI_RET rc;
+
+    if (index >= reader->count) {
+        return MOBI_PARAM_ERR;
+    }
+    rec = mb_text_reader_record(reader, index);
+    if (rec == NULL || rec->data == NULL) {
+        return MOBI_DATA_CORRUPT;
+    }
+    if (reader->extra_flags) {
+        /* trailing entries are not part of the compressed text */
+        extra = mobi_get_record_extrasize(rec, reader->extra_flags);
+        if (extra == MOBI_NOTSET || extra >= rec->size) {
+            return MOBI_DATA_CORRUPT;
+        }
+    }
+    size = rec->size - extra;
+    if (reader->multibyte) {
+        /* libmobi appends the overlap bytes, which precede the other trailing entries */
+        overlap = mobi_get_record_mb_extrasize(rec, reader->extra_flags);
+        if (overlap == MOBI_NOTSET || overlap > extra) {
+            return MOBI_DATA_CORRUPT;
+        }
+    }
+    switch (reader->compression) {
+        case MB_COMPRESSION_NONE:
+            if (size > *len) {
+                return MOBI_DATA_CORRUPT;
+            }
+            memcpy(out, rec->data, size);
+            *len = size;
+            rc = MOBI_SUCCESS;
+            break;
+        case MB_COMPRESSION_PALMDOC:
+            rc = mb_palmdoc_decode(out, len, rec->data, size);
+            break;
+        default:
+            if (reader->huff == NULL) {
+                rc = mb_huffcdic_load(&reader->huff, reader->m);
+                if (rc != MOBI_SUCCESS) {
+                    return rc;
+                }
+            }
+            rc = mb_huffcdic_decode(reader->huff, out, len, rec->data, size);
+            break;
+    }
+    if (rc != MOBI_SUCCESS || overlap == 0) {
+        return rc;
+    }
+    if (overlap > cap - *len) {
+        return MOBI_DATA_CORRUPT;
+    }
+    memcpy(out + *len, rec->data + size, overlap);
+    *len += overlap;
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_text_reader_read(mb_TEXT_READER *reader, size_t index, size_t *len)
+{
+    *len = reader->cap;
+    return mb_text_reader_decode(reader, index, reader->buf, len);
+}
+
+MOBI_RET mb_text_reader_read_all(mb_TEXT_READER *reader, unsigned char *out, size_t *len)
+{
+    size_t i, n, total = 0;
+    MOBI_RET rc;
+
+    for (i = 0; i < reader->count; i++) {
+        n = *len - total;
+        rc = mb_text_reader_decode(reader, i, out + total, &n);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+        total += n;
+    }
+    *len = total;
+    return MOBI_SUCCESS;
+}
+
+void mb_text_reader_free(mb_TEXT_READER *reader)
+{
+    mb_huffcdic_release(reader->huff);
+    free(reader->buf);
+    memset(reader, 0, sizeof(*reader));
+}
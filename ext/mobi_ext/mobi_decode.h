@@ -0,0 +1,104 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_DECODE_H
+#define MOBI_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mobi.h>
+
+/*
+ * Decoders for the text records. libmobi keeps its own ones private, and
+ * only offers decompression of the whole text at once.
+ */
+
+#define MB_COMPRESSION_NONE 1
+#define MB_COMPRESSION_PALMDOC 2
+#define MB_COMPRESSION_HUFFCDIC 17480
+
+/*
+ * Decompress PalmDOC (LZ77) record. On input *out_len is the capacity of
+ * out, on output the number of bytes written. Uses the implementation
+ * chosen by mb_palmdoc_select().
+ */
+MOBI_RET mb_palmdoc_decode(unsigned char *out, size_t *out_len, const unsigned char *in, size_t in_len);
+
+typedef MOBI_RET (*mb_PALMDOC_DECODE)(unsigned char *out, size_t *out_len, const unsigned char *in, size_t in_len);
+
+typedef struct mb_PALMDOC_IMPL {
+    const char *name;
+    mb_PALMDOC_DECODE decode;
+    /* returns zero when the CPU lacks the instructions */
+    int (*supported)(void);
+} mb_PALMDOC_IMPL;
+
+/* All compiled in implementations, from the slowest, terminated with NULL name */
+extern const mb_PALMDOC_IMPL mb_palmdoc_impls[];
+
+/*
+ * Select the implementation by name, or the fastest supported one when the
+ * name is NULL. Returns zero when it is unknown or not supported.
+ */
+int mb_palmdoc_select(const char *name);
+const mb_PALMDOC_IMPL *mb_palmdoc_selected(void);
+
+typedef struct mb_HUFFCDIC mb_HUFFCDIC;
+
+/*
+ * Load Huffman tables and CDIC dictionary of the book. The tables do not
+ * refer to the book, and are shared through process-wide cache with the
+ * other books carrying identical HUFF/CDIC records. They are read only, so
+ * can be used from several threads at once.
+ */
+MOBI_RET mb_huffcdic_load(mb_HUFFCDIC **out, const MOBIData *m);
+MOBI_RET mb_huffcdic_decode(mb_HUFFCDIC *huff, unsigned char *out, size_t *out_len, const unsigned char *in,
+                            size_t in_len);
+void mb_huffcdic_release(mb_HUFFCDIC *huff);
+
+typedef struct mb_HUFF_CACHE_STATS {
+    size_t hits;
+    size_t misses;
+    size_t entries;
+    /* memory held by the cached tables */
+    size_t bytes;
+} mb_HUFF_CACHE_STATS;
+
+/* Maximum number of the cached tables, zero disables the cache */
+void mb_huffcdic_cache_set_limit(size_t limit);
+size_t mb_huffcdic_cache_limit(void);
+void mb_huffcdic_cache_stats(mb_HUFF_CACHE_STATS *stats);
+
+/*
+ * Reads text records one at a time into the scratch buffer, which is reused
+ * for every record.
+ */
+typedef struct mb_TEXT_READER {
+    const MOBIData *m;
+    /* sequential number of the first text record */
+    size_t first;
+    size_t count;
+    uint16_t compression;
+    uint16_t extra_flags;
+    /* KF8 records carry the bytes of a character split across records */
+    int multibyte;
+    /* loaded with the first HUFF/CDIC record */
+    mb_HUFFCDIC *huff;
+    /* last record read, so that sequential reads do not walk the list */
+    const MOBIPdbRecord *rec;
+    size_t rec_index;
+    unsigned char *buf;
+    size_t cap;
+} mb_TEXT_READER;
+
+MOBI_RET mb_text_reader_init(mb_TEXT_READER *reader, const MOBIData *m);
+
+/* Decompress text record with the index into reader->buf, *len is set to the text length */
+MOBI_RET mb_text_reader_read(mb_TEXT_READER *reader, size_t index, size_t *len);
+
+/* Decompress all text records into out, on input *len is the capacity of out */
+MOBI_RET mb_text_reader_read_all(mb_TEXT_READER *reader, unsigned char *out, size_t *len);
+
+void mb_text_reader_free(mb_TEXT_READER *reader);
+
+#endif
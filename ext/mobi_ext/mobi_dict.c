@@ -0,0 +1,494 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_dict.h"
+#include "mobi_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* orth entry tags, see INDX_TAGARR_ORTH_* in libmobi */
+#define ORTH_TAG_POSITION 1
+#define ORTH_TAG_LENGTH 2
+#define ORTH_TAG_INFL 42
+/* infl group tag, which lists the rules, see INDX_TAGARR_INFL_PARTS_V2 */
+#define INFL_TAG_PARTS 26
+/* the longest inflected form, see INDX_INFLBUF_SIZEMAX */
+#define DICT_INFL_MAX 512
+#define DICT_LABEL_MAX 255
+
+static int mb_dict_reserve(void **ptr, size_t *cap, size_t need, size_t item)
+{
+    size_t n = *cap ? *cap : 256;
+    void *p;
+
+    if (need <= *cap) {
+        return 1;
+    }
+    while (n < need) {
+        n *= 2;
+    }
+    p = realloc(*ptr, n * item);
+    if (p == NULL) {
+        return 0;
+    }
+    *ptr = p;
+    *cap = n;
+    return 1;
+}
+
+static uint32_t mb_dict_head(const char *key, size_t len)
+{
+    uint32_t head = 0;
+    size_t i;
+
+    for (i = 0; i < 4; i++) {
+        head = head << 8 | (i < len ? (unsigned char)key[i] : 0);
+    }
+    return head;
+}
+
+/*
+ * Store the key into the arena. The key pointer holds the offset until
+ * mb_dict_rebase(), because the arena may move.
+ */
+static MOBI_RET mb_dict_add(mb_DICT *dict, mb_DICT_KEY **keys, size_t *count, size_t *cap, const char *key,
+                            size_t len, size_t entry)
+{
+    mb_DICT_KEY *k;
+
+    if (!mb_dict_reserve((void **)keys, cap, *count + 1, sizeof(mb_DICT_KEY)) ||
+        !mb_dict_reserve((void **)&dict->keys, &dict->keys_cap, dict->keys_size + len, 1)) {
+        return MOBI_MALLOC_FAILED;
+    }
+    k = &(*keys)[(*count)++];
+    k->head = mb_dict_head(key, len);
+    k->len = (uint32_t)len;
+    k->entry = (uint32_t)entry;
+    k->key = (const char *)(uintptr_t)dict->keys_size;
+    memcpy(dict->keys + dict->keys_size, key, len);
+    dict->keys_size += len;
+    return MOBI_SUCCESS;
+}
+
+size_t mb_dict_headword(const mb_DICT *dict, size_t entry, char *out)
+{
+    const unsigned char *label;
+    size_t len;
+
+    label = mb_index_label(&dict->orth->entries[entry], &len);
+    return mb_index_to_utf8(dict->orth, label, len, out);
+}
+
+static MOBI_RET mb_dict_load_words(mb_DICT *dict)
+{
+    char buf[3 * DICT_LABEL_MAX];
+    size_t i, cap = 0;
+    MOBI_RET rc;
+
+    for (i = 0; i < dict->orth->entries_count; i++) {
+        rc = mb_dict_add(dict, &dict->words, &dict->words_count, &cap, buf, mb_dict_headword(dict, i, buf), i);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+static size_t mb_dict_units(const MOBIIndx *indx, const unsigned char *in, size_t len, uint16_t *out)
+{
+    size_t i, n = 0;
+
+    if (mb_index_unit_size(indx) == 2) {
+        for (i = 0; i + 1 < len; i += 2) {
+            out[n++] = (uint16_t)(in[i] << 8 | in[i + 1]);
+        }
+    } else {
+        for (i = 0; i < len; i++) {
+            out[n++] = in[i];
+        }
+    }
+    return n;
+}
+
+/*
+ * Apply the inflection rule to the word, the same way as mobi_decode_infl().
+ * The rule switches between inserting and deleting at the start or the end
+ * of the word, characters inserted at the end come in reverse order. Returns
+ * zero when the rule does not fit the word.
+ */
+static int mb_dict_inflect(uint16_t *word, size_t *len, const uint16_t *rule, size_t rule_len)
+{
+    size_t i, pos = *len, n = *len;
+    int mode = -1;
+
+    for (i = 0; i < rule_len; i++) {
+        uint16_t c = rule[i];
+        if (c >= 0x0a && c <= 0x13) {
+            /* move back from the end */
+            if (mode != 2 && mode != 3) {
+                mode = 2;
+                pos = n;
+            }
+            if ((size_t)(c - 0x0a) > pos) {
+                return 0;
+            }
+            pos -= (size_t)(c - 0x0a);
+        } else if (c > 0x13) {
+            if (mode == 1 || mode == 2) {
+                if (n >= DICT_INFL_MAX) {
+                    return 0;
+                }
+                memmove(word + pos + 1, word + pos, (n - pos) * sizeof(uint16_t));
+                word[mode == 1 ? pos++ : pos] = c;
+                n++;
+            } else if (mode == 3 || mode == 4) {
+                if (mode == 3) {
+                    if (pos == 0) {
+                        return 0;
+                    }
+                    pos--;
+                }
+                if (pos >= n || word[pos] != c) {
+                    return 0;
+                }
+                memmove(word + pos, word + pos + 1, (n - pos - 1) * sizeof(uint16_t));
+                n--;
+            } else {
+                return 0;
+            }
+        } else if (c == 1 || c == 4) {
+            if (mode != 1 && mode != 4) {
+                pos = 0;
+            }
+            mode = c;
+        } else if (c == 2 || c == 3) {
+            if (mode != 2 && mode != 3) {
+                pos = n;
+            }
+            mode = c;
+        } else {
+            return 0;
+        }
+    }
+    *len = n;
+    return 1;
+}
+
+/* Add the forms the inflection group makes of the headword */
+static MOBI_RET mb_dict_load_group(mb_DICT *dict, size_t entry, const MOBIIndexEntry *group, const char *headword,
+                                   size_t headword_len)
+{
+    uint16_t word[DICT_INFL_MAX], rule[DICT_LABEL_MAX];
+    unsigned char bytes[2 * DICT_INFL_MAX];
+    char buf[3 * 2 * DICT_INFL_MAX];
+    const unsigned char *label;
+    size_t i, j, len, word_len, rule_len, unit_size = mb_index_unit_size(dict->orth);
+    uint32_t part;
+    MOBI_RET rc;
+
+    for (i = 0; mb_index_tag(group, INFL_TAG_PARTS, i, &part); i++) {
+        if (part >= dict->infl->entries_count) {
+            return MOBI_DATA_CORRUPT;
+        }
+        label = mb_index_label(&dict->orth->entries[entry], &len);
+        word_len = mb_dict_units(dict->orth, label, len, word);
+        label = mb_index_label(&dict->infl->entries[part], &len);
+        rule_len = mb_dict_units(dict->infl, label, len, rule);
+        if (!mb_dict_inflect(word, &word_len, rule, rule_len)) {
+            /* libmobi skips broken rules too */
+            continue;
+        }
+        for (j = 0; j < word_len; j++) {
+            if (unit_size == 2) {
+                bytes[2 * j] = (unsigned char)(word[j] >> 8);
+                bytes[2 * j + 1] = (unsigned char)word[j];
+            } else {
+                bytes[j] = (unsigned char)word[j];
+            }
+        }
+        len = mb_index_to_utf8(dict->orth, bytes, word_len * unit_size, buf);
+        if (len == headword_len && memcmp(buf, headword, len) == 0) {
+            continue;
+        }
+        rc = mb_dict_add(dict, &dict->forms, &dict->forms_count, &dict->forms_cap, buf, len, entry);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+static MOBI_RET mb_dict_load_forms(mb_DICT *dict)
+{
+    char headword[3 * DICT_LABEL_MAX];
+    size_t i, j, len;
+    uint32_t group;
+    MOBI_RET rc;
+
+    for (i = 0; i < dict->orth->entries_count; i++) {
+        const MOBIIndexEntry *entry = &dict->orth->entries[i];
+        if (!mb_index_tag(entry, ORTH_TAG_INFL, 0, &group)) {
+            continue;
+        }
+        len = mb_dict_headword(dict, i, headword);
+        for (j = 0; mb_index_tag(entry, ORTH_TAG_INFL, j, &group); j++) {
+            if (group >= dict->infl->entries_count) {
+                return MOBI_DATA_CORRUPT;
+            }
+            rc = mb_dict_load_group(dict, i, &dict->infl->entries[group], headword, len);
+            if (rc != MOBI_SUCCESS) {
+                return rc;
+            }
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/* Compare the key with the query, which matches the keys starting with it when prefix is set */
+static int mb_dict_compare(const mb_DICT_KEY *k, uint32_t head, const char *key, size_t len, int prefix)
+{
+    uint32_t k_head = k->head;
+    size_t n = k->len < len ? k->len : len;
+    int c;
+
+    if (prefix && len < 4) {
+        /* only the bytes of the prefix count */
+        k_head = len ? k_head & ~(0xffffffffu >> (8 * len)) : 0;
+    }
+    if (k_head != head) {
+        return k_head < head ? -1 : 1;
+    }
+    c = memcmp(k->key, key, n);
+    if (c != 0) {
+        return c;
+    }
+    if (k->len < len) {
+        return -1;
+    }
+    return prefix || k->len == len ? 0 : 1;
+}
+
+static int mb_dict_sort_cmp(const void *a, const void *b)
+{
+    const mb_DICT_KEY *x = a, *y = b;
+    int c = mb_dict_compare(x, y->head, y->key, y->len, 0);
+
+    if (c == 0) {
+        c = (x->entry > y->entry) - (x->entry < y->entry);
+    }
+    return c;
+}
+
+/* Turn the offsets into pointers, and sort the keys */
+static void mb_dict_rebase(mb_DICT *dict, mb_DICT_KEY *keys, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        keys[i].key = dict->keys + (uintptr_t)keys[i].key;
+    }
+    if (count > 1) {
+        qsort(keys, count, sizeof(mb_DICT_KEY), mb_dict_sort_cmp);
+    }
+}
+
+/* Several rules may make the same form */
+static void mb_dict_unique_forms(mb_DICT *dict)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < dict->forms_count; i++) {
+        if (n == 0 || mb_dict_sort_cmp(&dict->forms[n - 1], &dict->forms[i]) != 0) {
+            dict->forms[n++] = dict->forms[i];
+        }
+    }
+    dict->forms_count = n;
+}
+
+/* Text records by their index, so that lookups do not walk the list of records */
+static MOBI_RET mb_dict_load_records(mb_DICT *dict, const MOBIData *m)
+{
+    const MOBIPdbRecord *rec;
+    size_t i;
+    MOBI_RET rc;
+
+    rc = mb_text_reader_init(&dict->reader, m);
+    if (rc != MOBI_SUCCESS) {
+        return rc;
+    }
+    if (dict->reader.compression == MB_COMPRESSION_HUFFCDIC) {
+        rc = mb_huffcdic_load(&dict->reader.huff, m);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+    }
+    dict->record_size = m->rh->text_record_size;
+    dict->records = calloc(dict->reader.count + 1, sizeof(MOBIPdbRecord *));
+    if (dict->records == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    rec = mobi_get_record_by_seqnumber(m, dict->reader.first);
+    for (i = 0; i < dict->reader.count; i++, rec = rec->next) {
+        if (rec == NULL) {
+            return MOBI_DATA_CORRUPT;
+        }
+        dict->records[i] = rec;
+    }
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_dict_open(mb_DICT **out, const MOBIData *m)
+{
+    mb_DICT *dict;
+    MOBI_RET rc;
+
+    *out = NULL;
+    if (m == NULL || m->mh == NULL || m->mh->orth_index == NULL || *m->mh->orth_index == MOBI_NOTSET) {
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    dict = calloc(1, sizeof(mb_DICT));
+    if (dict == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    dict->utf8 = m->mh->text_encoding && *m->mh->text_encoding == MB_ENCODING_UTF8;
+    rc = mb_index_parse(&dict->orth, m, *m->mh->orth_index);
+    if (rc == MOBI_SUCCESS && m->mh->infl_index && *m->mh->infl_index != MOBI_NOTSET) {
+        rc = mb_index_parse(&dict->infl, m, *m->mh->infl_index);
+    }
+    if (rc == MOBI_SUCCESS) {
+        rc = mb_dict_load_words(dict);
+    }
+    if (rc == MOBI_SUCCESS && dict->infl) {
+        rc = mb_dict_load_forms(dict);
+    }
+    if (rc == MOBI_SUCCESS) {
+        rc = mb_dict_load_records(dict, m);
+    }
+    if (rc != MOBI_SUCCESS) {
+        mb_dict_free(dict);
+        return rc;
+    }
+    mb_dict_rebase(dict, dict->words, dict->words_count);
+    mb_dict_rebase(dict, dict->forms, dict->forms_count);
+    mb_dict_unique_forms(dict);
+    *out = dict;
+    return MOBI_SUCCESS;
+}
+
+void mb_dict_free(mb_DICT *dict)
+{
+    if (dict == NULL) {
+        return;
+    }
+    mb_index_free(dict->orth);
+    mb_index_free(dict->infl);
+    mb_text_reader_free(&dict->reader);
+    free(dict->records);
+    free(dict->keys);
+    free(dict->words);
+    free(dict->forms);
+    free(dict);
+}
+
+size_t mb_dict_memsize(const mb_DICT *dict)
+{
+    if (dict == NULL) {
+        return 0;
+    }
+    return sizeof(mb_DICT) + mb_index_memsize(dict->orth) + mb_index_memsize(dict->infl) + dict->keys_cap +
+           dict->words_count * sizeof(mb_DICT_KEY) + dict->forms_cap * sizeof(mb_DICT_KEY) + dict->reader.cap +
+           (dict->reader.count + 1) * sizeof(MOBIPdbRecord *);
+}
+
+size_t mb_dict_find(const mb_DICT_KEY *keys, size_t count, const char *key, size_t len, int prefix, size_t *n)
+{
+    uint32_t head = mb_dict_head(key, len);
+    size_t lo = 0, hi = count, first, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (mb_dict_compare(&keys[mid], head, key, len, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    first = lo;
+    hi = count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (mb_dict_compare(&keys[mid], head, key, len, prefix) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *n = lo - first;
+    return first;
+}
+
+int mb_dict_position(const mb_DICT *dict, size_t entry, uint32_t *pos, uint32_t *len)
+{
+    const MOBIIndexEntry *e = &dict->orth->entries[entry];
+
+    return mb_index_tag(e, ORTH_TAG_POSITION, 0, pos) && mb_index_tag(e, ORTH_TAG_LENGTH, 0, len);
+}
+
+MOBI_RET mb_dict_markup(const mb_DICT *dict, size_t entry, unsigned char **out, size_t *len)
+{
+    mb_TEXT_READER reader = dict->reader;
+    unsigned char *buf;
+    uint32_t pos, size;
+    size_t idx, start, done = 0, n, copy;
+    MOBI_RET rc = MOBI_SUCCESS;
+
+    *out = NULL;
+    *len = 0;
+    if (!mb_dict_position(dict, entry, &pos, &size)) {
+        return MOBI_SUCCESS;
+    }
+    if (dict->record_size == 0) {
+        return MOBI_DATA_CORRUPT;
+    }
+    buf = malloc(size ? size : 1);
+    /* the scratch buffer is private, the HUFF/CDIC tables are shared */
+    reader.buf = malloc(reader.cap);
+    if (buf == NULL || reader.buf == NULL) {
+        free(buf);
+        free(reader.buf);
+        return MOBI_MALLOC_FAILED;
+    }
+    idx = pos / dict->record_size;
+    start = idx * dict->record_size;
+    while (done < size) {
+        if (idx >= reader.count || start > pos + done) {
+            rc = MOBI_DATA_CORRUPT;
+            break;
+        }
+        /* mb_text_reader_read() uses the cached record when its index matches */
+        reader.rec = dict->records[idx];
+        reader.rec_index = idx;
+        rc = mb_text_reader_read(&reader, idx, &n);
+        if (rc != MOBI_SUCCESS) {
+            break;
+        }
+        if (pos + done < start + n) {
+            copy = start + n - (pos + done);
+            if (copy > size - done) {
+                copy = size - done;
+            }
+            memcpy(buf + done, reader.buf + (pos + done - start), copy);
+            done += copy;
+        }
+        start += n;
+        idx++;
+    }
+    free(reader.buf);
+    if (rc != MOBI_SUCCESS) {
+        free(buf);
+        return rc;
+    }
+    *out = buf;
+    *len = size;
+    return MOBI_SUCCESS;
+}
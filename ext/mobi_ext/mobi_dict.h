@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_DICT_H
+#define MOBI_DICT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mobi.h>
+
+#include "mobi_decode.h"
+
+/*
+ * Lookup of dictionary entries by the orthographic (orth) and inflection
+ * (infl) indexes. Headwords and their inflected forms are converted to UTF-8
+ * and kept in two sorted arrays, the markup of the entry is decompressed only
+ * from the text records it spans. Once opened, the dictionary is read only,
+ * so it can be searched from several threads at once.
+ */
+
+typedef struct mb_DICT_KEY {
+    /* first four bytes of the key, big endian and zero padded, compared before the key itself */
+    uint32_t head;
+    uint32_t len;
+    /* orth entry */
+    uint32_t entry;
+    const char *key;
+} mb_DICT_KEY;
+
+typedef struct mb_DICT {
+    MOBIIndx *orth;
+    /* NULL when the dictionary has no inflections */
+    MOBIIndx *infl;
+    /* UTF-8 keys of both arrays */
+    char *keys;
+    size_t keys_size;
+    size_t keys_cap;
+    mb_DICT_KEY *words;
+    size_t words_count;
+    /* inflected forms, which differ from their headword */
+    mb_DICT_KEY *forms;
+    size_t forms_count;
+    size_t forms_cap;
+    /* the text is in UTF-8, otherwise in CP1252 */
+    int utf8;
+    /* holds shared HUFF/CDIC tables, every lookup reads with its own copy */
+    mb_TEXT_READER reader;
+    const MOBIPdbRecord **records;
+    size_t record_size;
+} mb_DICT;
+
+MOBI_RET mb_dict_open(mb_DICT **out, const MOBIData *m);
+void mb_dict_free(mb_DICT *dict);
+
+/* Memory allocated for the dictionary, the shared HUFF/CDIC tables are not counted */
+size_t mb_dict_memsize(const mb_DICT *dict);
+
+/*
+ * Find keys equal to the key, or starting with it when prefix is set. Returns
+ * the index of the first one, and sets *count to the number of them.
+ */
+size_t mb_dict_find(const mb_DICT_KEY *keys, size_t count, const char *key, size_t len, int prefix, size_t *n);
+
+/* UTF-8 headword of the orth entry, out needs room for 3 * 255 bytes */
+size_t mb_dict_headword(const mb_DICT *dict, size_t entry, char *out);
+
+/* Start and length of the markup of the orth entry in the text, returns zero when it has none */
+int mb_dict_position(const mb_DICT *dict, size_t entry, uint32_t *pos, uint32_t *len);
+
+/* Decompress the markup of the orth entry into malloc'ed buffer */
+MOBI_RET mb_dict_markup(const mb_DICT *dict, size_t entry, unsigned char **out, size_t *len);
+
+#endif
@@ -0,0 +1,155 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_epub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* input bytes compressed at once, bounds the memory held by compressed data */
+#define EPUB_BATCH_SIZE (8 * 1024 * 1024)
+
+static const char mb_epub_mimetype[] = "application/epub+zip";
+
+static const char mb_epub_container[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n"
+    "  <rootfiles>\n"
+    "    <rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/>\n"
+    "  </rootfiles>\n"
+    "</container>\n";
+
+static size_t mb_epub_count(const MOBIPart *part)
+{
+    size_t n = 0;
+
+    for (; part; part = part->next) {
+        n++;
+    }
+    return n;
+}
+
+static mb_ZIP_ENTRY *mb_epub_add(mb_EPUB *epub, const void *data, size_t size)
+{
+    mb_ZIP_ENTRY *entry = &epub->entries[epub->count++];
+
+    entry->data = data;
+    entry->size = size;
+    return entry;
+}
+
+static void mb_epub_add_part(mb_EPUB *epub, const MOBIPart *part, const char *prefix)
+{
+    MOBIFileMeta meta = mobi_get_filemeta_by_type(part->type);
+    mb_ZIP_ENTRY *entry = mb_epub_add(epub, part->data, part->size);
+
+    snprintf(entry->name, sizeof(entry->name), "OEBPS/%s%05zu.%s", prefix, part->uid, meta.extension);
+    switch (part->type) {
+        case T_JPG:
+        case T_GIF:
+        case T_PNG:
+        case T_MP3:
+        case T_MPG:
+            /* deflate would only waste time on them */
+            entry->store = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+MOBI_RET mb_epub_init(mb_EPUB *epub, const MOBIRawml *rawml, const mb_ZIP_SINK *sink, size_t threads)
+{
+    const MOBIPart *part;
+    mb_ZIP_ENTRY *entry;
+    int has_opf = 0;
+
+    memset(epub, 0, sizeof(*epub));
+    for (part = rawml->resources; part; part = part->next) {
+        has_opf |= part->type == T_OPF;
+    }
+    if (!has_opf || rawml->markup == NULL) {
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    epub->entries = calloc(2 + mb_epub_count(rawml->markup) + mb_epub_count(rawml->flow) +
+                               mb_epub_count(rawml->resources),
+                           sizeof(mb_ZIP_ENTRY));
+    if (epub->entries == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    epub->threads = threads ? threads : 1;
+    mb_zip_init(&epub->zip, sink);
+
+    /* the mimetype must be the first, and stored */
+    entry = mb_epub_add(epub, mb_epub_mimetype, sizeof(mb_epub_mimetype) - 1);
+    strcpy(entry->name, "mimetype");
+    entry->store = 1;
+    entry = mb_epub_add(epub, mb_epub_container, sizeof(mb_epub_container) - 1);
+    strcpy(entry->name, "META-INF/container.xml");
+
+    for (part = rawml->markup; part; part = part->next) {
+        mb_epub_add_part(epub, part, "part");
+    }
+    /* the first flow is the raw markup, which has been split into the parts */
+    for (part = rawml->flow ? rawml->flow->next : NULL; part; part = part->next) {
+        mb_epub_add_part(epub, part, "flow");
+    }
+    for (part = rawml->resources; part; part = part->next) {
+        if (part->size == 0) {
+            continue;
+        }
+        if (part->type == T_OPF) {
+            entry = mb_epub_add(epub, part->data, part->size);
+            strcpy(entry->name, "OEBPS/content.opf");
+        } else if (part->type == T_NCX) {
+            entry = mb_epub_add(epub, part->data, part->size);
+            strcpy(entry->name, "OEBPS/toc.ncx");
+        } else {
+            mb_epub_add_part(epub, part, "resource");
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_epub_write(mb_EPUB *epub)
+{
+    MOBI_RET rc;
+
+    while (epub->next < epub->count && !epub->cancel) {
+        size_t end = epub->next, bytes = 0;
+
+        do {
+            bytes += epub->entries[end++].size;
+        } while (end < epub->count && bytes < EPUB_BATCH_SIZE);
+        rc = mb_zip_compress(epub->entries + epub->next, end - epub->next, epub->threads);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+        while (epub->next < end) {
+            rc = mb_zip_add(&epub->zip, &epub->entries[epub->next++]);
+            if (rc != MOBI_SUCCESS) {
+                return rc;
+            }
+        }
+    }
+    if (epub->next == epub->count && !epub->finished) {
+        rc = mb_zip_finish(&epub->zip);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+        epub->finished = 1;
+    }
+    return MOBI_SUCCESS;
+}
+
+void mb_epub_free(mb_EPUB *epub)
+{
+    size_t i;
+
+    for (i = 0; i < epub->count; i++) {
+        mb_zip_entry_free(&epub->entries[i]);
+    }
+    free(epub->entries);
+    mb_zip_free(&epub->zip);
+    memset(epub, 0, sizeof(*epub));
+}
@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_EPUB_H
+#define MOBI_EPUB_H
+
+#include <stddef.h>
+
+#include <mobi.h>
+
+#include "mobi_zip.h"
+
+/*
+ * EPUB container for the parts reconstructed by mobi_parse_rawml(), laid out
+ * the same way as mobitool does: markup, flows and resources under OEBPS,
+ * with the OPF and NCX built by libmobi. The entries point into MOBIRawml,
+ * which must outlive the export.
+ */
+
+typedef struct mb_EPUB {
+    mb_ZIP zip;
+    mb_ZIP_ENTRY *entries;
+    size_t count;
+    /* the first entry, which has not been written yet */
+    size_t next;
+    size_t threads;
+    int finished;
+    /* stops the export between batches, mb_epub_write() resumes it */
+    volatile int cancel;
+} mb_EPUB;
+
+MOBI_RET mb_epub_init(mb_EPUB *epub, const MOBIRawml *rawml, const mb_ZIP_SINK *sink, size_t threads);
+MOBI_RET mb_epub_write(mb_EPUB *epub);
+void mb_epub_free(mb_EPUB *epub);
+
+#endif
@@ -2,13 +2,36 @@
 
 #include <mobi.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+
+#include "mobi_config.h"
+#include "mobi_ext.h"
+#include "mobi_keys.h"
+#include "mobi_values.h"
+#include "mobi_loader.h"
+#include "mobi_text.h"
+#include "mobi_decode.h"
+#include "mobi_resource.h"
+#include "mobi_epub.h"
+#include "mobi_index.h"
+#include "mobi_dict.h"
+#include "mobi_cache.h"
+#include "mobi_stats.h"
+#include "mobi_save.h"
 
 VALUE mb_mMOBI;
 VALUE mb_eError;
 VALUE mb_cBook;
 
-static const char *mb_libmobi_strerror(MOBI_RET code)
+const char *mb_libmobi_strerror(MOBI_RET code)
 {
     switch (code) {
         case MOBI_ERROR:
@@ -44,7 +67,7 @@ static const char *mb_libmobi_strerror(MOBI_RET code)
     }
 }
 
-static void mb_raise_at(MOBI_RET code, const char *message, const char *file, int line)
+void mb_raise_at(MOBI_RET code, const char *message, const char *file, int line)
 {
     VALUE exc, str;
 
@@ -60,58 +83,691 @@ static void mb_raise_at(MOBI_RET code, const char *message, const char *file, in
     rb_exc_raise(exc);
 }
 
-#define mb_raise(code, message) mb_raise_at(code, message, __FILE__, __LINE__)
-#define mb_raise_msg(message) mb_raise_at(0, message, __FILE__, __LINE__)
-
 typedef struct mb_BOOK {
     MOBIData *data;
+    /* set for the other half of hybrid book, which owns data, see mb_book_next() */
+    VALUE parent;
+    /* set when the book has been loaded with "mmap: true" */
+    mb_MAPPING map;
+    /* set when the book has been loaded with "headers_only: true" */
+    int headers_only;
+    /* set when the book has been loaded from path, see Book#save_in_place */
+    char *path;
+    /* lazily reconstructed parts, see mb_book_fetch_rawml(), owned by rawml_owner */
+    MOBIRawml *rawml;
+    VALUE rawml_owner;
+    /* lazily decompressed text, see mb_book_fetch_rawml_text(), owned by rawml_text_owner */
+    char *rawml_text;
+    size_t rawml_text_size;
+    VALUE rawml_text_owner;
+    /* reader reused by #text_record, see mb_book_text_reader(), owned by text_reader_owner */
+    mb_TEXT_READER *text_reader;
+    VALUE text_reader_owner;
+    /* set while the reader decompresses without GVL */
+    int text_reader_busy;
+    /* set when the book has been opened with "cache:", see mb_book_rawml_parts() */
+    char *cache_path;
+    mb_CACHE_KEY cache_key;
+    /* NULL until the sidecar matches the book, owned by cache_owner */
+    mb_CACHE *cache;
+    VALUE cache_owner;
+    /* record payloads owned by the book, and the caches above, as reported to the GC */
+    size_t native_bytes;
+    size_t rawml_bytes;
+    /* timed while MOBI.instrument hook is installed, see Book#stats */
+    mb_PHASE_STATS stats[MB_PHASES_COUNT];
+    /* calls using data without GVL, see mb_book_call_without_gvl() */
+    int busy;
 } mb_BOOK;
 
+/*
+ * Hidden object, which owns native buffer referenced by the strings returned
+ * to the user (see mb_str_new_borrowed()). It also keeps the book alive,
+ * because the buffer might point into the records of MOBIData.
+ */
+typedef struct mb_OWNER {
+    void *ptr;
+    void (*release)(void *ptr);
+    VALUE book;
+    /* reported to the GC, see mb_owner_track() */
+    size_t bytes;
+} mb_OWNER;
+
+static ID mb_id_owner;
+static ID mb_id_call;
+
+/* Books alive, and native memory held by them and their caches, see MOBI.memory_stats */
+static size_t mb_live_books;
+static size_t mb_native_bytes;
+
+/*
+ * Report native memory to the GC, so that the books holding large buffers
+ * are collected in step with their real size.
+ */
+static void mb_memory_add(size_t bytes)
+{
+    mb_native_bytes += bytes;
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    rb_gc_adjust_memory_usage((ssize_t)bytes);
+#endif
+}
+
+static void mb_memory_sub(size_t bytes)
+{
+    mb_native_bytes -= bytes;
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    rb_gc_adjust_memory_usage(-(ssize_t)bytes);
+#endif
+}
+
+static void mb_owner_mark(void *ptr)
+{
+    mb_OWNER *owner = ptr;
+    rb_gc_mark(owner->book);
+}
+
+static void mb_owner_free(void *ptr)
+{
+    mb_OWNER *owner = ptr;
+    if (owner) {
+        if (owner->ptr) {
+            owner->release(owner->ptr);
+        }
+        mb_memory_sub(owner->bytes);
+        xfree(owner);
+    }
+}
+
+static VALUE mb_owner_new(VALUE book, void *ptr, void (*release)(void *ptr))
+{
+    VALUE obj;
+    mb_OWNER *owner;
+
+    obj = Data_Make_Struct(0, mb_OWNER, mb_owner_mark, mb_owner_free, owner);
+    owner->ptr = ptr;
+    owner->release = release;
+    owner->book = book;
+    return obj;
+}
+
+/* Account the buffer of the owner as native memory until the owner is freed */
+static void mb_owner_track(VALUE obj, size_t bytes)
+{
+    mb_OWNER *owner = DATA_PTR(obj);
+
+    owner->bytes += bytes;
+    mb_memory_add(bytes);
+}
+
+/*
+ * Create frozen string, which points directly into native buffer instead of
+ * copying it. The string keeps the owner of the buffer alive.
+ */
+static VALUE mb_str_new_borrowed(const void *ptr, size_t len, VALUE owner)
+{
+    VALUE str = rb_str_new_static((const char *)ptr, (long)len);
+    rb_ivar_set(str, mb_id_owner, owner);
+    return rb_obj_freeze(str);
+}
+
+static void mb_release_rawml(void *ptr)
+{
+    mobi_free_rawml(ptr);
+}
+
+static void mb_release_cache(void *ptr)
+{
+    mb_cache_free(ptr);
+}
+
+static void mb_nogvl_ubf(void *arg)
+{
+    (void)arg;
+}
+
+/*
+ * Run libmobi call without holding GVL.
+ *
+ * libmobi cannot be cancelled in the middle of the operation, so the unblocking
+ * function does nothing, and interrupted call is allowed to finish. It is up to
+ * the caller to take ownership of the results and then handle pending
+ * interrupts with rb_thread_check_ints(). The function must set *done once it
+ * has been executed.
+ */
+void mb_call_without_gvl(void *(*func)(void *), void *arg, volatile int *done)
+{
+    while (!*done) {
+        rb_thread_call_without_gvl2(func, arg, mb_nogvl_ubf, NULL);
+        if (!*done) {
+            /* interrupted before the call has been started, nothing to clean up */
+            rb_thread_check_ints();
+        }
+    }
+}
+
+/* The book owning MOBIData, the other half of hybrid book shares it with its parent */
+static mb_BOOK *mb_book_data_owner(mb_BOOK *book)
+{
+    return NIL_P(book->parent) ? book : DATA_PTR(book->parent);
+}
+
+/*
+ * mb_call_without_gvl() for the calls using MOBIData of the book. They are
+ * counted, and the setters, which free and allocate the headers, raise
+ * while any of them is running (see mb_book_editable()).
+ */
+static void mb_book_call_without_gvl(mb_BOOK *book, void *(*func)(void *), void *arg, volatile int *done)
+{
+    mb_BOOK *owner = mb_book_data_owner(book);
+
+    while (!*done) {
+        owner->busy++;
+        rb_thread_call_without_gvl2(func, arg, mb_nogvl_ubf, NULL);
+        owner->busy--;
+        if (!*done) {
+            rb_thread_check_ints();
+        }
+    }
+}
+
+/* MOBI.instrument hook, nil when the phases are not timed */
+static VALUE mb_instrument_hook = Qnil;
+
+static VALUE mb_phase_sym(mb_PHASE phase)
+{
+#define MB_PHASE_SYM(NAME)                                                                                             \
+    case MB_PHASE_##NAME:                                                                                              \
+        return MB_SYM(NAME);
+    switch (phase) {
+        MB_PHASES(MB_PHASE_SYM)
+    default:
+        return Qnil;
+    }
+#undef MB_PHASE_SYM
+}
+
+/* Account the phase in Book#stats, and pass it to MOBI.instrument hook */
+static void mb_book_phase_record(VALUE self, mb_BOOK *book, mb_PHASE phase, const mb_PHASE_STATS *stats)
+{
+    VALUE payload, hook = mb_instrument_hook;
+
+    book->stats[phase].nanos += stats->nanos;
+    book->stats[phase].bytes += stats->bytes;
+    book->stats[phase].calls += stats->calls;
+    if (!NIL_P(hook)) {
+        payload = rb_hash_new();
+        rb_hash_aset(payload, MB_SYM(book), self);
+        rb_hash_aset(payload, MB_SYM(time), DBL2NUM((double)stats->nanos / 1e9));
+        rb_hash_aset(payload, MB_SYM(bytes), ULL2NUM(stats->bytes));
+        rb_funcall(hook, mb_id_call, 2, mb_phase_sym(phase), payload);
+    }
+}
+
+/* End of the phase started with mb_phase_start() while holding GVL */
+static void mb_book_phase_done(VALUE self, mb_BOOK *book, mb_PHASE phase, uint64_t start, uint64_t bytes)
+{
+    mb_PHASE_STATS stats[MB_PHASES_COUNT] = {{0}};
+
+    mb_phase_done(stats, phase, start, bytes);
+    if (stats[phase].calls) {
+        mb_book_phase_record(self, book, phase, &stats[phase]);
+    }
+}
+
 static void mb_book_mark(void *ptr)
 {
     mb_BOOK *book = ptr;
-    (void)book;
+    rb_gc_mark(book->parent);
+    rb_gc_mark(book->rawml_owner);
+    rb_gc_mark(book->rawml_text_owner);
+    rb_gc_mark(book->text_reader_owner);
+    rb_gc_mark(book->cache_owner);
+}
+
+/*
+ * The caches are freed by their owners once all strings referencing them
+ * are gone.
+ */
+static void mb_book_release_caches_internal(mb_BOOK *book)
+{
+    book->rawml = NULL;
+    book->rawml_bytes = 0;
+    book->rawml_owner = Qnil;
+    book->rawml_text = NULL;
+    book->rawml_text_size = 0;
+    book->rawml_text_owner = Qnil;
+    book->text_reader = NULL;
+    book->text_reader_owner = Qnil;
 }
 
 static void mb_book_free(void *ptr)
 {
     mb_BOOK *book = ptr;
     if (book) {
-        if (book->data) {
+        mb_book_release_caches_internal(book);
+        if (!NIL_P(book->parent)) {
+            /* the data is freed with the parent */
+        } else if (book->map.addr) {
+            mb_free_mapped(book->data, &book->map);
+            mb_mapping_close(&book->map);
+        } else if (book->data) {
             mobi_free(book->data);
         }
         book->data = NULL;
+        xfree(book->path);
+        xfree(book->cache_path);
+        mb_memory_sub(book->native_bytes);
+        mb_live_books--;
+        xfree(book);
     }
 }
 
-static VALUE mb_book_alloc(VALUE klass)
+/*
+ * The caches are counted while the book references them, the record
+ * payloads in the mapping are backed by the file and are not counted.
+ */
+static size_t mb_book_memsize(const void *ptr)
+{
+    const mb_BOOK *book = ptr;
+    size_t size = sizeof(mb_BOOK) + book->native_bytes;
+
+    if (book->rawml) {
+        size += book->rawml_bytes;
+    }
+    if (book->rawml_text) {
+        size += book->rawml_text_size;
+    }
+    if (book->text_reader) {
+        size += sizeof(mb_TEXT_READER) + book->text_reader->cap;
+    }
+    return size;
+}
+
+/* designated, because the reserved fields differ between Ruby versions */
+static const rb_data_type_t mb_book_type = {
+    .wrap_struct_name = "MOBI::Book",
+    .function = {.dmark = mb_book_mark, .dfree = mb_book_free, .dsize = mb_book_memsize},
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE mb_book_new(VALUE klass, mb_BOOK **out)
 {
     VALUE obj;
     mb_BOOK *book;
 
-    obj = Data_Make_Struct(klass, mb_BOOK, mb_book_mark, mb_book_free, book);
+    obj = TypedData_Make_Struct(klass, mb_BOOK, &mb_book_type, book);
+    mb_book_release_caches_internal(book);
+    book->parent = Qnil;
+    book->cache_owner = Qnil;
+    mb_live_books++;
+    *out = book;
     return obj;
 }
 
-static VALUE mb_book_init(VALUE self, VALUE path)
+static VALUE mb_book_alloc(VALUE klass)
 {
-    mb_BOOK *book = DATA_PTR(self);
+    mb_BOOK *book;
+
+    return mb_book_new(klass, &book);
+}
+
+/* Record payloads owned by the book, see mb_book_memsize() */
+static size_t mb_book_records_bytes(const mb_BOOK *book)
+{
+    const MOBIPdbRecord *rec;
+    size_t size = 0;
+
+    for (rec = book->data->rec; rec != NULL; rec = rec->next) {
+        if (rec->data == NULL ||
+            (book->map.addr && rec->data >= book->map.addr && rec->data < book->map.addr + book->map.size)) {
+            continue;
+        }
+        size += rec->size;
+    }
+    return size;
+}
+
+typedef struct mb_LOAD_ARGS {
+    MOBIData *data;
+    /* either path or file should be set */
+    const char *path;
+    FILE *file;
+    /* when set, the path is mapped into memory instead of reading */
+    mb_MAPPING *map;
+    /* load only records needed to parse headers, uses temporary mapping */
+    int headers_only;
+    /* halves of hybrid book to parse */
+    mb_FORMAT format;
+    mb_MAPPING scratch;
+    /* when set, the sidecar cache is looked up once the book is loaded */
+    const char *cache_path;
+    mb_CACHE_KEY cache_key;
+    mb_CACHE *cache;
+    /* the phases timed without GVL, see mb_book_load() */
+    mb_PHASE_STATS stats[MB_PHASES_COUNT];
     MOBI_RET rc;
+    volatile int done;
+} mb_LOAD_ARGS;
+
+static void *mb_book_load_nogvl(void *ptr)
+{
+    mb_LOAD_ARGS *args = ptr;
+    struct stat st;
+    uint64_t start;
+
+    if (args->cache_path) {
+        /* taken before loading, so that the book modified in between invalidates the cache */
+        if (stat(args->path, &st) == 0) {
+            args->cache_key.size = (uint64_t)st.st_size;
+            args->cache_key.mtime = (int64_t)st.st_mtime;
+        }
+    }
+    if (args->map || args->headers_only) {
+        mb_MAPPING *map = args->map ? args->map : &args->scratch;
+        start = mb_phase_start(MB_PHASE_read);
+        args->rc = mb_mapping_open(map, args->path);
+        mb_phase_done(args->stats, MB_PHASE_read, start, map->size);
+        if (args->rc == MOBI_SUCCESS) {
+            start = mb_phase_start(MB_PHASE_parse);
+            args->rc = mb_load_mapped(&args->data, map, args->format, args->headers_only);
+            mb_phase_done(args->stats, MB_PHASE_parse, start, 0);
+            if (args->rc != MOBI_SUCCESS || args->headers_only) {
+                mb_mapping_close(map);
+            }
+        }
+    } else {
+        /* libmobi reads and parses in one go, so it is all counted as parsing */
+        start = mb_phase_start(MB_PHASE_parse);
+        args->data = mobi_init();
+        if (args->data == NULL) {
+            args->rc = MOBI_MALLOC_FAILED;
+        } else {
+            /* otherwise libmobi swaps the KF8 half in */
+            args->data->use_kf8 = args->format != MB_FORMAT_KF7;
+            if (args->file) {
+                args->rc = mobi_load_file(args->data, args->file);
+            } else {
+                args->rc = mobi_load_filename(args->data, args->path);
+            }
+            if (args->rc == MOBI_SUCCESS) {
+                args->rc = mb_select_format(args->data, args->format, NULL);
+            }
+        }
+        mb_phase_done(args->stats, MB_PHASE_parse, start, 0);
+        if (args->rc != MOBI_SUCCESS) {
+            mobi_free(args->data);
+        }
+    }
+    if (args->rc != MOBI_SUCCESS) {
+        args->data = NULL;
+    } else if (args->cache_path) {
+        start = mb_phase_start(MB_PHASE_index);
+        /* missing or stale cache is not an error, it is rebuilt by mb_book_fetch_rawml() */
+        mb_cache_open(&args->cache, args->cache_path, &args->cache_key, args->data);
+        mb_phase_done(args->stats, MB_PHASE_index, start, args->cache ? args->cache->map.size : 0);
+    }
+    args->done = 1;
+    return NULL;
+}
+
+/*
+ * Load MOBIData using path or file from the arguments. The file is not closed
+ * by this function.
+ */
+static void mb_book_load(VALUE self, mb_BOOK *book, mb_LOAD_ARGS *args, const char *message)
+{
+    const MOBIPdbRecord *rec;
+    int phase;
+
+    if (book->data != NULL) {
+        mb_raise_msg("the MOBI data is already loaded");
+    }
+    mb_call_without_gvl(mb_book_load_nogvl, args, &args->done);
+    if (args->rc != MOBI_SUCCESS) {
+        mb_raise(args->rc, message);
+    }
+    book->data = args->data;
+    book->headers_only = args->headers_only;
+    book->native_bytes = mb_book_records_bytes(book);
+    mb_memory_add(book->native_bytes);
+    book->cache_key = args->cache_key;
+    if (args->cache) {
+        book->cache_owner = mb_owner_new(self, args->cache, mb_release_cache);
+        book->cache = args->cache;
+    }
+    /* the hook may raise, so everything loaded is owned by the book already */
+    if (args->stats[MB_PHASE_parse].calls) {
+        for (rec = book->data->rec; rec != NULL; rec = rec->next) {
+            args->stats[MB_PHASE_parse].bytes += rec->size;
+        }
+    }
+    for (phase = 0; phase < MB_PHASES_COUNT; phase++) {
+        if (args->stats[phase].calls) {
+            mb_book_phase_record(self, book, (mb_PHASE)phase, &args->stats[phase]);
+        }
+    }
+}
+
+static void mb_book_ensure_payloads(const mb_BOOK *book)
+{
+    if (book->headers_only) {
+        mb_raise_msg("record payloads are not loaded, the book has been opened with \"headers_only: true\"");
+    }
+}
+
+/*
+ * Book.new(path, mmap: false, headers_only: false, cache: nil, format: :both)
+ *
+ * With "mmap: true" the file is mapped into memory, and record payloads are
+ * served directly from the mapping, so only the pages actually touched are
+ * read from the disk.
+ *
+ * With "headers_only: true" only the records needed for the headers and
+ * metadata are read, and everything that needs other record payloads
+ * raises an error.
+ *
+ * With "cache: true" (or the path of the cache file) the parts reconstructed
+ * by #rawml_parts are saved into "<path>.mbcache" sidecar, and the next time
+ * the book is opened, they are served from it without parsing the indexes
+ * or decompressing the text. The sidecar is keyed by size, modification time
+ * and hash of the headers of the book, and stale one is rebuilt. Only
+ * #rawml_parts (and #export_epub built on them) are served from the cache,
+ * #rawml and #text still decompress the text, the sidecar only tells them
+ * its length.
+ *
+ * With "format: :kf8" or "format: :kf7" only that half of hybrid KF7/KF8
+ * book is kept, and #next returns nil. The KF8 record 0 is not even parsed
+ * for :kf7 when the book is mapped, and the records after the boundary are
+ * dropped, so the book is not hybrid anymore. Other books raise MOBI::Error
+ * when they are not in the requested format.
+ */
+static VALUE mb_book_init(int argc, VALUE *argv, VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_LOAD_ARGS args = {0};
+    VALUE path, opts = Qnil, cache_path = Qnil;
 
+    rb_scan_args(argc, argv, "1:", &path, &opts);
     Check_Type(path, T_STRING);
+    if (book->data != NULL) {
+        mb_raise_msg("the MOBI data is already loaded");
+    }
+    if (!NIL_P(opts)) {
+        ID keys[4];
+        VALUE values[4];
+
+        keys[0] = MB_ID(mmap);
+        keys[1] = MB_ID(headers_only);
+        keys[2] = MB_ID(cache);
+        keys[3] = MB_ID(format);
+        rb_get_kwargs(opts, keys, 0, 4, values);
+        if (values[0] != Qundef && RTEST(values[0])) {
+            args.map = &book->map;
+        }
+        if (values[1] != Qundef && RTEST(values[1])) {
+            args.headers_only = 1;
+        }
+        if (values[2] == Qtrue) {
+            cache_path = rb_str_plus(path, rb_str_new_cstr(".mbcache"));
+        } else if (values[2] != Qundef && RTEST(values[2])) {
+            cache_path = rb_str_new_frozen(rb_get_path(values[2]));
+        }
+        if (values[3] == Qundef || values[3] == MB_SYM(both)) {
+            args.format = MB_FORMAT_BOTH;
+        } else if (values[3] == MB_SYM(kf7)) {
+            args.format = MB_FORMAT_KF7;
+        } else if (values[3] == MB_SYM(kf8)) {
+            args.format = MB_FORMAT_KF8;
+        } else {
+            rb_raise(rb_eArgError, "format must be :kf7, :kf8 or :both, got %" PRIsVALUE, rb_inspect(values[3]));
+        }
+        if (args.headers_only && !NIL_P(cache_path)) {
+            rb_raise(rb_eArgError, "cache cannot be used with \"headers_only: true\"");
+        }
+#ifndef HAVE_MMAP
+        if (args.map || args.headers_only || !NIL_P(cache_path)) {
+            rb_raise(rb_eNotImpError, "mmap, headers_only and cache are not supported on this platform");
+        }
+#endif
+    }
+    /* other threads should not be able to modify the path while it is being used without GVL */
+    path = rb_str_new_frozen(path);
+    args.path = StringValueCStr(path);
+    /* left from the previous call, which has failed to load the book */
+    xfree(book->path);
+    book->path = ruby_strdup(args.path);
+    xfree(book->cache_path);
+    book->cache_path = NULL;
+    if (!NIL_P(cache_path)) {
+        args.cache_path = StringValueCStr(cache_path);
+        book->cache_path = ruby_strdup(args.cache_path);
+    }
+    mb_book_load(self, book, &args, "unable to load book from path");
+    rb_thread_check_ints();
+    RB_GC_GUARD(path);
+    RB_GC_GUARD(cache_path);
+    return self;
+}
+
+typedef struct mb_LOAD_FILE_ARGS {
+    VALUE self;
+    mb_LOAD_ARGS load;
+    /* offset of the descriptor shared with IO to restore, or -1 */
+    off_t offset;
+} mb_LOAD_FILE_ARGS;
+
+static VALUE mb_book_load_file_body(VALUE arg)
+{
+    mb_LOAD_FILE_ARGS *args = (mb_LOAD_FILE_ARGS *)arg;
+
+    mb_book_load(args->self, DATA_PTR(args->self), &args->load, "unable to load book from file");
+    return args->self;
+}
+
+static VALUE mb_book_load_file_ensure(VALUE arg)
+{
+    mb_LOAD_FILE_ARGS *args = (mb_LOAD_FILE_ARGS *)arg;
 
-    book->data = mobi_init();
-    if (book->data == NULL) {
-        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate MOBIData struct");
+    if (args->offset >= 0) {
+        lseek(fileno(args->load.file), args->offset, SEEK_SET);
     }
+    fclose(args->load.file);
+    return Qnil;
+}
 
-    rc = mobi_load_filename(book->data, RSTRING_PTR(path));
-    if (rc != MOBI_SUCCESS) {
-        mb_raise(rc, "unable to load book from path");
+/*
+ * Load the book from FILE and close it afterwards. Unless offset is
+ * negative, the file is read from the beginning, and the offset of its
+ * descriptor is set back to offset.
+ */
+static VALUE mb_book_load_file(VALUE self, FILE *file, off_t offset)
+{
+    mb_LOAD_FILE_ARGS args = {0};
+
+    args.self = self;
+    args.load.file = file;
+    args.offset = offset;
+    if (offset >= 0 && fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        rb_sys_fail("unable to rewind file");
+    }
+    rb_ensure(mb_book_load_file_body, (VALUE)&args, mb_book_load_file_ensure, (VALUE)&args);
+    rb_thread_check_ints();
+    return self;
+}
+
+/*
+ * Load the book from the string. The string is not copied, the loader reads
+ * directly from its buffer.
+ */
+static VALUE mb_book_s_from_string(VALUE klass, VALUE bytes)
+{
+    VALUE self;
+    FILE *file;
+
+    StringValue(bytes);
+    if (RSTRING_LEN(bytes) == 0) {
+        mb_raise(MOBI_DATA_CORRUPT, "unable to load book from empty string");
+    }
+    /* frozen shared string protects the buffer from being modified while the GVL is released */
+    bytes = rb_str_new_frozen(bytes);
+    self = rb_obj_alloc(klass);
+    file = mb_fmemopen(RSTRING_PTR(bytes), (size_t)RSTRING_LEN(bytes));
+    if (file == NULL) {
+        rb_sys_fail("unable to open string as a file");
+    }
+    mb_book_load_file(self, file, -1);
+    RB_GC_GUARD(bytes);
+    return self;
+}
+
+/*
+ * Load the book from the IO object. When the IO is backed by regular file,
+ * its descriptor is used directly (the book is always read from the
+ * beginning of the file, and the position of the IO is kept), otherwise
+ * the IO is read into a string.
+ */
+static VALUE mb_book_s_from_io(VALUE klass, VALUE io)
+{
+    VALUE self, fileno = Qnil;
+    struct stat st;
+    FILE *file;
+    off_t offset;
+    int fd;
+
+    if (rb_respond_to(io, rb_intern("fileno"))) {
+        fileno = rb_funcall(io, rb_intern("fileno"), 0);
+    }
+    if (!FIXNUM_P(fileno) || fstat(FIX2INT(fileno), &st) != 0 || !S_ISREG(st.st_mode)) {
+        VALUE bytes = rb_funcall(io, rb_intern("read"), 0);
+        if (NIL_P(bytes)) {
+            mb_raise(MOBI_DATA_CORRUPT, "unable to load book from exhausted IO");
+        }
+        return mb_book_s_from_string(klass, bytes);
+    }
+    self = rb_obj_alloc(klass);
+    /* the duplicate shares the offset, and IO might have buffered the data past it */
+    offset = lseek(FIX2INT(fileno), 0, SEEK_CUR);
+    if (offset < 0) {
+        rb_sys_fail("unable to get file offset");
+    }
+    fd = dup(FIX2INT(fileno));
+    if (fd < 0) {
+        rb_sys_fail("unable to duplicate file descriptor");
+    }
+    file = fdopen(fd, "rb");
+    if (file == NULL) {
+        close(fd);
+        rb_sys_fail("unable to open file descriptor");
     }
+    mb_book_load_file(self, file, offset);
     return self;
 }
 
+/*
+ * The other half of hybrid book. It shares MOBIData with this book, and
+ * keeps it alive until both are collected.
+ */
 static VALUE mb_book_next(VALUE self)
 {
     mb_BOOK *book = DATA_PTR(self);
@@ -123,22 +779,33 @@ static VALUE mb_book_next(VALUE self)
         VALUE obj;
         mb_BOOK *next;
 
-        obj = Data_Make_Struct(mb_cBook, mb_BOOK, mb_book_mark, mb_book_free, next);
+        obj = mb_book_new(mb_cBook, &next);
         next->data = book->data->next;
+        next->parent = self;
+        next->headers_only = book->headers_only;
         return obj;
     }
 
     return Qnil;
 }
 
+/* Fills array of Qnil values, the Struct members which are not set stay nil */
+static void mb_values_clear(VALUE *values, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        values[i] = Qnil;
+    }
+}
+
 #define COPY_HEADER_INT(NAME)                                                                                          \
     if (hdr->NAME) {                                                                                                   \
-        rb_hash_aset(res, ID2SYM(rb_intern(#NAME)), INT2FIX(*hdr->NAME));                                              \
+        v[MB_MOBI_HEADER_##NAME] = INT2FIX(*hdr->NAME);                                                                \
     }
 static VALUE mb_book_mobi_header(VALUE self)
 {
     mb_BOOK *book = DATA_PTR(self);
-    VALUE res;
+    VALUE v[MB_MOBI_HEADER_COUNT];
     MOBIMobiHeader *hdr;
 
     if (book == NULL || book->data == NULL) {
@@ -149,112 +816,56 @@ static VALUE mb_book_mobi_header(VALUE self)
         return Qnil;
     }
 
-    res = rb_hash_new();
-    rb_hash_aset(res, ID2SYM(rb_intern("magic")), rb_str_new_cstr(hdr->mobi_magic));
-    COPY_HEADER_INT(header_length);
-    COPY_HEADER_INT(mobi_type);
+    mb_values_clear(v, MB_MOBI_HEADER_COUNT);
+    v[MB_MOBI_HEADER_magic] = rb_str_new_cstr(hdr->mobi_magic);
     if (hdr->text_encoding) {
-        rb_hash_aset(res, ID2SYM(rb_intern("text_encoding")), INT2FIX(*hdr->text_encoding));
+        v[MB_MOBI_HEADER_text_encoding] = INT2FIX(*hdr->text_encoding);
         switch (*hdr->text_encoding) {
             case MOBI_CP1252:
-                rb_hash_aset(res, ID2SYM(rb_intern("text_encoding_sym")), ID2SYM(rb_intern("cp1252")));
+                v[MB_MOBI_HEADER_text_encoding_sym] = MB_SYM(cp1252);
                 break;
             case MOBI_UTF8:
-                rb_hash_aset(res, ID2SYM(rb_intern("text_encoding_sym")), ID2SYM(rb_intern("utf8")));
+                v[MB_MOBI_HEADER_text_encoding_sym] = MB_SYM(utf8);
                 break;
             case MOBI_UTF16:
-                rb_hash_aset(res, ID2SYM(rb_intern("text_encoding_sym")), ID2SYM(rb_intern("utf16")));
+                v[MB_MOBI_HEADER_text_encoding_sym] = MB_SYM(utf16);
                 break;
             default:
-                rb_hash_aset(res, ID2SYM(rb_intern("text_encoding_sym")), ID2SYM(rb_intern("unknown")));
+                v[MB_MOBI_HEADER_text_encoding_sym] = MB_SYM(unknown);
                 break;
         }
     }
     if (hdr->locale) {
         const char *locale_string = mobi_get_locale_string(*hdr->locale);
         if (locale_string) {
-            rb_hash_aset(res, ID2SYM(rb_intern("locale_str")), rb_str_new_cstr(locale_string));
+            v[MB_MOBI_HEADER_locale_str] = rb_str_new_cstr(locale_string);
         }
-        rb_hash_aset(res, ID2SYM(rb_intern("locale")), INT2FIX(*hdr->locale));
+        v[MB_MOBI_HEADER_locale] = INT2FIX(*hdr->locale);
     }
     if (hdr->dict_input_lang) {
         const char *locale_string = mobi_get_locale_string(*hdr->dict_input_lang);
         if (locale_string) {
-            rb_hash_aset(res, ID2SYM(rb_intern("dict_input_lang_str")), rb_str_new_cstr(locale_string));
+            v[MB_MOBI_HEADER_dict_input_lang_str] = rb_str_new_cstr(locale_string);
         }
-        rb_hash_aset(res, ID2SYM(rb_intern("dict_input_lang")), INT2FIX(*hdr->dict_input_lang));
+        v[MB_MOBI_HEADER_dict_input_lang] = INT2FIX(*hdr->dict_input_lang);
     }
     if (hdr->dict_output_lang) {
         const char *locale_string = mobi_get_locale_string(*hdr->dict_output_lang);
         if (locale_string) {
-            rb_hash_aset(res, ID2SYM(rb_intern("dict_output_lang_str")), rb_str_new_cstr(locale_string));
-        }
-        rb_hash_aset(res, ID2SYM(rb_intern("dict_output_lang")), INT2FIX(*hdr->dict_output_lang));
-    }
-    COPY_HEADER_INT(uid);
-    COPY_HEADER_INT(version);
-    COPY_HEADER_INT(orth_index);
-    COPY_HEADER_INT(infl_index);
-    COPY_HEADER_INT(names_index);
-    COPY_HEADER_INT(keys_index);
-    COPY_HEADER_INT(keys_index);
-    COPY_HEADER_INT(extra0_index);
-    COPY_HEADER_INT(extra1_index);
-    COPY_HEADER_INT(extra2_index);
-    COPY_HEADER_INT(extra3_index);
-    COPY_HEADER_INT(extra4_index);
-    COPY_HEADER_INT(extra5_index);
-    COPY_HEADER_INT(non_text_index);
-    COPY_HEADER_INT(full_name_offset);
-    COPY_HEADER_INT(full_name_length);
-    COPY_HEADER_INT(min_version);
-    COPY_HEADER_INT(image_index);
-    COPY_HEADER_INT(huff_rec_index);
-    COPY_HEADER_INT(huff_rec_count);
-    COPY_HEADER_INT(datp_rec_index);
-    COPY_HEADER_INT(datp_rec_count);
-    COPY_HEADER_INT(exth_flags);
-    COPY_HEADER_INT(unknown6);
-    COPY_HEADER_INT(drm_offset);
-    COPY_HEADER_INT(drm_count);
-    COPY_HEADER_INT(drm_size);
-    COPY_HEADER_INT(drm_flags);
-    COPY_HEADER_INT(first_text_index);
-    COPY_HEADER_INT(last_text_index);
-    COPY_HEADER_INT(fdst_index);
-    COPY_HEADER_INT(fdst_section_count);
-    COPY_HEADER_INT(fcis_index);
-    COPY_HEADER_INT(fcis_count);
-    COPY_HEADER_INT(flis_index);
-    COPY_HEADER_INT(flis_count);
-    COPY_HEADER_INT(unknown10);
-    COPY_HEADER_INT(unknown11);
-    COPY_HEADER_INT(srcs_index);
-    COPY_HEADER_INT(srcs_count);
-    COPY_HEADER_INT(unknown12);
-    COPY_HEADER_INT(unknown13);
-    COPY_HEADER_INT(extra_flags);
-    COPY_HEADER_INT(ncx_index);
-    COPY_HEADER_INT(unknown14);
-    COPY_HEADER_INT(unknown15);
-    COPY_HEADER_INT(fragment_index);
-    COPY_HEADER_INT(skeleton_index);
-    COPY_HEADER_INT(datp_index);
-    COPY_HEADER_INT(unknown16);
-    COPY_HEADER_INT(guide_index);
-    COPY_HEADER_INT(unknown17);
-    COPY_HEADER_INT(unknown18);
-    COPY_HEADER_INT(unknown19);
-    COPY_HEADER_INT(unknown20);
+            v[MB_MOBI_HEADER_dict_output_lang_str] = rb_str_new_cstr(locale_string);
+        }
+        v[MB_MOBI_HEADER_dict_output_lang] = INT2FIX(*hdr->dict_output_lang);
+    }
+    MB_MOBI_HEADER_INTS(COPY_HEADER_INT)
 
-    return res;
+    return mb_value_new(mb_cMobiHeader, MB_MOBI_HEADER_COUNT, v);
 }
 #undef COPY_HEADER_INT
 
 static VALUE mb_book_pdb_header(VALUE self)
 {
     mb_BOOK *book = DATA_PTR(self);
-    VALUE res;
+    VALUE v[MB_PDB_HEADER_COUNT];
     MOBIPdbHeader *hdr;
 
     if (book == NULL || book->data == NULL) {
@@ -264,37 +875,37 @@ static VALUE mb_book_pdb_header(VALUE self)
     if (hdr == NULL) {
         return Qnil;
     }
-    res = rb_hash_new();
-    rb_hash_aset(res, ID2SYM(rb_intern("name")), rb_str_new_cstr(hdr->name));
-    rb_hash_aset(res, ID2SYM(rb_intern("attributes")), INT2FIX(hdr->attributes));
-    rb_hash_aset(res, ID2SYM(rb_intern("version")), INT2FIX(hdr->version));
-    rb_hash_aset(res, ID2SYM(rb_intern("ctime")), INT2FIX(hdr->ctime));
+    mb_values_clear(v, MB_PDB_HEADER_COUNT);
+    v[MB_PDB_HEADER_name] = rb_str_new_cstr(hdr->name);
+    v[MB_PDB_HEADER_attributes] = INT2FIX(hdr->attributes);
+    v[MB_PDB_HEADER_version] = INT2FIX(hdr->version);
+    v[MB_PDB_HEADER_ctime] = INT2FIX(hdr->ctime);
     if (hdr->ctime) {
-        rb_hash_aset(res, ID2SYM(rb_intern("ctime_time")), rb_time_new(mktime(mobi_pdbtime_to_time(hdr->ctime)), 0));
+        v[MB_PDB_HEADER_ctime_time] = rb_time_new(mktime(mobi_pdbtime_to_time(hdr->ctime)), 0);
     }
-    rb_hash_aset(res, ID2SYM(rb_intern("mtime")), INT2FIX(hdr->mtime));
+    v[MB_PDB_HEADER_mtime] = INT2FIX(hdr->mtime);
     if (hdr->mtime) {
-        rb_hash_aset(res, ID2SYM(rb_intern("mtime_time")), rb_time_new(mktime(mobi_pdbtime_to_time(hdr->mtime)), 0));
+        v[MB_PDB_HEADER_mtime_time] = rb_time_new(mktime(mobi_pdbtime_to_time(hdr->mtime)), 0);
     }
-    rb_hash_aset(res, ID2SYM(rb_intern("btime")), INT2FIX(hdr->btime));
+    v[MB_PDB_HEADER_btime] = INT2FIX(hdr->btime);
     if (hdr->btime) {
-        rb_hash_aset(res, ID2SYM(rb_intern("btime_time")), rb_time_new(mktime(mobi_pdbtime_to_time(hdr->btime)), 0));
-    }
-    rb_hash_aset(res, ID2SYM(rb_intern("mod_num")), INT2FIX(hdr->mod_num));
-    rb_hash_aset(res, ID2SYM(rb_intern("appinfo_offset")), INT2FIX(hdr->appinfo_offset));
-    rb_hash_aset(res, ID2SYM(rb_intern("sortinfo_offset")), INT2FIX(hdr->sortinfo_offset));
-    rb_hash_aset(res, ID2SYM(rb_intern("type")), rb_str_new_cstr(hdr->type));
-    rb_hash_aset(res, ID2SYM(rb_intern("creator")), rb_str_new_cstr(hdr->creator));
-    rb_hash_aset(res, ID2SYM(rb_intern("uid")), INT2FIX(hdr->uid));
-    rb_hash_aset(res, ID2SYM(rb_intern("next_rec")), INT2FIX(hdr->next_rec));
-    rb_hash_aset(res, ID2SYM(rb_intern("rec_count")), INT2FIX(hdr->rec_count));
-    return res;
+        v[MB_PDB_HEADER_btime_time] = rb_time_new(mktime(mobi_pdbtime_to_time(hdr->btime)), 0);
+    }
+    v[MB_PDB_HEADER_mod_num] = INT2FIX(hdr->mod_num);
+    v[MB_PDB_HEADER_appinfo_offset] = INT2FIX(hdr->appinfo_offset);
+    v[MB_PDB_HEADER_sortinfo_offset] = INT2FIX(hdr->sortinfo_offset);
+    v[MB_PDB_HEADER_type] = rb_str_new_cstr(hdr->type);
+    v[MB_PDB_HEADER_creator] = rb_str_new_cstr(hdr->creator);
+    v[MB_PDB_HEADER_uid] = INT2FIX(hdr->uid);
+    v[MB_PDB_HEADER_next_rec] = INT2FIX(hdr->next_rec);
+    v[MB_PDB_HEADER_rec_count] = INT2FIX(hdr->rec_count);
+    return mb_value_new(mb_cPdbHeader, MB_PDB_HEADER_COUNT, v);
 }
 
 static VALUE mb_book_record0_header(VALUE self)
 {
     mb_BOOK *book = DATA_PTR(self);
-    VALUE res;
+    VALUE v[MB_RECORD0_HEADER_COUNT];
     MOBIRecord0Header *hdr;
 
     if (book == NULL || book->data == NULL) {
@@ -305,36 +916,36 @@ static VALUE mb_book_record0_header(VALUE self)
         return Qnil;
     }
 
-    res = rb_hash_new();
-    rb_hash_aset(res, ID2SYM(rb_intern("compression_type")), INT2FIX(hdr->compression_type));
+    mb_values_clear(v, MB_RECORD0_HEADER_COUNT);
+    v[MB_RECORD0_HEADER_compression_type] = INT2FIX(hdr->compression_type);
     switch (hdr->compression_type) {
         case 1:
-            rb_hash_aset(res, ID2SYM(rb_intern("compression_type_sym")), ID2SYM(rb_intern("none")));
+            v[MB_RECORD0_HEADER_compression_type_sym] = MB_SYM(none);
             break;
         case 2:
-            rb_hash_aset(res, ID2SYM(rb_intern("compression_type_sym")), ID2SYM(rb_intern("palm_doc")));
+            v[MB_RECORD0_HEADER_compression_type_sym] = MB_SYM(palm_doc);
             break;
         case 17480:
-            rb_hash_aset(res, ID2SYM(rb_intern("compression_type_sym")), ID2SYM(rb_intern("huff_cdic")));
+            v[MB_RECORD0_HEADER_compression_type_sym] = MB_SYM(huff_cdic);
             break;
     }
-    rb_hash_aset(res, ID2SYM(rb_intern("text_length")), INT2FIX(hdr->text_length));
-    rb_hash_aset(res, ID2SYM(rb_intern("text_record_count")), INT2FIX(hdr->text_record_count));
-    rb_hash_aset(res, ID2SYM(rb_intern("text_record_size")), INT2FIX(hdr->text_record_size));
-    rb_hash_aset(res, ID2SYM(rb_intern("encryption_type")), INT2FIX(hdr->encryption_type));
+    v[MB_RECORD0_HEADER_text_length] = INT2FIX(hdr->text_length);
+    v[MB_RECORD0_HEADER_text_record_count] = INT2FIX(hdr->text_record_count);
+    v[MB_RECORD0_HEADER_text_record_size] = INT2FIX(hdr->text_record_size);
+    v[MB_RECORD0_HEADER_encryption_type] = INT2FIX(hdr->encryption_type);
     switch (hdr->encryption_type) {
         case 0:
-            rb_hash_aset(res, ID2SYM(rb_intern("encryption_type_sym")), ID2SYM(rb_intern("none")));
+            v[MB_RECORD0_HEADER_encryption_type_sym] = MB_SYM(none);
             break;
         case 1:
-            rb_hash_aset(res, ID2SYM(rb_intern("encryption_type_sym")), ID2SYM(rb_intern("old")));
+            v[MB_RECORD0_HEADER_encryption_type_sym] = MB_SYM(old);
             break;
         case 2:
-            rb_hash_aset(res, ID2SYM(rb_intern("encryption_type_sym")), ID2SYM(rb_intern("mobi")));
+            v[MB_RECORD0_HEADER_encryption_type_sym] = MB_SYM(mobi);
             break;
     }
-    rb_hash_aset(res, ID2SYM(rb_intern("unknown1")), INT2FIX(hdr->unknown1));
-    return res;
+    v[MB_RECORD0_HEADER_unknown1] = INT2FIX(hdr->unknown1);
+    return mb_value_new(mb_cRecord0Header, MB_RECORD0_HEADER_COUNT, v);
 }
 
 static VALUE mb_book_exth_header(VALUE self)
@@ -355,260 +966,38 @@ static VALUE mb_book_exth_header(VALUE self)
     while (hdr != NULL) {
         MOBIExthMeta tag = mobi_get_exthtagmeta_by_tag(hdr->tag);
         uint32_t val32;
-        VALUE item = rb_hash_new();
+        VALUE v[MB_EXTH_ENTRY_COUNT];
 
-        rb_hash_aset(item, ID2SYM(rb_intern("code")), INT2FIX(tag.tag));
-        switch (hdr->tag) {
-            case EXTH_SAMPLE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("sample")));
-                break;
-            case EXTH_STARTREADING:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("start_reading")));
-                break;
-            case EXTH_KF8BOUNDARY:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("kf8_boundary")));
-                break;
-            case EXTH_COUNTRESOURCES:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("count_resources")));
-                break;
-            case EXTH_RESCOFFSET:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("resc_offset")));
-                break;
-            case EXTH_COVEROFFSET:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("cover_offset")));
-                break;
-            case EXTH_THUMBOFFSET:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("thumb_offset")));
-                break;
-            case EXTH_HASFAKECOVER:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("has_fake_cover")));
-                break;
-            case EXTH_CREATORSOFT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_soft")));
-                break;
-            case EXTH_CREATORMAJOR:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_major")));
-                break;
-            case EXTH_CREATORMINOR:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_minor")));
-                break;
-            case EXTH_CREATORBUILD:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_build")));
-                break;
-            case EXTH_CLIPPINGLIMIT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("clipping_limit")));
-                break;
-            case EXTH_PUBLISHERLIMIT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("publisher_limit")));
-                break;
-            case EXTH_TTSDISABLE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("tts_disabled")));
-                break;
-            case EXTH_RENTAL:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("rental")));
-                break;
-            case EXTH_DRMSERVER:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("drm_server")));
-                break;
-            case EXTH_DRMCOMMERCE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("drm_commerce")));
-                break;
-            case EXTH_DRMEBOOKBASE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("drm_ebookbase")));
-                break;
-            case EXTH_TITLE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("title")));
-                break;
-            case EXTH_AUTHOR:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator")));
-                break;
-            case EXTH_PUBLISHER:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("publisher")));
-                break;
-            case EXTH_IMPRINT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("imprint")));
-                break;
-            case EXTH_DESCRIPTION:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("description")));
-                break;
-            case EXTH_ISBN:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("isbn")));
-                break;
-            case EXTH_SUBJECT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("subject")));
-                break;
-            case EXTH_PUBLISHINGDATE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("published")));
-                break;
-            case EXTH_REVIEW:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("review")));
-                break;
-            case EXTH_CONTRIBUTOR:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("contributor")));
-                break;
-            case EXTH_RIGHTS:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("rights")));
-                break;
-            case EXTH_SUBJECTCODE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("subject_code")));
-                break;
-            case EXTH_TYPE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("type")));
-                break;
-            case EXTH_SOURCE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("source")));
-                break;
-            case EXTH_ASIN:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("asin")));
-                break;
-            case EXTH_VERSION:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("version")));
-                break;
-            case EXTH_ADULT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("adult")));
-                break;
-            case EXTH_PRICE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("price")));
-                break;
-            case EXTH_CURRENCY:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("currency")));
-                break;
-            case EXTH_FIXEDLAYOUT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("fixed_layout")));
-                break;
-            case EXTH_BOOKTYPE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("book_type")));
-                break;
-            case EXTH_ORIENTATIONLOCK:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("orientation_lock")));
-                break;
-            case EXTH_ORIGRESOLUTION:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("orig_resolution")));
-                break;
-            case EXTH_ZEROGUTTER:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("zero_gutter")));
-                break;
-            case EXTH_ZEROMARGIN:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("zero_margin")));
-                break;
-            case EXTH_KF8COVERURI:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("kf8_cover_uri")));
-                break;
-            case EXTH_REGIONMAGNI:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("region_magnification")));
-                break;
-            case EXTH_DICTNAME:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("dict_name")));
-                break;
-            case EXTH_WATERMARK:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("watermark")));
-                break;
-            case EXTH_DOCTYPE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("doc_type")));
-                break;
-            case EXTH_LASTUPDATE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("last_update")));
-                break;
-            case EXTH_UPDATEDTITLE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("updated_title")));
-                break;
-            case EXTH_ASIN504:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("asin_504")));
-                break;
-            case EXTH_TITLEFILEAS:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("title_file_as")));
-                break;
-            case EXTH_CREATORFILEAS:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_file_as")));
-                break;
-            case EXTH_PUBLISHERFILEAS:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("publisher_file_as")));
-                break;
-            case EXTH_LANGUAGE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("language")));
-                break;
-            case EXTH_ALIGNMENT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("alignment")));
-                break;
-            case EXTH_PAGEDIR:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("page_dir")));
-                break;
-            case EXTH_OVERRIDEFONTS:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("override_fonts")));
-                break;
-            case EXTH_SORCEDESC:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("source_desc")));
-                break;
-            case EXTH_DICTLANGIN:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("dict_lang_in")));
-                break;
-            case EXTH_DICTLANGOUT:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("dict_lang_out")));
-                break;
-            case EXTH_INPUTSOURCE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("input_source")));
-                break;
-            case EXTH_CREATORBUILDREV:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_build_rev")));
-                break;
-            case EXTH_CREATORSTRING:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("creator_string")));
-                break;
-            case EXTH_TAMPERKEYS:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("tamper_keys")));
-                break;
-            case EXTH_FONTSIGNATURE:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("font_signature")));
-                break;
-            case EXTH_UNK403:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_403")));
-                break;
-            case EXTH_UNK405:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_405")));
-                break;
-            case EXTH_UNK407:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_407")));
-                break;
-            case EXTH_UNK450:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_450")));
-                break;
-            case EXTH_UNK451:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_451")));
-                break;
-            case EXTH_UNK452:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_452")));
-                break;
-            case EXTH_UNK453:
-                rb_hash_aset(item, ID2SYM(rb_intern("id")), ID2SYM(rb_intern("unknown_453")));
-                break;
-        }
+        mb_values_clear(v, MB_EXTH_ENTRY_COUNT);
+        v[MB_EXTH_ENTRY_code] = INT2FIX(tag.tag);
+        v[MB_EXTH_ENTRY_id] = mb_exth_tag_sym(hdr->tag);
         if (tag.tag == 0) {
-            rb_hash_aset(item, ID2SYM(rb_intern("val_bin")), rb_str_new((const char *)hdr->data, hdr->size));
+            v[MB_EXTH_ENTRY_val_bin] = rb_str_new((const char *)hdr->data, hdr->size);
             val32 = mobi_decode_exthvalue(hdr->data, hdr->size);
-            rb_hash_aset(item, ID2SYM(rb_intern("val_num")), INT2FIX(val32));
+            v[MB_EXTH_ENTRY_val_num] = INT2FIX(val32);
         } else {
             char *str;
-            rb_hash_aset(item, ID2SYM(rb_intern("name")), rb_str_new_cstr(tag.name));
+            v[MB_EXTH_ENTRY_name] = rb_str_new_cstr(tag.name);
             switch (tag.type) {
                 case EXTH_NUMERIC:
                     val32 = mobi_decode_exthvalue(hdr->data, hdr->size);
-                    rb_hash_aset(item, ID2SYM(rb_intern("val_num")), INT2FIX(val32));
+                    v[MB_EXTH_ENTRY_val_num] = INT2FIX(val32);
                     break;
                 case EXTH_STRING:
                     str = mobi_decode_exthstring(book->data, hdr->data, hdr->size);
                     if (str) {
-                        rb_hash_aset(item, ID2SYM(rb_intern("val_str")), rb_str_new_cstr(str));
+                        v[MB_EXTH_ENTRY_val_str] = rb_str_new_cstr(str);
                         free(str);
                     }
                     break;
                 case EXTH_BINARY:
-                    rb_hash_aset(item, ID2SYM(rb_intern("val_bin")), rb_str_new((const char *)hdr->data, hdr->size));
+                    v[MB_EXTH_ENTRY_val_bin] = rb_str_new((const char *)hdr->data, hdr->size);
                     break;
                 default:
                     break;
             }
         }
-        rb_ary_push(res, item);
+        rb_ary_push(res, mb_value_new(mb_cExthEntry, MB_EXTH_ENTRY_COUNT, v));
         hdr = hdr->next;
     }
     return res;
@@ -662,6 +1051,85 @@ DEFINE_META_GETTER_STR(copyright)
 DEFINE_META_GETTER_STR(asin)
 DEFINE_META_GETTER_STR(language)
 
+/*
+ * Book#title=(value), Book#add_title(value), and the same for the other
+ * metadata
+ *
+ * The setter replaces all EXTH entries of the attribute (in both halves
+ * of hybrid book), nil deletes them, and add_ appends one more. The value
+ * is expected in UTF-8. The changes are written with #save or
+ * #save_in_place.
+ */
+static mb_BOOK *mb_book_editable(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    /* libmobi edits both halves of hybrid book */
+    if (mobi_is_hybrid(book->data) && book->data->next == NULL) {
+        mb_raise_msg("only one half of hybrid book is loaded, see \"format:\" of Book.new");
+    }
+    /* the headers are reallocated, while another thread might be reading them */
+    if (mb_book_data_owner(book)->busy) {
+        mb_raise_msg("the book is being read by another thread");
+    }
+    return book;
+}
+
+#define DEFINE_META_SETTER_STR(ATTR)                                                                                   \
+    static VALUE mb_book_set_##ATTR(VALUE self, VALUE value)                                                           \
+    {                                                                                                                  \
+        const char *str = NULL;                                                                                        \
+        mb_BOOK *book;                                                                                                 \
+        MOBI_RET rc;                                                                                                   \
+                                                                                                                       \
+        rb_check_frozen(self);                                                                                         \
+        if (!NIL_P(value)) {                                                                                           \
+            str = StringValueCStr(value);                                                                              \
+        }                                                                                                              \
+        book = mb_book_editable(self);                                                                                 \
+        rc = str ? mobi_meta_set_##ATTR(book->data, str) : mobi_meta_delete_##ATTR(book->data);                        \
+        if (rc != MOBI_SUCCESS) {                                                                                      \
+            mb_raise(rc, "unable to set " #ATTR);                                                                      \
+        }                                                                                                              \
+        /* the parts and the text might have been built with the old metadata */                                       \
+        mb_book_release_caches_internal(book);                                                                         \
+        return value;                                                                                                  \
+    }                                                                                                                  \
+                                                                                                                       \
+    static VALUE mb_book_add_##ATTR(VALUE self, VALUE value)                                                           \
+    {                                                                                                                  \
+        const char *str;                                                                                               \
+        mb_BOOK *book;                                                                                                 \
+        MOBI_RET rc;                                                                                                   \
+                                                                                                                       \
+        rb_check_frozen(self);                                                                                         \
+        str = StringValueCStr(value);                                                                                  \
+        book = mb_book_editable(self);                                                                                 \
+        rc = mobi_meta_add_##ATTR(book->data, str);                                                                    \
+        if (rc != MOBI_SUCCESS) {                                                                                      \
+            mb_raise(rc, "unable to add " #ATTR);                                                                      \
+        }                                                                                                              \
+        mb_book_release_caches_internal(book);                                                                         \
+        return self;                                                                                                   \
+    }
+
+DEFINE_META_SETTER_STR(title)
+DEFINE_META_SETTER_STR(author)
+DEFINE_META_SETTER_STR(publisher)
+DEFINE_META_SETTER_STR(imprint)
+DEFINE_META_SETTER_STR(description)
+DEFINE_META_SETTER_STR(isbn)
+DEFINE_META_SETTER_STR(subject)
+DEFINE_META_SETTER_STR(publishdate)
+DEFINE_META_SETTER_STR(review)
+DEFINE_META_SETTER_STR(contributor)
+DEFINE_META_SETTER_STR(copyright)
+DEFINE_META_SETTER_STR(asin)
+DEFINE_META_SETTER_STR(language)
+
 #define DEFINE_PREDICATE(METHOD, FUNCTION)                                                                             \
     static VALUE mb_book_p_##METHOD(VALUE self)                                                                        \
     {                                                                                                                  \
@@ -690,6 +1158,36 @@ DEFINE_PREDICATE(is_mobipocket, mobi_is_mobipocket)
 DEFINE_PREDICATE(is_dictionary, mobi_is_dictionary)
 DEFINE_PREDICATE(is_kf8, mobi_is_kf8)
 
+/* Record payload is exposed without copying, and keeps the book alive */
+static VALUE mb_record_new(VALUE self, const MOBIPdbRecord *rec, int with_payload)
+{
+    VALUE v[MB_RECORD_COUNT];
+
+    v[MB_RECORD_offset] = INT2FIX(rec->offset);
+    v[MB_RECORD_size] = INT2FIX(rec->size);
+    v[MB_RECORD_attributes] = INT2FIX(rec->attributes);
+    v[MB_RECORD_uid] = INT2FIX(rec->uid);
+    v[MB_RECORD_data] = with_payload ? mb_str_new_borrowed(rec->data, rec->size, self) : Qnil;
+    return mb_value_new(mb_cRecord, MB_RECORD_COUNT, v);
+}
+
+/* Parses "payload: true|false" keyword argument, payload is included by default */
+static int mb_opt_payload(VALUE opts)
+{
+    ID keys[1];
+    VALUE values[1];
+
+    if (NIL_P(opts)) {
+        return 1;
+    }
+    keys[0] = MB_ID(payload);
+    rb_get_kwargs(opts, keys, 0, 1, values);
+    if (values[0] == Qundef) {
+        return 1;
+    }
+    return RTEST(values[0]);
+}
+
 static VALUE mb_book_records(VALUE self)
 {
     mb_BOOK *book = DATA_PTR(self);
@@ -699,6 +1197,7 @@ static VALUE mb_book_records(VALUE self)
     if (book == NULL || book->data == NULL) {
         mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
     }
+    mb_book_ensure_payloads(book);
     rec = book->data->rec;
     if (rec == NULL) {
         return Qnil;
@@ -706,181 +1205,1782 @@ static VALUE mb_book_records(VALUE self)
 
     res = rb_ary_new();
     while (rec != NULL) {
-        VALUE item = rb_hash_new();
-        rb_hash_aset(item, ID2SYM(rb_intern("offset")), INT2FIX(rec->offset));
-        rb_hash_aset(item, ID2SYM(rb_intern("size")), INT2FIX(rec->size));
-        rb_hash_aset(item, ID2SYM(rb_intern("attributes")), INT2FIX(rec->attributes));
-        rb_hash_aset(item, ID2SYM(rb_intern("uid")), INT2FIX(rec->uid));
-        rb_hash_aset(item, ID2SYM(rb_intern("data")), rb_str_new((const char *)rec->data, rec->size));
-        rb_ary_push(res, item);
+        rb_ary_push(res, mb_record_new(self, rec, 1));
         rec = rec->next;
     }
     return res;
 }
 
-static VALUE mb_book_rawml(VALUE self)
+static VALUE mb_book_records_size(VALUE self, VALUE args, VALUE eobj)
 {
     mb_BOOK *book = DATA_PTR(self);
-    MOBI_RET rc;
-    char *text = NULL;
-    size_t size;
-    VALUE res;
+    (void)args;
+    (void)eobj;
+
+    if (book == NULL || book->data == NULL || book->data->ph == NULL) {
+        return Qnil;
+    }
+    return INT2FIX(book->data->ph->rec_count);
+}
+
+/*
+ * Yields records one by one, so that only current record is materialized.
+ * Use "payload: false" to skip copying record data.
+ */
+static VALUE mb_book_each_record(int argc, VALUE *argv, VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    const MOBIPdbRecord *rec;
+    VALUE opts = Qnil;
+    int with_payload;
+
+    RETURN_SIZED_ENUMERATOR(self, argc, argv, mb_book_records_size);
+    rb_scan_args(argc, argv, "0:", &opts);
+    with_payload = mb_opt_payload(opts);
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    if (with_payload) {
+        mb_book_ensure_payloads(book);
+    }
+    rec = book->data->rec;
+    while (rec != NULL) {
+        rb_yield(mb_record_new(self, rec, with_payload));
+        rec = rec->next;
+    }
+    return self;
+}
+
+/*
+ * Returns record by its sequential number, negative index counts from the
+ * end. Use "payload: false" to skip copying record data.
+ */
+static VALUE mb_book_record(int argc, VALUE *argv, VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    const MOBIPdbRecord *rec;
+    VALUE index, opts = Qnil;
+    long idx;
+    int with_payload;
 
+    rb_scan_args(argc, argv, "1:", &index, &opts);
+    with_payload = mb_opt_payload(opts);
     if (book == NULL || book->data == NULL) {
         mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
     }
-    size = mobi_get_text_maxsize(book->data);
-    if (size == MOBI_NOTSET) {
+    if (with_payload) {
+        mb_book_ensure_payloads(book);
+    }
+    idx = NUM2LONG(index);
+    if (idx < 0 && book->data->ph) {
+        idx += book->data->ph->rec_count;
+    }
+    if (idx < 0) {
+        return Qnil;
+    }
+    rec = book->data->rec;
+    while (rec != NULL && idx > 0) {
+        rec = rec->next;
+        idx--;
+    }
+    if (rec == NULL) {
+        return Qnil;
+    }
+    return mb_record_new(self, rec, with_payload);
+}
+
+typedef struct mb_RAWML_ARGS {
+    const MOBIData *data;
+    char *text;
+    size_t size;
+    MOBI_RET rc;
+    volatile int done;
+} mb_RAWML_ARGS;
+
+/* set with MOBI_PALMDOC=reference, makes #rawml use libmobi's decoders */
+static int mb_palmdoc_reference;
+
+static void *mb_book_rawml_nogvl(void *ptr)
+{
+    mb_RAWML_ARGS *args = ptr;
+    mb_TEXT_READER reader;
+
+    /* compressed books are decoded natively, libmobi handles the rest and encrypted ones */
+    memset(&reader, 0, sizeof(reader));
+    if (!mb_palmdoc_reference && mb_text_reader_init(&reader, args->data) == MOBI_SUCCESS &&
+        reader.compression != MB_COMPRESSION_NONE) {
+        args->rc = mb_text_reader_read_all(&reader, (unsigned char *)args->text, &args->size);
+    } else {
+        /* libmobi insists on the buffer of the maximal size */
+        size_t maxsize = mobi_get_text_maxsize(args->data);
+        char *text = args->size < maxsize ? realloc(args->text, maxsize + 1) : args->text;
+
+        if (text == NULL) {
+            args->rc = MOBI_MALLOC_FAILED;
+        } else {
+            args->text = text;
+            args->size = args->size < maxsize ? maxsize : args->size;
+            args->rc = mobi_get_rawml(args->data, args->text, &args->size);
+        }
+    }
+    mb_text_reader_free(&reader);
+    args->done = 1;
+    return NULL;
+}
+
+/*
+ * Decompress the text records once, and keep the result in the book until
+ * mb_book_release_caches_internal() is called.
+ */
+static void mb_book_fetch_rawml_text(VALUE self, mb_BOOK *book)
+{
+    mb_RAWML_ARGS args = {0};
+    uint64_t start;
+
+    if (book->rawml_text) {
+        return;
+    }
+    mb_book_ensure_payloads(book);
+    if (book->map.addr) {
+        mb_mapping_advise_text(&book->map, book->data);
+    }
+    args.data = book->data;
+    if (book->cache && book->cache->header->text_count) {
+        /* the exact size is known from the sidecar cache */
+        args.size = (size_t)book->cache->text_offsets[book->cache->header->text_count];
+    } else {
+        args.size = mobi_get_text_maxsize(book->data);
+    }
+    if (args.size == MOBI_NOTSET) {
         mb_raise(MOBI_DATA_CORRUPT, "unable to determine size for rawml");
     }
-    text = calloc(size + 1, sizeof(char));
-    if (text == NULL) {
+    args.text = calloc(args.size + 1, sizeof(char));
+    if (args.text == NULL) {
         mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for rawml buffer");
     }
-    rc = mobi_get_rawml(book->data, text, &size);
+    start = mb_phase_start(MB_PHASE_decompress);
+    mb_book_call_without_gvl(book, mb_book_rawml_nogvl, &args, &args.done);
+    if (args.rc != MOBI_SUCCESS) {
+        free(args.text);
+        mb_raise(args.rc, "unable to generate rawml");
+    }
+    if (book->rawml_text) {
+        /* another thread has been faster */
+        free(args.text);
+    } else {
+        book->rawml_text_owner = mb_owner_new(self, args.text, free);
+        mb_owner_track(book->rawml_text_owner, args.size);
+        book->rawml_text = args.text;
+        book->rawml_text_size = args.size;
+    }
+    /* the hook may raise, so the text is owned by the book already */
+    mb_book_phase_done(self, book, MB_PHASE_decompress, start, args.size);
+    rb_thread_check_ints();
+}
+
+static VALUE mb_book_rawml(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_fetch_rawml_text(self, book);
+    return mb_str_new_borrowed(book->rawml_text, book->rawml_text_size, book->rawml_text_owner);
+}
+
+static void mb_release_text_reader(void *ptr)
+{
+    mb_text_reader_free(ptr);
+    free(ptr);
+}
+
+typedef struct mb_TEXT_RECORD_ARGS {
+    mb_TEXT_READER *reader;
+    size_t index;
+    size_t len;
+    MOBI_RET rc;
+    volatile int done;
+} mb_TEXT_RECORD_ARGS;
+
+static void *mb_book_text_record_nogvl(void *ptr)
+{
+    mb_TEXT_RECORD_ARGS *args = ptr;
+
+    args->rc = mb_text_reader_read(args->reader, args->index, &args->len);
+    args->done = 1;
+    return NULL;
+}
+
+/*
+ * Create reader of the text records. It is wrapped into the owner, so that
+ * the scratch buffer is freed even if the block raises.
+ */
+static VALUE mb_book_text_reader_new(VALUE self, mb_BOOK *book, mb_TEXT_READER **out)
+{
+    mb_TEXT_READER *reader;
+    MOBI_RET rc;
+
+    mb_book_ensure_payloads(book);
+    reader = calloc(1, sizeof(mb_TEXT_READER));
+    if (reader == NULL) {
+        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for text reader");
+    }
+    rc = mb_text_reader_init(reader, book->data);
     if (rc != MOBI_SUCCESS) {
-        free(text);
-        mb_raise(rc, "unable to generate rawml");
+        mb_release_text_reader(reader);
+        mb_raise(rc, "unable to read text records");
+    }
+    *out = reader;
+    return mb_owner_new(self, reader, mb_release_text_reader);
+}
+
+/*
+ * Reader kept by the book, so that the scratch buffer and the HUFF/CDIC
+ * tables are reused by the following calls. While it is busy in another
+ * thread, the caller gets its own reader, and *busy is set to NULL.
+ * Otherwise *busy points to the flag cleared by mb_book_read_text_record().
+ */
+static VALUE mb_book_text_reader(VALUE self, mb_BOOK *book, mb_TEXT_READER **out, int **busy)
+{
+    mb_TEXT_READER *reader;
+    VALUE owner;
+
+    if (book->text_reader_busy) {
+        *busy = NULL;
+        return mb_book_text_reader_new(self, book, out);
+    }
+    if (book->text_reader == NULL) {
+        owner = mb_book_text_reader_new(self, book, &reader);
+        book->text_reader = reader;
+        book->text_reader_owner = owner;
+    }
+    book->text_reader_busy = 1;
+    *busy = &book->text_reader_busy;
+    *out = book->text_reader;
+    return book->text_reader_owner;
+}
+
+/*
+ * Decompress single text record, the result is copied out of the scratch
+ * buffer before the reader is released with busy flag (when not NULL).
+ */
+static VALUE mb_book_read_text_record(mb_BOOK *book, mb_TEXT_READER *reader, size_t index, int *busy)
+{
+    mb_TEXT_RECORD_ARGS args = {0};
+    VALUE res = Qnil;
+
+    args.reader = reader;
+    args.index = index;
+    mb_book_call_without_gvl(book, mb_book_text_record_nogvl, &args, &args.done);
+    if (args.rc == MOBI_SUCCESS) {
+        res = rb_str_new((const char *)reader->buf, (long)args.len);
+    }
+    if (busy) {
+        *busy = 0;
+    }
+    if (args.rc != MOBI_SUCCESS) {
+        mb_raise(args.rc, "unable to decompress text record");
+    }
+    rb_thread_check_ints();
+    return res;
+}
+
+static VALUE mb_book_text_records_size(VALUE self, VALUE args, VALUE eobj)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    (void)args;
+    (void)eobj;
+
+    if (book == NULL || book->data == NULL || book->data->rh == NULL) {
+        return Qnil;
+    }
+    return INT2FIX(book->data->rh->text_record_count);
+}
+
+/*
+ * Book#text_record(index)
+ *
+ * Decompressed text record with the index, counting from the first text
+ * record of the book, negative index counts from the end. Only this record
+ * is decompressed, so it is much cheaper than #rawml for previews. The
+ * scratch buffer and the decoder tables are kept by the book for the next
+ * call, until #release_caches.
+ */
+static VALUE mb_book_text_record(VALUE self, VALUE index)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_TEXT_READER *reader;
+    VALUE owner, res;
+    long idx;
+    int *busy;
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    idx = NUM2LONG(index);
+    owner = mb_book_text_reader(self, book, &reader, &busy);
+    if (idx < 0) {
+        idx += (long)reader->count;
+    }
+    if (idx < 0 || (size_t)idx >= reader->count) {
+        if (busy) {
+            *busy = 0;
+        }
         return Qnil;
     }
-    res = rb_str_new(text, size);
-    free(text);
+    res = mb_book_read_text_record(book, reader, (size_t)idx, busy);
+    RB_GC_GUARD(owner);
     return res;
 }
 
-static VALUE mb_extract_mobiparts(const MOBIPart *part)
+/*
+ * Book#each_text_record { |text| ... }
+ *
+ * Yields decompressed text records one by one. The same scratch buffer is
+ * used for all of them, so at most one record is held in native memory.
+ */
+static VALUE mb_book_each_text_record(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_TEXT_READER *reader;
+    VALUE owner;
+    size_t i;
+
+    RETURN_SIZED_ENUMERATOR(self, 0, 0, mb_book_text_records_size);
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    owner = mb_book_text_reader_new(self, book, &reader);
+    for (i = 0; i < reader->count; i++) {
+        rb_yield(mb_book_read_text_record(book, reader, i, NULL));
+    }
+    RB_GC_GUARD(owner);
+    return self;
+}
+
+static VALUE mb_extract_mobiparts(const MOBIPart *part, VALUE owner, size_t *bytes)
 {
     VALUE items = rb_ary_new();
     while (part != NULL) {
-        VALUE item = rb_hash_new();
-        rb_hash_aset(item, ID2SYM(rb_intern("type")), INT2FIX(part->type));
-        switch (part->type) {
-            case T_UNKNOWN:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("unknown")));
-                break;
-            case T_HTML:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("html")));
-                break;
-            case T_CSS:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("css")));
-                break;
-            case T_SVG:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("svg")));
-                break;
-            case T_OPF:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("opf")));
-                break;
-            case T_NCX:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("ncx")));
-                break;
-            case T_JPG:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("jpg")));
-                break;
-            case T_GIF:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("gif")));
-                break;
-            case T_PNG:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("png")));
-                break;
-            case T_BMP:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("bmp")));
-                break;
-            case T_OTF:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("otf")));
-                break;
-            case T_TTF:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("ttf")));
-                break;
-            case T_MP3:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("mp3")));
-                break;
-            case T_MPG:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("mpg")));
-                break;
-            case T_PDF:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("pdf")));
-                break;
-            case T_FONT:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("font")));
-                break;
-            case T_AUDIO:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("audio")));
-                break;
-            case T_VIDEO:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("video")));
-                break;
-            case T_BREAK:
-                rb_hash_aset(item, ID2SYM(rb_intern("type_sym")), ID2SYM(rb_intern("break")));
-                break;
-        }
-        rb_hash_aset(item, ID2SYM(rb_intern("uid")), INT2FIX(part->uid));
-        rb_hash_aset(item, ID2SYM(rb_intern("size")), INT2FIX(part->size));
-        rb_hash_aset(item, ID2SYM(rb_intern("data")), rb_str_new((const char *)part->data, part->size));
+        VALUE v[MB_PART_COUNT];
+
+        v[MB_PART_type] = INT2FIX(part->type);
+        v[MB_PART_type_sym] = mb_part_type_sym(part->type);
+        v[MB_PART_uid] = INT2FIX(part->uid);
+        v[MB_PART_size] = INT2FIX(part->size);
+        v[MB_PART_data] = mb_str_new_borrowed(part->data, part->size, owner);
+        rb_ary_push(items, mb_value_new(mb_cPart, MB_PART_COUNT, v));
+        *bytes += part->size;
         part = part->next;
-        rb_ary_push(items, item);
     }
     return items;
 }
 
+typedef struct mb_PARSE_RAWML_ARGS {
+    const MOBIData *data;
+    MOBIRawml *rawml;
+    /* when set, the parts are saved into the sidecar cache */
+    const char *cache_path;
+    const mb_CACHE_KEY *cache_key;
+    MOBI_RET rc;
+    volatile int done;
+} mb_PARSE_RAWML_ARGS;
+
+static void *mb_book_parse_rawml_nogvl(void *ptr)
+{
+    mb_PARSE_RAWML_ARGS *args = ptr;
+
+    args->rc = mobi_parse_rawml(args->rawml, args->data);
+    if (args->rc == MOBI_SUCCESS && args->cache_path) {
+        /* the cache is an optimization, the book is readable without it */
+        mb_cache_write(args->cache_path, args->cache_key, args->data, args->rawml);
+    }
+    args->done = 1;
+    return NULL;
+}
+
+/* The markup and flows, the resources mostly point into the record payloads */
+static size_t mb_rawml_bytes(const MOBIRawml *rawml)
+{
+    const MOBIPart *part;
+    size_t size = 0;
+
+    for (part = rawml->markup; part != NULL; part = part->next) {
+        size += part->size;
+    }
+    for (part = rawml->flow; part != NULL; part = part->next) {
+        size += part->size;
+    }
+    return size;
+}
+
+/*
+ * Reconstruct the parts once, and keep the result in the book until
+ * mb_book_release_caches_internal() is called.
+ */
+static void mb_book_fetch_rawml(VALUE self, mb_BOOK *book)
+{
+    mb_PARSE_RAWML_ARGS args = {0};
+    uint64_t start;
+    size_t bytes;
+
+    if (book->rawml) {
+        return;
+    }
+    mb_book_ensure_payloads(book);
+    if (book->map.addr) {
+        mb_mapping_advise_text(&book->map, book->data);
+    }
+    args.data = book->data;
+    if (book->cache_path && !book->cache) {
+        args.cache_path = book->cache_path;
+        args.cache_key = &book->cache_key;
+    }
+    args.rawml = mobi_init_rawml(book->data);
+    if (args.rawml == NULL) {
+        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for rawml structure");
+    }
+    start = mb_phase_start(MB_PHASE_index);
+    mb_book_call_without_gvl(book, mb_book_parse_rawml_nogvl, &args, &args.done);
+    if (args.rc != MOBI_SUCCESS) {
+        mobi_free_rawml(args.rawml);
+        mb_raise(args.rc, "unable to generate rawml");
+    }
+    bytes = mb_rawml_bytes(args.rawml);
+    if (book->rawml) {
+        /* another thread has been faster */
+        mobi_free_rawml(args.rawml);
+    } else {
+        book->rawml_owner = mb_owner_new(self, args.rawml, mb_release_rawml);
+        book->rawml_bytes = bytes;
+        mb_owner_track(book->rawml_owner, book->rawml_bytes);
+        book->rawml = args.rawml;
+    }
+    /* the hook may raise, so the parts are owned by the book already */
+    mb_book_phase_done(self, book, MB_PHASE_index, start, bytes);
+    rb_thread_check_ints();
+}
+
+/* Same as mb_extract_mobiparts(), but for the parts of the sidecar cache */
+static VALUE mb_extract_cached_parts(const mb_CACHE *cache, uint32_t kind, VALUE owner, size_t *bytes)
+{
+    VALUE items = Qnil;
+    size_t i;
+
+    for (i = 0; i < cache->header->parts_count; i++) {
+        const mb_CACHE_PART *part = &cache->parts[i];
+        VALUE v[MB_PART_COUNT];
+
+        if (part->kind != kind) {
+            continue;
+        }
+        if (NIL_P(items)) {
+            items = rb_ary_new();
+        }
+        v[MB_PART_type] = INT2FIX(part->type);
+        v[MB_PART_type_sym] = mb_part_type_sym((MOBIFiletype)part->type);
+        v[MB_PART_uid] = INT2FIX(part->uid);
+        v[MB_PART_size] = INT2FIX(part->size);
+        v[MB_PART_data] = mb_str_new_borrowed(cache->data[i], part->size, owner);
+        rb_ary_push(items, mb_value_new(mb_cPart, MB_PART_COUNT, v));
+        *bytes += part->size;
+    }
+    return items;
+}
+
+static VALUE mb_book_cached_parts(mb_BOOK *book, size_t *bytes)
+{
+    VALUE res, items, owner = book->cache_owner;
+
+    res = rb_hash_new();
+    rb_hash_aset(res, MB_SYM(version), INT2FIX(book->cache->header->rawml_version));
+    items = mb_extract_cached_parts(book->cache, MB_CACHE_MARKUP, owner, bytes);
+    if (!NIL_P(items)) {
+        rb_hash_aset(res, MB_SYM(markup), items);
+    }
+    items = mb_extract_cached_parts(book->cache, MB_CACHE_FLOW, owner, bytes);
+    if (!NIL_P(items)) {
+        rb_hash_aset(res, MB_SYM(flow), items);
+    }
+    items = mb_extract_cached_parts(book->cache, MB_CACHE_RESOURCE, owner, bytes);
+    if (!NIL_P(items)) {
+        rb_hash_aset(res, MB_SYM(resources), items);
+    }
+    RB_GC_GUARD(owner);
+    return res;
+}
+
 static VALUE mb_book_rawml_parts(VALUE self)
 {
     mb_BOOK *book = DATA_PTR(self);
-    MOBI_RET rc;
     MOBIRawml *rawml;
-    VALUE res;
+    VALUE res, owner;
+    size_t bytes = 0;
+    uint64_t start;
 
     if (book == NULL || book->data == NULL) {
         mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
     }
-    rawml = mobi_init_rawml(book->data);
-    if (rawml == NULL) {
-        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for rawml structure");
-    }
-    rc = mobi_parse_rawml(rawml, book->data);
-    if (rc != MOBI_SUCCESS) {
-        mobi_free_rawml(rawml);
-        mb_raise(rc, "unable to generate rawml");
-        return Qnil;
+    if (book->cache) {
+        start = mb_phase_start(MB_PHASE_build);
+        res = mb_book_cached_parts(book, &bytes);
+        mb_book_phase_done(self, book, MB_PHASE_build, start, bytes);
+        return res;
     }
+    mb_book_fetch_rawml(self, book);
+    start = mb_phase_start(MB_PHASE_build);
+    rawml = book->rawml;
+    owner = book->rawml_owner;
     res = rb_hash_new();
-    rb_hash_aset(res, ID2SYM(rb_intern("version")), INT2FIX(rawml->version));
+    rb_hash_aset(res, MB_SYM(version), INT2FIX(rawml->version));
     if (rawml->markup != NULL) {
-        rb_hash_aset(res, ID2SYM(rb_intern("markup")), mb_extract_mobiparts(rawml->markup));
+        rb_hash_aset(res, MB_SYM(markup), mb_extract_mobiparts(rawml->markup, owner, &bytes));
     }
     if (rawml->flow != NULL) {
-        rb_hash_aset(res, ID2SYM(rb_intern("flow")), mb_extract_mobiparts(rawml->flow));
+        rb_hash_aset(res, MB_SYM(flow), mb_extract_mobiparts(rawml->flow, owner, &bytes));
     }
     if (rawml->resources != NULL) {
-        rb_hash_aset(res, ID2SYM(rb_intern("resources")), mb_extract_mobiparts(rawml->resources));
+        rb_hash_aset(res, MB_SYM(resources), mb_extract_mobiparts(rawml->resources, owner, &bytes));
     }
-    mobi_free_rawml(rawml);
+    mb_book_phase_done(self, book, MB_PHASE_build, start, bytes);
+    RB_GC_GUARD(owner);
     return res;
 }
 
-static void init_mobi_book()
+static VALUE mb_resource_new(VALUE self, const mb_RESOURCE *res)
 {
-    mb_cBook = rb_define_class_under(mb_mMOBI, "Book", rb_cObject);
-    rb_define_alloc_func(mb_cBook, mb_book_alloc);
-    rb_define_method(mb_cBook, "initialize", mb_book_init, 1);
-    rb_define_method(mb_cBook, "next", mb_book_next, 0);
-    rb_define_method(mb_cBook, "mobi_header", mb_book_mobi_header, 0);
-    rb_define_method(mb_cBook, "pdb_header", mb_book_pdb_header, 0);
-    rb_define_method(mb_cBook, "record0_header", mb_book_record0_header, 0);
-    rb_define_method(mb_cBook, "exth_header", mb_book_exth_header, 0);
-    rb_define_method(mb_cBook, "full_name", mb_book_full_name, 0);
-    rb_define_method(mb_cBook, "title", mb_book_title, 0);
-    rb_define_method(mb_cBook, "author", mb_book_author, 0);
-    rb_define_method(mb_cBook, "publisher", mb_book_publisher, 0);
-    rb_define_method(mb_cBook, "imprint", mb_book_imprint, 0);
-    rb_define_method(mb_cBook, "description", mb_book_description, 0);
-    rb_define_method(mb_cBook, "isbn", mb_book_isbn, 0);
-    rb_define_method(mb_cBook, "subject", mb_book_subject, 0);
+    VALUE v[MB_RESOURCE_COUNT], obj;
+
+    v[MB_RESOURCE_type] = INT2FIX(res->type);
+    v[MB_RESOURCE_type_sym] = mb_part_type_sym(res->type);
+    v[MB_RESOURCE_uid] = SIZET2NUM(res->uid);
+    v[MB_RESOURCE_size] = SIZET2NUM(res->size);
+    obj = rb_class_new_instance(MB_RESOURCE_COUNT, v, mb_cResource);
+    /* Resource#data goes back to the book */
+    rb_ivar_set(obj, mb_id_owner, self);
+    return rb_obj_freeze(obj);
+}
+
+/*
+ * Book#each_resource { |resource| ... }
+ *
+ * Yields images, fonts and media of the book as MOBI::Resource, straight
+ * from the PDB records and without reconstructing the markup. The payload
+ * is not touched until Resource#data is called. Fonts are reported as :font
+ * with the size declared in their header, until they are decoded.
+ */
+static VALUE mb_book_each_resource(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_RESOURCE_ITER iter;
+    mb_RESOURCE res;
+
+    RETURN_ENUMERATOR(self, 0, 0);
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_ensure_payloads(book);
+    mb_resource_iter_init(&iter, book->data);
+    while (mb_resource_next(&iter, &res)) {
+        rb_yield(mb_resource_new(self, &res));
+    }
+    return self;
+}
+
+/*
+ * Book#resource_data(uid)
+ *
+ * Payload of the resource with the uid, or nil when there is no such
+ * resource. Images and media are returned without copying, fonts are
+ * decompressed and deobfuscated.
+ */
+static VALUE mb_book_resource_data(VALUE self, VALUE uid)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_RESOURCE res;
+    const unsigned char *data;
+    unsigned char *owned;
+    size_t size;
+    MOBI_RET rc;
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_ensure_payloads(book);
+    if (!mb_resource_find(book->data, NUM2SIZET(uid), &res)) {
+        return Qnil;
+    }
+    rc = mb_resource_payload(&res, &data, &size, &owned);
+    if (rc != MOBI_SUCCESS) {
+        mb_raise(rc, "unable to decode resource");
+    }
+    if (owned) {
+        return mb_str_new_borrowed(data, size, mb_owner_new(self, owned, free));
+    }
+    return mb_str_new_borrowed(data, size, self);
+}
+
+static VALUE mb_resource_data(VALUE self)
+{
+    VALUE book = rb_ivar_get(self, mb_id_owner);
+    return mb_book_resource_data(book, RSTRUCT_GET(self, MB_RESOURCE_uid));
+}
+
+static void mb_release_resource_export(void *ptr)
+{
+    mb_resource_export_free(ptr);
+    free(ptr);
+}
+
+typedef struct mb_EXPORT_ARGS {
+    mb_RESOURCE_EXPORT *ex;
+    MOBI_RET rc;
+    volatile int done;
+} mb_EXPORT_ARGS;
+
+static void *mb_book_export_resources_nogvl(void *ptr)
+{
+    mb_EXPORT_ARGS *args = ptr;
+
+    args->rc = mb_resource_export(args->ex);
+    args->done = 1;
+    return NULL;
+}
+
+/* Unlike libmobi calls, the export stops between the files when interrupted */
+static void mb_book_export_resources_ubf(void *ptr)
+{
+    mb_RESOURCE_EXPORT *ex = ptr;
+    ex->cancel = 1;
+}
+
+/*
+ * Book#export_resources(dir)
+ *
+ * Writes all resources into existing directory as resourceNNNNN.ext, and
+ * returns their paths. The files are written without GVL, directly from the
+ * records, and for the books opened with "mmap: true" the raw payloads are
+ * copied by the kernel with copy_file_range(2) where available.
+ */
+static VALUE mb_book_export_resources(VALUE self, VALUE dir)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_EXPORT_ARGS args = {0};
+    mb_RESOURCE_EXPORT *ex;
+    char name[32];
+    VALUE owner, res;
+    size_t i;
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_ensure_payloads(book);
+    FilePathValue(dir);
+    dir = rb_str_new_frozen(dir);
+    ex = calloc(1, sizeof(mb_RESOURCE_EXPORT));
+    if (ex == NULL) {
+        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for resource export");
+    }
+    /* the list of the written files is freed even if the export is interrupted */
+    owner = mb_owner_new(self, ex, mb_release_resource_export);
+    ex->m = book->data;
+    ex->map = book->map.addr ? &book->map : NULL;
+    ex->dir = StringValueCStr(dir);
+    args.ex = ex;
+    for (;;) {
+        args.done = 0;
+        ex->cancel = 0;
+        mb_book_data_owner(book)->busy++;
+        rb_thread_call_without_gvl2(mb_book_export_resources_nogvl, &args, mb_book_export_resources_ubf, ex);
+        mb_book_data_owner(book)->busy--;
+        if (args.done && (args.rc != MOBI_SUCCESS || !ex->cancel)) {
+            break;
+        }
+        /* raises, or resumes with the next file */
+        rb_thread_check_ints();
+    }
+    if (args.rc == MOBI_WRITE_FAILED && ex->err) {
+        mb_resource_file_name(name, sizeof(name), ex->err_uid, ex->err_type);
+        rb_syserr_fail_str(ex->err, rb_file_expand_path(rb_str_new_cstr(name), dir));
+    }
+    if (args.rc != MOBI_SUCCESS) {
+        mb_raise(args.rc, "unable to export resources");
+    }
+    res = rb_ary_new_capa((long)ex->count);
+    for (i = 0; i < ex->count; i++) {
+        mb_resource_file_name(name, sizeof(name), ex->files[i].uid, ex->files[i].type);
+        rb_ary_push(res, rb_file_expand_path(rb_str_new_cstr(name), dir));
+    }
+    RB_GC_GUARD(owner);
+    RB_GC_GUARD(dir);
+    return res;
+}
+
+/* Resource referenced by numeric EXTH entry, looked up without reading the other records */
+static VALUE mb_book_exth_resource(VALUE self, MOBIExthTag tag)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    MOBIExthHeader *exth;
+    mb_RESOURCE res;
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_ensure_payloads(book);
+    exth = mobi_get_exthrecord_by_tag(book->data, tag);
+    if (exth == NULL) {
+        return Qnil;
+    }
+    if (!mb_resource_find(book->data, mobi_decode_exthvalue(exth->data, exth->size), &res)) {
+        return Qnil;
+    }
+    return mb_resource_new(self, &res);
+}
+
+/*
+ * Book#cover
+ *
+ * Cover image as MOBI::Resource, or nil when the book does not have one.
+ * The EXTH cover offset is resolved directly to the record of the image, the
+ * markup is not reconstructed.
+ */
+static VALUE mb_book_cover(VALUE self)
+{
+    return mb_book_exth_resource(self, EXTH_COVEROFFSET);
+}
+
+/*
+ * Book#thumbnail
+ *
+ * Thumbnail image as MOBI::Resource, or nil, the same way as Book#cover.
+ */
+static VALUE mb_book_thumbnail(VALUE self)
+{
+    return mb_book_exth_resource(self, EXTH_THUMBOFFSET);
+}
+
+typedef struct mb_EPUB_EXPORT {
+    mb_EPUB epub;
+    /* output file, or -1 when writing to IO object */
+    int fd;
+    VALUE io;
+    /* errno of the failed write to fd, or tag of the exception raised by IO#write */
+    int err;
+    int state;
+} mb_EPUB_EXPORT;
+
+static void mb_release_epub_export(void *ptr)
+{
+    mb_EPUB_EXPORT *ex = ptr;
+
+    mb_epub_free(&ex->epub);
+    if (ex->fd >= 0) {
+        close(ex->fd);
+    }
+    free(ex);
+}
+
+static int mb_epub_write_fd(void *ctx, const void *data, size_t size)
+{
+    mb_EPUB_EXPORT *ex = ctx;
+    const char *ptr = data;
+
+    while (size > 0) {
+        ssize_t n = write(ex->fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ex->err = errno;
+            return -1;
+        }
+        ptr += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+typedef struct mb_EPUB_IO_WRITE {
+    mb_EPUB_EXPORT *ex;
+    const void *data;
+    size_t size;
+} mb_EPUB_IO_WRITE;
+
+static VALUE mb_epub_io_write_body(VALUE ptr)
+{
+    mb_EPUB_IO_WRITE *req = (mb_EPUB_IO_WRITE *)ptr;
+    return rb_io_write(req->ex->io, rb_str_new(req->data, (long)req->size));
+}
+
+static void *mb_epub_io_write_gvl(void *ptr)
+{
+    mb_EPUB_IO_WRITE *req = ptr;
+    rb_protect(mb_epub_io_write_body, (VALUE)req, &req->ex->state);
+    return NULL;
+}
+
+/* IO objects are written with GVL, the exceptions are re-raised after the export stops */
+static int mb_epub_write_io(void *ctx, const void *data, size_t size)
+{
+    mb_EPUB_IO_WRITE req;
+
+    req.ex = ctx;
+    req.data = data;
+    req.size = size;
+    rb_thread_call_with_gvl(mb_epub_io_write_gvl, &req);
+    return req.ex->state ? -1 : 0;
+}
+
+typedef struct mb_EPUB_ARGS {
+    mb_EPUB_EXPORT *ex;
+    MOBI_RET rc;
+    volatile int done;
+} mb_EPUB_ARGS;
+
+static void *mb_book_export_epub_nogvl(void *ptr)
+{
+    mb_EPUB_ARGS *args = ptr;
+
+    args->rc = mb_epub_write(&args->ex->epub);
+    args->done = 1;
+    return NULL;
+}
+
+static void mb_book_export_epub_ubf(void *ptr)
+{
+    mb_EPUB_EXPORT *ex = ptr;
+    ex->epub.cancel = 1;
+}
+
+/*
+ * Book#export_epub(path_or_io, threads: nil)
+ *
+ * Writes the book as EPUB built from the reconstructed parts and libmobi's
+ * OPF and NCX. The parts are compressed without GVL on up to "threads"
+ * native threads (by default one per online CPU) in batches, and streamed
+ * into the file or IO object, so only the current batch is held in memory
+ * besides the parts themselves. Returns path_or_io.
+ */
+static VALUE mb_book_export_epub(int argc, VALUE *argv, VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    mb_EPUB_ARGS args = {0};
+    mb_EPUB_EXPORT *ex;
+    mb_ZIP_SINK sink;
+    VALUE target, opts = Qnil, path = Qnil, owner, rawml_owner;
+    long threads = 0;
+    MOBI_RET rc;
+
+    rb_scan_args(argc, argv, "1:", &target, &opts);
+    if (!NIL_P(opts)) {
+        ID keys[1];
+        VALUE values[1];
+
+        keys[0] = MB_ID(threads);
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        if (values[0] != Qundef && !NIL_P(values[0])) {
+            threads = NUM2LONG(values[0]);
+            if (threads < 1) {
+                rb_raise(rb_eArgError, "number of threads must be positive");
+            }
+        }
+    }
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1) {
+            threads = 1;
+        }
+    }
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_fetch_rawml(self, book);
+    rawml_owner = book->rawml_owner;
+
+    ex = calloc(1, sizeof(mb_EPUB_EXPORT));
+    if (ex == NULL) {
+        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for EPUB export");
+    }
+    ex->fd = -1;
+    /* the file is closed and the batch is freed even if the export is interrupted */
+    owner = mb_owner_new(self, ex, mb_release_epub_export);
+    if (RB_TYPE_P(target, T_STRING) || rb_respond_to(target, rb_intern("to_path"))) {
+        path = rb_get_path(target);
+        ex->fd = rb_cloexec_open(StringValueCStr(path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (ex->fd < 0) {
+            rb_sys_fail_str(path);
+        }
+        rb_update_max_fd(ex->fd);
+        sink.write = mb_epub_write_fd;
+    } else {
+        ex->io = target;
+        sink.write = mb_epub_write_io;
+    }
+    sink.ctx = ex;
+    rc = mb_epub_init(&ex->epub, book->rawml, &sink, (size_t)threads);
+    if (rc != MOBI_SUCCESS) {
+        mb_raise(rc, "unable to export EPUB");
+    }
+    args.ex = ex;
+    for (;;) {
+        args.done = 0;
+        ex->epub.cancel = 0;
+        mb_book_data_owner(book)->busy++;
+        rb_thread_call_without_gvl2(mb_book_export_epub_nogvl, &args, mb_book_export_epub_ubf, ex);
+        mb_book_data_owner(book)->busy--;
+        if (args.done && (args.rc != MOBI_SUCCESS || !ex->epub.cancel)) {
+            break;
+        }
+        /* raises, or resumes with the next batch */
+        rb_thread_check_ints();
+    }
+    if (ex->state) {
+        rb_jump_tag(ex->state);
+    }
+    if (args.rc == MOBI_WRITE_FAILED && ex->err) {
+        rb_syserr_fail_str(ex->err, path);
+    }
+    if (args.rc != MOBI_SUCCESS) {
+        mb_raise(args.rc, "unable to export EPUB");
+    }
+    if (ex->fd >= 0) {
+        int fd = ex->fd;
+        ex->fd = -1;
+        if (close(fd) != 0) {
+            rb_sys_fail_str(path);
+        }
+    }
+    RB_GC_GUARD(owner);
+    RB_GC_GUARD(rawml_owner);
+    RB_GC_GUARD(target);
+    return target;
+}
+
+static void mb_release_index(void *ptr)
+{
+    mb_index_free(ptr);
+}
+
+/* String in the encoding of the index as UTF-8 */
+static VALUE mb_index_str(const MOBIIndx *indx, const unsigned char *ptr, size_t len)
+{
+    VALUE buf, res;
+    char *out = ALLOCV_N(char, buf, len * 3 + 1);
+
+    res = rb_utf8_str_new(out, (long)mb_index_to_utf8(indx, ptr, len, out));
+    ALLOCV_END(buf);
+    return res;
+}
+
+static VALUE mb_index_label_str(const MOBIIndx *indx, const MOBIIndexEntry *entry)
+{
+    size_t len;
+    const unsigned char *label = mb_index_label(entry, &len);
+
+    return mb_index_str(indx, label, len);
+}
+
+static VALUE mb_index_cncx_str(const MOBIIndx *indx, const MOBIIndexEntry *entry, size_t tagid)
+{
+    const unsigned char *ptr;
+    uint32_t offset;
+    size_t len;
+
+    if (!mb_index_tag(entry, tagid, 0, &offset) || (ptr = mb_index_cncx(indx, offset, &len)) == NULL) {
+        return Qnil;
+    }
+    return mb_index_str(indx, ptr, len);
+}
+
+static VALUE mb_index_num(const MOBIIndexEntry *entry, size_t tagid, size_t n)
+{
+    uint32_t val;
+    return mb_index_tag(entry, tagid, n, &val) ? UINT2NUM(val) : Qnil;
+}
+
+/* NCX tags, see INDX_TAG_NCX_* in libmobi */
+#define NCX_TAG_FILEPOS 1
+#define NCX_TAG_LENGTH 2
+#define NCX_TAG_TEXT 3
+#define NCX_TAG_LEVEL 4
+#define NCX_TAG_POSFID 6
+#define NCX_TAG_PARENT 21
+#define NCX_TAG_CHILD_START 22
+#define NCX_TAG_CHILD_END 23
+/* guide tags, see INDX_TAG_GUIDE_TITLE_CNCX and INDX_TAG_FRAG_POSITION */
+#define GUIDE_TAG_TITLE 1
+#define GUIDE_TAG_POSFID 6
+
+static VALUE mb_toc_entry_new(const MOBIIndx *indx, const MOBIIndexEntry *entry)
+{
+    VALUE v[MB_TOC_ENTRY_COUNT];
+
+    v[MB_TOC_ENTRY_label] = mb_index_cncx_str(indx, entry, NCX_TAG_TEXT);
+    if (NIL_P(v[MB_TOC_ENTRY_label])) {
+        v[MB_TOC_ENTRY_label] = mb_index_label_str(indx, entry);
+    }
+    v[MB_TOC_ENTRY_level] = mb_index_num(entry, NCX_TAG_LEVEL, 0);
+    v[MB_TOC_ENTRY_pos] = mb_index_num(entry, NCX_TAG_FILEPOS, 0);
+    v[MB_TOC_ENTRY_length] = mb_index_num(entry, NCX_TAG_LENGTH, 0);
+    v[MB_TOC_ENTRY_fid] = mb_index_num(entry, NCX_TAG_POSFID, 0);
+    v[MB_TOC_ENTRY_off] = mb_index_num(entry, NCX_TAG_POSFID, 1);
+    v[MB_TOC_ENTRY_parent] = mb_index_num(entry, NCX_TAG_PARENT, 0);
+    v[MB_TOC_ENTRY_first_child] = mb_index_num(entry, NCX_TAG_CHILD_START, 0);
+    v[MB_TOC_ENTRY_last_child] = mb_index_num(entry, NCX_TAG_CHILD_END, 0);
+    return mb_value_new(mb_cTocEntry, MB_TOC_ENTRY_COUNT, v);
+}
+
+static VALUE mb_guide_entry_new(const MOBIIndx *indx, const MOBIIndexEntry *entry)
+{
+    VALUE v[MB_GUIDE_ENTRY_COUNT];
+
+    v[MB_GUIDE_ENTRY_type] = mb_index_label_str(indx, entry);
+    v[MB_GUIDE_ENTRY_title] = mb_index_cncx_str(indx, entry, GUIDE_TAG_TITLE);
+    v[MB_GUIDE_ENTRY_fid] = mb_index_num(entry, GUIDE_TAG_POSFID, 0);
+    return mb_value_new(mb_cGuideEntry, MB_GUIDE_ENTRY_COUNT, v);
+}
+
+/* Parse the index, and convert its entries, nil when the book does not have it */
+static VALUE mb_book_index_entries(VALUE self, const uint32_t *record,
+                                   VALUE (*entry_new)(const MOBIIndx *indx, const MOBIIndexEntry *entry))
+{
+    mb_BOOK *book = DATA_PTR(self);
+    MOBIIndx *indx;
+    VALUE owner, res;
+    MOBI_RET rc;
+    size_t i;
+
+    mb_book_ensure_payloads(book);
+    if (record == NULL || *record == MOBI_NOTSET) {
+        return Qnil;
+    }
+    rc = mb_index_parse(&indx, book->data, *record);
+    if (rc != MOBI_SUCCESS) {
+        mb_raise(rc, "unable to parse index");
+    }
+    owner = mb_owner_new(self, indx, mb_release_index);
+    res = rb_ary_new_capa((long)indx->entries_count);
+    for (i = 0; i < indx->entries_count; i++) {
+        rb_ary_push(res, entry_new(indx, &indx->entries[i]));
+    }
+    RB_GC_GUARD(owner);
+    return rb_ary_freeze(res);
+}
+
+/*
+ * Book#toc
+ *
+ * Entries of the NCX index as MOBI::TocEntry, in the order of the index, or
+ * nil when the book has no NCX. Only the index records are read: "pos" and
+ * "length" are positions in rawml, "fid" and "off" link into the fragments
+ * of KF8 books, "parent", "first_child" and "last_child" are indexes into
+ * the array.
+ */
+static VALUE mb_book_toc(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    return mb_book_index_entries(self, book->data->mh ? book->data->mh->ncx_index : NULL, mb_toc_entry_new);
+}
+
+/*
+ * Book#guide
+ *
+ * Entries of the KF8 guide index as MOBI::GuideEntry, or nil when the book
+ * has no guide index. "fid" is the fragment the reference points to.
+ */
+static VALUE mb_book_guide(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    return mb_book_index_entries(self, book->data->mh ? book->data->mh->guide_index : NULL, mb_guide_entry_new);
+}
+
+VALUE mb_cDictionary;
+
+typedef struct mb_DICTIONARY {
+    mb_DICT *dict;
+    VALUE book;
+    /* native memory of the indexes and the keys, as reported to the GC */
+    size_t native_bytes;
+} mb_DICTIONARY;
+
+static void mb_dictionary_mark(void *ptr)
+{
+    mb_DICTIONARY *dictionary = ptr;
+    rb_gc_mark(dictionary->book);
+}
+
+static void mb_dictionary_free(void *ptr)
+{
+    mb_DICTIONARY *dictionary = ptr;
+    if (dictionary) {
+        mb_dict_free(dictionary->dict);
+        mb_memory_sub(dictionary->native_bytes);
+        xfree(dictionary);
+    }
+}
+
+static size_t mb_dictionary_memsize(const void *ptr)
+{
+    const mb_DICTIONARY *dictionary = ptr;
+
+    return sizeof(mb_DICTIONARY) + dictionary->native_bytes;
+}
+
+static const rb_data_type_t mb_dictionary_type = {
+    .wrap_struct_name = "MOBI::Dictionary",
+    .function = {.dmark = mb_dictionary_mark, .dfree = mb_dictionary_free, .dsize = mb_dictionary_memsize},
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE mb_dictionary_alloc(VALUE klass)
+{
+    mb_DICTIONARY *dictionary;
+    VALUE obj = TypedData_Make_Struct(klass, mb_DICTIONARY, &mb_dictionary_type, dictionary);
+
+    dictionary->book = Qnil;
+    return obj;
+}
+
+typedef struct mb_DICT_ARGS {
+    const MOBIData *data;
+    mb_DICT *dict;
+    MOBI_RET rc;
+    volatile int done;
+} mb_DICT_ARGS;
+
+static void *mb_dictionary_open_nogvl(void *ptr)
+{
+    mb_DICT_ARGS *args = ptr;
+
+    args->rc = mb_dict_open(&args->dict, args->data);
+    args->done = 1;
+    return NULL;
+}
+
+/*
+ * Dictionary.new(book)
+ *
+ * Read the orthographic and inflection indexes of the dictionary. Their
+ * headwords and inflected forms are kept in sorted arrays, so lookups are
+ * binary searches, and only the text records of the matching entries are
+ * ever decompressed. Raises MOBI::Error when the book is not a dictionary.
+ */
+static VALUE mb_dictionary_init(VALUE self, VALUE book)
+{
+    mb_DICTIONARY *dictionary = DATA_PTR(self);
+    mb_DICT_ARGS args = {0};
+    mb_BOOK *b;
+
+    if (!rb_obj_is_kind_of(book, mb_cBook)) {
+        rb_raise(rb_eTypeError, "wrong argument type %" PRIsVALUE " (expected MOBI::Book)", rb_obj_class(book));
+    }
+    if (dictionary->dict != NULL) {
+        mb_raise_msg("the dictionary is already loaded");
+    }
+    b = DATA_PTR(book);
+    if (b == NULL || b->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_ensure_payloads(b);
+    args.data = b->data;
+    mb_book_call_without_gvl(b, mb_dictionary_open_nogvl, &args, &args.done);
+    if (args.rc != MOBI_SUCCESS) {
+        mb_raise(args.rc, "unable to load dictionary");
+    }
+    dictionary->dict = args.dict;
+    dictionary->book = book;
+    dictionary->native_bytes = mb_dict_memsize(args.dict);
+    mb_memory_add(dictionary->native_bytes);
+    rb_thread_check_ints();
+    return self;
+}
+
+static mb_DICT *mb_dictionary_get(VALUE self)
+{
+    mb_DICTIONARY *dictionary = DATA_PTR(self);
+
+    if (dictionary == NULL || dictionary->dict == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the dictionary is not loaded");
+    }
+    return dictionary->dict;
+}
+
+static VALUE mb_dictionary_entry_new(VALUE self, const mb_DICT *dict, size_t entry)
+{
+    char headword[3 * 255];
+    VALUE v[MB_DICTIONARY_ENTRY_COUNT], obj;
+    uint32_t pos, len;
+
+    v[MB_DICTIONARY_ENTRY_headword] = rb_utf8_str_new(headword, (long)mb_dict_headword(dict, entry, headword));
+    v[MB_DICTIONARY_ENTRY_index] = SIZET2NUM(entry);
+    v[MB_DICTIONARY_ENTRY_pos] = Qnil;
+    v[MB_DICTIONARY_ENTRY_length] = Qnil;
+    if (mb_dict_position(dict, entry, &pos, &len)) {
+        v[MB_DICTIONARY_ENTRY_pos] = UINT2NUM(pos);
+        v[MB_DICTIONARY_ENTRY_length] = UINT2NUM(len);
+    }
+    obj = rb_class_new_instance(MB_DICTIONARY_ENTRY_COUNT, v, mb_cDictionaryEntry);
+    /* DictionaryEntry#markup goes back to the dictionary */
+    rb_ivar_set(obj, mb_id_owner, self);
+    return rb_obj_freeze(obj);
+}
+
+/* Append entries of the keys, skipping the ones already in the result */
+static void mb_dictionary_collect(VALUE self, const mb_DICT *dict, const mb_DICT_KEY *keys, size_t count,
+                                  VALUE seen, VALUE res)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        VALUE entry = UINT2NUM(keys[i].entry);
+        if (!NIL_P(seen)) {
+            if (RTEST(rb_hash_lookup2(seen, entry, Qfalse))) {
+                continue;
+            }
+            rb_hash_aset(seen, entry, Qtrue);
+        }
+        rb_ary_push(res, mb_dictionary_entry_new(self, dict, keys[i].entry));
+    }
+}
+
+static VALUE mb_dictionary_size(VALUE self)
+{
+    return SIZET2NUM(mb_dictionary_get(self)->words_count);
+}
+
+/*
+ * Dictionary#lookup(word)
+ *
+ * Entries with the headword, as MOBI::DictionaryEntry. The word is compared
+ * byte by byte in UTF-8, so the case matters. Returns an empty array when
+ * nothing matches.
+ */
+static VALUE mb_dictionary_lookup(VALUE self, VALUE word)
+{
+    mb_DICT *dict = mb_dictionary_get(self);
+    VALUE res = rb_ary_new();
+    size_t first, n;
+
+    StringValue(word);
+    word = rb_str_export_to_enc(word, rb_utf8_encoding());
+    first = mb_dict_find(dict->words, dict->words_count, RSTRING_PTR(word), (size_t)RSTRING_LEN(word), 0, &n);
+    mb_dictionary_collect(self, dict, dict->words + first, n, Qnil, res);
+    RB_GC_GUARD(word);
+    return rb_ary_freeze(res);
+}
+
+/*
+ * Dictionary#lookup_prefix(prefix, limit: nil)
+ *
+ * Entries, whose headword starts with the prefix, ordered by the headword.
+ * At most limit entries are returned, when it is given.
+ */
+static VALUE mb_dictionary_lookup_prefix(int argc, VALUE *argv, VALUE self)
+{
+    mb_DICT *dict = mb_dictionary_get(self);
+    VALUE prefix, opts = Qnil, res = rb_ary_new();
+    size_t first, n;
+
+    rb_scan_args(argc, argv, "1:", &prefix, &opts);
+    StringValue(prefix);
+    prefix = rb_str_export_to_enc(prefix, rb_utf8_encoding());
+    first = mb_dict_find(dict->words, dict->words_count, RSTRING_PTR(prefix), (size_t)RSTRING_LEN(prefix), 1, &n);
+    if (!NIL_P(opts)) {
+        ID keys[1];
+        VALUE values[1];
+
+        keys[0] = MB_ID(limit);
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        if (values[0] != Qundef && !NIL_P(values[0])) {
+            long limit = NUM2LONG(values[0]);
+            if (limit < 0) {
+                rb_raise(rb_eArgError, "limit must not be negative");
+            }
+            if ((size_t)limit < n) {
+                n = (size_t)limit;
+            }
+        }
+    }
+    mb_dictionary_collect(self, dict, dict->words + first, n, Qnil, res);
+    RB_GC_GUARD(prefix);
+    return rb_ary_freeze(res);
+}
+
+/*
+ * Dictionary#lookup_inflected(word)
+ *
+ * Entries with the headword, followed by the entries having the word among
+ * their inflected forms, which are generated from the inflection rules of
+ * the dictionary when it is loaded. Each entry is returned once.
+ */
+static VALUE mb_dictionary_lookup_inflected(VALUE self, VALUE word)
+{
+    mb_DICT *dict = mb_dictionary_get(self);
+    VALUE seen = rb_hash_new(), res = rb_ary_new();
+    const char *ptr;
+    size_t first, n, len;
+
+    StringValue(word);
+    word = rb_str_export_to_enc(word, rb_utf8_encoding());
+    ptr = RSTRING_PTR(word);
+    len = (size_t)RSTRING_LEN(word);
+    first = mb_dict_find(dict->words, dict->words_count, ptr, len, 0, &n);
+    mb_dictionary_collect(self, dict, dict->words + first, n, seen, res);
+    first = mb_dict_find(dict->forms, dict->forms_count, ptr, len, 0, &n);
+    mb_dictionary_collect(self, dict, dict->forms + first, n, seen, res);
+    RB_GC_GUARD(word);
+    return rb_ary_freeze(res);
+}
+
+typedef struct mb_MARKUP_ARGS {
+    const mb_DICT *dict;
+    size_t entry;
+    unsigned char *data;
+    size_t len;
+    MOBI_RET rc;
+    volatile int done;
+} mb_MARKUP_ARGS;
+
+static void *mb_dictionary_markup_nogvl(void *ptr)
+{
+    mb_MARKUP_ARGS *args = ptr;
+
+    args->rc = mb_dict_markup(args->dict, args->entry, &args->data, &args->len);
+    args->done = 1;
+    return NULL;
+}
+
+/*
+ * DictionaryEntry#markup
+ *
+ * Markup of the entry in UTF-8, decompressed from the text records it
+ * spans. Returns nil when the entry does not point into the text.
+ */
+static VALUE mb_dictionary_entry_markup(VALUE self)
+{
+    VALUE dictionary = rb_ivar_get(self, mb_id_owner), res, buf;
+    mb_MARKUP_ARGS args = {0};
+    mb_DICTIONARY *data;
+
+    args.dict = mb_dictionary_get(dictionary);
+    args.entry = NUM2SIZET(RSTRUCT_GET(self, MB_DICTIONARY_ENTRY_index));
+    if (args.entry >= args.dict->orth->entries_count) {
+        rb_raise(rb_eIndexError, "no such dictionary entry");
+    }
+    data = DATA_PTR(dictionary);
+    mb_book_call_without_gvl(DATA_PTR(data->book), mb_dictionary_markup_nogvl, &args, &args.done);
+    if (args.rc != MOBI_SUCCESS) {
+        mb_raise(args.rc, "unable to decompress dictionary entry");
+    }
+    if (args.data == NULL) {
+        res = Qnil;
+    } else if (args.dict->utf8) {
+        res = rb_utf8_str_new((const char *)args.data, (long)args.len);
+    } else {
+        char *out = ALLOCV_N(char, buf, args.len * 3 + 1);
+        res = rb_utf8_str_new(out, (long)mb_cp1252_to_utf8(args.data, args.len, out));
+        ALLOCV_END(buf);
+    }
+    free(args.data);
+    rb_thread_check_ints();
+    RB_GC_GUARD(dictionary);
+    return res;
+}
+
+static void init_mobi_dictionary()
+{
+    mb_cDictionary = rb_define_class_under(mb_mMOBI, "Dictionary", rb_cObject);
+    rb_define_alloc_func(mb_cDictionary, mb_dictionary_alloc);
+    rb_define_method(mb_cDictionary, "initialize", mb_dictionary_init, 1);
+    rb_define_method(mb_cDictionary, "size", mb_dictionary_size, 0);
+    rb_define_method(mb_cDictionary, "lookup", mb_dictionary_lookup, 1);
+    rb_define_method(mb_cDictionary, "lookup_prefix", mb_dictionary_lookup_prefix, -1);
+    rb_define_method(mb_cDictionary, "lookup_inflected", mb_dictionary_lookup_inflected, 1);
+    rb_define_method(mb_cDictionaryEntry, "markup", mb_dictionary_entry_markup, 0);
+}
+
+/* default size of the chunks yielded by Book#each_text_chunk */
+#define MB_TEXT_CHUNK_SIZE 65536
+
+typedef struct mb_TEXT_ARGS {
+    mb_TEXT text;
+    /* current markup part and position in it */
+    const MOBIPart *part;
+    size_t offset;
+    char *buf;
+    size_t cap;
+    size_t len;
+    int finished;
+    volatile int done;
+} mb_TEXT_ARGS;
+
+/* Fill the buffer with plain text from the markup parts */
+static void *mb_book_text_nogvl(void *ptr)
+{
+    mb_TEXT_ARGS *args = ptr;
+
+    while (args->part && args->cap - args->len >= MB_TEXT_MAX_EMIT) {
+        const MOBIPart *part = args->part;
+        if (part->type == T_HTML && args->offset < part->size) {
+            args->offset += mb_text_strip(&args->text, part->data + args->offset, part->size - args->offset,
+                                          args->buf, args->cap, &args->len);
+        }
+        if (part->type != T_HTML || args->offset >= part->size) {
+            args->part = part->next;
+            args->offset = 0;
+        }
+    }
+    if (args->part == NULL && !args->finished && args->cap - args->len >= MB_TEXT_MAX_EMIT) {
+        mb_text_finish(&args->text, args->buf, &args->len);
+        args->finished = 1;
+    }
+    args->done = 1;
+    return NULL;
+}
+
+/*
+ * Convert the markup to plain text in chunks of at most chunk_size bytes,
+ * which never split UTF-8 character. Every chunk is yielded, or appended to
+ * result when it is not nil.
+ */
+static void mb_book_strip_text(VALUE self, mb_BOOK *book, long chunk_size, VALUE result)
+{
+    mb_TEXT_ARGS args;
+    VALUE owner, scratch;
+    size_t n;
+
+    if (chunk_size < MB_TEXT_MAX_EMIT * 4) {
+        rb_raise(rb_eArgError, "chunk size must be at least %d bytes", MB_TEXT_MAX_EMIT * 4);
+    }
+    mb_book_fetch_rawml(self, book);
+    /* the parts stay valid, even if the caches are released in the block */
+    owner = book->rawml_owner;
+    memset(&args, 0, sizeof(args));
+    mb_text_init(&args.text);
+    args.part = book->rawml->markup;
+    scratch = rb_str_buf_new(chunk_size);
+    args.buf = RSTRING_PTR(scratch);
+    args.cap = (size_t)chunk_size;
+
+    while (!args.finished || args.len > 0) {
+        if (!args.finished) {
+            args.done = 0;
+            mb_book_call_without_gvl(book, mb_book_text_nogvl, &args, &args.done);
+        }
+        n = args.finished ? args.len : mb_text_utf8_prefix(args.buf, args.len);
+        if (n > 0) {
+            if (NIL_P(result)) {
+                rb_yield(rb_utf8_str_new(args.buf, (long)n));
+            } else {
+                rb_str_cat(result, args.buf, (long)n);
+            }
+        }
+        memmove(args.buf, args.buf + n, args.len - n);
+        args.len -= n;
+        rb_thread_check_ints();
+    }
+    RB_GC_GUARD(owner);
+    RB_GC_GUARD(scratch);
+}
+
+/*
+ * Book#each_text_chunk(size = 65536) { |chunk| ... }
+ *
+ * Yields plain text of the book in UTF-8 chunks of at most size bytes, so
+ * that the whole text never has to exist as a single string.
+ */
+static VALUE mb_book_each_text_chunk(int argc, VALUE *argv, VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    VALUE size = Qnil;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    rb_scan_args(argc, argv, "01", &size);
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    mb_book_strip_text(self, book, NIL_P(size) ? MB_TEXT_CHUNK_SIZE : NUM2LONG(size), Qnil);
+    return self;
+}
+
+/*
+ * Book#text
+ *
+ * Plain text of the book: tags are stripped, entities are decoded, and the
+ * whitespace is normalized. Block elements end with "\n", page breaks are
+ * "\f".
+ */
+static VALUE mb_book_text(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    VALUE result;
+
+    if (book == NULL || book->data == NULL) {
+        mb_raise(MOBI_INIT_FAILED, "the MOBI data is not loaded");
+    }
+    result = rb_utf8_str_new(NULL, 0);
+    mb_book_strip_text(self, book, MB_TEXT_CHUNK_SIZE, result);
+    return result;
+}
+
+typedef struct mb_SAVE_ARGS {
+    mb_SAVE save;
+    const char *path;
+    /* Book#save_in_place, and whether the file has been patched */
+    int in_place;
+    int patched;
+    MOBI_RET rc;
+    volatile int done;
+} mb_SAVE_ARGS;
+
+static void mb_release_save(void *ptr)
+{
+    mb_SAVE_ARGS *args = ptr;
+
+    mb_save_free(&args->save);
+    free(args);
+}
+
+static void *mb_book_save_nogvl(void *ptr)
+{
+    mb_SAVE_ARGS *args = ptr;
+
+    if (args->in_place) {
+        args->rc = mb_save_in_place(&args->save, args->path, &args->patched);
+    } else {
+        args->rc = mb_save_write(&args->save, args->path);
+    }
+    args->done = 1;
+    return NULL;
+}
+
+/* Returns whether the file has been patched in place */
+static int mb_book_save_internal(VALUE self, VALUE path, int in_place)
+{
+    mb_BOOK *book = mb_book_editable(self);
+    mb_SAVE_ARGS *args;
+    VALUE owner;
+    MOBI_RET rc;
+
+    if (!NIL_P(book->parent)) {
+        mb_raise_msg("the book is half of hybrid book, save the book #next has been called on");
+    }
+    args = calloc(1, sizeof(mb_SAVE_ARGS));
+    if (args == NULL) {
+        mb_raise(MOBI_MALLOC_FAILED, "unable to allocate memory for saving");
+    }
+    /* the serialized records are freed even if the save is interrupted */
+    owner = mb_owner_new(self, args, mb_release_save);
+    args->path = StringValueCStr(path);
+    args->in_place = in_place;
+    /* serialized with GVL, the setters modify the same headers */
+    rc = mb_save_prepare(&args->save, book->data, book->map.addr ? &book->map : NULL);
+    if (rc != MOBI_SUCCESS) {
+        mb_raise(rc, "unable to serialize headers");
+    }
+    mb_book_call_without_gvl(book, mb_book_save_nogvl, args, &args->done);
+    if (args->rc == MOBI_WRITE_FAILED && args->save.err) {
+        rb_syserr_fail_str(args->save.err, path);
+    }
+    if (args->rc == MOBI_FILE_UNSUPPORTED) {
+        mb_raise_msg("record 0 does not fit in place, and record payloads are not loaded, the book has been opened "
+                     "with \"headers_only: true\"");
+    }
+    if (args->rc != MOBI_SUCCESS) {
+        mb_raise(args->rc, "unable to save book");
+    }
+    rb_thread_check_ints();
+    RB_GC_GUARD(owner);
+    return args->patched;
+}
+
+/*
+ * Book#save(path)
+ *
+ * Writes the book with the modified metadata to path. Record 0 (and KF8
+ * record 0 of hybrid book) is serialized from the headers, the other
+ * records are written as they are, without GVL. For the books opened with
+ * "mmap: true" they are copied by the kernel with copy_file_range(2) where
+ * available. The file is written next to path and renamed over it.
+ */
+static VALUE mb_book_save(VALUE self, VALUE path)
+{
+    mb_book_ensure_payloads(DATA_PTR(self));
+    FilePathValue(path);
+    path = rb_str_new_frozen(path);
+    mb_book_save_internal(self, path, 0);
+    RB_GC_GUARD(path);
+    return self;
+}
+
+/*
+ * Book#save_in_place
+ *
+ * Writes the modified metadata back to the file the book has been loaded
+ * from. When the new record 0 fits into the old one (books usually have
+ * padding there for this very purpose), only record 0 is overwritten, and
+ * true is returned. Otherwise the whole file is rewritten as by #save, and
+ * the result is false. Books opened with "mmap: true" are always saved the
+ * second way, so that the data of their records returned before does not
+ * change, and books opened with "headers_only: true" only the first way.
+ */
+static VALUE mb_book_save_in_place(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    VALUE path;
+    int patched;
+
+    if (book == NULL || book->path == NULL) {
+        mb_raise_msg("the book has not been loaded from path");
+    }
+    path = rb_str_new_frozen(rb_str_new_cstr(book->path));
+    patched = mb_book_save_internal(self, path, 1);
+    RB_GC_GUARD(path);
+    return patched ? Qtrue : Qfalse;
+}
+
+/*
+ * Book#cached?
+ *
+ * Whether #rawml_parts are served from the sidecar cache, see Book.new.
+ */
+static VALUE mb_book_p_cached(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+
+    return book && book->cache ? Qtrue : Qfalse;
+}
+
+static VALUE mb_book_release_caches(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+
+    if (book) {
+        mb_book_release_caches_internal(book);
+    }
+    return Qnil;
+}
+
+/*
+ * Book#stats
+ *
+ * Time in seconds, bytes processed and number of calls of every phase,
+ * counted while MOBI.instrument hook has been installed.
+ */
+static VALUE mb_book_stats(VALUE self)
+{
+    mb_BOOK *book = DATA_PTR(self);
+    VALUE res = rb_hash_new();
+    int phase;
+
+    for (phase = 0; phase < MB_PHASES_COUNT; phase++) {
+        const mb_PHASE_STATS *stats = &book->stats[phase];
+        VALUE item = rb_hash_new();
+
+        rb_hash_aset(item, MB_SYM(time), DBL2NUM((double)stats->nanos / 1e9));
+        rb_hash_aset(item, MB_SYM(bytes), ULL2NUM(stats->bytes));
+        rb_hash_aset(item, MB_SYM(calls), ULL2NUM(stats->calls));
+        rb_hash_aset(res, mb_phase_sym((mb_PHASE)phase), item);
+    }
+    return res;
+}
+
+/*
+ * MOBI.instrument { |phase, payload| ... }
+ *
+ * Install the hook, which is called after every phase of the work done for
+ * a book (:read, :parse, :decompress, :index or :build) with the payload
+ * {book:, time:, bytes:}. Without a block the hook is removed, and the
+ * phases are not timed anymore. Returns the previous hook.
+ */
+static VALUE mb_s_instrument(VALUE self)
+{
+    VALUE prev = mb_instrument_hook;
+    (void)self;
+
+    mb_instrument_hook = rb_block_given_p() ? rb_block_proc() : Qnil;
+    mb_instrument_enabled = !NIL_P(mb_instrument_hook);
+    return prev;
+}
+
+/*
+ * MOBI.memory_stats
+ *
+ * Number of the books alive, and the native memory held by them, by their
+ * dictionaries, and by the strings borrowed from them. The same bytes are
+ * reported to the GC.
+ */
+static VALUE mb_s_memory_stats(VALUE self)
+{
+    VALUE res = rb_hash_new();
+    (void)self;
+
+    rb_hash_aset(res, MB_SYM(books), SIZET2NUM(mb_live_books));
+    rb_hash_aset(res, MB_SYM(native_bytes), SIZET2NUM(mb_native_bytes));
+    return res;
+}
+
+static void init_mobi_book()
+{
+    mb_cBook = rb_define_class_under(mb_mMOBI, "Book", rb_cObject);
+    rb_define_alloc_func(mb_cBook, mb_book_alloc);
+    rb_define_singleton_method(mb_cBook, "from_string", mb_book_s_from_string, 1);
+    rb_define_singleton_method(mb_cBook, "from_io", mb_book_s_from_io, 1);
+    rb_define_method(mb_cBook, "initialize", mb_book_init, -1);
+    rb_define_method(mb_cBook, "next", mb_book_next, 0);
+    rb_define_method(mb_cBook, "mobi_header", mb_book_mobi_header, 0);
+    rb_define_method(mb_cBook, "pdb_header", mb_book_pdb_header, 0);
+    rb_define_method(mb_cBook, "record0_header", mb_book_record0_header, 0);
+    rb_define_method(mb_cBook, "exth_header", mb_book_exth_header, 0);
+    rb_define_method(mb_cBook, "full_name", mb_book_full_name, 0);
+    rb_define_method(mb_cBook, "title", mb_book_title, 0);
+    rb_define_method(mb_cBook, "author", mb_book_author, 0);
+    rb_define_method(mb_cBook, "publisher", mb_book_publisher, 0);
+    rb_define_method(mb_cBook, "imprint", mb_book_imprint, 0);
+    rb_define_method(mb_cBook, "description", mb_book_description, 0);
+    rb_define_method(mb_cBook, "isbn", mb_book_isbn, 0);
+    rb_define_method(mb_cBook, "subject", mb_book_subject, 0);
     rb_define_method(mb_cBook, "publishdate", mb_book_publishdate, 0);
     rb_define_method(mb_cBook, "review", mb_book_review, 0);
     rb_define_method(mb_cBook, "contributor", mb_book_contributor, 0);
     rb_define_method(mb_cBook, "copyright", mb_book_copyright, 0);
     rb_define_method(mb_cBook, "asin", mb_book_asin, 0);
     rb_define_method(mb_cBook, "language", mb_book_language, 0);
+    rb_define_method(mb_cBook, "title=", mb_book_set_title, 1);
+    rb_define_method(mb_cBook, "author=", mb_book_set_author, 1);
+    rb_define_method(mb_cBook, "publisher=", mb_book_set_publisher, 1);
+    rb_define_method(mb_cBook, "imprint=", mb_book_set_imprint, 1);
+    rb_define_method(mb_cBook, "description=", mb_book_set_description, 1);
+    rb_define_method(mb_cBook, "isbn=", mb_book_set_isbn, 1);
+    rb_define_method(mb_cBook, "subject=", mb_book_set_subject, 1);
+    rb_define_method(mb_cBook, "publishdate=", mb_book_set_publishdate, 1);
+    rb_define_method(mb_cBook, "review=", mb_book_set_review, 1);
+    rb_define_method(mb_cBook, "contributor=", mb_book_set_contributor, 1);
+    rb_define_method(mb_cBook, "copyright=", mb_book_set_copyright, 1);
+    rb_define_method(mb_cBook, "asin=", mb_book_set_asin, 1);
+    rb_define_method(mb_cBook, "language=", mb_book_set_language, 1);
+    rb_define_method(mb_cBook, "add_title", mb_book_add_title, 1);
+    rb_define_method(mb_cBook, "add_author", mb_book_add_author, 1);
+    rb_define_method(mb_cBook, "add_publisher", mb_book_add_publisher, 1);
+    rb_define_method(mb_cBook, "add_imprint", mb_book_add_imprint, 1);
+    rb_define_method(mb_cBook, "add_description", mb_book_add_description, 1);
+    rb_define_method(mb_cBook, "add_isbn", mb_book_add_isbn, 1);
+    rb_define_method(mb_cBook, "add_subject", mb_book_add_subject, 1);
+    rb_define_method(mb_cBook, "add_publishdate", mb_book_add_publishdate, 1);
+    rb_define_method(mb_cBook, "add_review", mb_book_add_review, 1);
+    rb_define_method(mb_cBook, "add_contributor", mb_book_add_contributor, 1);
+    rb_define_method(mb_cBook, "add_copyright", mb_book_add_copyright, 1);
+    rb_define_method(mb_cBook, "add_asin", mb_book_add_asin, 1);
+    rb_define_method(mb_cBook, "add_language", mb_book_add_language, 1);
     rb_define_method(mb_cBook, "has_mobi_header?", mb_book_p_has_mobi_header, 0);
     rb_define_method(mb_cBook, "has_fdst?", mb_book_p_has_fdst, 0);
     rb_define_method(mb_cBook, "has_skeleton_index?", mb_book_p_has_skeleton_index, 0);
@@ -895,8 +2995,167 @@ static void init_mobi_book()
     rb_define_method(mb_cBook, "is_dictionary?", mb_book_p_is_dictionary, 0);
     rb_define_method(mb_cBook, "is_kf8?", mb_book_p_is_kf8, 0);
     rb_define_method(mb_cBook, "records", mb_book_records, 0);
+    rb_define_method(mb_cBook, "each_record", mb_book_each_record, -1);
+    rb_define_method(mb_cBook, "record", mb_book_record, -1);
     rb_define_method(mb_cBook, "rawml", mb_book_rawml, 0);
+    rb_define_method(mb_cBook, "text_record", mb_book_text_record, 1);
+    rb_define_method(mb_cBook, "each_text_record", mb_book_each_text_record, 0);
     rb_define_method(mb_cBook, "rawml_parts", mb_book_rawml_parts, 0);
+    rb_define_method(mb_cBook, "each_resource", mb_book_each_resource, 0);
+    rb_define_method(mb_cBook, "resource_data", mb_book_resource_data, 1);
+    rb_define_method(mb_cBook, "export_resources", mb_book_export_resources, 1);
+    rb_define_method(mb_cBook, "cover", mb_book_cover, 0);
+    rb_define_method(mb_cBook, "thumbnail", mb_book_thumbnail, 0);
+    rb_define_method(mb_cBook, "export_epub", mb_book_export_epub, -1);
+    rb_define_method(mb_cBook, "toc", mb_book_toc, 0);
+    rb_define_method(mb_cBook, "guide", mb_book_guide, 0);
+    rb_define_method(mb_cBook, "text", mb_book_text, 0);
+    rb_define_method(mb_cBook, "each_text_chunk", mb_book_each_text_chunk, -1);
+    rb_define_method(mb_cBook, "save", mb_book_save, 1);
+    rb_define_method(mb_cBook, "save_in_place", mb_book_save_in_place, 0);
+    rb_define_method(mb_cBook, "cached?", mb_book_p_cached, 0);
+    rb_define_method(mb_cBook, "release_caches", mb_book_release_caches, 0);
+    rb_define_method(mb_cBook, "stats", mb_book_stats, 0);
+    rb_define_module_function(mb_mMOBI, "memory_stats", mb_s_memory_stats, 0);
+    rb_define_module_function(mb_mMOBI, "instrument", mb_s_instrument, 0);
+    rb_gc_register_address(&mb_instrument_hook);
+    rb_define_method(mb_cResource, "data", mb_resource_data, 0);
+}
+
+/*
+ * MOBI::PalmDOC.decode(data, implementation = nil)
+ *
+ * Decompress single PalmDOC record with the given implementation, or the
+ * one selected for this CPU.
+ */
+static VALUE mb_palmdoc_s_decode(int argc, VALUE *argv, VALUE self)
+{
+    const mb_PALMDOC_IMPL *impl = mb_palmdoc_selected();
+    VALUE data, name = Qnil, res;
+    size_t len;
+    MOBI_RET rc;
+    (void)self;
+
+    rb_scan_args(argc, argv, "11", &data, &name);
+    StringValue(data);
+    if (!NIL_P(name)) {
+        const char *wanted = StringValueCStr(name);
+        for (impl = mb_palmdoc_impls; impl->name; impl++) {
+            if (strcmp(wanted, impl->name) == 0 && impl->supported()) {
+                break;
+            }
+        }
+        if (impl->name == NULL) {
+            rb_raise(rb_eArgError, "PalmDOC implementation \"%s\" is not available", wanted);
+        }
+    }
+    /* two bytes of back reference expand to at most ten */
+    len = (size_t)RSTRING_LEN(data) * 5;
+    res = rb_str_buf_new((long)len);
+    rc = impl->decode((unsigned char *)RSTRING_PTR(res), &len, (const unsigned char *)RSTRING_PTR(data),
+                      (size_t)RSTRING_LEN(data));
+    if (rc != MOBI_SUCCESS) {
+        mb_raise(rc, "unable to decompress PalmDOC data");
+    }
+    rb_str_set_len(res, (long)len);
+    RB_GC_GUARD(data);
+    return res;
+}
+
+/* Names of the PalmDOC implementations supported by this CPU */
+static VALUE mb_palmdoc_s_implementations(VALUE self)
+{
+    const mb_PALMDOC_IMPL *impl;
+    VALUE res = rb_ary_new();
+    (void)self;
+
+    for (impl = mb_palmdoc_impls; impl->name; impl++) {
+        if (impl->supported()) {
+            rb_ary_push(res, rb_str_new_cstr(impl->name));
+        }
+    }
+    return res;
+}
+
+/* Name of the PalmDOC implementation used by Book#rawml and friends */
+static VALUE mb_palmdoc_s_implementation(VALUE self)
+{
+    (void)self;
+    return rb_str_new_cstr(mb_palmdoc_reference ? "reference" : mb_palmdoc_selected()->name);
+}
+
+static VALUE mb_huffcdic_s_cache_limit(VALUE self)
+{
+    (void)self;
+    return SIZET2NUM(mb_huffcdic_cache_limit());
+}
+
+/*
+ * MOBI::HuffCDIC.cache_limit = 8
+ *
+ * Maximum number of HUFF/CDIC tables kept for the books loaded later, zero
+ * disables the cache.
+ */
+static VALUE mb_huffcdic_s_set_cache_limit(VALUE self, VALUE limit)
+{
+    long value = NUM2LONG(limit);
+    (void)self;
+
+    if (value < 0) {
+        rb_raise(rb_eArgError, "cache limit must not be negative");
+    }
+    mb_huffcdic_cache_set_limit((size_t)value);
+    return limit;
+}
+
+static VALUE mb_huffcdic_s_cache_stats(VALUE self)
+{
+    mb_HUFF_CACHE_STATS stats;
+    VALUE res = rb_hash_new();
+    (void)self;
+
+    mb_huffcdic_cache_stats(&stats);
+    rb_hash_aset(res, MB_SYM(hits), SIZET2NUM(stats.hits));
+    rb_hash_aset(res, MB_SYM(misses), SIZET2NUM(stats.misses));
+    rb_hash_aset(res, MB_SYM(entries), SIZET2NUM(stats.entries));
+    rb_hash_aset(res, MB_SYM(bytes), SIZET2NUM(stats.bytes));
+    return res;
+}
+
+/*
+ * The Huffman tables and CDIC dictionaries of HUFF/CDIC compressed books
+ * are kept in a process-wide cache, shared by the books with identical
+ * HUFF/CDIC records.
+ */
+static void init_mobi_huffcdic()
+{
+    VALUE mHuffCDIC = rb_define_module_under(mb_mMOBI, "HuffCDIC");
+
+    rb_define_module_function(mHuffCDIC, "cache_limit", mb_huffcdic_s_cache_limit, 0);
+    rb_define_module_function(mHuffCDIC, "cache_limit=", mb_huffcdic_s_set_cache_limit, 1);
+    rb_define_module_function(mHuffCDIC, "cache_stats", mb_huffcdic_s_cache_stats, 0);
+}
+
+/*
+ * The fastest implementation is used unless MOBI_PALMDOC environment
+ * variable names another one, or "reference" for libmobi's decoder.
+ */
+static void init_mobi_palmdoc()
+{
+    VALUE mPalmDOC;
+    const char *name = getenv("MOBI_PALMDOC");
+
+    if (name && strcmp(name, "reference") == 0) {
+        mb_palmdoc_reference = 1;
+        mb_palmdoc_select(NULL);
+    } else if (!mb_palmdoc_select(name && *name ? name : NULL)) {
+        rb_warn("PalmDOC implementation \"%s\" is not available, using the default one", name);
+        mb_palmdoc_select(NULL);
+    }
+    mPalmDOC = rb_define_module_under(mb_mMOBI, "PalmDOC");
+    rb_define_module_function(mPalmDOC, "decode", mb_palmdoc_s_decode, -1);
+    rb_define_module_function(mPalmDOC, "implementations", mb_palmdoc_s_implementations, 0);
+    rb_define_module_function(mPalmDOC, "implementation", mb_palmdoc_s_implementation, 0);
 }
 
 void Init_mobi_ext()
@@ -904,6 +3163,14 @@ void Init_mobi_ext()
     mb_mMOBI = rb_define_module("MOBI");
     rb_define_const(mb_mMOBI, "LIB_VERSION", rb_str_freeze(rb_external_str_new_cstr(mobi_version())));
     mb_eError = rb_const_get(mb_mMOBI, rb_intern("Error"));
+    mb_id_owner = rb_intern("__mobi_owner__");
+    mb_id_call = rb_intern("call");
 
+    init_mobi_keys();
+    init_mobi_values();
     init_mobi_book();
+    init_mobi_dictionary();
+    init_mobi_palmdoc();
+    init_mobi_huffcdic();
+    init_mobi_scan();
 }
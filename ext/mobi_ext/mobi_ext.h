@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_EXT_H
+#define MOBI_EXT_H
+
+#include <mobi.h>
+
+#include <ruby.h>
+
+extern VALUE mb_mMOBI;
+extern VALUE mb_eError;
+extern VALUE mb_cBook;
+
+const char *mb_libmobi_strerror(MOBI_RET code);
+NORETURN(void mb_raise_at(MOBI_RET code, const char *message, const char *file, int line));
+
+#define mb_raise(code, message) mb_raise_at(code, message, __FILE__, __LINE__)
+#define mb_raise_msg(message) mb_raise_at(0, message, __FILE__, __LINE__)
+
+void mb_call_without_gvl(void *(*func)(void *), void *arg, volatile int *done);
+
+void init_mobi_scan(void);
+
+#endif
@@ -0,0 +1,666 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_config.h"
+#include "mobi_decode.h"
+#include "mobi_loader.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define HUFF_MAGIC "HUFF"
+#define HUFF_HEADER_LEN 24
+#define CDIC_MAGIC "CDIC"
+#define CDIC_HEADER_LEN 16
+/* dictionary entries refer to other entries, the nesting is shallow in practice */
+#define HUFF_DEPTH_MAX 32
+/* expansion of single dictionary entry */
+#define HUFF_ENTRY_MAX 16384
+/* readable bytes past the end of every phrase, so that short ones are copied at once */
+#define HUFF_PADDING 16
+/* codes up to this length are resolved with single lookup */
+#define HUFF_LOOKUP_BITS 12
+#ifdef HAVE_PTHREAD_H
+#define HUFF_CACHE_DEFAULT_LIMIT 8
+#else
+/* the cached tables are shared by the threads, which needs the lock */
+#define HUFF_CACHE_DEFAULT_LIMIT 0
+#endif
+
+static uint32_t mb_get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static uint16_t mb_get16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+enum {
+    /* data is compressed phrase */
+    MB_HUFF_RAW,
+    /* being expanded, the phrase refers to itself when it is met again */
+    MB_HUFF_BUSY,
+    /* expanded into the arena at off, while the tables are being built */
+    MB_HUFF_ARENA,
+    /* data is the phrase */
+    MB_HUFF_READY,
+    MB_HUFF_BROKEN
+};
+
+typedef struct mb_HUFF_ENTRY {
+    const unsigned char *data;
+    size_t off;
+    uint32_t len;
+    uint32_t state;
+} mb_HUFF_ENTRY;
+
+typedef struct mb_HUFF_LOOKUP {
+    /* zero when the code is longer than HUFF_LOOKUP_BITS */
+    uint32_t codelen;
+    /* the symbol is base minus the code */
+    uint32_t base;
+} mb_HUFF_LOOKUP;
+
+struct mb_HUFFCDIC {
+    /* indexed by the top HUFF_LOOKUP_BITS of the code */
+    mb_HUFF_LOOKUP lookup[1 << HUFF_LOOKUP_BITS];
+    /* shortest length of the codes by their top 8 bits */
+    uint8_t codelen1[256];
+    /* boundaries of the codes by their length */
+    uint64_t mincode[33];
+    uint64_t maxcode[33];
+    mb_HUFF_ENTRY *entries;
+    size_t count;
+    /* expanded phrases */
+    unsigned char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    /* output buffers for every nesting level of the expansion */
+    unsigned char *scratch[HUFF_DEPTH_MAX];
+    /* copy of the HUFF and CDIC records, the entries point into it */
+    unsigned char *records;
+    size_t *record_sizes;
+    size_t record_count;
+    uint64_t hash;
+    size_t bytes;
+    /* held by the readers, and by the cache while it is listed there */
+    size_t refs;
+    int cached;
+    struct mb_HUFFCDIC *prev;
+    struct mb_HUFFCDIC *next;
+};
+
+/*
+ * Process-wide cache of the tables, least recently used at the tail. Books
+ * produced by the same toolchain often carry identical dictionaries.
+ */
+static struct {
+    mb_HUFFCDIC *head;
+    mb_HUFFCDIC *tail;
+    size_t limit;
+    mb_HUFF_CACHE_STATS stats;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+} mb_huff_cache = {NULL, NULL, HUFF_CACHE_DEFAULT_LIMIT, {0, 0, 0, 0},
+#ifdef HAVE_PTHREAD_H
+                   PTHREAD_MUTEX_INITIALIZER
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#define HUFF_CACHE_LOCK() pthread_mutex_lock(&mb_huff_cache.lock)
+#define HUFF_CACHE_UNLOCK() pthread_mutex_unlock(&mb_huff_cache.lock)
+#else
+#define HUFF_CACHE_LOCK()
+#define HUFF_CACHE_UNLOCK()
+#endif
+
+static MOBI_RET mb_huff_parse(mb_HUFFCDIC *huff, const unsigned char *data, size_t size)
+{
+    size_t off1, off2, i, j;
+    uint8_t term1[256];
+    uint32_t maxcode1[256];
+
+    if (size < HUFF_HEADER_LEN || memcmp(data, HUFF_MAGIC, 4) != 0 || mb_get32(data + 4) != HUFF_HEADER_LEN) {
+        return MOBI_DATA_CORRUPT;
+    }
+    off1 = mb_get32(data + 8);
+    off2 = mb_get32(data + 12);
+    if (off1 > size || size - off1 < 256 * 4 || off2 > size || size - off2 < 64 * 4) {
+        return MOBI_DATA_CORRUPT;
+    }
+    for (i = 0; i < 256; i++) {
+        uint32_t v = mb_get32(data + off1 + i * 4);
+        uint8_t codelen = v & 0x1f;
+        if (codelen == 0) {
+            return MOBI_DATA_CORRUPT;
+        }
+        huff->codelen1[i] = codelen;
+        term1[i] = (v & 0x80) != 0;
+        maxcode1[i] = v >> 8;
+    }
+    huff->mincode[0] = 0;
+    huff->maxcode[0] = 0;
+    for (i = 1; i <= 32; i++) {
+        uint64_t mincode = mb_get32(data + off2 + (i - 1) * 8);
+        uint64_t maxcode = mb_get32(data + off2 + (i - 1) * 8 + 4);
+        huff->mincode[i] = mincode << (32 - i);
+        huff->maxcode[i] = ((maxcode + 1) << (32 - i)) - 1;
+    }
+    /*
+     * Whether the code is at least mincode of some length depends only on
+     * that many top bits, so every code up to HUFF_LOOKUP_BITS long is
+     * resolved by its prefix.
+     */
+    for (i = 0; i < (1 << HUFF_LOOKUP_BITS); i++) {
+        size_t top = i >> (HUFF_LOOKUP_BITS - 8);
+        mb_HUFF_LOOKUP *entry = &huff->lookup[i];
+
+        entry->codelen = 0;
+        if (term1[top]) {
+            entry->codelen = huff->codelen1[top];
+            entry->base = maxcode1[top];
+            continue;
+        }
+        for (j = huff->codelen1[top]; j <= HUFF_LOOKUP_BITS; j++) {
+            if ((i >> (HUFF_LOOKUP_BITS - j)) >= (huff->mincode[j] >> (32 - j))) {
+                entry->codelen = (uint32_t)j;
+                entry->base = (uint32_t)(huff->maxcode[j] >> (32 - j));
+                break;
+            }
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+static MOBI_RET mb_cdic_parse(mb_HUFFCDIC *huff, const unsigned char *data, size_t size)
+{
+    size_t phrases, bits, n, i;
+
+    if (size < CDIC_HEADER_LEN || memcmp(data, CDIC_MAGIC, 4) != 0 || mb_get32(data + 4) != CDIC_HEADER_LEN) {
+        return MOBI_DATA_CORRUPT;
+    }
+    phrases = mb_get32(data + 8);
+    bits = mb_get32(data + 12);
+    if (bits > 16 || phrases > 0x100000) {
+        return MOBI_DATA_CORRUPT;
+    }
+    if (huff->entries == NULL) {
+        huff->entries = calloc(phrases ? phrases : 1, sizeof(mb_HUFF_ENTRY));
+        if (huff->entries == NULL) {
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    if (huff->count >= phrases) {
+        return MOBI_SUCCESS;
+    }
+    n = phrases - huff->count;
+    if (n > ((size_t)1 << bits)) {
+        n = (size_t)1 << bits;
+    }
+    if (size < CDIC_HEADER_LEN + n * 2) {
+        return MOBI_DATA_CORRUPT;
+    }
+    for (i = 0; i < n; i++) {
+        size_t off = CDIC_HEADER_LEN + mb_get16(data + CDIC_HEADER_LEN + i * 2);
+        uint16_t blen;
+        mb_HUFF_ENTRY *entry = &huff->entries[huff->count + i];
+
+        if (off + 2 > size) {
+            return MOBI_DATA_CORRUPT;
+        }
+        blen = mb_get16(data + off);
+        entry->data = data + off + 2;
+        entry->len = blen & 0x7fff;
+        entry->state = (blen & 0x8000) ? MB_HUFF_READY : MB_HUFF_RAW;
+        if (off + 2 + entry->len > size) {
+            return MOBI_DATA_CORRUPT;
+        }
+    }
+    huff->count += n;
+    return MOBI_SUCCESS;
+}
+
+static uint64_t mb_huff_read64(const unsigned char *in, size_t in_len, size_t pos)
+{
+    uint64_t x = 0;
+    size_t k;
+
+    if (pos + 8 <= in_len) {
+        for (k = 0; k < 8; k++) {
+            x = x << 8 | in[pos + k];
+        }
+        return x;
+    }
+    /* bits past the end of the input are zeros */
+    for (k = 0; k < 8; k++) {
+        x = x << 8 | (pos + k < in_len ? in[pos + k] : 0);
+    }
+    return x;
+}
+
+static MOBI_RET mb_huff_decode(mb_HUFFCDIC *huff, unsigned char *out, size_t *out_len, const unsigned char *in,
+                               size_t in_len, int depth);
+
+static MOBI_RET mb_huff_expand(mb_HUFFCDIC *huff, mb_HUFF_ENTRY *entry, int depth)
+{
+    unsigned char *buf;
+    size_t len = HUFF_ENTRY_MAX;
+    MOBI_RET rc;
+
+    if (depth >= HUFF_DEPTH_MAX) {
+        return MOBI_DATA_CORRUPT;
+    }
+    buf = huff->scratch[depth];
+    if (buf == NULL) {
+        buf = huff->scratch[depth] = malloc(HUFF_ENTRY_MAX);
+        if (buf == NULL) {
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    entry->state = MB_HUFF_BUSY;
+    rc = mb_huff_decode(huff, buf, &len, entry->data, entry->len, depth + 1);
+    if (rc != MOBI_SUCCESS) {
+        entry->state = rc == MOBI_MALLOC_FAILED ? MB_HUFF_RAW : MB_HUFF_BROKEN;
+        return rc;
+    }
+    /* short phrases in the arena are copied with padding while the tables are being built too */
+    if (huff->arena_cap - huff->arena_len < len + HUFF_PADDING) {
+        size_t cap = huff->arena_cap ? huff->arena_cap : 4096;
+        unsigned char *arena;
+        while (cap - huff->arena_len < len + HUFF_PADDING) {
+            cap *= 2;
+        }
+        arena = realloc(huff->arena, cap);
+        if (arena == NULL) {
+            entry->state = MB_HUFF_RAW;
+            return MOBI_MALLOC_FAILED;
+        }
+        huff->arena = arena;
+        huff->arena_cap = cap;
+    }
+    memcpy(huff->arena + huff->arena_len, buf, len);
+    entry->off = huff->arena_len;
+    entry->len = (uint32_t)len;
+    entry->state = MB_HUFF_ARENA;
+    huff->arena_len += len;
+    return MOBI_SUCCESS;
+}
+
+/*
+ * Phrase of the entry, expanding it when the tables are being built. Once
+ * they are built, only the entries which have failed to expand are not
+ * ready.
+ */
+static MOBI_RET mb_huff_phrase(mb_HUFFCDIC *huff, mb_HUFF_ENTRY *entry, int depth, const unsigned char **data)
+{
+    MOBI_RET rc;
+
+    switch (entry->state) {
+        case MB_HUFF_RAW:
+            rc = mb_huff_expand(huff, entry, depth);
+            if (rc != MOBI_SUCCESS) {
+                return rc;
+            }
+            /* fall through */
+        case MB_HUFF_ARENA:
+            *data = huff->arena + entry->off;
+            return MOBI_SUCCESS;
+        case MB_HUFF_READY:
+            *data = entry->data;
+            return MOBI_SUCCESS;
+        default:
+            return MOBI_DATA_CORRUPT;
+    }
+}
+
+static MOBI_RET mb_huff_decode(mb_HUFFCDIC *huff, unsigned char *out, size_t *out_len, const unsigned char *in,
+                               size_t in_len, int depth)
+{
+    size_t cap = *out_len, o = 0, pos = 0;
+    long long bitsleft = (long long)in_len * 8;
+    uint64_t x = mb_huff_read64(in, in_len, 0);
+    int n = 32;
+
+    for (;;) {
+        uint64_t code, r;
+        const mb_HUFF_LOOKUP *lookup;
+        size_t codelen, base;
+        mb_HUFF_ENTRY *entry;
+        const unsigned char *data;
+
+        if (n <= 0) {
+            pos += 4;
+            x = mb_huff_read64(in, in_len, pos);
+            n += 32;
+        }
+        code = (x >> n) & 0xffffffff;
+        lookup = &huff->lookup[code >> (32 - HUFF_LOOKUP_BITS)];
+        codelen = lookup->codelen;
+        base = lookup->base;
+        if (codelen == 0) {
+            codelen = huff->codelen1[code >> 24];
+            if (codelen <= HUFF_LOOKUP_BITS) {
+                codelen = HUFF_LOOKUP_BITS + 1;
+            }
+            while (codelen <= 32 && code < huff->mincode[codelen]) {
+                codelen++;
+            }
+            if (codelen > 32) {
+                return MOBI_DATA_CORRUPT;
+            }
+            base = (size_t)(huff->maxcode[codelen] >> (32 - codelen));
+        }
+        n -= (int)codelen;
+        bitsleft -= (long long)codelen;
+        if (bitsleft < 0) {
+            break;
+        }
+        /* wraps around for the codes past maxcode */
+        r = (uint64_t)base - (code >> (32 - codelen));
+        if (r >= huff->count) {
+            return MOBI_DATA_CORRUPT;
+        }
+        entry = &huff->entries[r];
+        data = entry->data;
+        if (entry->state != MB_HUFF_READY) {
+            MOBI_RET rc = mb_huff_phrase(huff, entry, depth, &data);
+            if (rc != MOBI_SUCCESS) {
+                return rc;
+            }
+        }
+        if (o + entry->len > cap) {
+            return MOBI_DATA_CORRUPT;
+        }
+        if (entry->len <= HUFF_PADDING && o + HUFF_PADDING <= cap) {
+            memcpy(out + o, data, HUFF_PADDING);
+        } else {
+            memcpy(out + o, data, entry->len);
+        }
+        o += entry->len;
+    }
+    *out_len = o;
+    return MOBI_SUCCESS;
+}
+
+static void mb_huff_free_scratch(mb_HUFFCDIC *huff)
+{
+    size_t i;
+
+    for (i = 0; i < HUFF_DEPTH_MAX; i++) {
+        free(huff->scratch[i]);
+        huff->scratch[i] = NULL;
+    }
+}
+
+static void mb_huffcdic_free(mb_HUFFCDIC *huff)
+{
+    mb_huff_free_scratch(huff);
+    free(huff->entries);
+    free(huff->arena);
+    free(huff->records);
+    free(huff->record_sizes);
+    free(huff);
+}
+
+static int mb_huff_same(const mb_HUFFCDIC *huff, uint64_t hash, const MOBIPdbRecord *rec, size_t count)
+{
+    const unsigned char *data = huff->records;
+    size_t i;
+
+    if (huff->hash != hash || huff->record_count != count) {
+        return 0;
+    }
+    for (i = 0; i < count; i++, rec = rec->next) {
+        if (huff->record_sizes[i] != rec->size || memcmp(data, rec->data, rec->size) != 0) {
+            return 0;
+        }
+        data += rec->size;
+    }
+    return 1;
+}
+
+/* Build the tables from own copy of the records, and expand every dictionary entry */
+static MOBI_RET mb_huff_build(mb_HUFFCDIC **out, const MOBIPdbRecord *first, size_t count, uint64_t hash)
+{
+    mb_HUFFCDIC *huff;
+    const MOBIPdbRecord *rec;
+    unsigned char *data;
+    size_t i, total = 0;
+    MOBI_RET rc;
+
+    huff = calloc(1, sizeof(mb_HUFFCDIC));
+    if (huff == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    for (i = 0, rec = first; i < count; i++, rec = rec->next) {
+        total += rec->size;
+    }
+    huff->records = calloc(total + HUFF_PADDING, 1);
+    huff->record_sizes = malloc(count * sizeof(size_t));
+    if (huff->records == NULL || huff->record_sizes == NULL) {
+        mb_huffcdic_free(huff);
+        return MOBI_MALLOC_FAILED;
+    }
+    huff->record_count = count;
+    huff->hash = hash;
+    huff->bytes = sizeof(mb_HUFFCDIC) + total + HUFF_PADDING + count * sizeof(size_t);
+    data = huff->records;
+    rc = MOBI_SUCCESS;
+    for (i = 0, rec = first; rc == MOBI_SUCCESS && i < count; i++, rec = rec->next) {
+        memcpy(data, rec->data, rec->size);
+        huff->record_sizes[i] = rec->size;
+        rc = i == 0 ? mb_huff_parse(huff, data, rec->size) : mb_cdic_parse(huff, data, rec->size);
+        data += rec->size;
+    }
+    if (rc != MOBI_SUCCESS) {
+        mb_huffcdic_free(huff);
+        return rc;
+    }
+    for (i = 0; i < huff->count; i++) {
+        /* broken entries make only the records using them fail */
+        if (huff->entries[i].state == MB_HUFF_RAW && mb_huff_expand(huff, &huff->entries[i], 0) == MOBI_MALLOC_FAILED) {
+            mb_huffcdic_free(huff);
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    mb_huff_free_scratch(huff);
+    data = realloc(huff->arena, huff->arena_len + HUFF_PADDING);
+    if (data == NULL) {
+        mb_huffcdic_free(huff);
+        return MOBI_MALLOC_FAILED;
+    }
+    memset(data + huff->arena_len, 0, HUFF_PADDING);
+    huff->arena = data;
+    huff->arena_cap = huff->arena_len + HUFF_PADDING;
+    /* the arena does not move anymore */
+    for (i = 0; i < huff->count; i++) {
+        if (huff->entries[i].state == MB_HUFF_ARENA) {
+            huff->entries[i].data = huff->arena + huff->entries[i].off;
+            huff->entries[i].state = MB_HUFF_READY;
+        }
+    }
+    huff->bytes += huff->count * sizeof(mb_HUFF_ENTRY) + huff->arena_cap;
+    huff->refs = 1;
+    *out = huff;
+    return MOBI_SUCCESS;
+}
+
+static void mb_huff_cache_unlink(mb_HUFFCDIC *huff)
+{
+    if (huff->prev) {
+        huff->prev->next = huff->next;
+    } else {
+        mb_huff_cache.head = huff->next;
+    }
+    if (huff->next) {
+        huff->next->prev = huff->prev;
+    } else {
+        mb_huff_cache.tail = huff->prev;
+    }
+    huff->prev = huff->next = NULL;
+}
+
+static void mb_huff_cache_push(mb_HUFFCDIC *huff)
+{
+    huff->prev = NULL;
+    huff->next = mb_huff_cache.head;
+    if (mb_huff_cache.head) {
+        mb_huff_cache.head->prev = huff;
+    } else {
+        mb_huff_cache.tail = huff;
+    }
+    mb_huff_cache.head = huff;
+}
+
+/* Drop the tables from the cache, the caller holds the lock. Returns them when they have to be freed */
+static mb_HUFFCDIC *mb_huff_cache_evict(mb_HUFFCDIC *huff)
+{
+    mb_huff_cache_unlink(huff);
+    huff->cached = 0;
+    mb_huff_cache.stats.entries--;
+    mb_huff_cache.stats.bytes -= huff->bytes;
+    return --huff->refs == 0 ? huff : NULL;
+}
+
+/* Trim the cache down to the limit, the evicted tables are freed outside of the lock */
+static void mb_huff_cache_trim(void)
+{
+    mb_HUFFCDIC *freed = NULL, *huff;
+
+    HUFF_CACHE_LOCK();
+    while (mb_huff_cache.stats.entries > mb_huff_cache.limit) {
+        huff = mb_huff_cache_evict(mb_huff_cache.tail);
+        if (huff) {
+            huff->next = freed;
+            freed = huff;
+        }
+    }
+    HUFF_CACHE_UNLOCK();
+    while (freed) {
+        huff = freed->next;
+        mb_huffcdic_free(freed);
+        freed = huff;
+    }
+}
+
+MOBI_RET mb_huffcdic_load(mb_HUFFCDIC **out, const MOBIData *m)
+{
+    mb_HUFFCDIC *huff, *built;
+    const MOBIPdbRecord *first, *rec;
+    size_t count, i;
+    uint64_t hash;
+    MOBI_RET rc;
+
+    if (m->mh == NULL || m->mh->huff_rec_index == NULL || m->mh->huff_rec_count == NULL ||
+        *m->mh->huff_rec_count < 2) {
+        return MOBI_DATA_CORRUPT;
+    }
+    count = *m->mh->huff_rec_count;
+    first = mobi_get_record_by_seqnumber(m, *m->mh->huff_rec_index + mobi_get_kf8offset(m));
+    for (i = 0, rec = first; i < count; i++, rec = rec->next) {
+        if (rec == NULL || rec->data == NULL) {
+            return MOBI_DATA_CORRUPT;
+        }
+    }
+    hash = mb_records_hash(first, count);
+
+    HUFF_CACHE_LOCK();
+    for (huff = mb_huff_cache.head; huff; huff = huff->next) {
+        if (mb_huff_same(huff, hash, first, count)) {
+            mb_huff_cache_unlink(huff);
+            mb_huff_cache_push(huff);
+            huff->refs++;
+            mb_huff_cache.stats.hits++;
+            break;
+        }
+    }
+    if (huff == NULL) {
+        mb_huff_cache.stats.misses++;
+    }
+    HUFF_CACHE_UNLOCK();
+    if (huff) {
+        *out = huff;
+        return MOBI_SUCCESS;
+    }
+
+    rc = mb_huff_build(&built, first, count, hash);
+    if (rc != MOBI_SUCCESS) {
+        return rc;
+    }
+    HUFF_CACHE_LOCK();
+    if (mb_huff_cache.limit > 0) {
+        /* another thread might have built the same tables meanwhile */
+        for (huff = mb_huff_cache.head; huff; huff = huff->next) {
+            if (mb_huff_same(huff, hash, first, count)) {
+                huff->refs++;
+                break;
+            }
+        }
+        if (huff == NULL) {
+            built->cached = 1;
+            built->refs++;
+            mb_huff_cache_push(built);
+            mb_huff_cache.stats.entries++;
+            mb_huff_cache.stats.bytes += built->bytes;
+        }
+    }
+    HUFF_CACHE_UNLOCK();
+    if (huff) {
+        mb_huffcdic_free(built);
+        built = huff;
+    } else {
+        mb_huff_cache_trim();
+    }
+    *out = built;
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_huffcdic_decode(mb_HUFFCDIC *huff, unsigned char *out, size_t *out_len, const unsigned char *in,
+                            size_t in_len)
+{
+    return mb_huff_decode(huff, out, out_len, in, in_len, 0);
+}
+
+void mb_huffcdic_release(mb_HUFFCDIC *huff)
+{
+    size_t refs;
+
+    if (huff == NULL) {
+        return;
+    }
+    HUFF_CACHE_LOCK();
+    refs = --huff->refs;
+    HUFF_CACHE_UNLOCK();
+    if (refs == 0) {
+        mb_huffcdic_free(huff);
+    }
+}
+
+void mb_huffcdic_cache_set_limit(size_t limit)
+{
+#ifndef HAVE_PTHREAD_H
+    limit = 0;
+#endif
+    HUFF_CACHE_LOCK();
+    mb_huff_cache.limit = limit;
+    HUFF_CACHE_UNLOCK();
+    mb_huff_cache_trim();
+}
+
+size_t mb_huffcdic_cache_limit(void)
+{
+    return mb_huff_cache.limit;
+}
+
+void mb_huffcdic_cache_stats(mb_HUFF_CACHE_STATS *stats)
+{
+    HUFF_CACHE_LOCK();
+    *stats = mb_huff_cache.stats;
+    HUFF_CACHE_UNLOCK();
+}
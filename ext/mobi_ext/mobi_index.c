@@ -0,0 +1,499 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INDX_MAGIC "INDX"
+#define TAGX_MAGIC "TAGX"
+#define IDXT_MAGIC "IDXT"
+#define INDX_HEADER_LEN 56
+#define TAGX_HEADER_LEN 12
+#define TAGX_MAX 64
+#define ORDT_MAGIC "ORDT"
+#define CNCX_RECORD_SIZE 0x10000
+/* the ORDT fields at the end of the header */
+#define INDX_ORDT_LEN 180
+
+typedef struct mb_TAGX {
+    unsigned char tag;
+    unsigned char values_count;
+    unsigned char bitmask;
+    unsigned char control_byte;
+} mb_TAGX;
+
+/*
+ * MOBIIndx followed by the flat arrays its entries point into. While the
+ * index is being parsed, the pointers hold offsets into the arrays, because
+ * the arrays may move.
+ */
+typedef struct mb_INDEX {
+    MOBIIndx indx;
+    size_t entries_cap;
+    MOBIIndexTag *tags;
+    size_t tags_count;
+    size_t tags_cap;
+    uint32_t *values;
+    size_t values_count;
+    size_t values_cap;
+    /* every label is preceded by its length, labels with 16-bit units may contain NUL */
+    char *labels;
+    size_t labels_size;
+    size_t labels_cap;
+    /* ORDT2 table in the main record, which maps label units to UTF-16 */
+    const unsigned char *ordt;
+    size_t ordt_count;
+    size_t unit_size;
+} mb_INDEX;
+
+static uint32_t mb_get32(const unsigned char *ptr)
+{
+    return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 | (uint32_t)ptr[2] << 8 | (uint32_t)ptr[3];
+}
+
+static uint16_t mb_get16(const unsigned char *ptr)
+{
+    return (uint16_t)(ptr[0] << 8 | ptr[1]);
+}
+
+/* Grow the array to hold at least need items */
+static int mb_index_reserve(void **ptr, size_t *cap, size_t need, size_t item)
+{
+    size_t n = *cap ? *cap : 64;
+    void *p;
+
+    if (need <= *cap) {
+        return 1;
+    }
+    while (n < need) {
+        n *= 2;
+    }
+    p = realloc(*ptr, n * item);
+    if (p == NULL) {
+        return 0;
+    }
+    *ptr = p;
+    *cap = n;
+    return 1;
+}
+
+/* Variable width integer, the last byte has the high bit set */
+static int mb_index_varlen(const unsigned char *data, size_t end, size_t *pos, uint32_t *val)
+{
+    uint32_t v = 0;
+    size_t i;
+
+    for (i = 0; i < 4 && *pos < end; i++) {
+        unsigned char c = data[(*pos)++];
+        v = v << 7 | (c & 0x7f);
+        if (c & 0x80) {
+            *val = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static size_t mb_index_bitcount(unsigned char n)
+{
+    size_t count = 0;
+
+    for (; n; n &= (unsigned char)(n - 1)) {
+        count++;
+    }
+    return count;
+}
+
+static MOBI_RET mb_index_parse_entry(mb_INDEX *index, const unsigned char *data, size_t pos, size_t end,
+                                     const mb_TAGX *tagx, size_t tagx_count, size_t control_bytes)
+{
+    MOBIIndexEntry *entry;
+    const unsigned char *cb;
+    struct {
+        size_t tag;
+        size_t values_count;
+        size_t count;
+        size_t bytes;
+    } ptags[TAGX_MAX];
+    size_t i, ci = 0, nptags = 0, label_len;
+
+    if (pos >= end) {
+        return MOBI_DATA_CORRUPT;
+    }
+    label_len = data[pos++];
+    if (pos + label_len + control_bytes > end) {
+        return MOBI_DATA_CORRUPT;
+    }
+    if (!mb_index_reserve((void **)&index->indx.entries, &index->entries_cap, index->indx.entries_count + 1,
+                          sizeof(MOBIIndexEntry)) ||
+        !mb_index_reserve((void **)&index->labels, &index->labels_cap, index->labels_size + label_len + 2, 1)) {
+        return MOBI_MALLOC_FAILED;
+    }
+    entry = &index->indx.entries[index->indx.entries_count++];
+    entry->label = (char *)(uintptr_t)(index->labels_size + 1);
+    entry->tags = (MOBIIndexTag *)(uintptr_t)index->tags_count;
+    entry->tags_count = 0;
+    index->labels[index->labels_size] = (char)label_len;
+    memcpy(index->labels + index->labels_size + 1, data + pos, label_len);
+    index->labels[index->labels_size + 1 + label_len] = '\0';
+    index->labels_size += label_len + 2;
+    pos += label_len;
+    cb = data + pos;
+    pos += control_bytes;
+
+    /* the control bytes tell which tags are present, and how many values they have */
+    for (i = 0; i < tagx_count; i++) {
+        unsigned char value;
+
+        if (tagx[i].control_byte == 1) {
+            if (++ci >= control_bytes) {
+                break;
+            }
+            continue;
+        }
+        value = cb[ci] & tagx[i].bitmask;
+        if (value == 0) {
+            continue;
+        }
+        ptags[nptags].tag = tagx[i].tag;
+        ptags[nptags].values_count = tagx[i].values_count;
+        ptags[nptags].count = 0;
+        ptags[nptags].bytes = 0;
+        if (value == tagx[i].bitmask && mb_index_bitcount(tagx[i].bitmask) > 1) {
+            uint32_t bytes;
+            if (!mb_index_varlen(data, end, &pos, &bytes)) {
+                return MOBI_DATA_CORRUPT;
+            }
+            ptags[nptags].bytes = bytes;
+        } else {
+            unsigned char mask = tagx[i].bitmask;
+            while ((mask & 1) == 0) {
+                mask >>= 1;
+                value >>= 1;
+            }
+            ptags[nptags].count = value;
+        }
+        nptags++;
+    }
+
+    if (!mb_index_reserve((void **)&index->tags, &index->tags_cap, index->tags_count + nptags, sizeof(MOBIIndexTag))) {
+        return MOBI_MALLOC_FAILED;
+    }
+    for (i = 0; i < nptags; i++) {
+        MOBIIndexTag *tag = &index->tags[index->tags_count++];
+        size_t start = pos, n = ptags[i].count * ptags[i].values_count;
+        uint32_t val;
+
+        tag->tagid = ptags[i].tag;
+        tag->tagvalues_count = 0;
+        tag->tagvalues = (uint32_t *)(uintptr_t)index->values_count;
+        while (ptags[i].bytes ? pos - start < ptags[i].bytes : tag->tagvalues_count < n) {
+            if (!mb_index_varlen(data, end, &pos, &val)) {
+                return MOBI_DATA_CORRUPT;
+            }
+            if (!mb_index_reserve((void **)&index->values, &index->values_cap, index->values_count + 1,
+                                  sizeof(uint32_t))) {
+                return MOBI_MALLOC_FAILED;
+            }
+            index->values[index->values_count++] = val;
+            tag->tagvalues_count++;
+        }
+        entry->tags_count++;
+    }
+    return MOBI_SUCCESS;
+}
+
+static MOBI_RET mb_index_parse_record(mb_INDEX *index, const MOBIPdbRecord *rec, const mb_TAGX *tagx,
+                                      size_t tagx_count, size_t control_bytes)
+{
+    const unsigned char *data = rec->data;
+    size_t idxt, count, i;
+    MOBI_RET rc;
+
+    if (data == NULL || rec->size < INDX_HEADER_LEN || memcmp(data, INDX_MAGIC, 4) != 0) {
+        return MOBI_DATA_CORRUPT;
+    }
+    idxt = mb_get32(data + 20);
+    count = mb_get32(data + 24);
+    if (idxt + 4 + 2 * count > rec->size || memcmp(data + idxt, IDXT_MAGIC, 4) != 0) {
+        return MOBI_DATA_CORRUPT;
+    }
+    for (i = 0; i < count; i++) {
+        size_t start = mb_get16(data + idxt + 4 + 2 * i);
+        size_t end = i + 1 < count ? mb_get16(data + idxt + 6 + 2 * i) : idxt;
+        if (end > idxt || start > end) {
+            return MOBI_DATA_CORRUPT;
+        }
+        rc = mb_index_parse_entry(index, data, start, end, tagx, tagx_count, control_bytes);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/*
+ * Dictionaries in some languages encode labels as indexes into the ORDT2
+ * table of UTF-16 code units, 8 or 16 bits wide, see mobi_getstring_ordt().
+ */
+static void mb_index_parse_ordt(mb_INDEX *index, const MOBIPdbRecord *rec)
+{
+    const unsigned char *data = rec->data;
+    size_t header_len = mb_get32(data + 4), type, count, offset;
+
+    index->unit_size = 1;
+    if (header_len < INDX_ORDT_LEN || rec->size < INDX_ORDT_LEN) {
+        return;
+    }
+    type = mb_get32(data + 164);
+    count = mb_get32(data + 168);
+    offset = mb_get32(data + 176);
+    if (count == 0 || offset > rec->size || rec->size - offset < 4 || (rec->size - offset - 4) / 2 < count ||
+        memcmp(data + offset, ORDT_MAGIC, 4) != 0) {
+        return;
+    }
+    index->ordt = data + offset + 4;
+    index->ordt_count = count;
+    index->unit_size = type == 1 ? 1 : 2;
+}
+
+/* Turn the offsets stored during parsing into pointers */
+static void mb_index_rebase(mb_INDEX *index)
+{
+    size_t i;
+
+    for (i = 0; i < index->tags_count; i++) {
+        index->tags[i].tagvalues = index->values + (uintptr_t)index->tags[i].tagvalues;
+    }
+    for (i = 0; i < index->indx.entries_count; i++) {
+        MOBIIndexEntry *entry = &index->indx.entries[i];
+        entry->label = index->labels + (uintptr_t)entry->label;
+        entry->tags = index->tags + (uintptr_t)entry->tags;
+    }
+}
+
+MOBI_RET mb_index_parse(MOBIIndx **out, const MOBIData *m, size_t record)
+{
+    const MOBIPdbRecord *rec;
+    const unsigned char *data;
+    mb_TAGX tagx[TAGX_MAX];
+    size_t header_len, tagx_len, tagx_count, control_bytes, records, i;
+    mb_INDEX *index;
+    MOBI_RET rc = MOBI_SUCCESS;
+
+    *out = NULL;
+    rec = mobi_get_record_by_seqnumber(m, record + mobi_get_kf8offset(m));
+    if (rec == NULL || rec->data == NULL || rec->size < INDX_HEADER_LEN || memcmp(rec->data, INDX_MAGIC, 4) != 0) {
+        return MOBI_DATA_CORRUPT;
+    }
+    data = rec->data;
+    header_len = mb_get32(data + 4);
+    if (header_len > rec->size || rec->size - header_len < TAGX_HEADER_LEN ||
+        memcmp(data + header_len, TAGX_MAGIC, 4) != 0) {
+        return MOBI_DATA_CORRUPT;
+    }
+    tagx_len = mb_get32(data + header_len + 4);
+    control_bytes = mb_get32(data + header_len + 8);
+    if (tagx_len < TAGX_HEADER_LEN || tagx_len > rec->size - header_len || control_bytes == 0 ||
+        control_bytes > 8) {
+        return MOBI_DATA_CORRUPT;
+    }
+    tagx_count = (tagx_len - TAGX_HEADER_LEN) / 4;
+    if (tagx_count > TAGX_MAX) {
+        return MOBI_DATA_CORRUPT;
+    }
+    for (i = 0; i < tagx_count; i++) {
+        const unsigned char *p = data + header_len + TAGX_HEADER_LEN + 4 * i;
+        tagx[i].tag = p[0];
+        tagx[i].values_count = p[1];
+        tagx[i].bitmask = p[2];
+        tagx[i].control_byte = p[3];
+    }
+
+    index = calloc(1, sizeof(mb_INDEX));
+    if (index == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    index->indx.type = mb_get32(data + 12);
+    index->indx.encoding = (MOBIEncoding)mb_get32(data + 28);
+    index->indx.total_entries_count = mb_get32(data + 36);
+    index->indx.ordt_offset = mb_get32(data + 40);
+    index->indx.ligt_offset = mb_get32(data + 44);
+    index->indx.ligt_entries_count = mb_get32(data + 48);
+    index->indx.cncx_records_count = mb_get32(data + 52);
+    mb_index_parse_ordt(index, rec);
+
+    /* the entries are in the records following the main one, then come CNCX records */
+    records = mb_get32(data + 24);
+    for (i = 0; i < records && rc == MOBI_SUCCESS; i++) {
+        rec = rec->next;
+        rc = rec ? mb_index_parse_record(index, rec, tagx, tagx_count, control_bytes) : MOBI_DATA_CORRUPT;
+    }
+    if (rc != MOBI_SUCCESS) {
+        mb_index_free(&index->indx);
+        return rc;
+    }
+    if (index->indx.cncx_records_count > 0) {
+        index->indx.cncx_record = rec->next;
+    }
+    mb_index_rebase(index);
+    *out = &index->indx;
+    return MOBI_SUCCESS;
+}
+
+void mb_index_free(MOBIIndx *indx)
+{
+    mb_INDEX *index = (mb_INDEX *)indx;
+
+    if (index == NULL) {
+        return;
+    }
+    free(index->indx.entries);
+    free(index->tags);
+    free(index->values);
+    free(index->labels);
+    free(index);
+}
+
+size_t mb_index_memsize(const MOBIIndx *indx)
+{
+    const mb_INDEX *index = (const mb_INDEX *)indx;
+
+    if (index == NULL) {
+        return 0;
+    }
+    return sizeof(mb_INDEX) + index->entries_cap * sizeof(MOBIIndexEntry) + index->tags_cap * sizeof(MOBIIndexTag) +
+           index->values_cap * sizeof(uint32_t) + index->labels_cap;
+}
+
+int mb_index_tag(const MOBIIndexEntry *entry, size_t tagid, size_t n, uint32_t *value)
+{
+    size_t i;
+
+    for (i = 0; i < entry->tags_count; i++) {
+        if (entry->tags[i].tagid == tagid) {
+            if (n >= entry->tags[i].tagvalues_count) {
+                return 0;
+            }
+            *value = entry->tags[i].tagvalues[n];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const unsigned char *mb_index_cncx(const MOBIIndx *indx, uint32_t offset, size_t *len)
+{
+    const MOBIPdbRecord *rec = indx->cncx_record;
+    size_t i, pos = offset % CNCX_RECORD_SIZE;
+    uint32_t size;
+
+    if (offset / CNCX_RECORD_SIZE >= indx->cncx_records_count) {
+        return NULL;
+    }
+    for (i = 0; rec && i < offset / CNCX_RECORD_SIZE; i++) {
+        rec = rec->next;
+    }
+    if (rec == NULL || rec->data == NULL || !mb_index_varlen(rec->data, rec->size, &pos, &size) ||
+        size > rec->size - pos) {
+        return NULL;
+    }
+    *len = size;
+    return rec->data + pos;
+}
+
+const unsigned char *mb_index_label(const MOBIIndexEntry *entry, size_t *len)
+{
+    const unsigned char *label = (const unsigned char *)entry->label;
+
+    *len = label[-1];
+    return label;
+}
+
+size_t mb_index_unit_size(const MOBIIndx *indx)
+{
+    return ((const mb_INDEX *)indx)->unit_size;
+}
+
+static size_t mb_put_utf8(char *out, uint32_t c)
+{
+    if (c < 0x80) {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char)(0xc0 | c >> 6);
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xe0 | c >> 12);
+        out[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | c >> 18);
+    out[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    out[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+/* Map the units through ORDT2, and join the surrogate pairs */
+static size_t mb_index_ordt_to_utf8(const mb_INDEX *index, const unsigned char *in, size_t len, char *out)
+{
+    size_t i, o = 0;
+    uint32_t high = 0;
+
+    for (i = 0; i + index->unit_size <= len; i += index->unit_size) {
+        uint32_t c = index->unit_size == 1 ? in[i] : mb_get16(in + i);
+        if (c < index->ordt_count) {
+            c = mb_get16(index->ordt + 2 * c);
+        }
+        if (c >= 0xd800 && c < 0xdc00) {
+            high = c;
+            continue;
+        }
+        if (c >= 0xdc00 && c < 0xe000) {
+            c = high ? 0x10000 + ((high - 0xd800) << 10) + (c - 0xdc00) : 0xfffd;
+        }
+        high = 0;
+        o += mb_put_utf8(out + o, c);
+    }
+    return o;
+}
+
+/* Code points of 0x80..0x9f in CP1252, the rest matches Latin-1 */
+static const uint16_t mb_cp1252[32] = {0x20ac, 0xfffd, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+                                       0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0xfffd, 0x017d, 0xfffd,
+                                       0xfffd, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+                                       0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0xfffd, 0x017e, 0x0178};
+
+size_t mb_cp1252_to_utf8(const unsigned char *in, size_t len, char *out)
+{
+    size_t i, o = 0;
+
+    for (i = 0; i < len; i++) {
+        uint32_t c = in[i];
+        if (c >= 0x80 && c < 0xa0) {
+            c = mb_cp1252[c - 0x80];
+        }
+        o += mb_put_utf8(out + o, c);
+    }
+    return o;
+}
+
+size_t mb_index_to_utf8(const MOBIIndx *indx, const unsigned char *in, size_t len, char *out)
+{
+    const mb_INDEX *index = (const mb_INDEX *)indx;
+
+    if (index->ordt) {
+        return mb_index_ordt_to_utf8(index, in, len, out);
+    }
+    if (indx->encoding == MB_ENCODING_UTF8) {
+        memcpy(out, in, len);
+        return len;
+    }
+    return mb_cp1252_to_utf8(in, len, out);
+}
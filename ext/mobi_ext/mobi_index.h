@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_INDEX_H
+#define MOBI_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mobi.h>
+
+/*
+ * Reader of INDX indexes (NCX, guide, skeleton, fragments, orthographic)
+ * into libmobi's MOBIIndx structures. libmobi parses them only as a part of
+ * mobi_parse_rawml(), which decompresses the whole text first. Labels, tags
+ * and their values are kept in a few flat arrays, and CNCX records and ORDT
+ * tables are borrowed from MOBIData. Labels are kept in the encoding of the
+ * index, use mb_index_to_utf8() to convert them.
+ */
+
+#define MB_ENCODING_UTF8 65001
+
+/* Parse the index, which starts at the record number from the MOBI header */
+MOBI_RET mb_index_parse(MOBIIndx **out, const MOBIData *m, size_t record);
+void mb_index_free(MOBIIndx *indx);
+
+/* Memory allocated for the index, the borrowed records are not counted */
+size_t mb_index_memsize(const MOBIIndx *indx);
+
+/* The nth value of the tag, returns zero when the entry does not have it */
+int mb_index_tag(const MOBIIndexEntry *entry, size_t tagid, size_t n, uint32_t *value);
+
+/* Label of the entry with its length, it may contain NUL when the units are 16-bit */
+const unsigned char *mb_index_label(const MOBIIndexEntry *entry, size_t *len);
+
+/* Width of the label units in bytes, 2 for labels mapped through 16-bit ORDT table */
+size_t mb_index_unit_size(const MOBIIndx *indx);
+
+/* String at the offset in the CNCX records, in the encoding of the index */
+const unsigned char *mb_index_cncx(const MOBIIndx *indx, uint32_t offset, size_t *len);
+
+/*
+ * Convert string in the encoding of the index to UTF-8, out needs room for
+ * 3 * len bytes. Returns the length of the result.
+ */
+size_t mb_index_to_utf8(const MOBIIndx *indx, const unsigned char *in, size_t len, char *out);
+
+/* Same for CP1252 text, out needs room for 3 * len bytes */
+size_t mb_cp1252_to_utf8(const unsigned char *in, size_t len, char *out);
+
+#endif
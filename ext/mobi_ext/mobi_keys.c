@@ -0,0 +1,149 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <mobi.h>
+
+#include <ruby.h>
+
+#include "mobi_keys.h"
+
+ID mb_key_ids[MB_KEYS_COUNT];
+VALUE mb_key_syms[MB_KEYS_COUNT];
+/* keeps the symbols reachable, so they are never collected */
+static VALUE mb_key_pinned = Qnil;
+
+#define MB_KEY_NAME(NAME) #NAME,
+static const char *const mb_key_names[MB_KEYS_COUNT] = {NULL, MB_KEYS(MB_KEY_NAME)};
+#undef MB_KEY_NAME
+
+/* EXTH tag to key, the tags not listed here are MB_KEY_UNDEF */
+static const unsigned short mb_exth_tag_keys[] = {
+    [EXTH_DRMSERVER] = MB_KEY_drm_server,
+    [EXTH_DRMCOMMERCE] = MB_KEY_drm_commerce,
+    [EXTH_DRMEBOOKBASE] = MB_KEY_drm_ebookbase,
+    [EXTH_TITLE] = MB_KEY_title,
+    [EXTH_AUTHOR] = MB_KEY_creator,
+    [EXTH_PUBLISHER] = MB_KEY_publisher,
+    [EXTH_IMPRINT] = MB_KEY_imprint,
+    [EXTH_DESCRIPTION] = MB_KEY_description,
+    [EXTH_ISBN] = MB_KEY_isbn,
+    [EXTH_SUBJECT] = MB_KEY_subject,
+    [EXTH_PUBLISHINGDATE] = MB_KEY_published,
+    [EXTH_REVIEW] = MB_KEY_review,
+    [EXTH_CONTRIBUTOR] = MB_KEY_contributor,
+    [EXTH_RIGHTS] = MB_KEY_rights,
+    [EXTH_SUBJECTCODE] = MB_KEY_subject_code,
+    [EXTH_TYPE] = MB_KEY_type,
+    [EXTH_SOURCE] = MB_KEY_source,
+    [EXTH_ASIN] = MB_KEY_asin,
+    [EXTH_VERSION] = MB_KEY_version,
+    [EXTH_SAMPLE] = MB_KEY_sample,
+    [EXTH_STARTREADING] = MB_KEY_start_reading,
+    [EXTH_ADULT] = MB_KEY_adult,
+    [EXTH_PRICE] = MB_KEY_price,
+    [EXTH_CURRENCY] = MB_KEY_currency,
+    [EXTH_KF8BOUNDARY] = MB_KEY_kf8_boundary,
+    [EXTH_FIXEDLAYOUT] = MB_KEY_fixed_layout,
+    [EXTH_BOOKTYPE] = MB_KEY_book_type,
+    [EXTH_ORIENTATIONLOCK] = MB_KEY_orientation_lock,
+    [EXTH_COUNTRESOURCES] = MB_KEY_count_resources,
+    [EXTH_ORIGRESOLUTION] = MB_KEY_orig_resolution,
+    [EXTH_ZEROGUTTER] = MB_KEY_zero_gutter,
+    [EXTH_ZEROMARGIN] = MB_KEY_zero_margin,
+    [EXTH_KF8COVERURI] = MB_KEY_kf8_cover_uri,
+    [EXTH_RESCOFFSET] = MB_KEY_resc_offset,
+    [EXTH_REGIONMAGNI] = MB_KEY_region_magnification,
+    [EXTH_DICTNAME] = MB_KEY_dict_name,
+    [EXTH_COVEROFFSET] = MB_KEY_cover_offset,
+    [EXTH_THUMBOFFSET] = MB_KEY_thumb_offset,
+    [EXTH_HASFAKECOVER] = MB_KEY_has_fake_cover,
+    [EXTH_CREATORSOFT] = MB_KEY_creator_soft,
+    [EXTH_CREATORMAJOR] = MB_KEY_creator_major,
+    [EXTH_CREATORMINOR] = MB_KEY_creator_minor,
+    [EXTH_CREATORBUILD] = MB_KEY_creator_build,
+    [EXTH_WATERMARK] = MB_KEY_watermark,
+    [EXTH_TAMPERKEYS] = MB_KEY_tamper_keys,
+    [EXTH_FONTSIGNATURE] = MB_KEY_font_signature,
+    [EXTH_CLIPPINGLIMIT] = MB_KEY_clipping_limit,
+    [EXTH_PUBLISHERLIMIT] = MB_KEY_publisher_limit,
+    [EXTH_UNK403] = MB_KEY_unknown_403,
+    [EXTH_TTSDISABLE] = MB_KEY_tts_disabled,
+    [EXTH_UNK405] = MB_KEY_unknown_405,
+    [EXTH_RENTAL] = MB_KEY_rental,
+    [EXTH_UNK407] = MB_KEY_unknown_407,
+    [EXTH_UNK450] = MB_KEY_unknown_450,
+    [EXTH_UNK451] = MB_KEY_unknown_451,
+    [EXTH_UNK452] = MB_KEY_unknown_452,
+    [EXTH_UNK453] = MB_KEY_unknown_453,
+    [EXTH_DOCTYPE] = MB_KEY_doc_type,
+    [EXTH_LASTUPDATE] = MB_KEY_last_update,
+    [EXTH_UPDATEDTITLE] = MB_KEY_updated_title,
+    [EXTH_ASIN504] = MB_KEY_asin_504,
+    [EXTH_TITLEFILEAS] = MB_KEY_title_file_as,
+    [EXTH_CREATORFILEAS] = MB_KEY_creator_file_as,
+    [EXTH_PUBLISHERFILEAS] = MB_KEY_publisher_file_as,
+    [EXTH_LANGUAGE] = MB_KEY_language,
+    [EXTH_ALIGNMENT] = MB_KEY_alignment,
+    [EXTH_CREATORSTRING] = MB_KEY_creator_string,
+    [EXTH_PAGEDIR] = MB_KEY_page_dir,
+    [EXTH_OVERRIDEFONTS] = MB_KEY_override_fonts,
+    [EXTH_SORCEDESC] = MB_KEY_source_desc,
+    [EXTH_DICTLANGIN] = MB_KEY_dict_lang_in,
+    [EXTH_DICTLANGOUT] = MB_KEY_dict_lang_out,
+    [EXTH_INPUTSOURCE] = MB_KEY_input_source,
+    [EXTH_CREATORBUILDREV] = MB_KEY_creator_build_rev,
+};
+
+/* MOBIFiletype to key */
+static const unsigned short mb_part_type_keys[] = {
+    [T_UNKNOWN] = MB_KEY_unknown,
+    [T_HTML] = MB_KEY_html,
+    [T_CSS] = MB_KEY_css,
+    [T_SVG] = MB_KEY_svg,
+    [T_OPF] = MB_KEY_opf,
+    [T_NCX] = MB_KEY_ncx,
+    [T_JPG] = MB_KEY_jpg,
+    [T_GIF] = MB_KEY_gif,
+    [T_PNG] = MB_KEY_png,
+    [T_BMP] = MB_KEY_bmp,
+    [T_OTF] = MB_KEY_otf,
+    [T_TTF] = MB_KEY_ttf,
+    [T_MP3] = MB_KEY_mp3,
+    [T_MPG] = MB_KEY_mpg,
+    [T_PDF] = MB_KEY_pdf,
+    [T_FONT] = MB_KEY_font,
+    [T_AUDIO] = MB_KEY_audio,
+    [T_VIDEO] = MB_KEY_video,
+    [T_BREAK] = MB_KEY_break,
+};
+
+#define MB_LOOKUP_SYM(TABLE, INDEX)                                                                                    \
+    ((INDEX) < sizeof(TABLE) / sizeof(TABLE[0]) ? mb_key_syms[TABLE[INDEX]] : Qnil)
+
+VALUE mb_exth_tag_sym(uint32_t tag)
+{
+    return MB_LOOKUP_SYM(mb_exth_tag_keys, tag);
+}
+
+VALUE mb_part_type_sym(int type)
+{
+    if (type < 0) {
+        return Qnil;
+    }
+    return MB_LOOKUP_SYM(mb_part_type_keys, (size_t)type);
+}
+
+void init_mobi_keys(void)
+{
+    size_t i;
+
+    /* MB_KEY_UNDEF maps to nil, so the lookup tables need no special case for the gaps */
+    mb_key_syms[MB_KEY_UNDEF] = Qnil;
+    rb_global_variable(&mb_key_pinned);
+    mb_key_pinned = rb_ary_new_capa(MB_KEYS_COUNT);
+    for (i = 1; i < MB_KEYS_COUNT; i++) {
+        mb_key_ids[i] = rb_intern(mb_key_names[i]);
+        mb_key_syms[i] = ID2SYM(mb_key_ids[i]);
+        rb_ary_push(mb_key_pinned, mb_key_syms[i]);
+    }
+    rb_obj_freeze(mb_key_pinned);
+}
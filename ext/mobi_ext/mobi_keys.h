@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_KEYS_H
+#define MOBI_KEYS_H
+
+#include <ruby.h>
+
+/*
+ * Every symbol the extension hands out as a Hash key or an enum value.
+ * They are interned once by init_mobi_keys(), so accessors do not have to
+ * call rb_intern() on every call.
+ */
+#define MB_KEYS(X)                                                                                                     \
+    /* text encodings, compression and encryption types */                                                             \
+    X(cp1252)                                                                                                          \
+    X(utf8)                                                                                                            \
+    X(utf16)                                                                                                           \
+    X(unknown)                                                                                                         \
+    X(none)                                                                                                            \
+    X(palm_doc)                                                                                                        \
+    X(huff_cdic)                                                                                                       \
+    X(old)                                                                                                             \
+    X(mobi)                                                                                                            \
+    /* EXTH tags */                                                                                                    \
+    X(type)                                                                                                            \
+    X(creator)                                                                                                         \
+    X(sample)                                                                                                          \
+    X(start_reading)                                                                                                   \
+    X(kf8_boundary)                                                                                                    \
+    X(count_resources)                                                                                                 \
+    X(resc_offset)                                                                                                     \
+    X(cover_offset)                                                                                                    \
+    X(thumb_offset)                                                                                                    \
+    X(has_fake_cover)                                                                                                  \
+    X(creator_soft)                                                                                                    \
+    X(creator_major)                                                                                                   \
+    X(creator_minor)                                                                                                   \
+    X(creator_build)                                                                                                   \
+    X(clipping_limit)                                                                                                  \
+    X(publisher_limit)                                                                                                 \
+    X(tts_disabled)                                                                                                    \
+    X(rental)                                                                                                          \
+    X(drm_server)                                                                                                      \
+    X(drm_commerce)                                                                                                    \
+    X(drm_ebookbase)                                                                                                   \
+    X(title)                                                                                                           \
+    X(publisher)                                                                                                       \
+    X(imprint)                                                                                                         \
+    X(description)                                                                                                     \
+    X(isbn)                                                                                                            \
+    X(subject)                                                                                                         \
+    X(published)                                                                                                       \
+    X(review)                                                                                                          \
+    X(contributor)                                                                                                     \
+    X(rights)                                                                                                          \
+    X(subject_code)                                                                                                    \
+    X(source)                                                                                                          \
+    X(asin)                                                                                                            \
+    X(adult)                                                                                                           \
+    X(price)                                                                                                           \
+    X(currency)                                                                                                        \
+    X(fixed_layout)                                                                                                    \
+    X(book_type)                                                                                                       \
+    X(orientation_lock)                                                                                                \
+    X(orig_resolution)                                                                                                 \
+    X(zero_gutter)                                                                                                     \
+    X(zero_margin)                                                                                                     \
+    X(kf8_cover_uri)                                                                                                   \
+    X(region_magnification)                                                                                            \
+    X(dict_name)                                                                                                       \
+    X(watermark)                                                                                                       \
+    X(doc_type)                                                                                                        \
+    X(last_update)                                                                                                     \
+    X(updated_title)                                                                                                   \
+    X(asin_504)                                                                                                        \
+    X(title_file_as)                                                                                                   \
+    X(creator_file_as)                                                                                                 \
+    X(publisher_file_as)                                                                                               \
+    X(language)                                                                                                        \
+    X(alignment)                                                                                                       \
+    X(page_dir)                                                                                                        \
+    X(override_fonts)                                                                                                  \
+    X(source_desc)                                                                                                     \
+    X(dict_lang_in)                                                                                                    \
+    X(dict_lang_out)                                                                                                   \
+    X(input_source)                                                                                                    \
+    X(creator_build_rev)                                                                                               \
+    X(creator_string)                                                                                                  \
+    X(tamper_keys)                                                                                                     \
+    X(font_signature)                                                                                                  \
+    X(unknown_403)                                                                                                     \
+    X(unknown_405)                                                                                                     \
+    X(unknown_407)                                                                                                     \
+    X(unknown_450)                                                                                                     \
+    X(unknown_451)                                                                                                     \
+    X(unknown_452)                                                                                                     \
+    X(unknown_453)                                                                                                     \
+    /* rawml parts and their types */                                                                                  \
+    X(version)                                                                                                         \
+    X(markup)                                                                                                          \
+    X(flow)                                                                                                            \
+    X(resources)                                                                                                       \
+    X(html)                                                                                                            \
+    X(css)                                                                                                             \
+    X(svg)                                                                                                             \
+    X(opf)                                                                                                             \
+    X(ncx)                                                                                                             \
+    X(jpg)                                                                                                             \
+    X(gif)                                                                                                             \
+    X(png)                                                                                                             \
+    X(bmp)                                                                                                             \
+    X(otf)                                                                                                             \
+    X(ttf)                                                                                                             \
+    X(mp3)                                                                                                             \
+    X(mpg)                                                                                                             \
+    X(pdf)                                                                                                             \
+    X(font)                                                                                                            \
+    X(audio)                                                                                                           \
+    X(video)                                                                                                           \
+    X(break)                                                                                                           \
+    /* MOBI.scan results */                                                                                            \
+    X(index)                                                                                                           \
+    X(path)                                                                                                            \
+    X(error)                                                                                                           \
+    X(code)                                                                                                            \
+    X(full_name)                                                                                                       \
+    X(author)                                                                                                          \
+    X(publishdate)                                                                                                     \
+    X(copyright)                                                                                                       \
+    /* HUFF/CDIC cache statistics */                                                                                   \
+    X(hits)                                                                                                            \
+    X(misses)                                                                                                          \
+    X(entries)                                                                                                         \
+    X(bytes)                                                                                                           \
+    /* memory statistics */                                                                                            \
+    X(books)                                                                                                           \
+    X(native_bytes)                                                                                                    \
+    /* instrumentation phases and their statistics */                                                                  \
+    X(read)                                                                                                            \
+    X(parse)                                                                                                           \
+    X(decompress)                                                                                                      \
+    X(build)                                                                                                           \
+    X(time)                                                                                                            \
+    X(calls)                                                                                                           \
+    X(book)                                                                                                            \
+    /* book formats */                                                                                                 \
+    X(kf7)                                                                                                             \
+    X(kf8)                                                                                                             \
+    X(both)                                                                                                            \
+    /* keyword arguments */                                                                                            \
+    X(mmap)                                                                                                            \
+    X(headers_only)                                                                                                    \
+    X(cache)                                                                                                           \
+    X(format)                                                                                                          \
+    X(payload)                                                                                                         \
+    X(threads)                                                                                                         \
+    X(limit)                                                                                                           \
+    X(fields)
+
+#define MB_KEY_ENUM(NAME) MB_KEY_##NAME,
+typedef enum { MB_KEY_UNDEF = 0, MB_KEYS(MB_KEY_ENUM) MB_KEYS_COUNT } mb_KEY;
+#undef MB_KEY_ENUM
+
+extern ID mb_key_ids[MB_KEYS_COUNT];
+extern VALUE mb_key_syms[MB_KEYS_COUNT];
+
+#define MB_ID(NAME) (mb_key_ids[MB_KEY_##NAME])
+#define MB_SYM(NAME) (mb_key_syms[MB_KEY_##NAME])
+
+/* Symbol for EXTH tag, or Qnil when the tag is not known */
+VALUE mb_exth_tag_sym(uint32_t tag);
+
+/* Symbol for MOBIFiletype, or Qnil when the type is not known */
+VALUE mb_part_type_sym(int type);
+
+void init_mobi_keys(void);
+
+#endif
@@ -0,0 +1,490 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_config.h"
+#ifdef HAVE_COPY_FILE_RANGE
+#define _GNU_SOURCE
+#endif
+
+#include "mobi_loader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#define PDB_HEADER_LEN 78
+#define PDB_RECORD_INFO_LEN 8
+#define PDB_TYPE_OFFSET 60
+#define PDB_REC_COUNT_OFFSET 76
+#define KF8_BOUNDARY_MAGIC "BOUNDARY"
+
+static uint32_t mb_get32(const unsigned char *ptr)
+{
+    return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 | (uint32_t)ptr[2] << 8 | (uint32_t)ptr[3];
+}
+
+static uint16_t mb_get16(const unsigned char *ptr)
+{
+    return (uint16_t)(ptr[0] << 8 | ptr[1]);
+}
+
+static void mb_put32(unsigned char *ptr, uint32_t val)
+{
+    ptr[0] = (unsigned char)(val >> 24);
+    ptr[1] = (unsigned char)(val >> 16);
+    ptr[2] = (unsigned char)(val >> 8);
+    ptr[3] = (unsigned char)val;
+}
+
+FILE *mb_fmemopen(void *buf, size_t size)
+{
+#ifdef HAVE_FMEMOPEN
+    return fmemopen(buf, size, "rb");
+#else
+    FILE *file = tmpfile();
+    if (file) {
+        if (fwrite(buf, size, 1, file) != 1) {
+            fclose(file);
+            return NULL;
+        }
+        rewind(file);
+    }
+    return file;
+#endif
+}
+
+MOBI_RET mb_mapping_open(mb_MAPPING *map, const char *path)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return MOBI_FILE_NOT_FOUND;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return MOBI_FILE_NOT_FOUND;
+    }
+    if (st.st_size < PDB_HEADER_LEN) {
+        close(fd);
+        return MOBI_DATA_CORRUPT;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return MOBI_MALLOC_FAILED;
+    }
+#ifdef HAVE_MADVISE
+    /* only headers are read on load, the rest is touched on demand */
+    madvise(addr, (size_t)st.st_size, MADV_RANDOM);
+#endif
+    map->addr = addr;
+    map->size = (size_t)st.st_size;
+    map->fd = fd;
+    return MOBI_SUCCESS;
+#else
+    (void)map;
+    (void)path;
+    return MOBI_FILE_UNSUPPORTED;
+#endif
+}
+
+void mb_mapping_close(mb_MAPPING *map)
+{
+#ifdef HAVE_MMAP
+    if (map->addr) {
+        munmap(map->addr, map->size);
+        close(map->fd);
+    }
+#endif
+    map->addr = NULL;
+    map->size = 0;
+    map->fd = -1;
+}
+
+int mb_write_all(int fd, const unsigned char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+size_t mb_copy_mapped(int out, const mb_MAPPING *map, const unsigned char *data, size_t size, int *err)
+{
+    size_t done = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    off_t offset;
+
+    if (map == NULL || map->fd < 0 || data < map->addr || data + size > map->addr + map->size) {
+        return 0;
+    }
+    offset = (off_t)(data - map->addr);
+    while (done < size) {
+        ssize_t n = copy_file_range(map->fd, &offset, out, NULL, size - done, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                *err = errno;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+#else
+    (void)out;
+    (void)map;
+    (void)data;
+    (void)size;
+    (void)err;
+#endif
+    return done;
+}
+
+uint64_t mb_records_hash(const MOBIPdbRecord *rec, size_t count)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL, word;
+    size_t i, k;
+
+    for (i = 0; i < count && rec != NULL; i++, rec = rec->next) {
+        hash = (hash ^ rec->size) * prime;
+        for (k = 0; k + 8 <= rec->size; k += 8) {
+            memcpy(&word, rec->data + k, 8);
+            hash = (hash ^ word) * prime;
+            hash ^= hash >> 29;
+        }
+        for (; k < rec->size; k++) {
+            hash = (hash ^ rec->data[k]) * prime;
+        }
+    }
+    return hash;
+}
+
+static void mb_free_records(MOBIPdbRecord *rec, const mb_MAPPING *map)
+{
+    while (rec) {
+        MOBIPdbRecord *next = rec->next;
+        if (map == NULL || rec->data < map->addr || rec->data >= map->addr + map->size) {
+            free(rec->data);
+        }
+        free(rec);
+        rec = next;
+    }
+}
+
+/*
+ * libmobi does not expose record 0 parser, so pass it single-record PDB
+ * built from the original header and the record 0 payload. The record list of
+ * the result is released, the caller links the full list instead.
+ */
+static MOBI_RET mb_load_record0(MOBIData **out, const unsigned char *header, const MOBIPdbRecord *rec)
+{
+    size_t size = PDB_HEADER_LEN + PDB_RECORD_INFO_LEN + 2 + rec->size;
+    unsigned char *buf, *ptr;
+    MOBIData *m;
+    FILE *file;
+    MOBI_RET rc;
+
+    buf = calloc(size, 1);
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    memcpy(buf, header, PDB_HEADER_LEN);
+    buf[PDB_REC_COUNT_OFFSET] = 0;
+    buf[PDB_REC_COUNT_OFFSET + 1] = 1;
+    ptr = buf + PDB_HEADER_LEN;
+    mb_put32(ptr, PDB_HEADER_LEN + PDB_RECORD_INFO_LEN + 2);
+    mb_put32(ptr + 4, rec->uid);
+    ptr[4] = rec->attributes;
+    memcpy(ptr + PDB_RECORD_INFO_LEN + 2, rec->data, rec->size);
+
+    m = mobi_init();
+    if (m == NULL) {
+        free(buf);
+        return MOBI_MALLOC_FAILED;
+    }
+    file = mb_fmemopen(buf, size);
+    if (file == NULL) {
+        free(buf);
+        mobi_free(m);
+        return MOBI_FILE_NOT_FOUND;
+    }
+    rc = mobi_load_file(m, file);
+    fclose(file);
+    free(buf);
+    if (rc != MOBI_SUCCESS) {
+        mobi_free(m);
+        return rc;
+    }
+    mb_free_records(m->rec, NULL);
+    m->rec = NULL;
+    *out = m;
+    return MOBI_SUCCESS;
+}
+
+static MOBIPdbRecord *mb_record_at(MOBIPdbRecord *rec, size_t seqnumber)
+{
+    while (rec && seqnumber > 0) {
+        rec = rec->next;
+        seqnumber--;
+    }
+    return rec;
+}
+
+static MOBI_RET mb_parse_records(MOBIPdbRecord **out, const mb_MAPPING *map)
+{
+    const unsigned char *header = map->addr, *info;
+    MOBIPdbRecord *head = NULL, **tail = &head;
+    size_t rec_count, i;
+
+    if (map->size < PDB_HEADER_LEN) {
+        return MOBI_DATA_CORRUPT;
+    }
+    if (memcmp(header + PDB_TYPE_OFFSET, "BOOK", 4) != 0 && memcmp(header + PDB_TYPE_OFFSET, "TEXt", 4) != 0) {
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    rec_count = mb_get16(header + PDB_REC_COUNT_OFFSET);
+    if (rec_count == 0 || PDB_HEADER_LEN + rec_count * PDB_RECORD_INFO_LEN > map->size) {
+        return MOBI_DATA_CORRUPT;
+    }
+    info = header + PDB_HEADER_LEN;
+    for (i = 0; i < rec_count; i++, info += PDB_RECORD_INFO_LEN) {
+        uint32_t offset = mb_get32(info);
+        size_t end = map->size;
+        MOBIPdbRecord *rec;
+
+        if (i + 1 < rec_count) {
+            end = mb_get32(info + PDB_RECORD_INFO_LEN);
+        }
+        if (offset > end || end > map->size) {
+            mb_free_records(head, map);
+            return MOBI_DATA_CORRUPT;
+        }
+        rec = calloc(1, sizeof(MOBIPdbRecord));
+        if (rec == NULL) {
+            mb_free_records(head, map);
+            return MOBI_MALLOC_FAILED;
+        }
+        rec->offset = offset;
+        rec->size = end - offset;
+        rec->attributes = info[4];
+        rec->uid = mb_get32(info + 4) & 0x00ffffff;
+        rec->data = rec->size ? map->addr + offset : NULL;
+        *tail = rec;
+        tail = &rec->next;
+    }
+    *out = head;
+    return MOBI_SUCCESS;
+}
+
+/* Returns sequential number of the KF8 boundary record, or MOBI_NOTSET */
+static size_t mb_find_kf8_boundary(const MOBIData *m, MOBIPdbRecord *records)
+{
+    MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, EXTH_KF8BOUNDARY);
+    const MOBIPdbRecord *rec;
+    uint32_t seqnumber;
+
+    if (exth == NULL) {
+        return MOBI_NOTSET;
+    }
+    seqnumber = mobi_decode_exthvalue(exth->data, exth->size);
+    if (seqnumber == 0 || seqnumber == MOBI_NOTSET) {
+        return MOBI_NOTSET;
+    }
+    seqnumber--;
+    rec = mb_record_at(records, seqnumber);
+    if (rec == NULL || rec->next == NULL || rec->size < sizeof(KF8_BOUNDARY_MAGIC) - 1 ||
+        memcmp(rec->data, KF8_BOUNDARY_MAGIC, sizeof(KF8_BOUNDARY_MAGIC) - 1) != 0) {
+        return MOBI_NOTSET;
+    }
+    return seqnumber;
+}
+
+/*
+ * Replace payloads of the records, which are needed to parse the headers, with
+ * copies, and drop all other payloads, so that the mapping can be closed.
+ */
+static MOBI_RET mb_detach_headers(MOBIData *m, const mb_MAPPING *map)
+{
+    MOBIPdbRecord *rec;
+    size_t seqnumber = 0;
+
+    for (rec = m->rec; rec != NULL; rec = rec->next, seqnumber++) {
+        int keep = seqnumber == 0;
+        if (m->kf8_boundary_offset != MOBI_NOTSET) {
+            keep = keep || seqnumber == m->kf8_boundary_offset || seqnumber == m->kf8_boundary_offset + 1;
+        }
+        if (keep && rec->data) {
+            unsigned char *copy = malloc(rec->size);
+            if (copy == NULL) {
+                return MOBI_MALLOC_FAILED;
+            }
+            memcpy(copy, rec->data, rec->size);
+            rec->data = copy;
+        } else if (rec->data >= map->addr && rec->data < map->addr + map->size) {
+            rec->data = NULL;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_select_format(MOBIData *m, mb_FORMAT format, const mb_MAPPING *map)
+{
+    MOBIData *other = m->next;
+    MOBIPdbRecord *last;
+
+    if (format == MB_FORMAT_BOTH) {
+        return MOBI_SUCCESS;
+    }
+    if (!mobi_is_hybrid(m)) {
+        return mobi_is_kf8(m) == (format == MB_FORMAT_KF8) ? MOBI_SUCCESS : MOBI_FILE_UNSUPPORTED;
+    }
+    if (other) {
+        /* the PDB header, the records and the key belong to the primary half */
+        m->next = NULL;
+        other->next = NULL;
+        other->ph = NULL;
+        other->rec = NULL;
+        other->drm_key = NULL;
+        mobi_free(other);
+    }
+    if (format == MB_FORMAT_KF7) {
+        last = mb_record_at(m->rec, m->kf8_boundary_offset - 1);
+        if (last) {
+            mb_free_records(last->next, map);
+            last->next = NULL;
+        }
+        m->ph->rec_count = (uint16_t)m->kf8_boundary_offset;
+        m->kf8_boundary_offset = MOBI_NOTSET;
+        m->use_kf8 = false;
+        /* the boundary is gone, so the book saved afterwards is plain KF7 */
+        mobi_delete_exthrecord_by_tag(m, EXTH_KF8BOUNDARY);
+    }
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_load_mapped(MOBIData **out, const mb_MAPPING *map, mb_FORMAT format, bool headers_only)
+{
+    MOBIPdbRecord *records = NULL;
+    MOBIData *m = NULL, *kf8 = NULL;
+    MOBIRecord0Header *rh;
+    MOBIMobiHeader *mh;
+    MOBIExthHeader *eh;
+    size_t boundary;
+    MOBI_RET rc;
+
+    rc = mb_parse_records(&records, map);
+    if (rc != MOBI_SUCCESS) {
+        return rc;
+    }
+    rc = mb_load_record0(&m, map->addr, records);
+    if (rc != MOBI_SUCCESS) {
+        mb_free_records(records, map);
+        return rc;
+    }
+    m->rec = records;
+    m->ph->rec_count = mb_get16(map->addr + PDB_REC_COUNT_OFFSET);
+    m->use_kf8 = format != MB_FORMAT_KF7;
+
+    boundary = mb_find_kf8_boundary(m, records);
+    if (boundary != MOBI_NOTSET) {
+        m->kf8_boundary_offset = (uint32_t)boundary;
+    }
+    if (boundary != MOBI_NOTSET && format != MB_FORMAT_KF7) {
+        rc = mb_load_record0(&kf8, map->addr, mb_record_at(records, boundary + 1));
+        if (rc != MOBI_SUCCESS) {
+            mb_free_mapped(m, map);
+            return rc;
+        }
+        /* link the same way as mobi_load_file() does for hybrid files */
+        free(kf8->ph);
+        kf8->ph = m->ph;
+        kf8->rec = m->rec;
+        kf8->drm_key = m->drm_key;
+        kf8->next = m;
+        m->next = kf8;
+        /* and make KF8 half primary, as use_kf8 does there */
+        rh = m->rh;
+        mh = m->mh;
+        eh = m->eh;
+        m->rh = kf8->rh;
+        m->mh = kf8->mh;
+        m->eh = kf8->eh;
+        kf8->rh = rh;
+        kf8->mh = mh;
+        kf8->eh = eh;
+    }
+    rc = mb_select_format(m, format, map);
+    if (rc == MOBI_SUCCESS && headers_only) {
+        rc = mb_detach_headers(m, map);
+    }
+    if (rc != MOBI_SUCCESS) {
+        mb_free_mapped(m, map);
+        return rc;
+    }
+    *out = m;
+    return MOBI_SUCCESS;
+}
+
+void mb_mapping_advise_text(const mb_MAPPING *map, const MOBIData *m)
+{
+#ifdef HAVE_MADVISE
+    const MOBIPdbRecord *first, *last;
+    size_t page, start, end;
+
+    if (map->addr == NULL || m->rh == NULL || m->rh->text_record_count == 0) {
+        return;
+    }
+    first = mb_record_at(m->rec, mobi_get_kf8offset(m) + 1);
+    last = mb_record_at((MOBIPdbRecord *)first, m->rh->text_record_count - 1);
+    if (first == NULL || last == NULL) {
+        return;
+    }
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    start = first->offset & ~(page - 1);
+    end = last->offset + last->size;
+    madvise(map->addr + start, end - start, MADV_SEQUENTIAL);
+    madvise(map->addr + start, end - start, MADV_WILLNEED);
+#else
+    (void)map;
+    (void)m;
+#endif
+}
+
+void mb_free_mapped(MOBIData *m, const mb_MAPPING *map)
+{
+    MOBIPdbRecord *rec;
+
+    if (m == NULL) {
+        return;
+    }
+    /* payloads inside the mapping must not reach free() */
+    for (rec = m->rec; rec != NULL; rec = rec->next) {
+        if (rec->data >= map->addr && rec->data < map->addr + map->size) {
+            rec->data = NULL;
+        }
+    }
+    mobi_free(m);
+}
@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_LOADER_H
+#define MOBI_LOADER_H
+
+#include <stdio.h>
+
+#include <mobi.h>
+
+/*
+ * Read-only mapping of the book file. Record payloads of the books loaded
+ * with mb_load_mapped() point directly into it.
+ */
+typedef struct mb_MAPPING {
+    unsigned char *addr;
+    size_t size;
+    int fd;
+} mb_MAPPING;
+
+/* Halves of hybrid KF7/KF8 book to keep, see mb_select_format() */
+typedef enum { MB_FORMAT_BOTH, MB_FORMAT_KF7, MB_FORMAT_KF8 } mb_FORMAT;
+
+/* Open memory buffer as FILE, uses temporary file when fmemopen is not available */
+FILE *mb_fmemopen(void *buf, size_t size);
+
+MOBI_RET mb_mapping_open(mb_MAPPING *map, const char *path);
+void mb_mapping_close(mb_MAPPING *map);
+
+/*
+ * Load the book from the mapping. The PDB header and the record table are
+ * parsed here, record 0 (and KF8 record 0 for hybrids) is parsed by libmobi,
+ * and record payloads are not copied. For MB_FORMAT_KF7 the KF8 record 0 is
+ * not parsed at all.
+ *
+ * With headers_only, the payloads of all records except record 0, KF8
+ * boundary and KF8 record 0 are set to NULL, and the rest are copied, so the
+ * result does not depend on the mapping anymore.
+ */
+MOBI_RET mb_load_mapped(MOBIData **out, const mb_MAPPING *map, mb_FORMAT format, bool headers_only);
+
+/*
+ * Keep only one half of the hybrid book loaded in both formats, the headers
+ * of the other half are freed, and for MB_FORMAT_KF7 the records from the
+ * boundary on and the boundary EXTH entry are dropped, so the book is not
+ * hybrid anymore. The KF7 half
+ * must be primary for MB_FORMAT_KF7 (use_kf8 unset before loading), and the
+ * KF8 one for MB_FORMAT_KF8. Payloads inside the map (may be NULL) are not
+ * freed. Returns MOBI_FILE_UNSUPPORTED when the book is not hybrid and has
+ * no such format.
+ */
+MOBI_RET mb_select_format(MOBIData *m, mb_FORMAT format, const mb_MAPPING *map);
+
+/*
+ * Hash of the sizes and contents of up to count records, eight bytes at a
+ * time. It is not cryptographic, equal hashes only pick the candidates.
+ */
+uint64_t mb_records_hash(const MOBIPdbRecord *rec, size_t count);
+
+/* Write all the data to fd, returns errno of the failed write or zero */
+int mb_write_all(int fd, const unsigned char *data, size_t size);
+
+/*
+ * Copy the payload, which lies in the mapped file, from its descriptor. The
+ * pages do not have to be faulted in and copied through the user space.
+ * Returns number of bytes copied, which is less than size when the kernel
+ * cannot copy between these files, and the rest has to be written.
+ */
+size_t mb_copy_mapped(int out, const mb_MAPPING *map, const unsigned char *data, size_t size, int *err);
+
+/* Hint the kernel that text records are going to be read sequentially */
+void mb_mapping_advise_text(const mb_MAPPING *map, const MOBIData *m);
+
+/* Free MOBIData loaded by mb_load_mapped(), the mapping itself is left intact */
+void mb_free_mapped(MOBIData *m, const mb_MAPPING *map);
+
+#endif
@@ -0,0 +1,262 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mobi_decode.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MB_PALMDOC_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define MB_PALMDOC_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Byte by byte decoder, used when no vector unit is available, and to check the others */
+static MOBI_RET mb_palmdoc_decode_generic(unsigned char *out, size_t *out_len, const unsigned char *in,
+                                          size_t in_len)
+{
+    size_t cap = *out_len, o = 0, i = 0;
+
+    while (i < in_len) {
+        unsigned char c = in[i++];
+
+        if (c >= 0x01 && c <= 0x08) {
+            /* literal run */
+            if (i + c > in_len || o + c > cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            memcpy(out + o, in + i, c);
+            o += c;
+            i += c;
+        } else if (c <= 0x7f) {
+            if (o >= cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            out[o++] = c;
+        } else if (c <= 0xbf) {
+            /* back reference, 11 bits of distance and 3 bits of length */
+            size_t dist, len;
+            if (i >= in_len) {
+                return MOBI_DATA_CORRUPT;
+            }
+            dist = (((size_t)c << 8 | in[i++]) >> 3) & 0x7ff;
+            len = (in[i - 1] & 0x07) + 3;
+            if (dist == 0 || dist > o || o + len > cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            /* the source may overlap the destination */
+            while (len--) {
+                out[o] = out[o - dist];
+                o++;
+            }
+        } else {
+            /* space and character */
+            if (o + 2 > cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            out[o++] = ' ';
+            out[o++] = c ^ 0x80;
+        }
+    }
+    *out_len = o;
+    return MOBI_SUCCESS;
+}
+
+static int mb_palmdoc_always(void)
+{
+    return 1;
+}
+
+#if defined(MB_PALMDOC_X86) || defined(MB_PALMDOC_NEON)
+
+/*
+ * Shuffle masks repeating the first dist bytes over 16 bytes, so that
+ * back references overlapping their destination take single shuffle.
+ */
+static const unsigned char mb_palmdoc_patterns[16][16] = {
+    {0},
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
+    {0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0},
+    {0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3},
+    {0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0},
+    {0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3},
+    {0, 1, 2, 3, 4, 5, 6, 0, 1, 2, 3, 4, 5, 6, 0, 1},
+    {0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 0, 1, 2, 3, 4, 5, 6},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1, 2, 3, 4, 5},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0, 1, 2, 3, 4},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0, 1, 2, 3},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 0, 1, 2},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 0, 1},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 0}};
+
+#endif
+
+#ifdef MB_PALMDOC_X86
+
+#define MB_TARGET_SSE2 __attribute__((target("sse2")))
+#define MB_TARGET_AVX2 __attribute__((target("avx2")))
+
+static int mb_palmdoc_have_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int mb_palmdoc_have_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * Plain literals are 0x00 and 0x09..0x7f. As signed bytes everything else is
+ * either negative, or in 1..8.
+ */
+static inline MB_TARGET_SSE2 __m128i mb_palmdoc_special_sse2(__m128i v)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i run = _mm_and_si128(_mm_cmpgt_epi8(v, zero), _mm_cmplt_epi8(v, _mm_set1_epi8(9)));
+    return _mm_or_si128(_mm_cmplt_epi8(v, zero), run);
+}
+
+static inline MB_TARGET_SSE2 size_t mb_palmdoc_literals_sse2(unsigned char *d, const unsigned char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = (unsigned)_mm_movemask_epi8(mb_palmdoc_special_sse2(v));
+
+    _mm_storeu_si128((__m128i *)d, v);
+    return mask ? (size_t)__builtin_ctz(mask) : 16;
+}
+
+static inline MB_TARGET_SSE2 void mb_palmdoc_backref_sse2(unsigned char *d, size_t dist, size_t len)
+{
+    if (dist >= 16) {
+        _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)(d - dist)));
+    } else if (dist >= 8) {
+        /* the second half reads what the first one has just written */
+        memcpy(d, d - dist, 8);
+        memcpy(d + 8, d + 8 - dist, 8);
+    } else {
+        while (len--) {
+            *d = *(d - dist);
+            d++;
+        }
+    }
+}
+
+#define MB_PALMDOC_FUNC mb_palmdoc_decode_sse2
+#define MB_PALMDOC_ATTR MB_TARGET_SSE2
+#define MB_PALMDOC_WIDTH 16
+#define MB_PALMDOC_LITERALS mb_palmdoc_literals_sse2
+#define MB_PALMDOC_BACKREF mb_palmdoc_backref_sse2
+#include "mobi_palmdoc_impl.h"
+
+static inline MB_TARGET_AVX2 size_t mb_palmdoc_literals_avx2(unsigned char *d, const unsigned char *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i run = _mm256_and_si256(_mm256_cmpgt_epi8(v, zero), _mm256_cmpgt_epi8(_mm256_set1_epi8(9), v));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(zero, v), run));
+
+    _mm256_storeu_si256((__m256i *)d, v);
+    return mask ? (size_t)__builtin_ctz(mask) : 32;
+}
+
+static inline MB_TARGET_AVX2 void mb_palmdoc_backref_avx2(unsigned char *d, size_t dist, size_t len)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)(d - dist));
+
+    (void)len;
+    if (dist < 16) {
+        v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i *)mb_palmdoc_patterns[dist]));
+    }
+    _mm_storeu_si128((__m128i *)d, v);
+}
+
+#define MB_PALMDOC_FUNC mb_palmdoc_decode_avx2
+#define MB_PALMDOC_ATTR MB_TARGET_AVX2
+#define MB_PALMDOC_WIDTH 32
+#define MB_PALMDOC_LITERALS mb_palmdoc_literals_avx2
+#define MB_PALMDOC_BACKREF mb_palmdoc_backref_avx2
+#include "mobi_palmdoc_impl.h"
+
+#endif
+
+#ifdef MB_PALMDOC_NEON
+
+static inline size_t mb_palmdoc_literals_neon(unsigned char *d, const unsigned char *p)
+{
+    uint8x16_t v = vld1q_u8(p);
+    uint8x16_t run = vcltq_u8(vsubq_u8(v, vdupq_n_u8(1)), vdupq_n_u8(8));
+    uint8x16_t special = vorrq_u8(vcgeq_u8(v, vdupq_n_u8(0x80)), run);
+    /* four bits per byte, there is no movemask */
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)), 0);
+
+    vst1q_u8(d, v);
+    return mask ? (size_t)(__builtin_ctzll(mask) >> 2) : 16;
+}
+
+static inline void mb_palmdoc_backref_neon(unsigned char *d, size_t dist, size_t len)
+{
+    uint8x16_t v = vld1q_u8(d - dist);
+
+    (void)len;
+    if (dist < 16) {
+        v = vqtbl1q_u8(v, vld1q_u8(mb_palmdoc_patterns[dist]));
+    }
+    vst1q_u8(d, v);
+}
+
+#define MB_PALMDOC_FUNC mb_palmdoc_decode_neon
+#define MB_PALMDOC_ATTR
+#define MB_PALMDOC_WIDTH 16
+#define MB_PALMDOC_LITERALS mb_palmdoc_literals_neon
+#define MB_PALMDOC_BACKREF mb_palmdoc_backref_neon
+#include "mobi_palmdoc_impl.h"
+
+#endif
+
+const mb_PALMDOC_IMPL mb_palmdoc_impls[] = {
+    {"generic", mb_palmdoc_decode_generic, mb_palmdoc_always},
+#ifdef MB_PALMDOC_X86
+    {"sse2", mb_palmdoc_decode_sse2, mb_palmdoc_have_sse2},
+    {"avx2", mb_palmdoc_decode_avx2, mb_palmdoc_have_avx2},
+#endif
+#ifdef MB_PALMDOC_NEON
+    {"neon", mb_palmdoc_decode_neon, mb_palmdoc_always},
+#endif
+    {NULL, NULL, NULL}};
+
+static const mb_PALMDOC_IMPL *mb_palmdoc_impl = &mb_palmdoc_impls[0];
+
+int mb_palmdoc_select(const char *name)
+{
+    const mb_PALMDOC_IMPL *impl, *found = NULL;
+
+    for (impl = mb_palmdoc_impls; impl->name; impl++) {
+        if ((name == NULL || strcmp(name, impl->name) == 0) && impl->supported()) {
+            found = impl;
+        }
+    }
+    if (found == NULL) {
+        return 0;
+    }
+    mb_palmdoc_impl = found;
+    return 1;
+}
+
+const mb_PALMDOC_IMPL *mb_palmdoc_selected(void)
+{
+    return mb_palmdoc_impl;
+}
+
+MOBI_RET mb_palmdoc_decode(unsigned char *out, size_t *out_len, const unsigned char *in, size_t in_len)
+{
+    return mb_palmdoc_impl->decode(out, out_len, in, in_len);
+}
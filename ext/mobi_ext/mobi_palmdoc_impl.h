@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Vectorized PalmDOC decoder loop, included by mobi_palmdoc.c once per
+ * instruction set. The includer defines:
+ *
+ *   MB_PALMDOC_FUNC             name of the function
+ *   MB_PALMDOC_ATTR             function attributes (target)
+ *   MB_PALMDOC_WIDTH            bytes examined by MB_PALMDOC_LITERALS
+ *   MB_PALMDOC_LITERALS(d, p)   copy MB_PALMDOC_WIDTH bytes from p to d, and
+ *                               return the number of leading plain literals
+ *   MB_PALMDOC_BACKREF(d, dist, len)
+ *                               copy back reference to d, may write up to
+ *                               16 bytes
+ *
+ * The fast paths may write past the end of the decoded data, so they are
+ * taken only when there is enough room left in the output, and the tail is
+ * decoded byte by byte.
+ */
+
+#if !defined(MB_PALMDOC_FUNC) || !defined(MB_PALMDOC_WIDTH)
+#error "mobi_palmdoc_impl.h must be included from mobi_palmdoc.c"
+#endif
+
+static MB_PALMDOC_ATTR MOBI_RET MB_PALMDOC_FUNC(unsigned char *out, size_t *out_len, const unsigned char *in,
+                                                size_t in_len)
+{
+    size_t cap = *out_len, o = 0, i = 0;
+
+    while (i < in_len) {
+        unsigned char c;
+
+        /* runs of bytes, which stand for themselves, are copied at once */
+        if (i + MB_PALMDOC_WIDTH <= in_len && o + MB_PALMDOC_WIDTH <= cap) {
+            size_t n = MB_PALMDOC_LITERALS(out + o, in + i);
+            if (n > 0) {
+                o += n;
+                i += n;
+                continue;
+            }
+        }
+        c = in[i++];
+        if (c >= 0x01 && c <= 0x08) {
+            if (i + c > in_len || o + c > cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            if (i + 8 <= in_len && o + 8 <= cap) {
+                memcpy(out + o, in + i, 8);
+            } else {
+                memcpy(out + o, in + i, c);
+            }
+            o += c;
+            i += c;
+        } else if (c <= 0x7f) {
+            if (o >= cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            out[o++] = c;
+        } else if (c <= 0xbf) {
+            size_t dist, len;
+            if (i >= in_len) {
+                return MOBI_DATA_CORRUPT;
+            }
+            dist = (((size_t)c << 8 | in[i++]) >> 3) & 0x7ff;
+            len = (in[i - 1] & 0x07) + 3;
+            if (dist == 0 || dist > o || o + len > cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            if (o + 16 <= cap) {
+                MB_PALMDOC_BACKREF(out + o, dist, len);
+                o += len;
+            } else {
+                while (len--) {
+                    out[o] = out[o - dist];
+                    o++;
+                }
+            }
+        } else {
+            if (o + 2 > cap) {
+                return MOBI_DATA_CORRUPT;
+            }
+            out[o++] = ' ';
+            out[o++] = c ^ 0x80;
+        }
+    }
+    *out_len = o;
+    return MOBI_SUCCESS;
+}
+
+#undef MB_PALMDOC_FUNC
+#undef MB_PALMDOC_ATTR
+#undef MB_PALMDOC_WIDTH
+#undef MB_PALMDOC_LITERALS
+#undef MB_PALMDOC_BACKREF
@@ -0,0 +1,275 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_resource.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define MEDIA_HEADER_LEN 12
+
+static uint32_t mb_get32(const unsigned char *ptr)
+{
+    return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 | (uint32_t)ptr[2] << 8 | (uint32_t)ptr[3];
+}
+
+/* Same rules as mobi_determine_resource_type(), which libmobi does not export */
+static MOBIFiletype mb_resource_type(const MOBIPdbRecord *rec)
+{
+    const unsigned char *p = rec->data;
+    size_t size = rec->size;
+
+    if (p == NULL || size < 4) {
+        return T_UNKNOWN;
+    }
+    if (memcmp(p, "\xff\xd8\xff", 3) == 0) {
+        return T_JPG;
+    }
+    if (memcmp(p, "GIF8", 4) == 0) {
+        return T_GIF;
+    }
+    if (size >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return T_PNG;
+    }
+    if (memcmp(p, "FONT", 4) == 0) {
+        return T_FONT;
+    }
+    if (size >= 8 && memcmp(p, "BOUNDARY", 8) == 0) {
+        return T_BREAK;
+    }
+    if (memcmp(p, "\xe9\x8e\r\n", 4) == 0) {
+        return T_BREAK;
+    }
+    if (size >= MEDIA_HEADER_LEN && memcmp(p, "AUDI", 4) == 0) {
+        return T_MP3;
+    }
+    if (size >= MEDIA_HEADER_LEN && memcmp(p, "VIDE", 4) == 0) {
+        return T_MPG;
+    }
+    if (size >= 6 && p[0] == 'B' && p[1] == 'M') {
+        /* the size in the header is little endian */
+        uint32_t bmp_size = (uint32_t)p[2] | (uint32_t)p[3] << 8 | (uint32_t)p[4] << 16 | (uint32_t)p[5] << 24;
+        if (bmp_size == size) {
+            return T_BMP;
+        }
+    }
+    return T_UNKNOWN;
+}
+
+/* Size of the media payload, which follows the header at the offset stored in it */
+static size_t mb_resource_media_size(const MOBIPdbRecord *rec)
+{
+    uint32_t offset = mb_get32(rec->data + 4);
+    return offset <= rec->size ? rec->size - offset : 0;
+}
+
+void mb_resource_iter_init(mb_RESOURCE_ITER *iter, const MOBIData *m)
+{
+    size_t first = mobi_get_first_resource_record(m);
+
+    iter->uid = 0;
+    iter->rec = first == MOBI_NOTSET ? NULL : mobi_get_record_by_seqnumber(m, first);
+}
+
+static void mb_resource_fill(mb_RESOURCE *res, const MOBIPdbRecord *rec, size_t uid, MOBIFiletype type)
+{
+    res->uid = uid;
+    res->type = type;
+    res->rec = rec;
+    if (type == T_FONT) {
+        res->size = rec->size >= 8 ? mb_get32(rec->data + 4) : 0;
+    } else if (type == T_MP3 || type == T_MPG) {
+        res->size = mb_resource_media_size(rec);
+    } else {
+        res->size = rec->size;
+    }
+}
+
+int mb_resource_next(mb_RESOURCE_ITER *iter, mb_RESOURCE *res)
+{
+    while (iter->rec) {
+        const MOBIPdbRecord *rec = iter->rec;
+        MOBIFiletype type = mb_resource_type(rec);
+        size_t uid = iter->uid;
+
+        if (type == T_BREAK) {
+            iter->rec = NULL;
+            break;
+        }
+        iter->rec = rec->next;
+        iter->uid++;
+        if (type == T_UNKNOWN) {
+            /* FLIS, FCIS, RESC and friends still take their uid */
+            continue;
+        }
+        mb_resource_fill(res, rec, uid, type);
+        return 1;
+    }
+    return 0;
+}
+
+int mb_resource_find(const MOBIData *m, size_t uid, mb_RESOURCE *res)
+{
+    size_t first = mobi_get_first_resource_record(m);
+    const MOBIPdbRecord *rec;
+    MOBIFiletype type;
+
+    /* every record after the first resource takes uid, so it is a direct lookup */
+    if (first == MOBI_NOTSET || uid > SIZE_MAX - first) {
+        return 0;
+    }
+    rec = mobi_get_record_by_seqnumber(m, first + uid);
+    if (rec == NULL) {
+        return 0;
+    }
+    type = mb_resource_type(rec);
+    if (type == T_UNKNOWN || type == T_BREAK) {
+        return 0;
+    }
+    mb_resource_fill(res, rec, uid, type);
+    return 1;
+}
+
+MOBI_RET mb_resource_payload(mb_RESOURCE *res, const unsigned char **data, size_t *size, unsigned char **owned)
+{
+    MOBIPart part;
+    unsigned char *decoded = NULL;
+    size_t decoded_size = 0;
+    MOBI_RET rc;
+
+    *owned = NULL;
+    if (res->type != T_FONT && res->type != T_OTF && res->type != T_TTF && res->type != T_MP3 &&
+        res->type != T_MPG) {
+        *data = res->rec->data;
+        *size = res->rec->size;
+        return MOBI_SUCCESS;
+    }
+    memset(&part, 0, sizeof(part));
+    part.uid = res->uid;
+    part.type = res->type;
+    part.size = res->rec->size;
+    part.data = res->rec->data;
+    if (res->type == T_MP3) {
+        rc = mobi_decode_audio_resource(&decoded, &decoded_size, &part);
+    } else if (res->type == T_MPG) {
+        rc = mobi_decode_video_resource(&decoded, &decoded_size, &part);
+    } else {
+        /* fonts may be compressed and obfuscated, so the result is a new buffer */
+        rc = mobi_decode_font_resource(&decoded, &decoded_size, &part);
+        if (rc == MOBI_SUCCESS) {
+            *owned = decoded;
+            res->type = decoded_size >= 4 && memcmp(decoded, "OTTO", 4) == 0 ? T_OTF : T_TTF;
+        }
+    }
+    if (rc != MOBI_SUCCESS) {
+        return rc;
+    }
+    *data = decoded;
+    *size = decoded_size;
+    res->size = decoded_size;
+    return MOBI_SUCCESS;
+}
+
+void mb_resource_file_name(char *buf, size_t size, size_t uid, MOBIFiletype type)
+{
+    MOBIFileMeta meta = mobi_get_filemeta_by_type(type);
+    snprintf(buf, size, "resource%05zu.%s", uid, meta.extension[0] ? meta.extension : "bin");
+}
+
+static int mb_resource_write(mb_RESOURCE_EXPORT *ex, const char *path, const unsigned char *data, size_t size,
+                             int raw)
+{
+    int fd, err = 0;
+    size_t done = 0;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return errno;
+    }
+    if (raw) {
+        done = mb_copy_mapped(fd, ex->map, data, size, &err);
+    }
+    if (err == 0) {
+        err = mb_write_all(fd, data + done, size - done);
+    }
+    if (close(fd) != 0 && err == 0) {
+        err = errno;
+    }
+    return err;
+}
+
+static MOBI_RET mb_resource_export_one(mb_RESOURCE_EXPORT *ex, mb_RESOURCE *res)
+{
+    char path[PATH_MAX], name[32];
+    const unsigned char *data;
+    unsigned char *owned;
+    size_t size;
+    mb_RESOURCE_FILE *files;
+    MOBI_RET rc;
+    int len;
+
+    rc = mb_resource_payload(res, &data, &size, &owned);
+    if (rc != MOBI_SUCCESS) {
+        return rc;
+    }
+    mb_resource_file_name(name, sizeof(name), res->uid, res->type);
+    len = snprintf(path, sizeof(path), "%s/%s", ex->dir, name);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        ex->err = ENAMETOOLONG;
+    } else {
+        ex->err = mb_resource_write(ex, path, data, size, owned == NULL);
+    }
+    free(owned);
+    if (ex->err != 0) {
+        ex->err_uid = res->uid;
+        ex->err_type = res->type;
+        return MOBI_WRITE_FAILED;
+    }
+    if (ex->count == ex->cap) {
+        size_t cap = ex->cap ? ex->cap * 2 : 64;
+        files = realloc(ex->files, cap * sizeof(*files));
+        if (files == NULL) {
+            return MOBI_MALLOC_FAILED;
+        }
+        ex->files = files;
+        ex->cap = cap;
+    }
+    ex->files[ex->count].uid = res->uid;
+    ex->files[ex->count].type = res->type;
+    ex->count++;
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_resource_export(mb_RESOURCE_EXPORT *ex)
+{
+    mb_RESOURCE res;
+    MOBI_RET rc;
+
+    if (!ex->started) {
+        mb_resource_iter_init(&ex->iter, ex->m);
+        ex->started = 1;
+    }
+    while (!ex->cancel && mb_resource_next(&ex->iter, &res)) {
+        rc = mb_resource_export_one(ex, &res);
+        if (rc != MOBI_SUCCESS) {
+            return rc;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+void mb_resource_export_free(mb_RESOURCE_EXPORT *ex)
+{
+    free(ex->files);
+    ex->files = NULL;
+    ex->count = ex->cap = 0;
+}
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_RESOURCE_H
+#define MOBI_RESOURCE_H
+
+#include <stddef.h>
+
+#include <mobi.h>
+
+#include "mobi_loader.h"
+
+/*
+ * Resource records (images, fonts and media) read straight from the PDB
+ * records, without reconstructing the markup. The uid is the position after
+ * the first resource record, the same as in MOBIRawml resources and in
+ * the recindex of the markup.
+ */
+
+typedef struct mb_RESOURCE {
+    size_t uid;
+    /* T_FONT until the font is decoded, then T_OTF or T_TTF */
+    MOBIFiletype type;
+    /* size of the payload, fonts report the size declared in their header */
+    size_t size;
+    const MOBIPdbRecord *rec;
+} mb_RESOURCE;
+
+typedef struct mb_RESOURCE_ITER {
+    const MOBIPdbRecord *rec;
+    size_t uid;
+} mb_RESOURCE_ITER;
+
+void mb_resource_iter_init(mb_RESOURCE_ITER *iter, const MOBIData *m);
+
+/* Fill the next resource, returns zero when there are no more of them */
+int mb_resource_next(mb_RESOURCE_ITER *iter, mb_RESOURCE *res);
+
+/* Find the resource by uid reading only its record, returns zero when there is no such resource */
+int mb_resource_find(const MOBIData *m, size_t uid, mb_RESOURCE *res);
+
+/*
+ * Locate the payload of the resource. Images, audio and video point into the
+ * record, fonts are decoded into *owned, which must be freed by the caller.
+ */
+MOBI_RET mb_resource_payload(mb_RESOURCE *res, const unsigned char **data, size_t *size, unsigned char **owned);
+
+typedef struct mb_RESOURCE_FILE {
+    size_t uid;
+    MOBIFiletype type;
+} mb_RESOURCE_FILE;
+
+/*
+ * Export state, mb_resource_export() can be stopped by setting cancel, and
+ * resumed by calling it again.
+ */
+typedef struct mb_RESOURCE_EXPORT {
+    const MOBIData *m;
+    /* when set, raw payloads are copied from map->fd inside the kernel */
+    const mb_MAPPING *map;
+    const char *dir;
+    mb_RESOURCE_ITER iter;
+    int started;
+    /* files written so far */
+    mb_RESOURCE_FILE *files;
+    size_t count;
+    size_t cap;
+    /* errno, uid and type of the resource, which could not be written */
+    int err;
+    size_t err_uid;
+    MOBIFiletype err_type;
+    volatile int cancel;
+} mb_RESOURCE_EXPORT;
+
+/* Name of the exported file, relative to the directory */
+void mb_resource_file_name(char *buf, size_t size, size_t uid, MOBIFiletype type);
+
+/*
+ * Write all resources into dir as resourceNNNNN.ext. Returns MOBI_WRITE_FAILED
+ * with errno in err when a file cannot be written.
+ */
+MOBI_RET mb_resource_export(mb_RESOURCE_EXPORT *ex);
+void mb_resource_export_free(mb_RESOURCE_EXPORT *ex);
+
+#endif
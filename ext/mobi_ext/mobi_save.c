@@ -0,0 +1,437 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_config.h"
+#include "mobi_save.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define PDB_RECORD_INFO_LEN 8
+#define PDB_REC_COUNT_OFFSET 76
+
+static uint32_t mb_get32(const unsigned char *ptr)
+{
+    return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 | (uint32_t)ptr[2] << 8 | (uint32_t)ptr[3];
+}
+
+static uint16_t mb_get16(const unsigned char *ptr)
+{
+    return (uint16_t)(ptr[0] << 8 | ptr[1]);
+}
+
+static void mb_put32(unsigned char *ptr, uint32_t val)
+{
+    ptr[0] = (unsigned char)(val >> 24);
+    ptr[1] = (unsigned char)(val >> 16);
+    ptr[2] = (unsigned char)(val >> 8);
+    ptr[3] = (unsigned char)val;
+}
+
+static const MOBIPdbRecord *mb_save_record_at(const MOBIData *m, size_t seqnumber)
+{
+    const MOBIPdbRecord *rec = m->rec;
+
+    while (rec && seqnumber > 0) {
+        rec = rec->next;
+        seqnumber--;
+    }
+    return rec;
+}
+
+static const mb_SAVE_RECORD *mb_save_replaced(const mb_SAVE *save, size_t seqnumber)
+{
+    size_t i;
+
+    for (i = 0; i < save->count; i++) {
+        if (save->records[i].seqnumber == seqnumber) {
+            return &save->records[i];
+        }
+    }
+    return NULL;
+}
+
+/* Take record 0 from the single-record PDB written by libmobi */
+static MOBI_RET mb_save_read_record0(mb_SAVE *save, FILE *file, size_t seqnumber)
+{
+    mb_SAVE_RECORD *out = &save->records[save->count];
+    unsigned char *buf;
+    uint32_t offset;
+    long size;
+
+    if (fflush(file) != 0 || fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0) {
+        return MOBI_WRITE_FAILED;
+    }
+    if ((size_t)size < MB_SAVE_PDB_HEADER_LEN + PDB_RECORD_INFO_LEN) {
+        return MOBI_DATA_CORRUPT;
+    }
+    buf = malloc((size_t)size);
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    rewind(file);
+    if (fread(buf, (size_t)size, 1, file) != 1) {
+        free(buf);
+        return MOBI_WRITE_FAILED;
+    }
+    offset = mb_get32(buf + MB_SAVE_PDB_HEADER_LEN);
+    if (mb_get16(buf + PDB_REC_COUNT_OFFSET) != 1 || offset > (size_t)size) {
+        free(buf);
+        return MOBI_DATA_CORRUPT;
+    }
+    if (save->count == 0) {
+        memcpy(save->header, buf, MB_SAVE_PDB_HEADER_LEN);
+    }
+    out->seqnumber = seqnumber;
+    out->size = (size_t)size - offset;
+    memmove(buf, buf + offset, out->size);
+    out->data = buf;
+    save->count++;
+    return MOBI_SUCCESS;
+}
+
+/*
+ * libmobi does not expose record 0 serializer either (see mb_load_record0()),
+ * so save single-record PDB with the headers, and take record 0 from it. The
+ * headers are borrowed, the PDB header and the record are copies.
+ */
+static MOBI_RET mb_save_record0(mb_SAVE *save, const MOBIData *m, const MOBIData *headers, size_t seqnumber)
+{
+    const MOBIPdbRecord *rec = mb_save_record_at(m, seqnumber);
+    MOBIData *tmp;
+    FILE *file;
+    MOBI_RET rc;
+
+    if (rec == NULL || rec->data == NULL) {
+        return MOBI_DATA_CORRUPT;
+    }
+    tmp = mobi_init();
+    if (tmp == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    tmp->ph = malloc(sizeof(MOBIPdbHeader));
+    tmp->rec = calloc(1, sizeof(MOBIPdbRecord));
+    if (tmp->ph == NULL || tmp->rec == NULL || (tmp->rec->data = malloc(rec->size ? rec->size : 1)) == NULL) {
+        mobi_free(tmp);
+        return MOBI_MALLOC_FAILED;
+    }
+    *tmp->ph = *m->ph;
+    tmp->ph->rec_count = 1;
+    tmp->rec->size = rec->size;
+    tmp->rec->attributes = rec->attributes;
+    tmp->rec->uid = rec->uid;
+    memcpy(tmp->rec->data, rec->data, rec->size);
+    tmp->rh = headers->rh;
+    tmp->mh = headers->mh;
+    tmp->eh = headers->eh;
+    tmp->use_kf8 = false;
+
+    file = tmpfile();
+    if (file == NULL) {
+        rc = MOBI_WRITE_FAILED;
+    } else {
+        rc = mobi_save_file(tmp, file);
+    }
+    tmp->rh = NULL;
+    tmp->mh = NULL;
+    tmp->eh = NULL;
+    mobi_free(tmp);
+    if (rc == MOBI_SUCCESS) {
+        rc = mb_save_read_record0(save, file, seqnumber);
+    }
+    if (file) {
+        fclose(file);
+    }
+    return rc;
+}
+
+MOBI_RET mb_save_prepare(mb_SAVE *save, MOBIData *m, const mb_MAPPING *map)
+{
+    const MOBIData *kf7 = m, *kf8 = NULL;
+    MOBI_RET rc;
+
+    memset(save, 0, sizeof(mb_SAVE));
+    save->m = m;
+    save->map = map;
+    if (m->ph == NULL || m->rec == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    if (mobi_is_hybrid(m)) {
+        if (m->next == NULL) {
+            return MOBI_FILE_UNSUPPORTED;
+        }
+        kf7 = m->use_kf8 ? m->next : m;
+        kf8 = m->use_kf8 ? m : m->next;
+    }
+    rc = mb_save_record0(save, m, kf7, 0);
+    if (rc == MOBI_SUCCESS && kf8) {
+        rc = mb_save_record0(save, m, kf8, m->kf8_boundary_offset + 1);
+    }
+    if (rc != MOBI_SUCCESS) {
+        mb_save_free(save);
+    }
+    return rc;
+}
+
+void mb_save_free(mb_SAVE *save)
+{
+    size_t i;
+
+    for (i = 0; i < save->count; i++) {
+        free(save->records[i].data);
+        save->records[i].data = NULL;
+    }
+    save->count = 0;
+}
+
+/*
+ * Records not replaced in one go: contiguous runs inside the mapping are
+ * copied by the kernel, the rest is written from memory.
+ */
+static int mb_save_write_records(const mb_SAVE *save, int fd)
+{
+    const mb_MAPPING *map = save->map;
+    const MOBIPdbRecord *rec, *last;
+    const mb_SAVE_RECORD *replaced;
+    size_t seqnumber = 0, size, done;
+    int err = 0;
+
+    for (rec = save->m->rec; rec != NULL && err == 0; rec = last->next, seqnumber++) {
+        last = rec;
+        replaced = mb_save_replaced(save, seqnumber);
+        if (replaced) {
+            err = mb_write_all(fd, replaced->data, replaced->size);
+            continue;
+        }
+        size = rec->size;
+        if (size == 0) {
+            continue;
+        }
+        if (map && rec->data >= map->addr && rec->data < map->addr + map->size) {
+            while (last->next && !mb_save_replaced(save, seqnumber + 1) && last->next->data == rec->data + size) {
+                last = last->next;
+                size += last->size;
+                seqnumber++;
+            }
+        }
+        done = mb_copy_mapped(fd, map, rec->data, size, &err);
+        if (err == 0) {
+            err = mb_write_all(fd, rec->data + done, size - done);
+        }
+    }
+    return err;
+}
+
+/* Created with open() rather than mkstemp(), so that the umask applies to the book */
+static int mb_save_open_temp(const char *path, char **out)
+{
+    static unsigned counter;
+    size_t size = strlen(path) + 32;
+    char *tmp = malloc(size);
+    int fd = -1, attempt;
+
+    if (tmp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (attempt = 0; attempt < 100 && fd < 0; attempt++) {
+        snprintf(tmp, size, "%s.%ld.%u", path, (long)getpid(), counter++);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    *out = tmp;
+    return fd;
+}
+
+MOBI_RET mb_save_write(mb_SAVE *save, const char *path)
+{
+    const MOBIPdbRecord *rec;
+    const mb_SAVE_RECORD *replaced;
+    unsigned char *table, *ptr;
+    size_t count = 0, seqnumber, offset, size;
+    struct stat st;
+    char *tmp = NULL;
+    int fd, err;
+
+    for (rec = save->m->rec; rec != NULL; rec = rec->next, count++) {
+        if (rec->data == NULL && rec->size && !mb_save_replaced(save, count)) {
+            return MOBI_FILE_UNSUPPORTED;
+        }
+    }
+    if (count > UINT16_MAX) {
+        return MOBI_DATA_CORRUPT;
+    }
+    size = MB_SAVE_PDB_HEADER_LEN + count * PDB_RECORD_INFO_LEN + 2;
+    table = calloc(size, 1);
+    if (table == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    memcpy(table, save->header, MB_SAVE_PDB_HEADER_LEN);
+    table[PDB_REC_COUNT_OFFSET] = (unsigned char)(count >> 8);
+    table[PDB_REC_COUNT_OFFSET + 1] = (unsigned char)count;
+    ptr = table + MB_SAVE_PDB_HEADER_LEN;
+    offset = size;
+    for (rec = save->m->rec, seqnumber = 0; rec != NULL; rec = rec->next, seqnumber++) {
+        replaced = mb_save_replaced(save, seqnumber);
+        if (offset > UINT32_MAX) {
+            free(table);
+            return MOBI_DATA_CORRUPT;
+        }
+        mb_put32(ptr, (uint32_t)offset);
+        mb_put32(ptr + 4, rec->uid & 0x00ffffff);
+        ptr[4] = rec->attributes;
+        ptr += PDB_RECORD_INFO_LEN;
+        offset += replaced ? replaced->size : rec->size;
+    }
+
+    /* the book is replaced atomically, so that readers never see it half-written */
+    fd = mb_save_open_temp(path, &tmp);
+    if (fd < 0) {
+        save->err = errno;
+        free(table);
+        return MOBI_WRITE_FAILED;
+    }
+    err = mb_write_all(fd, table, size);
+    free(table);
+    if (err == 0) {
+        err = mb_save_write_records(save, fd);
+    }
+    /* keep the permissions of the book being replaced */
+    if (err == 0 && stat(path, &st) == 0 && fchmod(fd, st.st_mode & 07777) != 0) {
+        err = errno;
+    }
+    if (close(fd) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err == 0 && rename(tmp, path) != 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        unlink(tmp);
+        save->err = err;
+    }
+    free(tmp);
+    return err ? MOBI_WRITE_FAILED : MOBI_SUCCESS;
+}
+
+static int mb_pwrite_all(int fd, const unsigned char *data, size_t size, off_t offset)
+{
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Check the record table of the file against the book, and find where the
+ * replaced records are. Returns zero when they do not fit, or are mapped.
+ */
+static int mb_save_fits(const mb_SAVE *save, int fd, size_t file_size, uint32_t *offsets, size_t *sizes)
+{
+    unsigned char header[MB_SAVE_PDB_HEADER_LEN], *table;
+    const MOBIPdbRecord *rec;
+    const mb_SAVE_RECORD *replaced;
+    size_t count, i, start, end;
+    int fits = 1;
+
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        return 0;
+    }
+    count = mb_get16(header + PDB_REC_COUNT_OFFSET);
+    table = malloc(count * PDB_RECORD_INFO_LEN + 1);
+    if (table == NULL) {
+        return 0;
+    }
+    if (pread(fd, table, count * PDB_RECORD_INFO_LEN, MB_SAVE_PDB_HEADER_LEN) !=
+        (ssize_t)(count * PDB_RECORD_INFO_LEN)) {
+        free(table);
+        return 0;
+    }
+    for (rec = save->m->rec, i = 0; fits && rec != NULL && i < count; rec = rec->next, i++) {
+        start = mb_get32(table + i * PDB_RECORD_INFO_LEN);
+        end = i + 1 < count ? mb_get32(table + (i + 1) * PDB_RECORD_INFO_LEN) : file_size;
+        if (start > end || end > file_size) {
+            fits = 0;
+            break;
+        }
+        replaced = mb_save_replaced(save, i);
+        if (replaced && save->map && rec->data >= save->map->addr && rec->data < save->map->addr + save->map->size) {
+            /* the private mapping shows the patched file, and so would the strings borrowed from it */
+            fits = 0;
+        } else if (replaced) {
+            fits = replaced->size <= end - start;
+            offsets[replaced - save->records] = (uint32_t)start;
+            sizes[replaced - save->records] = end - start;
+        } else {
+            fits = rec->size == end - start;
+        }
+    }
+    free(table);
+    return fits && rec == NULL && i == count;
+}
+
+MOBI_RET mb_save_in_place(mb_SAVE *save, const char *path, int *in_place)
+{
+    uint32_t offsets[2] = {0};
+    size_t sizes[2] = {0}, i;
+    unsigned char *padding = NULL;
+    struct stat st;
+    int fd, err = 0;
+
+    *in_place = 0;
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        save->err = errno;
+        return MOBI_WRITE_FAILED;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !mb_save_fits(save, fd, (size_t)st.st_size, offsets, sizes)) {
+        close(fd);
+        return mb_save_write(save, path);
+    }
+    for (i = 0; i < save->count && err == 0; i++) {
+        const mb_SAVE_RECORD *rec = &save->records[i];
+        err = mb_pwrite_all(fd, rec->data, rec->size, (off_t)offsets[i]);
+        if (err == 0 && sizes[i] > rec->size) {
+            padding = calloc(sizes[i] - rec->size, 1);
+            if (padding == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            err = mb_pwrite_all(fd, padding, sizes[i] - rec->size, (off_t)(offsets[i] + rec->size));
+            free(padding);
+        }
+    }
+    if (close(fd) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        save->err = err;
+        return MOBI_WRITE_FAILED;
+    }
+    *in_place = 1;
+    return MOBI_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_SAVE_H
+#define MOBI_SAVE_H
+
+#include <stddef.h>
+
+#include <mobi.h>
+
+#include "mobi_loader.h"
+
+/*
+ * Saving the book after its headers have been modified. Record 0 (and the
+ * KF8 record 0 of hybrids) is serialized by libmobi from the headers, all
+ * other records are written as they are: copied from the mapped file by
+ * copy_file_range(2) where available, or from memory.
+ */
+
+#define MB_SAVE_PDB_HEADER_LEN 78
+
+/* Record replaced by its serialized headers */
+typedef struct mb_SAVE_RECORD {
+    size_t seqnumber;
+    unsigned char *data;
+    size_t size;
+} mb_SAVE_RECORD;
+
+typedef struct mb_SAVE {
+    const MOBIData *m;
+    /* when set, the records inside it are copied from map->fd */
+    const mb_MAPPING *map;
+    /* PDB header as written by libmobi, the record count is patched */
+    unsigned char header[MB_SAVE_PDB_HEADER_LEN];
+    mb_SAVE_RECORD records[2];
+    size_t count;
+    /* errno of the failed write */
+    int err;
+} mb_SAVE;
+
+/*
+ * Serialize the headers of m, needs GVL, because libmobi updates some of
+ * the header values (offsets and lengths) while doing so. Returns
+ * MOBI_FILE_UNSUPPORTED for hybrid books with only one half loaded.
+ */
+MOBI_RET mb_save_prepare(mb_SAVE *save, MOBIData *m, const mb_MAPPING *map);
+
+/*
+ * Write the book to a temporary file next to path, and rename it to path.
+ * Returns MOBI_WRITE_FAILED with errno in err, and MOBI_FILE_UNSUPPORTED
+ * when the payloads of the records are not loaded.
+ */
+MOBI_RET mb_save_write(mb_SAVE *save, const char *path);
+
+/*
+ * Overwrite only the serialized records in the book at path, padded with
+ * zeros, when they fit into the records of the file and the other records
+ * have the same size, and the payloads of the records are not read from the
+ * mapping of the file. Otherwise the whole book is written with
+ * mb_save_write(). in_place is set when the file has been patched.
+ */
+MOBI_RET mb_save_in_place(mb_SAVE *save, const char *path, int *in_place);
+
+void mb_save_free(mb_SAVE *save);
+
+#endif
@@ -0,0 +1,415 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * MOBI.scan(paths, threads:, fields:)
+ *
+ * Loads the headers of many books on a pool of native threads. The workers
+ * never touch Ruby objects: they produce plain C strings, and the calling
+ * thread converts them to Hashes while holding GVL.
+ */
+
+#include <mobi.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+
+#include "mobi_config.h"
+#include "mobi_ext.h"
+#include "mobi_keys.h"
+#include "mobi_loader.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#define FULL_NAME_MAX 1024
+
+static char *mb_scan_full_name(const MOBIData *m)
+{
+    char *full_name = calloc(1, FULL_NAME_MAX + 1);
+
+    if (full_name && mobi_get_fullname(m, full_name, FULL_NAME_MAX) != MOBI_SUCCESS) {
+        free(full_name);
+        return NULL;
+    }
+    return full_name;
+}
+
+static const struct {
+    mb_KEY key;
+    char *(*get)(const MOBIData *m);
+} mb_scan_fields[] = {
+    {MB_KEY_full_name, mb_scan_full_name},
+    {MB_KEY_title, mobi_meta_get_title},
+    {MB_KEY_author, mobi_meta_get_author},
+    {MB_KEY_publisher, mobi_meta_get_publisher},
+    {MB_KEY_imprint, mobi_meta_get_imprint},
+    {MB_KEY_description, mobi_meta_get_description},
+    {MB_KEY_isbn, mobi_meta_get_isbn},
+    {MB_KEY_subject, mobi_meta_get_subject},
+    {MB_KEY_publishdate, mobi_meta_get_publishdate},
+    {MB_KEY_review, mobi_meta_get_review},
+    {MB_KEY_contributor, mobi_meta_get_contributor},
+    {MB_KEY_copyright, mobi_meta_get_copyright},
+    {MB_KEY_asin, mobi_meta_get_asin},
+    {MB_KEY_language, mobi_meta_get_language},
+};
+
+#define MB_SCAN_FIELDS_COUNT (sizeof(mb_scan_fields) / sizeof(mb_scan_fields[0]))
+
+#ifdef HAVE_PTHREAD_H
+
+typedef struct mb_SCAN_JOB {
+    char *path;
+    MOBI_RET rc;
+    /* the step that failed, when rc is not MOBI_SUCCESS */
+    const char *failure;
+    char *values[MB_SCAN_FIELDS_COUNT];
+} mb_SCAN_JOB;
+
+typedef struct mb_SCAN {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    mb_SCAN_JOB *jobs;
+    size_t njobs;
+    /* index of the next job to be taken by worker */
+    size_t next;
+    /* indexes of finished jobs in order of completion */
+    size_t *finished;
+    size_t nfinished;
+    /* number of finished jobs already converted to Hashes */
+    size_t nconsumed;
+    /* workers stop taking new jobs */
+    int cancel;
+    /* the waiting thread has been interrupted */
+    int wakeup;
+    unsigned char wanted[MB_SCAN_FIELDS_COUNT];
+    pthread_t *threads;
+    size_t nthreads;
+} mb_SCAN;
+
+static void mb_scan_process(const mb_SCAN *scan, mb_SCAN_JOB *job)
+{
+    MOBIData *m = NULL;
+    mb_MAPPING map;
+    size_t i;
+
+#ifdef HAVE_MMAP
+    job->rc = mb_mapping_open(&map, job->path);
+    if (job->rc != MOBI_SUCCESS) {
+        job->failure = "unable to open book";
+        return;
+    }
+    /* headers only, so the result does not depend on the mapping */
+    job->rc = mb_load_mapped(&m, &map, MB_FORMAT_BOTH, true);
+    mb_mapping_close(&map);
+#else
+    (void)map;
+    m = mobi_init();
+    if (m == NULL) {
+        job->rc = MOBI_MALLOC_FAILED;
+    } else {
+        job->rc = mobi_load_filename(m, job->path);
+        if (job->rc != MOBI_SUCCESS) {
+            mobi_free(m);
+        }
+    }
+#endif
+    if (job->rc != MOBI_SUCCESS) {
+        job->failure = "unable to load book from path";
+        return;
+    }
+    for (i = 0; i < MB_SCAN_FIELDS_COUNT; i++) {
+        if (scan->wanted[i]) {
+            job->values[i] = mb_scan_fields[i].get(m);
+        }
+    }
+    mobi_free(m);
+}
+
+static void *mb_scan_worker(void *ptr)
+{
+    mb_SCAN *scan = ptr;
+    size_t idx;
+
+    pthread_mutex_lock(&scan->mutex);
+    while (!scan->cancel && scan->next < scan->njobs) {
+        idx = scan->next++;
+        pthread_mutex_unlock(&scan->mutex);
+        mb_scan_process(scan, &scan->jobs[idx]);
+        pthread_mutex_lock(&scan->mutex);
+        scan->finished[scan->nfinished++] = idx;
+        pthread_cond_broadcast(&scan->cond);
+    }
+    pthread_mutex_unlock(&scan->mutex);
+    return NULL;
+}
+
+/* Block until some job finishes or the calling Ruby thread is interrupted */
+static void *mb_scan_wait_nogvl(void *ptr)
+{
+    mb_SCAN *scan = ptr;
+
+    pthread_mutex_lock(&scan->mutex);
+    while (!scan->wakeup && scan->nconsumed == scan->nfinished) {
+        pthread_cond_wait(&scan->cond, &scan->mutex);
+    }
+    scan->wakeup = 0;
+    pthread_mutex_unlock(&scan->mutex);
+    return NULL;
+}
+
+static void mb_scan_wait_ubf(void *ptr)
+{
+    mb_SCAN *scan = ptr;
+
+    pthread_mutex_lock(&scan->mutex);
+    scan->wakeup = 1;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->mutex);
+}
+
+static void mb_scan_start(mb_SCAN *scan, size_t nthreads)
+{
+    sigset_t all, saved;
+    size_t i;
+    int err = 0;
+
+    scan->threads = ALLOC_N(pthread_t, nthreads);
+    /* signals are handled by Ruby threads, workers inherit the blocked mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (i = 0; i < nthreads; i++) {
+        err = pthread_create(&scan->threads[i], NULL, mb_scan_worker, scan);
+        if (err != 0) {
+            break;
+        }
+        scan->nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (scan->nthreads == 0) {
+        rb_syserr_fail(err, "pthread_create");
+    }
+}
+
+static void *mb_scan_join_nogvl(void *ptr)
+{
+    mb_SCAN *scan = ptr;
+    size_t i;
+
+    pthread_mutex_lock(&scan->mutex);
+    scan->cancel = 1;
+    pthread_mutex_unlock(&scan->mutex);
+    for (i = 0; i < scan->nthreads; i++) {
+        pthread_join(scan->threads[i], NULL);
+    }
+    scan->nthreads = 0;
+    return NULL;
+}
+
+static void mb_scan_free_job(mb_SCAN_JOB *job)
+{
+    size_t i;
+
+    for (i = 0; i < MB_SCAN_FIELDS_COUNT; i++) {
+        free(job->values[i]);
+        job->values[i] = NULL;
+    }
+}
+
+static VALUE mb_scan_result(mb_SCAN *scan, size_t idx, VALUE path)
+{
+    mb_SCAN_JOB *job = &scan->jobs[idx];
+    VALUE res = rb_hash_new();
+    size_t i;
+
+    rb_hash_aset(res, MB_SYM(index), SIZET2NUM(idx));
+    rb_hash_aset(res, MB_SYM(path), path);
+    if (job->rc != MOBI_SUCCESS) {
+        VALUE msg = rb_sprintf("%s: (0x%02x) \"%s\"", job->failure, (int)job->rc, mb_libmobi_strerror(job->rc));
+        rb_hash_aset(res, MB_SYM(error), msg);
+        rb_hash_aset(res, MB_SYM(code), INT2FIX(job->rc));
+        return res;
+    }
+    for (i = 0; i < MB_SCAN_FIELDS_COUNT; i++) {
+        if (scan->wanted[i]) {
+            VALUE val = job->values[i] ? rb_str_new_cstr(job->values[i]) : Qnil;
+            rb_hash_aset(res, mb_key_syms[mb_scan_fields[i].key], val);
+        }
+    }
+    mb_scan_free_job(job);
+    return res;
+}
+
+typedef struct mb_SCAN_ARGS {
+    mb_SCAN *scan;
+    VALUE paths;
+    VALUE results;
+    size_t nthreads;
+} mb_SCAN_ARGS;
+
+static VALUE mb_scan_run(VALUE ptr)
+{
+    mb_SCAN_ARGS *args = (mb_SCAN_ARGS *)ptr;
+    mb_SCAN *scan = args->scan;
+    size_t i, nfinished;
+
+    for (i = 0; i < scan->njobs; i++) {
+        scan->jobs[i].path = ruby_strdup(RSTRING_PTR(RARRAY_AREF(args->paths, i)));
+    }
+    scan->finished = ALLOC_N(size_t, scan->njobs);
+    mb_scan_start(scan, args->nthreads);
+
+    while (scan->nconsumed < scan->njobs) {
+        rb_thread_call_without_gvl(mb_scan_wait_nogvl, scan, mb_scan_wait_ubf, scan);
+        pthread_mutex_lock(&scan->mutex);
+        nfinished = scan->nfinished;
+        pthread_mutex_unlock(&scan->mutex);
+        while (scan->nconsumed < nfinished) {
+            size_t idx = scan->finished[scan->nconsumed++];
+            VALUE res = mb_scan_result(scan, idx, RARRAY_AREF(args->paths, idx));
+            if (NIL_P(args->results)) {
+                rb_yield(res);
+            } else {
+                rb_ary_store(args->results, (long)idx, res);
+            }
+        }
+    }
+    return args->results;
+}
+
+static VALUE mb_scan_cleanup(VALUE ptr)
+{
+    mb_SCAN_ARGS *args = (mb_SCAN_ARGS *)ptr;
+    mb_SCAN *scan = args->scan;
+    size_t i;
+
+    if (scan->nthreads > 0) {
+        /* running jobs cannot be interrupted, wait for them to finish */
+        rb_thread_call_without_gvl2(mb_scan_join_nogvl, scan, NULL, NULL);
+        if (scan->nthreads > 0) {
+            /* interrupted before joining, the threads must not outlive the jobs */
+            mb_scan_join_nogvl(scan);
+        }
+    }
+    for (i = 0; i < scan->njobs; i++) {
+        mb_scan_free_job(&scan->jobs[i]);
+        xfree(scan->jobs[i].path);
+    }
+    xfree(scan->jobs);
+    xfree(scan->finished);
+    xfree(scan->threads);
+    pthread_cond_destroy(&scan->cond);
+    pthread_mutex_destroy(&scan->mutex);
+    return Qnil;
+}
+
+#endif
+
+/*
+ * MOBI.scan(paths, threads: nil, fields: nil) -> Array
+ * MOBI.scan(paths, threads: nil, fields: nil) { |result| ... } -> nil
+ *
+ * Reads metadata of the books in paths on a pool of native threads (by
+ * default one per online CPU). Only the records needed for the headers are
+ * read. Every result is a Hash with :index and :path, and either the
+ * requested fields (all of them by default) or :error and :code when the book
+ * cannot be loaded. Without a block the results are returned in the input
+ * order, with a block they are yielded as soon as they are ready.
+ */
+static VALUE mb_scan(int argc, VALUE *argv, VALUE self)
+{
+#ifdef HAVE_PTHREAD_H
+    mb_SCAN scan;
+    mb_SCAN_ARGS args;
+    VALUE paths, opts = Qnil;
+    long threads = 0;
+    size_t i;
+
+    (void)self;
+    rb_scan_args(argc, argv, "1:", &paths, &opts);
+    memset(&scan, 0, sizeof(scan));
+    memset(scan.wanted, 1, sizeof(scan.wanted));
+    if (!NIL_P(opts)) {
+        ID keys[2];
+        VALUE values[2];
+
+        keys[0] = MB_ID(threads);
+        keys[1] = MB_ID(fields);
+        rb_get_kwargs(opts, keys, 0, 2, values);
+        if (values[0] != Qundef && !NIL_P(values[0])) {
+            threads = NUM2LONG(values[0]);
+            if (threads < 1) {
+                rb_raise(rb_eArgError, "number of threads must be positive");
+            }
+        }
+        if (values[1] != Qundef && !NIL_P(values[1])) {
+            VALUE fields = rb_Array(values[1]);
+
+            memset(scan.wanted, 0, sizeof(scan.wanted));
+            for (i = 0; i < (size_t)RARRAY_LEN(fields); i++) {
+                VALUE field = RARRAY_AREF(fields, i);
+                size_t f;
+
+                Check_Type(field, T_SYMBOL);
+                for (f = 0; f < MB_SCAN_FIELDS_COUNT; f++) {
+                    if (field == mb_key_syms[mb_scan_fields[f].key]) {
+                        scan.wanted[f] = 1;
+                        break;
+                    }
+                }
+                if (f == MB_SCAN_FIELDS_COUNT) {
+                    rb_raise(rb_eArgError, "unknown field: %" PRIsVALUE, field);
+                }
+            }
+        }
+    }
+
+    /* workers read the paths without GVL, so they must not change */
+    paths = rb_Array(paths);
+    args.paths = rb_ary_new_capa(RARRAY_LEN(paths));
+    for (i = 0; i < (size_t)RARRAY_LEN(paths); i++) {
+        VALUE path = RARRAY_AREF(paths, i);
+
+        Check_Type(path, T_STRING);
+        path = rb_str_new_frozen(path);
+        StringValueCStr(path);
+        rb_ary_push(args.paths, path);
+    }
+    args.results = rb_block_given_p() ? Qnil : rb_ary_new_capa(RARRAY_LEN(args.paths));
+    if (RARRAY_LEN(args.paths) == 0) {
+        return args.results;
+    }
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1) {
+            threads = 1;
+        }
+    }
+    scan.njobs = (size_t)RARRAY_LEN(args.paths);
+    args.nthreads = (size_t)threads < scan.njobs ? (size_t)threads : scan.njobs;
+    args.scan = &scan;
+    pthread_mutex_init(&scan.mutex, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+    scan.jobs = ZALLOC_N(mb_SCAN_JOB, scan.njobs);
+    rb_ensure(mb_scan_run, (VALUE)&args, mb_scan_cleanup, (VALUE)&args);
+    RB_GC_GUARD(args.paths);
+    return args.results;
+#else
+    (void)argc;
+    (void)argv;
+    (void)self;
+    rb_raise(rb_eNotImpError, "MOBI.scan is not supported on this platform");
+#endif
+}
+
+void init_mobi_scan(void)
+{
+    rb_define_module_function(mb_mMOBI, "scan", mb_scan, -1);
+}
@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_stats.h"
+
+#include <time.h>
+
+#define MB_PHASE_NAME(NAME) #NAME,
+const char *const mb_phase_names[MB_PHASES_COUNT] = {MB_PHASES(MB_PHASE_NAME)};
+#undef MB_PHASE_NAME
+
+int mb_instrument_enabled;
+
+uint64_t mb_clock_nanos(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_STATS_H
+#define MOBI_STATS_H
+
+#include <stdint.h>
+
+#include "mobi_config.h"
+
+/*
+ * Phases of the work done for the book. They are timed with the monotonic
+ * clock only while MOBI.instrument hook is installed. When sys/sdt.h is
+ * available, the phases are also marked with USDT probes
+ * mobi:phase__start(name) and mobi:phase__done(name, bytes), which stay
+ * single no-op instructions unless traced.
+ */
+#define MB_PHASES(X)                                                                                                   \
+    /* mapping of the file */                                                                                          \
+    X(read)                                                                                                            \
+    /* loading of the records and headers */                                                                           \
+    X(parse)                                                                                                           \
+    /* decompression of the text records */                                                                            \
+    X(decompress)                                                                                                      \
+    /* parsing of the indexes and reconstruction of the parts, or lookup of their cache */                             \
+    X(index)                                                                                                           \
+    /* construction of the Ruby objects */                                                                             \
+    X(build)
+
+#define MB_PHASE_ENUM(NAME) MB_PHASE_##NAME,
+typedef enum { MB_PHASES(MB_PHASE_ENUM) MB_PHASES_COUNT } mb_PHASE;
+#undef MB_PHASE_ENUM
+
+extern const char *const mb_phase_names[MB_PHASES_COUNT];
+
+typedef struct mb_PHASE_STATS {
+    uint64_t nanos;
+    uint64_t bytes;
+    uint64_t calls;
+} mb_PHASE_STATS;
+
+/* Set while MOBI.instrument hook is installed */
+extern int mb_instrument_enabled;
+
+/* Monotonic clock in nanoseconds */
+uint64_t mb_clock_nanos(void);
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define MB_PROBE_START(phase) DTRACE_PROBE1(mobi, phase__start, mb_phase_names[phase])
+#define MB_PROBE_DONE(phase, bytes) DTRACE_PROBE2(mobi, phase__done, mb_phase_names[phase], bytes)
+#else
+#define MB_PROBE_START(phase) ((void)(phase))
+#define MB_PROBE_DONE(phase, bytes) ((void)(phase), (void)(bytes))
+#endif
+
+/* Start of the phase, returns zero when it is not timed */
+static inline uint64_t mb_phase_start(mb_PHASE phase)
+{
+    MB_PROBE_START(phase);
+    return mb_instrument_enabled ? mb_clock_nanos() : 0;
+}
+
+/* End of the phase started with mb_phase_start(), accumulates it into stats */
+static inline void mb_phase_done(mb_PHASE_STATS *stats, mb_PHASE phase, uint64_t start, uint64_t bytes)
+{
+    MB_PROBE_DONE(phase, bytes);
+    if (start) {
+        stats[phase].nanos += mb_clock_nanos() - start;
+        stats[phase].bytes += bytes;
+        stats[phase].calls++;
+    }
+}
+
+#endif
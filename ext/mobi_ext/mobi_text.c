@@ -0,0 +1,302 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mobi_text.h"
+
+enum { MB_TEXT_DATA, MB_TEXT_TAG, MB_TEXT_ENTITY, MB_TEXT_COMMENT };
+
+/* pending separators, the stronger one wins */
+enum { MB_SEP_NONE, MB_SEP_SPACE, MB_SEP_LINE, MB_SEP_PAGE };
+
+static const char *const mb_text_block_tags[] = {
+    "address", "article", "aside", "blockquote", "body", "br", "dd", "div", "dl", "dt", "figcaption", "figure",
+    "footer", "h1", "h2", "h3", "h4", "h5", "h6", "header", "hr", "html", "li", "nav", "ol", "p", "pre",
+    "section", "table", "tr", "ul", NULL};
+
+static const char *const mb_text_cell_tags[] = {"td", "th", NULL};
+
+static const char *const mb_text_skip_tags[] = {"head", "script", "style", NULL};
+
+static const struct {
+    const char *name;
+    uint32_t code;
+} mb_text_entities[] = {
+    {"amp", '&'},        {"lt", '<'},         {"gt", '>'},         {"quot", '"'},      {"apos", '\''},
+    {"nbsp", ' '},       {"shy", 0xad},       {"ndash", 0x2013},   {"mdash", 0x2014},  {"lsquo", 0x2018},
+    {"rsquo", 0x2019},   {"sbquo", 0x201a},   {"ldquo", 0x201c},   {"rdquo", 0x201d},  {"bdquo", 0x201e},
+    {"laquo", 0xab},     {"raquo", 0xbb},     {"hellip", 0x2026},  {"bull", 0x2022},   {"middot", 0xb7},
+    {"copy", 0xa9},      {"reg", 0xae},       {"trade", 0x2122},   {"euro", 0x20ac},   {"pound", 0xa3},
+    {"yen", 0xa5},       {"cent", 0xa2},      {"sect", 0xa7},      {"para", 0xb6},     {"deg", 0xb0},
+    {"times", 0xd7},     {"divide", 0xf7},    {"iexcl", 0xa1},     {"iquest", 0xbf},   {NULL, 0}};
+
+static int mb_text_in(const char *name, const char *const *list)
+{
+    for (; *list; list++) {
+        if (strcmp(name, *list) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int mb_text_is_space(unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static void mb_text_separate(mb_TEXT *text, int sep)
+{
+    if (text->sep < sep) {
+        text->sep = sep;
+    }
+}
+
+static void mb_text_put(mb_TEXT *text, char *out, size_t *len, const char *str, size_t n)
+{
+    if (text->started && text->sep != MB_SEP_NONE) {
+        out[(*len)++] = text->sep == MB_SEP_PAGE ? '\f' : text->sep == MB_SEP_LINE ? '\n' : ' ';
+    }
+    text->sep = MB_SEP_NONE;
+    memcpy(out + *len, str, n);
+    *len += n;
+    text->started = 1;
+}
+
+static size_t mb_text_utf8_encode(uint32_t code, char *buf)
+{
+    if (code == 0 || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) {
+        code = 0xfffd;
+    }
+    if (code < 0x80) {
+        buf[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        buf[0] = (char)(0xc0 | (code >> 6));
+        buf[1] = (char)(0x80 | (code & 0x3f));
+        return 2;
+    }
+    if (code < 0x10000) {
+        buf[0] = (char)(0xe0 | (code >> 12));
+        buf[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+        buf[2] = (char)(0x80 | (code & 0x3f));
+        return 3;
+    }
+    buf[0] = (char)(0xf0 | (code >> 18));
+    buf[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    buf[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    buf[3] = (char)(0x80 | (code & 0x3f));
+    return 4;
+}
+
+/* Returns code point of the entity, or -1 when it is not known */
+static long mb_text_entity_code(const char *name, size_t len)
+{
+    size_t i;
+
+    if (len > 1 && name[0] == '#') {
+        char *end;
+        long code;
+        if (name[1] == 'x' || name[1] == 'X') {
+            code = strtol(name + 2, &end, 16);
+        } else {
+            code = strtol(name + 1, &end, 10);
+        }
+        if (end != name + len || end == name + 1 || code < 0) {
+            return -1;
+        }
+        return code;
+    }
+    for (i = 0; mb_text_entities[i].name; i++) {
+        if (strcmp(name, mb_text_entities[i].name) == 0) {
+            return (long)mb_text_entities[i].code;
+        }
+    }
+    return -1;
+}
+
+static void mb_text_put_entity_literal(mb_TEXT *text, char *out, size_t *len, int terminated)
+{
+    char buf[sizeof(text->entity) + 2];
+    size_t n = 0;
+
+    buf[n++] = '&';
+    memcpy(buf + n, text->entity, text->entity_len);
+    n += text->entity_len;
+    if (terminated) {
+        buf[n++] = ';';
+    }
+    mb_text_put(text, out, len, buf, n);
+}
+
+static void mb_text_put_entity(mb_TEXT *text, char *out, size_t *len)
+{
+    char buf[4];
+    long code;
+
+    text->entity[text->entity_len] = '\0';
+    code = mb_text_entity_code(text->entity, text->entity_len);
+    if (code < 0) {
+        mb_text_put_entity_literal(text, out, len, 1);
+    } else if (code == ' ' && text->entity[0] != '#') {
+        /* &nbsp; */
+        mb_text_separate(text, MB_SEP_SPACE);
+    } else if (code == 0xa0) {
+        mb_text_separate(text, MB_SEP_SPACE);
+    } else if (code == 0xad) {
+        /* soft hyphen is invisible */
+    } else {
+        mb_text_put(text, out, len, buf, mb_text_utf8_encode((uint32_t)code, buf));
+    }
+}
+
+static void mb_text_end_tag(mb_TEXT *text)
+{
+    const char *name = text->name;
+
+    text->name[text->name_len < sizeof(text->name) ? text->name_len : 0] = '\0';
+    if (text->skip[0]) {
+        if (text->closing && strcmp(name, text->skip) == 0) {
+            text->skip[0] = '\0';
+        }
+        return;
+    }
+    if (!text->closing && !text->self_closing && mb_text_in(name, mb_text_skip_tags)) {
+        strcpy(text->skip, name);
+    } else if (strcmp(name, "mbp:pagebreak") == 0) {
+        mb_text_separate(text, MB_SEP_PAGE);
+    } else if (mb_text_in(name, mb_text_block_tags)) {
+        mb_text_separate(text, MB_SEP_LINE);
+    } else if (mb_text_in(name, mb_text_cell_tags)) {
+        mb_text_separate(text, MB_SEP_SPACE);
+    }
+}
+
+void mb_text_init(mb_TEXT *text)
+{
+    memset(text, 0, sizeof(*text));
+    text->state = MB_TEXT_DATA;
+}
+
+size_t mb_text_strip(mb_TEXT *text, const unsigned char *in, size_t in_len, char *out, size_t cap, size_t *len)
+{
+    size_t i = 0;
+
+    while (i < in_len && cap - *len >= MB_TEXT_MAX_EMIT) {
+        unsigned char c = in[i];
+
+        switch (text->state) {
+            case MB_TEXT_DATA:
+                if (c == '<') {
+                    text->state = MB_TEXT_TAG;
+                    text->name_len = 0;
+                    text->name_done = 0;
+                    text->closing = 0;
+                    text->self_closing = 0;
+                    text->quote = 0;
+                } else if (text->skip[0]) {
+                    /* content of head, script or style */
+                } else if (c == '&') {
+                    text->state = MB_TEXT_ENTITY;
+                    text->entity_len = 0;
+                } else if (mb_text_is_space(c)) {
+                    mb_text_separate(text, MB_SEP_SPACE);
+                } else {
+                    mb_text_put(text, out, len, (const char *)&c, 1);
+                }
+                break;
+            case MB_TEXT_TAG:
+                if (text->quote) {
+                    if (c == text->quote) {
+                        text->quote = 0;
+                    }
+                } else if (c == '>') {
+                    text->state = MB_TEXT_DATA;
+                    mb_text_end_tag(text);
+                } else if (!text->name_done) {
+                    if (c == '/' && text->name_len == 0 && !text->closing) {
+                        text->closing = 1;
+                    } else if (mb_text_is_space(c) || c == '/') {
+                        text->name_done = 1;
+                        text->self_closing = c == '/';
+                    } else {
+                        if (text->name_len < sizeof(text->name) - 1) {
+                            text->name[text->name_len] = (char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+                        }
+                        /* too long names are not matched against anything */
+                        text->name_len++;
+                        if (text->name_len == 3 && memcmp(text->name, "!--", 3) == 0) {
+                            text->state = MB_TEXT_COMMENT;
+                            text->dashes = 0;
+                        }
+                    }
+                } else if (c == '"' || c == '\'') {
+                    text->quote = (char)c;
+                    text->self_closing = 0;
+                } else if (!mb_text_is_space(c)) {
+                    text->self_closing = c == '/';
+                }
+                break;
+            case MB_TEXT_COMMENT:
+                if (c == '>' && text->dashes >= 2) {
+                    text->state = MB_TEXT_DATA;
+                } else if (c == '-') {
+                    text->dashes++;
+                } else {
+                    text->dashes = 0;
+                }
+                break;
+            case MB_TEXT_ENTITY:
+                if (c == ';') {
+                    text->state = MB_TEXT_DATA;
+                    mb_text_put_entity(text, out, len);
+                } else if (text->entity_len < sizeof(text->entity) - 1 &&
+                           ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '#')) {
+                    text->entity[text->entity_len++] = (char)c;
+                } else {
+                    /* not an entity, the character is processed again as data */
+                    text->state = MB_TEXT_DATA;
+                    mb_text_put_entity_literal(text, out, len, 0);
+                    continue;
+                }
+                break;
+        }
+        i++;
+    }
+    return i;
+}
+
+void mb_text_finish(mb_TEXT *text, char *out, size_t *len)
+{
+    if (text->state == MB_TEXT_ENTITY) {
+        mb_text_put_entity_literal(text, out, len, 0);
+    }
+    text->state = MB_TEXT_DATA;
+}
+
+size_t mb_text_utf8_prefix(const char *buf, size_t len)
+{
+    size_t i, need;
+    unsigned char c;
+
+    /* look for the lead byte of the last sequence */
+    for (i = len; i > 0 && len - i < 4; i--) {
+        c = (unsigned char)buf[i - 1];
+        if ((c & 0xc0) != 0x80) {
+            if (c >= 0xf0) {
+                need = 4;
+            } else if (c >= 0xe0) {
+                need = 3;
+            } else if (c >= 0xc0) {
+                need = 2;
+            } else {
+                need = 1;
+            }
+            return len - (i - 1) >= need ? len : i - 1;
+        }
+    }
+    return len;
+}
@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_TEXT_H
+#define MOBI_TEXT_H
+
+#include <stddef.h>
+
+/*
+ * Streaming HTML to plain text converter for the reconstructed markup.
+ *
+ * Tags are dropped, entities are decoded, content of head, script and style
+ * elements is skipped. Whitespace runs become single space, block elements
+ * become line breaks, and <mbp:pagebreak/> becomes form feed. The input is
+ * expected to be UTF-8, and the state is kept between the calls, so the
+ * markup can be fed in arbitrary pieces.
+ */
+
+/* The most bytes a single input byte can produce */
+#define MB_TEXT_MAX_EMIT 16
+
+typedef struct mb_TEXT {
+    int state;
+    /* separator to be emitted before the next character */
+    int sep;
+    /* nothing is emitted before the first character */
+    int started;
+    /* name of the element, whose content is being skipped */
+    char skip[8];
+    /* element name of the tag being parsed */
+    char name[16];
+    size_t name_len;
+    int name_done;
+    int closing;
+    int self_closing;
+    char quote;
+    /* consecutive dashes in comment */
+    int dashes;
+    /* entity name being parsed, without "&" and ";" */
+    char entity[12];
+    size_t entity_len;
+} mb_TEXT;
+
+void mb_text_init(mb_TEXT *text);
+
+/*
+ * Convert input into out[*len..cap], and advance *len. Stops when the input
+ * is exhausted or there is less than MB_TEXT_MAX_EMIT bytes of space left,
+ * returns the number of input bytes consumed.
+ */
+size_t mb_text_strip(mb_TEXT *text, const unsigned char *in, size_t in_len, char *out, size_t cap, size_t *len);
+
+/* Flush the state at the end of input, needs MB_TEXT_MAX_EMIT bytes of space */
+void mb_text_finish(mb_TEXT *text, char *out, size_t *len);
+
+/* Length of the longest prefix of buf, which does not end in the middle of UTF-8 sequence */
+size_t mb_text_utf8_prefix(const char *buf, size_t len);
+
+#endif
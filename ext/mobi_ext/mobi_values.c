@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <ruby.h>
+
+#include "mobi_ext.h"
+#include "mobi_values.h"
+
+VALUE mb_cPdbHeader;
+VALUE mb_cRecord0Header;
+VALUE mb_cMobiHeader;
+VALUE mb_cExthEntry;
+VALUE mb_cRecord;
+VALUE mb_cPart;
+VALUE mb_cResource;
+VALUE mb_cTocEntry;
+VALUE mb_cGuideEntry;
+VALUE mb_cDictionaryEntry;
+
+VALUE mb_value_new(VALUE klass, int argc, const VALUE *argv)
+{
+    return rb_obj_freeze(rb_class_new_instance(argc, argv, klass));
+}
+
+#define MB_FIELD_NAME(NAME) #NAME,
+
+void init_mobi_values(void)
+{
+    mb_cPdbHeader = rb_struct_define_under(mb_mMOBI, "PdbHeader", MB_PDB_HEADER_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cRecord0Header =
+        rb_struct_define_under(mb_mMOBI, "Record0Header", MB_RECORD0_HEADER_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cMobiHeader = rb_struct_define_under(mb_mMOBI, "MobiHeader", MB_MOBI_HEADER_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cExthEntry = rb_struct_define_under(mb_mMOBI, "ExthEntry", MB_EXTH_ENTRY_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cRecord = rb_struct_define_under(mb_mMOBI, "Record", MB_RECORD_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cPart = rb_struct_define_under(mb_mMOBI, "Part", MB_PART_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cResource = rb_struct_define_under(mb_mMOBI, "Resource", MB_RESOURCE_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cTocEntry = rb_struct_define_under(mb_mMOBI, "TocEntry", MB_TOC_ENTRY_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cGuideEntry = rb_struct_define_under(mb_mMOBI, "GuideEntry", MB_GUIDE_ENTRY_FIELDS(MB_FIELD_NAME) NULL);
+    mb_cDictionaryEntry =
+        rb_struct_define_under(mb_mMOBI, "DictionaryEntry", MB_DICTIONARY_ENTRY_FIELDS(MB_FIELD_NAME) NULL);
+}
+
+#undef MB_FIELD_NAME
@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_VALUES_H
+#define MOBI_VALUES_H
+
+#include <ruby.h>
+
+/*
+ * Frozen Struct classes returned by the header and record accessors. Members
+ * are listed here once, and used both to define the class and to fill the
+ * instance positionally, e.g. values[MB_PDB_HEADER_name].
+ */
+
+#define MB_PDB_HEADER_FIELDS(X)                                                                                        \
+    X(name)                                                                                                            \
+    X(attributes)                                                                                                      \
+    X(version)                                                                                                         \
+    X(ctime)                                                                                                           \
+    X(ctime_time)                                                                                                      \
+    X(mtime)                                                                                                           \
+    X(mtime_time)                                                                                                      \
+    X(btime)                                                                                                           \
+    X(btime_time)                                                                                                      \
+    X(mod_num)                                                                                                         \
+    X(appinfo_offset)                                                                                                  \
+    X(sortinfo_offset)                                                                                                 \
+    X(type)                                                                                                            \
+    X(creator)                                                                                                         \
+    X(uid)                                                                                                             \
+    X(next_rec)                                                                                                        \
+    X(rec_count)
+
+#define MB_RECORD0_HEADER_FIELDS(X)                                                                                    \
+    X(compression_type)                                                                                                \
+    X(compression_type_sym)                                                                                            \
+    X(text_length)                                                                                                     \
+    X(text_record_count)                                                                                               \
+    X(text_record_size)                                                                                                \
+    X(encryption_type)                                                                                                 \
+    X(encryption_type_sym)                                                                                             \
+    X(unknown1)
+
+/* MOBI header members, which are plain optional integers in MOBIMobiHeader */
+#define MB_MOBI_HEADER_INTS(X)                                                                                         \
+    X(header_length)                                                                                                   \
+    X(mobi_type)                                                                                                       \
+    X(uid)                                                                                                             \
+    X(version)                                                                                                         \
+    X(orth_index)                                                                                                      \
+    X(infl_index)                                                                                                      \
+    X(names_index)                                                                                                     \
+    X(keys_index)                                                                                                      \
+    X(extra0_index)                                                                                                    \
+    X(extra1_index)                                                                                                    \
+    X(extra2_index)                                                                                                    \
+    X(extra3_index)                                                                                                    \
+    X(extra4_index)                                                                                                    \
+    X(extra5_index)                                                                                                    \
+    X(non_text_index)                                                                                                  \
+    X(full_name_offset)                                                                                                \
+    X(full_name_length)                                                                                                \
+    X(min_version)                                                                                                     \
+    X(image_index)                                                                                                     \
+    X(huff_rec_index)                                                                                                  \
+    X(huff_rec_count)                                                                                                  \
+    X(datp_rec_index)                                                                                                  \
+    X(datp_rec_count)                                                                                                  \
+    X(exth_flags)                                                                                                      \
+    X(unknown6)                                                                                                        \
+    X(drm_offset)                                                                                                      \
+    X(drm_count)                                                                                                       \
+    X(drm_size)                                                                                                        \
+    X(drm_flags)                                                                                                       \
+    X(first_text_index)                                                                                                \
+    X(last_text_index)                                                                                                 \
+    X(fdst_index)                                                                                                      \
+    X(fdst_section_count)                                                                                              \
+    X(fcis_index)                                                                                                      \
+    X(fcis_count)                                                                                                      \
+    X(flis_index)                                                                                                      \
+    X(flis_count)                                                                                                      \
+    X(unknown10)                                                                                                       \
+    X(unknown11)                                                                                                       \
+    X(srcs_index)                                                                                                      \
+    X(srcs_count)                                                                                                      \
+    X(unknown12)                                                                                                       \
+    X(unknown13)                                                                                                       \
+    X(extra_flags)                                                                                                     \
+    X(ncx_index)                                                                                                       \
+    X(unknown14)                                                                                                       \
+    X(unknown15)                                                                                                       \
+    X(fragment_index)                                                                                                  \
+    X(skeleton_index)                                                                                                  \
+    X(datp_index)                                                                                                      \
+    X(unknown16)                                                                                                       \
+    X(guide_index)                                                                                                     \
+    X(unknown17)                                                                                                       \
+    X(unknown18)                                                                                                       \
+    X(unknown19)                                                                                                       \
+    X(unknown20)
+
+#define MB_MOBI_HEADER_FIELDS(X)                                                                                       \
+    X(magic)                                                                                                           \
+    X(text_encoding)                                                                                                   \
+    X(text_encoding_sym)                                                                                               \
+    X(locale)                                                                                                          \
+    X(locale_str)                                                                                                      \
+    X(dict_input_lang)                                                                                                 \
+    X(dict_input_lang_str)                                                                                             \
+    X(dict_output_lang)                                                                                                \
+    X(dict_output_lang_str)                                                                                            \
+    MB_MOBI_HEADER_INTS(X)
+
+#define MB_EXTH_ENTRY_FIELDS(X)                                                                                        \
+    X(code)                                                                                                            \
+    X(id)                                                                                                              \
+    X(name)                                                                                                            \
+    X(val_num)                                                                                                         \
+    X(val_str)                                                                                                         \
+    X(val_bin)
+
+#define MB_RECORD_FIELDS(X)                                                                                            \
+    X(offset)                                                                                                          \
+    X(size)                                                                                                            \
+    X(attributes)                                                                                                      \
+    X(uid)                                                                                                             \
+    X(data)
+
+#define MB_PART_FIELDS(X)                                                                                              \
+    X(type)                                                                                                            \
+    X(type_sym)                                                                                                        \
+    X(uid)                                                                                                             \
+    X(size)                                                                                                            \
+    X(data)
+
+#define MB_RESOURCE_FIELDS(X)                                                                                          \
+    X(type)                                                                                                            \
+    X(type_sym)                                                                                                        \
+    X(uid)                                                                                                             \
+    X(size)
+
+#define MB_TOC_ENTRY_FIELDS(X)                                                                                         \
+    X(label)                                                                                                           \
+    X(level)                                                                                                           \
+    X(pos)                                                                                                             \
+    X(length)                                                                                                          \
+    X(fid)                                                                                                             \
+    X(off)                                                                                                             \
+    X(parent)                                                                                                          \
+    X(first_child)                                                                                                     \
+    X(last_child)
+
+#define MB_GUIDE_ENTRY_FIELDS(X)                                                                                       \
+    X(type)                                                                                                            \
+    X(title)                                                                                                           \
+    X(fid)
+
+#define MB_DICTIONARY_ENTRY_FIELDS(X)                                                                                  \
+    X(headword)                                                                                                        \
+    X(index)                                                                                                           \
+    X(pos)                                                                                                             \
+    X(length)
+
+#define MB_PDB_HEADER_ENUM(NAME) MB_PDB_HEADER_##NAME,
+#define MB_RECORD0_HEADER_ENUM(NAME) MB_RECORD0_HEADER_##NAME,
+#define MB_MOBI_HEADER_ENUM(NAME) MB_MOBI_HEADER_##NAME,
+#define MB_EXTH_ENTRY_ENUM(NAME) MB_EXTH_ENTRY_##NAME,
+#define MB_RECORD_ENUM(NAME) MB_RECORD_##NAME,
+#define MB_PART_ENUM(NAME) MB_PART_##NAME,
+#define MB_RESOURCE_ENUM(NAME) MB_RESOURCE_##NAME,
+#define MB_TOC_ENTRY_ENUM(NAME) MB_TOC_ENTRY_##NAME,
+#define MB_GUIDE_ENTRY_ENUM(NAME) MB_GUIDE_ENTRY_##NAME,
+#define MB_DICTIONARY_ENTRY_ENUM(NAME) MB_DICTIONARY_ENTRY_##NAME,
+enum { MB_PDB_HEADER_FIELDS(MB_PDB_HEADER_ENUM) MB_PDB_HEADER_COUNT };
+enum { MB_RECORD0_HEADER_FIELDS(MB_RECORD0_HEADER_ENUM) MB_RECORD0_HEADER_COUNT };
+enum { MB_MOBI_HEADER_FIELDS(MB_MOBI_HEADER_ENUM) MB_MOBI_HEADER_COUNT };
+enum { MB_EXTH_ENTRY_FIELDS(MB_EXTH_ENTRY_ENUM) MB_EXTH_ENTRY_COUNT };
+enum { MB_RECORD_FIELDS(MB_RECORD_ENUM) MB_RECORD_COUNT };
+enum { MB_PART_FIELDS(MB_PART_ENUM) MB_PART_COUNT };
+enum { MB_RESOURCE_FIELDS(MB_RESOURCE_ENUM) MB_RESOURCE_COUNT };
+enum { MB_TOC_ENTRY_FIELDS(MB_TOC_ENTRY_ENUM) MB_TOC_ENTRY_COUNT };
+enum { MB_GUIDE_ENTRY_FIELDS(MB_GUIDE_ENTRY_ENUM) MB_GUIDE_ENTRY_COUNT };
+enum { MB_DICTIONARY_ENTRY_FIELDS(MB_DICTIONARY_ENTRY_ENUM) MB_DICTIONARY_ENTRY_COUNT };
+#undef MB_PDB_HEADER_ENUM
+#undef MB_RECORD0_HEADER_ENUM
+#undef MB_MOBI_HEADER_ENUM
+#undef MB_EXTH_ENTRY_ENUM
+#undef MB_RECORD_ENUM
+#undef MB_PART_ENUM
+#undef MB_RESOURCE_ENUM
+#undef MB_TOC_ENTRY_ENUM
+#undef MB_GUIDE_ENTRY_ENUM
+#undef MB_DICTIONARY_ENTRY_ENUM
+
+extern VALUE mb_cPdbHeader;
+extern VALUE mb_cRecord0Header;
+extern VALUE mb_cMobiHeader;
+extern VALUE mb_cExthEntry;
+extern VALUE mb_cRecord;
+extern VALUE mb_cPart;
+extern VALUE mb_cResource;
+extern VALUE mb_cTocEntry;
+extern VALUE mb_cGuideEntry;
+extern VALUE mb_cDictionaryEntry;
+
+/* Fill all members of the Struct, missing ones should be Qnil, and freeze it */
+VALUE mb_value_new(VALUE klass, int argc, const VALUE *argv);
+
+void init_mobi_values(void);
+
+#endif
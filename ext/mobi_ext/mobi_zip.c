@@ -0,0 +1,329 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "mobi_config.h"
+#include "mobi_zip.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#define ZIP_LOCAL_MAGIC 0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC 0x06054b50
+#define ZIP_LOCAL_LEN 30
+#define ZIP_CENTRAL_LEN 46
+#define ZIP_END_LEN 22
+#define ZIP_VERSION 20
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+/* all entries are dated 1980-01-01 00:00, so the archives are reproducible */
+#define ZIP_DOS_TIME 0
+#define ZIP_DOS_DATE 0x21
+#define ZIP_LIMIT 0xffffffffu
+
+static void mb_put16le(unsigned char *ptr, uint16_t val)
+{
+    ptr[0] = (unsigned char)val;
+    ptr[1] = (unsigned char)(val >> 8);
+}
+
+static void mb_put32le(unsigned char *ptr, uint32_t val)
+{
+    ptr[0] = (unsigned char)val;
+    ptr[1] = (unsigned char)(val >> 8);
+    ptr[2] = (unsigned char)(val >> 16);
+    ptr[3] = (unsigned char)(val >> 24);
+}
+
+#ifdef HAVE_ZLIB_H
+
+static uint32_t mb_zip_crc32(const unsigned char *data, size_t size)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    /* zlib takes 32-bit lengths */
+    while (size > 0) {
+        uInt n = size > 0x40000000 ? 0x40000000 : (uInt)size;
+        crc = crc32(crc, data, n);
+        data += n;
+        size -= n;
+    }
+    return (uint32_t)crc;
+}
+
+static MOBI_RET mb_zip_deflate(mb_ZIP_ENTRY *entry)
+{
+    z_stream zs;
+    size_t bound;
+    int rc;
+
+    if (entry->size > 0x40000000) {
+        /* not worth the trouble of feeding zlib in pieces */
+        return MOBI_SUCCESS;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return MOBI_MALLOC_FAILED;
+    }
+    bound = deflateBound(&zs, (uLong)entry->size);
+    entry->out = malloc(bound);
+    if (entry->out == NULL) {
+        deflateEnd(&zs);
+        return MOBI_MALLOC_FAILED;
+    }
+    zs.next_in = (Bytef *)entry->data;
+    zs.avail_in = (uInt)entry->size;
+    zs.next_out = entry->out;
+    zs.avail_out = (uInt)bound;
+    rc = deflate(&zs, Z_FINISH);
+    entry->out_size = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || entry->out_size >= entry->size) {
+        /* incompressible, store it */
+        free(entry->out);
+        entry->out = NULL;
+        entry->out_size = 0;
+        return MOBI_SUCCESS;
+    }
+    entry->method = ZIP_DEFLATED;
+    return MOBI_SUCCESS;
+}
+
+#else
+
+static uint32_t mb_zip_crc_table[256];
+
+static void mb_zip_crc_init(void)
+{
+    uint32_t i, j, c;
+
+    if (mb_zip_crc_table[1]) {
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        mb_zip_crc_table[i] = c;
+    }
+}
+
+static uint32_t mb_zip_crc32(const unsigned char *data, size_t size)
+{
+    uint32_t crc = 0xffffffffu;
+
+    while (size--) {
+        crc = mb_zip_crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffu;
+}
+
+static MOBI_RET mb_zip_deflate(mb_ZIP_ENTRY *entry)
+{
+    (void)entry;
+    return MOBI_SUCCESS;
+}
+
+#endif
+
+static void mb_zip_compress_one(mb_ZIP_ENTRY *entry)
+{
+    entry->crc = mb_zip_crc32(entry->data, entry->size);
+    entry->method = ZIP_STORED;
+    entry->out = NULL;
+    entry->out_size = 0;
+    entry->rc = entry->store ? MOBI_SUCCESS : mb_zip_deflate(entry);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+typedef struct mb_ZIP_JOBS {
+    pthread_mutex_t mutex;
+    mb_ZIP_ENTRY *entries;
+    size_t count;
+    size_t next;
+} mb_ZIP_JOBS;
+
+static void *mb_zip_worker(void *ptr)
+{
+    mb_ZIP_JOBS *jobs = ptr;
+    size_t idx;
+
+    pthread_mutex_lock(&jobs->mutex);
+    while (jobs->next < jobs->count) {
+        idx = jobs->next++;
+        pthread_mutex_unlock(&jobs->mutex);
+        mb_zip_compress_one(&jobs->entries[idx]);
+        pthread_mutex_lock(&jobs->mutex);
+    }
+    pthread_mutex_unlock(&jobs->mutex);
+    return NULL;
+}
+
+#endif
+
+MOBI_RET mb_zip_compress(mb_ZIP_ENTRY *entries, size_t count, size_t threads)
+{
+    size_t i;
+
+#ifndef HAVE_ZLIB_H
+    mb_zip_crc_init();
+#endif
+#ifdef HAVE_PTHREAD_H
+    if (threads > 1 && count > 1) {
+        mb_ZIP_JOBS jobs;
+        pthread_t *tids;
+        sigset_t all, saved;
+        size_t started = 0;
+
+        if (threads > count) {
+            threads = count;
+        }
+        tids = malloc((threads - 1) * sizeof(pthread_t));
+        if (tids != NULL) {
+            jobs.entries = entries;
+            jobs.count = count;
+            jobs.next = 0;
+            pthread_mutex_init(&jobs.mutex, NULL);
+            /* signals are handled by Ruby threads, workers inherit the blocked mask */
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &saved);
+            for (i = 0; i + 1 < threads; i++) {
+                if (pthread_create(&tids[i], NULL, mb_zip_worker, &jobs) != 0) {
+                    break;
+                }
+                started++;
+            }
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            /* the calling thread takes its share too */
+            mb_zip_worker(&jobs);
+            for (i = 0; i < started; i++) {
+                pthread_join(tids[i], NULL);
+            }
+            pthread_mutex_destroy(&jobs.mutex);
+            free(tids);
+            count = 0;
+        }
+    }
+#else
+    (void)threads;
+#endif
+    for (i = 0; i < count; i++) {
+        mb_zip_compress_one(&entries[i]);
+    }
+    return MOBI_SUCCESS;
+}
+
+void mb_zip_init(mb_ZIP *zip, const mb_ZIP_SINK *sink)
+{
+    memset(zip, 0, sizeof(*zip));
+    zip->sink = *sink;
+}
+
+MOBI_RET mb_zip_add(mb_ZIP *zip, mb_ZIP_ENTRY *entry)
+{
+    unsigned char hdr[ZIP_LOCAL_LEN + MB_ZIP_NAME_MAX], *cd;
+    const unsigned char *data = entry->out ? entry->out : entry->data;
+    size_t name_len = strlen(entry->name);
+    size_t size = entry->out ? entry->out_size : entry->size;
+    MOBI_RET rc;
+
+    if (entry->rc != MOBI_SUCCESS) {
+        rc = entry->rc;
+        mb_zip_entry_free(entry);
+        return rc;
+    }
+    if (zip->count >= 0xffff || entry->size > ZIP_LIMIT || zip->offset + ZIP_LOCAL_LEN + name_len + size > ZIP_LIMIT) {
+        mb_zip_entry_free(entry);
+        return MOBI_BUFFER_END;
+    }
+    if (zip->cdir_size + ZIP_CENTRAL_LEN + name_len > zip->cdir_cap) {
+        size_t cap = zip->cdir_cap ? zip->cdir_cap * 2 : 4096;
+        unsigned char *cdir = realloc(zip->cdir, cap);
+        if (cdir == NULL) {
+            mb_zip_entry_free(entry);
+            return MOBI_MALLOC_FAILED;
+        }
+        zip->cdir = cdir;
+        zip->cdir_cap = cap;
+    }
+
+    mb_put32le(hdr, ZIP_LOCAL_MAGIC);
+    mb_put16le(hdr + 4, ZIP_VERSION);
+    mb_put16le(hdr + 6, 0);
+    mb_put16le(hdr + 8, (uint16_t)entry->method);
+    mb_put16le(hdr + 10, ZIP_DOS_TIME);
+    mb_put16le(hdr + 12, ZIP_DOS_DATE);
+    mb_put32le(hdr + 14, entry->crc);
+    mb_put32le(hdr + 18, (uint32_t)size);
+    mb_put32le(hdr + 22, (uint32_t)entry->size);
+    mb_put16le(hdr + 26, (uint16_t)name_len);
+    mb_put16le(hdr + 28, 0);
+    memcpy(hdr + ZIP_LOCAL_LEN, entry->name, name_len);
+
+    /* the central record repeats most of the local header */
+    cd = zip->cdir + zip->cdir_size;
+    mb_put32le(cd, ZIP_CENTRAL_MAGIC);
+    mb_put16le(cd + 4, ZIP_VERSION);
+    memcpy(cd + 6, hdr + 4, 26);
+    memset(cd + 32, 0, 10);
+    mb_put32le(cd + 42, (uint32_t)zip->offset);
+    memcpy(cd + ZIP_CENTRAL_LEN, entry->name, name_len);
+
+    if (zip->sink.write(zip->sink.ctx, hdr, ZIP_LOCAL_LEN + name_len) != 0 ||
+        (size > 0 && zip->sink.write(zip->sink.ctx, data, size) != 0)) {
+        mb_zip_entry_free(entry);
+        return MOBI_WRITE_FAILED;
+    }
+    mb_zip_entry_free(entry);
+    zip->cdir_size += ZIP_CENTRAL_LEN + name_len;
+    zip->offset += ZIP_LOCAL_LEN + name_len + size;
+    zip->count++;
+    return MOBI_SUCCESS;
+}
+
+MOBI_RET mb_zip_finish(mb_ZIP *zip)
+{
+    unsigned char end[ZIP_END_LEN];
+
+    if (zip->offset + zip->cdir_size > ZIP_LIMIT) {
+        return MOBI_BUFFER_END;
+    }
+    mb_put32le(end, ZIP_END_MAGIC);
+    mb_put16le(end + 4, 0);
+    mb_put16le(end + 6, 0);
+    mb_put16le(end + 8, (uint16_t)zip->count);
+    mb_put16le(end + 10, (uint16_t)zip->count);
+    mb_put32le(end + 12, (uint32_t)zip->cdir_size);
+    mb_put32le(end + 16, (uint32_t)zip->offset);
+    mb_put16le(end + 20, 0);
+    if ((zip->cdir_size > 0 && zip->sink.write(zip->sink.ctx, zip->cdir, zip->cdir_size) != 0) ||
+        zip->sink.write(zip->sink.ctx, end, ZIP_END_LEN) != 0) {
+        return MOBI_WRITE_FAILED;
+    }
+    zip->offset += zip->cdir_size + ZIP_END_LEN;
+    return MOBI_SUCCESS;
+}
+
+void mb_zip_free(mb_ZIP *zip)
+{
+    free(zip->cdir);
+    zip->cdir = NULL;
+    zip->cdir_size = zip->cdir_cap = 0;
+}
+
+void mb_zip_entry_free(mb_ZIP_ENTRY *entry)
+{
+    free(entry->out);
+    entry->out = NULL;
+    entry->out_size = 0;
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef MOBI_ZIP_H
+#define MOBI_ZIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mobi.h>
+
+/*
+ * Streaming ZIP writer. Entries are compressed in batches, possibly on
+ * several threads, and written in order through the sink, so only the
+ * compressed batch and the central directory are held in memory. Without
+ * zlib the entries are stored. ZIP64 is not supported, archives are limited
+ * to 4 GB and 65535 entries.
+ */
+
+#define MB_ZIP_NAME_MAX 64
+
+typedef struct mb_ZIP_SINK {
+    /* returns zero on success */
+    int (*write)(void *ctx, const void *data, size_t size);
+    void *ctx;
+} mb_ZIP_SINK;
+
+typedef struct mb_ZIP_ENTRY {
+    char name[MB_ZIP_NAME_MAX];
+    const unsigned char *data;
+    size_t size;
+    /* already compressed data (images), or entries which must be stored (mimetype) */
+    int store;
+    /* filled by mb_zip_compress() */
+    uint32_t crc;
+    int method;
+    unsigned char *out;
+    size_t out_size;
+    MOBI_RET rc;
+} mb_ZIP_ENTRY;
+
+typedef struct mb_ZIP {
+    mb_ZIP_SINK sink;
+    uint64_t offset;
+    /* central directory, written by mb_zip_finish() */
+    unsigned char *cdir;
+    size_t cdir_size;
+    size_t cdir_cap;
+    size_t count;
+} mb_ZIP;
+
+void mb_zip_init(mb_ZIP *zip, const mb_ZIP_SINK *sink);
+
+/* Compute checksums and compress the entries, using up to threads threads */
+MOBI_RET mb_zip_compress(mb_ZIP_ENTRY *entries, size_t count, size_t threads);
+
+/* Write compressed entry, and free its compressed data */
+MOBI_RET mb_zip_add(mb_ZIP *zip, mb_ZIP_ENTRY *entry);
+
+/* Write the central directory */
+MOBI_RET mb_zip_finish(mb_ZIP *zip);
+
+void mb_zip_free(mb_ZIP *zip);
+void mb_zip_entry_free(mb_ZIP_ENTRY *entry);
+
+#endif
@@ -18,6 +18,7 @@ require 'mobi/version'
 require 'mobi/error'
 require 'mobi/book'
 require 'mobi_ext'
+require 'mobi/values'
 
 module MOBI
 end
@@ -0,0 +1,31 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+module MOBI
+  # Shared behaviour of the frozen value types returned by the extension.
+  module Value
+    # Hash with the members present in the book, the same shape the header
+    # and record accessors used to return.
+    def to_h(&block)
+      super(&block).compact
+    end
+  end
+
+  [PdbHeader, Record0Header, MobiHeader, ExthEntry, Record, Part, Resource, TocEntry, GuideEntry,
+   DictionaryEntry].each do |klass|
+    klass.include(Value)
+  end
+end
@@ -15,6 +15,9 @@
 # along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 require 'test_helper'
+require 'tmpdir'
+require 'fileutils'
+require 'objspace'
 
 class BookTest < Minitest::Test
   def test_that_it_can_load_book
@@ -81,7 +84,7 @@ class BookTest < Minitest::Test
       name: 'ASIN',
       val_str: 'dcc4c715-c7de-484d-a533-d4fe6e1f6453'
     }
-    assert_equal expected, tag
+    assert_equal expected, tag.to_h
   end
 
   def test_that_it_can_access_document_records
@@ -106,4 +109,459 @@ class BookTest < Minitest::Test
     assert_equal 1805, parts[:markup][0][:size]
     assert_match(/lorem ipsum dolor/i, parts[:markup][0][:data])
   end
+
+  def test_that_it_can_parse_books_from_multiple_threads
+    path = fixture_path('lorem.azw3')
+    expected = MOBI::Book.new(path).rawml
+    threads = Array.new(4) do
+      Thread.new do
+        Array.new(10) do
+          book = MOBI::Book.new(path)
+          [book.rawml, book.rawml_parts[:markup][0][:size]]
+        end
+      end
+    end
+    threads.map(&:value).flatten(1).each do |rawml, size|
+      assert_equal expected, rawml
+      assert_equal 1805, size
+    end
+  end
+
+  def test_that_it_does_not_allow_to_reinitialize_book
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    assert_raises(MOBI::Error) do
+      book.send(:initialize, fixture_path('lorem.azw3'))
+    end
+  end
+
+  def test_that_it_caches_rawml
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    rawml = book.rawml
+    parts = book.rawml_parts
+    assert_equal rawml, book.rawml
+    assert_equal parts, book.rawml_parts
+    assert_nil book.release_caches
+    assert_equal rawml, book.rawml
+    assert_equal parts, book.rawml_parts
+  end
+
+  def test_that_it_can_enumerate_document_records
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    records = book.records
+    assert_equal 15, book.each_record.size
+    assert_equal records, book.each_record.to_a
+    assert_equal records.map { |rec| rec[:size] }, book.each_record(payload: false).lazy.map { |rec| rec[:size] }.to_a
+    assert_nil book.each_record(payload: false).first.data
+  end
+
+  def test_that_it_can_access_single_record
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    records = book.records
+    assert_equal records[0], book.record(0)
+    assert_equal records[-1], book.record(-1)
+    assert_nil book.record(15)
+    assert_nil book.record(-16)
+    rec = book.record(1, payload: false)
+    assert_equal records[1][:size], rec[:size]
+    assert_nil rec.data
+  end
+
+  def test_that_payloads_are_frozen_and_outlive_caches
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    rawml = book.rawml
+    markup = book.rawml_parts[:markup][0][:data]
+    record = book.record(1)[:data]
+    assert rawml.frozen?
+    assert markup.frozen?
+    assert record.frozen?
+    book.release_caches
+    book = nil
+    GC.start
+    assert_equal 1840, rawml.size
+    assert_match(/lorem ipsum dolor/i, markup)
+    refute_empty record
+  end
+
+  def test_that_it_can_load_book_from_string
+    bytes = File.binread(fixture_path('lorem.azw3'))
+    book = MOBI::Book.from_string(bytes)
+    assert_equal 'Lorem Ipsum', book.title
+    assert_equal 1840, book.rawml.size
+    assert_raises(MOBI::Error) do
+      MOBI::Book.from_string('')
+    end
+  end
+
+  def test_that_it_can_load_book_from_io
+    File.open(fixture_path('lorem.azw3'), 'rb') do |io|
+      book = MOBI::Book.from_io(io)
+      assert_equal 'Lorem Ipsum', book.title
+    end
+    File.open(fixture_path('lorem.azw3'), 'rb') do |io|
+      header = io.read(4)
+      book = MOBI::Book.from_io(io)
+      assert_equal 'Lorem Ipsum', book.title
+      assert_equal 4, io.pos
+      assert_equal File.binread(fixture_path('lorem.azw3'), 4, 4), io.read(4)
+      assert_equal 'test', header
+    end
+    io = StringIO.new(File.binread(fixture_path('lorem.azw3')))
+    book = MOBI::Book.from_io(io)
+    assert_equal 'Lorem Ipsum', book.title
+  end
+
+  def test_that_it_can_map_book_into_memory
+    expected = MOBI::Book.new(fixture_path('lorem.azw3'))
+    book = MOBI::Book.new(fixture_path('lorem.azw3'), mmap: true)
+    assert_equal expected.title, book.title
+    assert_equal expected.full_name, book.full_name
+    assert_equal expected.pdb_header, book.pdb_header
+    assert_equal expected.mobi_header, book.mobi_header
+    assert_equal expected.exth_header, book.exth_header
+    assert_equal expected.records, book.records
+    assert_equal expected.rawml, book.rawml
+    assert_equal expected.rawml_parts, book.rawml_parts
+  end
+
+  def test_that_it_can_load_headers_only
+    expected = MOBI::Book.new(fixture_path('lorem.azw3'))
+    book = MOBI::Book.new(fixture_path('lorem.azw3'), headers_only: true)
+    assert_equal expected.title, book.title
+    assert_equal expected.full_name, book.full_name
+    assert_equal expected.pdb_header, book.pdb_header
+    assert_equal expected.record0_header, book.record0_header
+    assert_equal expected.mobi_header, book.mobi_header
+    assert_equal expected.exth_header, book.exth_header
+    assert_equal expected.each_record(payload: false).to_a, book.each_record(payload: false).to_a
+    assert_raises(MOBI::Error) { book.rawml }
+    assert_raises(MOBI::Error) { book.rawml_parts }
+    assert_raises(MOBI::Error) { book.records }
+    assert_raises(MOBI::Error) { book.record(1) }
+  end
+
+  def test_that_it_can_load_one_half_of_hybrid_book
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'hybrid.azw3')
+      File.binwrite(path, fixture_hybrid)
+      [false, true].each do |mmap|
+        both = MOBI::Book.new(path, mmap: mmap)
+        assert both.is_hybrid?
+        assert_equal 'Lorem Ipsum', both.title
+        assert_equal 'KF7 part', both.next.title
+
+        kf8 = MOBI::Book.new(path, mmap: mmap, format: :kf8)
+        assert kf8.is_kf8?
+        assert_nil kf8.next
+        assert_equal both.rawml_parts, kf8.rawml_parts
+
+        kf7 = MOBI::Book.new(path, mmap: mmap, format: :kf7)
+        refute kf7.is_hybrid?
+        refute kf7.is_kf8?
+        assert_nil kf7.next
+        assert_equal 'KF7 part', kf7.title
+        assert_equal 3, kf7.records.size
+        assert_equal both.next.rawml, kf7.rawml
+        assert_equal '<html><body><p>Lorem ipsum in KF7</p></body></html>', kf7.rawml
+      end
+      assert_raises(ArgumentError) { MOBI::Book.new(path, format: :epub) }
+    end
+    assert_raises(MOBI::Error) { MOBI::Book.new(fixture_path('lorem.azw3'), format: :kf7) }
+    assert MOBI::Book.new(fixture_path('lorem.azw3'), format: :kf8).is_kf8?
+  end
+
+  def test_that_next_keeps_hybrid_book_alive
+    book = MOBI::Book.from_string(fixture_hybrid)
+    halves = Array.new(3) { book.next }
+    book = nil
+    GC.start
+    halves.each { |half| assert_equal 'KF7 part', half.title }
+    assert_equal 'Lorem Ipsum', halves.first.next.title
+    halves = nil
+    GC.start
+  end
+
+  def test_that_it_can_cache_parts_in_sidecar
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'images.azw3')
+      File.binwrite(path, fixture_with_images)
+      expected = MOBI::Book.new(path)
+      book = MOBI::Book.new(path, cache: true)
+      refute book.cached?
+      assert_equal expected.rawml_parts, book.rawml_parts
+      assert File.exist?("#{path}.mbcache")
+
+      [MOBI::Book.new(path, cache: true), MOBI::Book.new(path, mmap: true, cache: true)].each do |cached|
+        assert cached.cached?
+        assert_equal expected.rawml_parts, cached.rawml_parts
+        assert_equal expected.rawml, cached.rawml
+      end
+
+      File.binwrite(path, fixture_with_images.sub('Lorem', 'Lorum'))
+      refute MOBI::Book.new(path, cache: true).cached?
+      MOBI::Book.new(path, cache: true).rawml_parts
+      assert MOBI::Book.new(path, cache: true).cached?
+      File.utime(Time.now, File.mtime(path) + 10, path)
+      refute MOBI::Book.new(path, cache: true).cached?
+      assert_raises(ArgumentError) { MOBI::Book.new(path, headers_only: true, cache: true) }
+    end
+  end
+
+  def test_that_it_can_instrument_phases
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    assert_equal %i[read parse decompress index build], book.stats.keys
+    assert(book.stats.values.all? { |phase| phase[:calls].zero? })
+
+    events = []
+    MOBI.instrument { |phase, payload| events << [phase, payload] }
+    book = MOBI::Book.new(fixture_path('lorem.azw3'), mmap: true)
+    text = book.rawml
+    parts = book.rawml_parts
+    assert_equal %i[read parse decompress index build], events.map(&:first)
+    assert(events.all? { |_, payload| payload[:book].equal?(book) && payload[:time] >= 0 })
+    stats = book.stats
+    assert_equal File.size(fixture_path('lorem.azw3')), stats[:read][:bytes]
+    assert_equal text.bytesize, stats[:decompress][:bytes]
+    sizes = parts.values_at(:markup, :flow, :resources).compact.flatten.map { |part| part[:size] }
+    assert_equal sizes.inject(0, :+), stats[:build][:bytes]
+    assert_equal 1, stats[:index][:calls]
+  ensure
+    MOBI.instrument
+  end
+
+  def test_that_results_outlive_raising_hook
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    MOBI.instrument { |phase, _| raise ArgumentError, phase.to_s }
+    assert_raises(ArgumentError) { MOBI::Book.new(fixture_path('lorem.azw3')) }
+    assert_raises(ArgumentError) { book.rawml }
+    assert_raises(ArgumentError) { book.rawml_parts }
+    MOBI.instrument
+    assert_equal 1, book.stats[:decompress][:calls]
+    assert_equal book.rawml, MOBI::Book.new(fixture_path('lorem.azw3')).rawml
+    assert_equal 1, book.stats[:decompress][:calls]
+    assert_equal 1, book.stats[:index][:calls]
+    refute_empty book.rawml_parts[:markup]
+  ensure
+    MOBI.instrument
+  end
+
+  def test_that_headers_are_frozen_value_types
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    hdr = book.pdb_header
+    assert_kind_of MOBI::PdbHeader, hdr
+    assert hdr.frozen?
+    assert_equal 'test', hdr.name
+    assert_equal hdr.name, hdr[:name]
+    assert_kind_of MOBI::Record0Header, book.record0_header
+    assert_equal 'MOBI', book.mobi_header.magic
+    assert_kind_of MOBI::ExthEntry, book.exth_header.first
+    assert_kind_of MOBI::Record, book.record(0)
+    assert_kind_of MOBI::Part, book.rawml_parts[:markup][0]
+    refute book.record(0, payload: false).to_h.key?(:data)
+    refute_includes book.mobi_header.to_h.values, nil
+  end
+
+  def test_that_it_can_extract_plain_text
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    text = book.text
+    assert_equal Encoding::UTF_8, text.encoding
+    assert text.valid_encoding?
+    assert_match(/lorem ipsum dolor/i, text)
+    refute_match(/[<>]/, text)
+    refute_match(/  /, text)
+    chunks = book.each_text_chunk(64).to_a
+    assert(chunks.all? { |chunk| chunk.bytesize <= 64 && chunk.valid_encoding? })
+    assert_equal text, chunks.join
+    assert_raises(ArgumentError) { book.each_text_chunk(1) {} }
+  end
+
+  def test_that_it_can_decompress_text_records_one_by_one
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    rawml = book.rawml
+    first = book.text_record(0)
+    assert rawml.start_with?(first)
+    assert_equal first, book.text_record(-1)
+    assert_nil book.text_record(1)
+    assert_equal 1, book.each_text_record.size
+    assert_equal rawml, book.each_text_record.to_a.join
+    book.each_text_record { |text| assert_equal text, book.text_record(0) }
+    book.release_caches
+    assert_equal first, book.text_record(0)
+    headers_only = MOBI::Book.new(fixture_path('lorem.azw3'), headers_only: true)
+    assert_raises(MOBI::Error) { headers_only.text_record(0) }
+  end
+
+  def test_that_it_can_enumerate_resources
+    assert_empty MOBI::Book.new(fixture_path('lorem.azw3')).each_resource.to_a
+    book = MOBI::Book.from_string(fixture_with_images)
+    resources = book.each_resource.to_a
+    assert_equal [[:gif, 0, 36], [:bmp, 1, 52]], resources.map { |res| [res.type_sym, res.uid, res.size] }
+    assert resources.all?(&:frozen?)
+    assert_equal book.rawml_parts[:resources].map(&:data), resources.map(&:data)
+    assert_equal resources[1].data, book.resource_data(1)
+    assert_nil book.resource_data(2)
+  end
+
+  def test_that_it_can_export_resources
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'images.azw3')
+      File.binwrite(path, fixture_with_images)
+      [MOBI::Book.new(path), MOBI::Book.new(path, mmap: true)].each_with_index do |book, i|
+        out = File.join(dir, i.to_s)
+        Dir.mkdir(out)
+        paths = book.export_resources(out)
+        assert_equal %w[resource00000.gif resource00001.bmp], paths.map { |file| File.basename(file) }
+        assert_equal book.each_resource.map(&:data), paths.map { |file| File.binread(file) }
+      end
+      assert_raises(Errno::ENOENT) { MOBI::Book.new(path).export_resources(File.join(dir, 'missing')) }
+    end
+  end
+
+  def test_that_it_can_find_cover_and_thumbnail
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    assert_nil book.cover
+    assert_nil book.thumbnail
+    book = MOBI::Book.from_string(fixture_with_images)
+    resources = book.each_resource.to_a
+    assert_equal resources[0], book.cover
+    assert_equal resources[1], book.thumbnail
+    assert_equal resources[0].data, book.cover.data
+    assert_equal 1, book.exth_header.count { |entry| entry.id == :cover_offset }
+  end
+
+  def test_that_it_can_export_epub
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'lorem.epub')
+      assert_equal path, book.export_epub(path)
+      epub = File.binread(path)
+      assert epub.start_with?("PK\x03\x04".b)
+      assert_equal 'mimetypeapplication/epub+zip', epub[30, 28]
+      %w[META-INF/container.xml OEBPS/content.opf OEBPS/part00000.html].each do |name|
+        assert_includes epub, name
+      end
+      io = StringIO.new(''.b)
+      book.export_epub(io, threads: 1)
+      assert_equal epub, io.string
+      assert_raises(ArgumentError) { book.export_epub(io, threads: 0) }
+      assert_raises(Errno::ENOENT) { book.export_epub(File.join(dir, 'missing', 'lorem.epub')) }
+    end
+  end
+
+  def test_that_it_can_read_toc_and_guide
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    toc = book.toc
+    assert toc.frozen?
+    assert_equal 1, toc.size
+    entry = toc.first
+    assert_kind_of MOBI::TocEntry, entry
+    assert_equal ['Start', 0, 229, 1611], [entry.label, entry.level, entry.pos, entry.length]
+    assert_equal [0, 0], [entry.fid, entry.off]
+    assert_equal Encoding::UTF_8, entry.label.encoding
+    assert_nil entry.parent
+    assert_nil book.guide
+    headers_only = MOBI::Book.new(fixture_path('lorem.azw3'), headers_only: true)
+    assert_raises(MOBI::Error) { headers_only.toc }
+  end
+
+  def test_that_it_can_edit_metadata_and_save
+    original = MOBI::Book.new(fixture_path('lorem.azw3'))
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'lorem.azw3')
+      book = MOBI::Book.new(fixture_path('lorem.azw3'))
+      assert_equal 'Lorem Dolor', (book.title = 'Lorem Dolor')
+      book.asin = 'B000000000'
+      book.description = nil
+      book.add_author('Second Author')
+      assert_same book, book.save(path)
+
+      saved = MOBI::Book.new(path)
+      assert_equal ['Lorem Dolor', 'B000000000'], [saved.title, saved.asin]
+      assert_nil saved.description
+      authors = saved.exth_header.select { |entry| entry.id == :author }.map(&:val_str)
+      assert_equal ['libmobi.rb', 'Second Author'], authors
+      assert_equal original.rawml, saved.rawml
+      assert_equal original.records[1..-1].map(&:data), saved.records[1..-1].map(&:data)
+      assert_raises(TypeError) { book.title = 42 }
+      assert_raises(RuntimeError) { book.freeze.title = 'Frozen' }
+    end
+  end
+
+  def test_that_setters_drop_caches
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    book.rawml_parts
+    size = ObjectSpace.memsize_of(book)
+    book.title = 'Lorem Dolor'
+    assert_operator ObjectSpace.memsize_of(book), :<, size
+    book.rawml_parts
+    book.add_author('Second Author')
+    assert_operator ObjectSpace.memsize_of(book), :<, size
+  end
+
+  def test_that_metadata_cannot_be_set_while_book_is_read
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    io = StringIO.new(''.b)
+    io.define_singleton_method(:write) do |data|
+      book.title = 'Busy'
+      super(data)
+    end
+    error = assert_raises(MOBI::Error) { book.export_epub(io, threads: 1) }
+    assert_match(/another thread/, error.message)
+    book.title = 'Idle'
+    assert_equal 'Idle', book.title
+  end
+
+  def test_that_it_can_save_in_place
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'lorem.azw3')
+      FileUtils.cp(fixture_path('lorem.azw3'), path)
+      size = File.size(path)
+      book = MOBI::Book.new(path, headers_only: true)
+      book.title = 'Lorem'
+      assert_equal true, book.save_in_place
+      assert_equal size, File.size(path)
+      assert_equal 'Lorem', MOBI::Book.new(path).title
+
+      book = MOBI::Book.new(path, mmap: true)
+      book.description = 'Lorem ipsum dolor sit amet. ' * 1000
+      assert_equal false, book.save_in_place
+      saved = MOBI::Book.new(path)
+      assert_equal book.description, saved.description
+      assert_equal MOBI::Book.new(fixture_path('lorem.azw3')).rawml, saved.rawml
+
+      book = MOBI::Book.new(path, headers_only: true)
+      book.description = 'Lorem ipsum dolor sit amet. ' * 2000
+      assert_raises(MOBI::Error) { book.save_in_place }
+      assert_raises(MOBI::Error) { MOBI::Book.from_string(File.binread(path)).save_in_place }
+    end
+  end
+
+  def test_that_it_does_not_patch_mapped_book_in_place
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'lorem.azw3')
+      FileUtils.cp(fixture_path('lorem.azw3'), path)
+      book = MOBI::Book.new(path, mmap: true)
+      data = book.record(0).data
+      expected = data.dup
+      book.title = 'Lorem'
+      assert_equal false, book.save_in_place
+      assert_equal expected, data
+      assert_equal 'Lorem', MOBI::Book.new(path).title
+    end
+  end
+
+  def test_that_it_can_save_hybrid_book
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'hybrid.mobi')
+      book = MOBI::Book.from_string(fixture_hybrid)
+      book.title = 'Edited'
+      book.save(path)
+      assert_equal 'Edited', MOBI::Book.new(path, format: :kf7).title
+      assert_equal book.next.rawml, MOBI::Book.new(path).next.rawml
+      assert_raises(MOBI::Error) { book.next.save(path) }
+
+      half = MOBI::Book.new(path, format: :kf8)
+      assert_raises(MOBI::Error) { half.title = 'Half' }
+      assert_raises(MOBI::Error) { half.save(path) }
+    end
+  end
 end
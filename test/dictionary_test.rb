@@ -0,0 +1,71 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+require 'test_helper'
+require 'objspace'
+
+class DictionaryTest < Minitest::Test
+  def setup
+    @book = MOBI::Book.from_string(fixture_dictionary)
+    @dictionary = MOBI::Dictionary.new(@book)
+  end
+
+  def test_that_it_requires_dictionary
+    assert @book.has_orth_index?
+    assert @book.has_infl_index?
+    assert_raises(MOBI::Error) { MOBI::Dictionary.new(MOBI::Book.new(fixture_path('lorem.azw3'))) }
+    assert_raises(TypeError) { MOBI::Dictionary.new('lorem') }
+    assert_raises(MOBI::Error) { @dictionary.send(:initialize, @book) }
+  end
+
+  def test_that_it_can_lookup_headword
+    assert_equal 3, @dictionary.size
+    entries = @dictionary.lookup('lorem')
+    assert entries.frozen?
+    assert_equal 1, entries.size
+    entry = entries.first
+    assert_kind_of MOBI::DictionaryEntry, entry
+    assert_equal ['lorem', 2, 321, 26], [entry.headword, entry.index, entry.pos, entry.length]
+    assert_equal 'Lorem ipsum dolor sit amet', entry.markup
+    assert_equal Encoding::UTF_8, entry.markup.encoding
+    assert_empty @dictionary.lookup('Lorem')
+    assert_empty @dictionary.lookup('lore')
+  end
+
+  def test_that_it_can_lookup_prefix
+    assert_equal %w[dolor ipsum lorem], @dictionary.lookup_prefix('').map(&:headword)
+    assert_equal %w[dolor ipsum], @dictionary.lookup_prefix('', limit: 2).map(&:headword)
+    assert_equal %w[lorem], @dictionary.lookup_prefix('lo').map(&:headword)
+    assert_equal 'dolor sit amet', @dictionary.lookup_prefix('dol').first.markup
+    assert_empty @dictionary.lookup_prefix('ipsumx')
+    assert_raises(ArgumentError) { @dictionary.lookup_prefix('', limit: -1) }
+  end
+
+  def test_that_it_can_lookup_inflected_forms
+    assert_equal %w[dolor], @dictionary.lookup_inflected('dolores').map(&:headword)
+    assert_equal %w[ipsum], @dictionary.lookup_inflected('ipsa').map(&:headword)
+    assert_equal %w[ipsum], @dictionary.lookup_inflected('ipsums').map(&:headword)
+    assert_equal %w[ipsum], @dictionary.lookup_inflected('ipsum').map(&:headword)
+    assert_empty @dictionary.lookup_inflected('lorems')
+    assert_empty @dictionary.lookup('ipsa')
+  end
+
+  def test_that_it_reports_native_memory
+    native = ObjectSpace.memsize_of(@dictionary) - ObjectSpace.memsize_of(MOBI::Dictionary.allocate)
+    assert_operator native, :>, 0
+    assert_operator MOBI.memory_stats[:native_bytes], :>=, native
+  end
+end
@@ -15,6 +15,10 @@
 # along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 require 'test_helper'
+require 'objspace'
+require 'digest'
+require 'rbconfig'
+require 'tmpdir'
 
 class MOBITest < Minitest::Test
   def test_that_it_has_a_version_number
@@ -24,4 +28,86 @@ class MOBITest < Minitest::Test
   def test_that_it_has_the_library_version_number
     refute_nil MOBI::LIB_VERSION
   end
+
+  def test_that_it_can_scan_books
+    path = fixture_path('lorem.azw3')
+    missing = fixture_path('missing.azw3')
+    results = MOBI.scan([path, missing, path], threads: 2, fields: %i[title author])
+    assert_equal 3, results.size
+    assert_equal({ index: 0, path: path, title: 'Lorem Ipsum', author: 'libmobi.rb' }, results[0])
+    assert_equal 1, results[1][:index]
+    assert_equal missing, results[1][:path]
+    assert_kind_of String, results[1][:error]
+    assert_kind_of Integer, results[1][:code]
+    assert_equal results[0].merge(index: 2), results[2]
+  end
+
+  def test_that_scan_yields_results_as_they_complete
+    paths = Array.new(8) { fixture_path('lorem.azw3') }
+    yielded = []
+    assert_nil(MOBI.scan(paths) { |result| yielded << result })
+    assert_equal (0...8).to_a, yielded.map { |result| result[:index] }.sort
+    assert_equal MOBI::Book.new(paths[0]).full_name, yielded[0][:full_name]
+    assert_raises(ArgumentError) { MOBI.scan(paths, fields: [:unknown]) }
+    assert_raises(ArgumentError) { MOBI.scan(paths, threads: 0) }
+  end
+
+  def test_that_huffcdic_cache_can_be_configured
+    limit = MOBI::HuffCDIC.cache_limit
+    MOBI::HuffCDIC.cache_limit = 0
+    stats = MOBI::HuffCDIC.cache_stats
+    assert_equal %i[hits misses entries bytes], stats.keys
+    assert_equal 0, stats[:entries]
+    assert_equal 0, stats[:bytes]
+    assert_raises(ArgumentError) { MOBI::HuffCDIC.cache_limit = -1 }
+  ensure
+    MOBI::HuffCDIC.cache_limit = limit
+  end
+
+  def test_that_huffcdic_books_match_libmobi_decoder
+    expected = MOBI::Book.new(fixture_path('lorem.azw3'))
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'lorem.mobi')
+      File.binwrite(path, fixture_huffcdic)
+      book = MOBI::Book.new(path)
+      assert_equal :huff_cdic, book.record0_header[:compression_type_sym]
+      assert_equal expected.text_record(0), book.text_record(0)
+      assert_equal expected.rawml, book.rawml
+      script = 'require "libmobi"; require "digest"; print Digest::SHA256.hexdigest(MOBI::Book.new(ARGV[0]).rawml)'
+      args = [RbConfig.ruby, *$LOAD_PATH.map { |load_path| "-I#{load_path}" }, '-e', script, path]
+      reference = IO.popen({ 'MOBI_PALMDOC' => 'reference' }, args, &:read)
+      assert_equal Digest::SHA256.hexdigest(book.rawml), reference
+    end
+  end
+
+  def test_that_huffcdic_tables_are_shared_between_books
+    limit = MOBI::HuffCDIC.cache_limit
+    MOBI::HuffCDIC.cache_limit = 0
+    MOBI::HuffCDIC.cache_limit = 8
+    skip 'the tables are not cached without threads' if MOBI::HuffCDIC.cache_limit.zero?
+    data = fixture_huffcdic
+    before = MOBI::HuffCDIC.cache_stats
+    first = MOBI::Book.from_string(data).text_record(0)
+    assert_equal before[:misses] + 1, MOBI::HuffCDIC.cache_stats[:misses]
+    assert_equal first, MOBI::Book.from_string(data).text_record(0)
+    stats = MOBI::HuffCDIC.cache_stats
+    assert_equal before[:hits] + 1, stats[:hits]
+    assert_equal 1, stats[:entries]
+    assert_operator stats[:bytes], :>, 0
+  ensure
+    MOBI::HuffCDIC.cache_limit = limit
+  end
+
+  def test_that_books_report_native_memory
+    assert_equal %i[books native_bytes], MOBI.memory_stats.keys
+    book = MOBI::Book.new(fixture_path('lorem.azw3'))
+    records = book.records.inject(0) { |sum, record| sum + record.size }
+    stats = MOBI.memory_stats
+    assert_operator stats[:books], :>=, 1
+    assert_operator stats[:native_bytes], :>=, records
+    assert_operator ObjectSpace.memsize_of(book), :>=, records
+    text = book.rawml
+    assert_operator ObjectSpace.memsize_of(book), :>=, records + text.bytesize
+    assert_operator ObjectSpace.memsize_of(MOBI::Book.new(fixture_path('lorem.azw3'), mmap: true)), :<, records
+  end
 end
@@ -0,0 +1,118 @@
+# libmobi - library for handling Kindle (MOBI) formats of ebook documents
+# Copyright (C) 2018 Sergey Avseyev <sergey.avseyev@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+require 'test_helper'
+require 'digest'
+require 'rbconfig'
+require 'tmpdir'
+
+class PalmDOCTest < Minitest::Test
+  WORDS = %w[lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod <p> </p> &amp;].freeze
+
+  # Greedy compressor, which exercises every kind of token
+  def compress(data)
+    bytes = data.bytes
+    out = []
+    last = {}
+    i = 0
+    while i < bytes.size
+      key = bytes[i, 3]
+      j = last[key] if key.size == 3
+      last[key] = i
+      if j && i - j <= 2047
+        len = 0
+        len += 1 while len < 10 && i + len < bytes.size && bytes[j + len] == bytes[i + len]
+        if len >= 3
+          out.concat([0x8000 | (i - j) << 3 | (len - 3)].pack('n').bytes)
+          i += len
+          next
+        end
+      end
+      c = bytes[i]
+      if c == 0x20 && bytes[i + 1] && bytes[i + 1].between?(0x40, 0x7f)
+        out << (bytes[i + 1] ^ 0x80)
+        i += 2
+      elsif c.zero? || c.between?(0x09, 0x7f)
+        out << c
+        i += 1
+      else
+        run = bytes[i, 8].take_while { |b| !(b.zero? || b.between?(0x09, 0x7f)) }
+        out << run.size
+        out.concat(run)
+        i += run.size
+      end
+    end
+    out.pack('C*')
+  end
+
+  def generate(random)
+    data = ''.b
+    while data.bytesize < 4096
+      case random.rand(6)
+      when 0 then data << Array.new(random.rand(1..40)) { random.rand(256) }.pack('C*')
+      when 1 then data << (random.rand(256).chr * random.rand(3..40))
+      when 2 then data << (Array.new(random.rand(2..15)) { random.rand(256) }.pack('C*') * random.rand(2..6))
+      else data << WORDS.sample(random: random) << ' '
+      end
+    end
+    data.byteslice(0, random.rand(1..4096))
+  end
+
+  def test_that_all_implementations_match_the_generic_one
+    random = Random.new(42)
+    implementations = MOBI::PalmDOC.implementations
+    assert_includes implementations, 'generic'
+    assert_includes implementations, MOBI::PalmDOC.implementation unless MOBI::PalmDOC.implementation == 'reference'
+    200.times do
+      plain = generate(random)
+      record = compress(plain)
+      implementations.each do |impl|
+        assert_equal plain, MOBI::PalmDOC.decode(record, impl), "#{impl} on #{record.unpack1('H*')}"
+      end
+    end
+  end
+
+  def test_that_it_rejects_corrupt_records
+    ["\x80\x08".b, "a\x80".b, "\x05ab".b, "ab\x80\x18".b].each do |record|
+      MOBI::PalmDOC.implementations.each do |impl|
+        assert_raises(MOBI::Error, impl) { MOBI::PalmDOC.decode(record, impl) }
+      end
+    end
+    assert_raises(ArgumentError) { MOBI::PalmDOC.decode('', 'unknown') }
+  end
+
+  def test_that_rawml_matches_libmobi_decoder
+    assert_rawml_matches_reference(fixture_path('lorem.azw3'))
+  end
+
+  def test_that_rawml_keeps_multibyte_overlap_like_libmobi
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'multibyte.azw3')
+      File.binwrite(path, fixture_multibyte)
+      assert MOBI::Book.new(path).rawml.end_with?("\xc3\xa9".b)
+      assert_rawml_matches_reference(path)
+    end
+  end
+
+  private
+
+  def assert_rawml_matches_reference(path)
+    script = 'require "libmobi"; require "digest"; print Digest::SHA256.hexdigest(MOBI::Book.new(ARGV[0]).rawml)'
+    args = [RbConfig.ruby, *$LOAD_PATH.map { |dir| "-I#{dir}" }, '-e', script, path]
+    reference = IO.popen({ 'MOBI_PALMDOC' => 'reference' }, args, &:read)
+    assert_equal Digest::SHA256.hexdigest(MOBI::Book.new(path).rawml), reference
+  end
+end
@@ -18,7 +18,209 @@ $LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
 require 'libmobi'
 
 require 'minitest/autorun'
+require 'stringio'
 
 def fixture_path(id)
   File.expand_path(File.join(__dir__, 'fixtures', id))
 end
+
+# lorem.azw3 has no images, so its FLIS and FCIS records are overwritten with
+# GIF and BMP of the same size, and the first image index is pointed at them.
+# Unused EXTH entries 125 and 207 become cover (GIF) and thumbnail (BMP) offsets.
+def fixture_with_images
+  data = File.binread(fixture_path('lorem.azw3'))
+  offsets = Array.new(data.unpack1('@76n')) { |i| data.unpack1("@#{78 + 8 * i}N") }
+  data[offsets[0] + 108, 4] = [12].pack('N')
+  data[offsets[0] + 638, 12] = [201, 12, 0].pack('N3')
+  data[offsets[0] + 686, 12] = [202, 12, 1].pack('N3')
+  data[offsets[12], 36] = 'GIF89a'.b.ljust(36, "\x00")
+  data[offsets[13], 52] = ['BM', 52].pack('a2V').ljust(52, "\x01")
+  data
+end
+
+# Variable width integer of the index entries, the last byte has the high bit set
+def index_varlen(value)
+  bytes = [value & 0x7f | 0x80]
+  bytes.unshift(value & 0x7f) while (value >>= 7) > 0
+  bytes.pack('C*')
+end
+
+# INDX header record with TAGX and single record with the entries. Tags are
+# [tag, bitmask] pairs, entries are [label, {tag => values}] pairs.
+def build_index(tags, entries)
+  tagx = tags.map { |tag, mask| [tag, 1, mask, 0].pack('C4') }.join + [0, 0, 0, 1].pack('C4')
+  main = ['INDX', 192, 1, 65_001, entries.size].pack('a4N@24NN@36N').ljust(192, "\x00")
+  main << ['TAGX', 12 + tagx.bytesize, 1].pack('a4NN') << tagx
+  body = ''.b
+  offsets = entries.map do |label, values|
+    offset = 192 + body.bytesize
+    control = 0
+    data = tags.select { |tag, _| values.key?(tag) }.map do |tag, mask|
+      control |= Array(values[tag]).size * (mask & -mask)
+      Array(values[tag]).map { |value| index_varlen(value) }.join
+    end
+    body << [label.bytesize, label, control].pack('Ca*C') << data.join
+    offset
+  end
+  data = ['INDX', 192, 192 + body.bytesize, entries.size].pack('a4N@20NN').ljust(192, "\x00")
+  [main, data + body + 'IDXT' + offsets.pack('n*')]
+end
+
+# Append the records to the PDB, and return their numbers
+def append_records(data, records)
+  count = data.unpack1('@76n')
+  list = Array.new(count) { |i| data.unpack("@#{78 + 8 * i}NN") }
+  shift = 8 * records.size
+  offset = data.bytesize + shift
+  list = list.map { |off, uid| [off + shift, uid] }
+  records.each_with_index do |rec, i|
+    list << [offset, 2 * (count + i)]
+    offset += rec.bytesize
+  end
+  data.replace(data[0, 76] + [count + records.size].pack('n') + list.flatten.pack('N*') + data[78 + 8 * count..-1] +
+               records.join)
+  (count...count + records.size).to_a
+end
+
+# lorem.azw3 turned into a dictionary of three headwords pointing into its
+# text. "dolor" and "ipsum" have inflection rules making "dolores", "ipsa"
+# and "ipsums".
+def fixture_dictionary
+  data = File.binread(fixture_path('lorem.azw3'))
+  text = 'Lorem ipsum dolor sit amet'
+  pos = 321
+  orth = build_index([[1, 0x01], [2, 0x02], [42, 0x0c]],
+                     [['dolor', { 1 => pos + 12, 2 => 14, 42 => 0 }],
+                      ['ipsum', { 1 => pos + 6, 2 => 5, 42 => 1 }],
+                      ['lorem', { 1 => pos, 2 => text.size }]])
+  infl = build_index([[26, 0x03]],
+                     [['', { 26 => 2 }], ['', { 26 => [3, 4] }],
+                      ["\x02se", {}], ["\x03mu\x02a", {}], ["\x02s", {}]])
+  orth_index, = append_records(data, orth)
+  infl_index, = append_records(data, infl)
+  r0 = data.unpack1('@78N')
+  data[r0 + 40, 8] = [orth_index, infl_index].pack('NN')
+  data
+end
+
+# Hybrid book as made by kindlegen: KF7 half with one uncompressed text
+# record, the boundary record, and the records of lorem.azw3 as KF8 half.
+def fixture_hybrid
+  kf8 = File.binread(fixture_path('lorem.azw3'))
+  offsets = Array.new(kf8.unpack1('@76n')) { |i| kf8.unpack1("@#{78 + 8 * i}N") } << kf8.bytesize
+  text = '<html><body><p>Lorem ipsum in KF7</p></body></html>'
+  exth = ['EXTH', 40, 2, 503, 16, 'KF7 part', 121, 12, 4].pack('a4N4a8N3')
+  r0 = "\x00".b * 248
+  r0[0, 16] = [1, 0, text.bytesize, 1, 4096, 0, 0].pack('nnNn4')
+  r0[16, 24] = ['MOBI', 232, 2, 65_001, 1, 6].pack('a4N5')
+  r0[40, 40] = [0xffffffff].pack('N') * 10
+  r0[80, 32] = [2, 248 + exth.bytesize, 8, 9, 0, 0, 6, 0xffffffff].pack('N8')
+  r0[128, 4] = [0x40].pack('N')
+  r0[164, 8] = [0xffffffff].pack('N') * 2
+  r0[192, 24] = [1, 1, 1, 0xffffffff, 0, 0xffffffff, 0].pack('nnN5')
+  r0[224, 24] = [0xffffffff, 0, 0xffffffff, 0xffffffff, 0, 0xffffffff].pack('N6')
+  records = [r0 + exth + "KF7 part\x00\x00\x00\x00", text, "\xe9\x8e\r\n".b, 'BOUNDARY'.b]
+  records += Array.new(offsets.size - 1) { |i| kf8[offsets[i]...offsets[i + 1]] }
+  build_pdb(kf8, records)
+end
+
+# lorem.azw3 with the first bytes of a character, which continues in the
+# next text record, stored in the multibyte trailing entry of its text record.
+def fixture_multibyte
+  data = File.binread(fixture_path('lorem.azw3'))
+  offsets = Array.new(data.unpack1('@76n')) { |i| data.unpack1("@#{78 + 8 * i}N") } << data.bytesize
+  records = Array.new(offsets.size - 1) { |i| data[offsets[i]...offsets[i + 1]] }
+  # two overlap bytes and their count replace the empty entry before the TBS entry
+  records[1][-4, 1] = "\xc3\xa9\x02".b
+  build_pdb(data, records)
+end
+
+# PDB with the header of data and the records
+def build_pdb(data, records)
+  offset = 78 + 8 * records.size + 2
+  list = records.each_with_index.map do |rec, i|
+    offset += rec.bytesize
+    [offset - rec.bytesize, 2 * i]
+  end
+  data[0, 76] + [records.size].pack('n') + list.flatten.pack('N*') + "\x00\x00" + records.join
+end
+
+# Phrases of the HUFF/CDIC fixture with the lengths of their codes, the bytes
+# have 9 bits long codes. Phrases marked with true are stored compressed, the
+# last one refers to another compressed phrase.
+HUFF_PHRASES = [
+  [' ', 2], ['e', 3], ['i', 4], ['s', 5], ['u', 6], ['t', 7], ['a', 8], ['</p>', 9], ['<p aid="', 10],
+  ['Vivamus', 11], ['sit amet', 12], ['elit', 13], ['Lorem ipsum dolor sit amet', 14, true], ['euismod', 15],
+  ['facilisis', 16], ['Pellentesque', 17], ['posuere', 18, true], ['mollis', 19], ['Nullam', 20],
+  ['Nulla posuere, nisi', 20, true]
+].freeze
+
+# Canonical code, where shorter codes have bigger values, and the entries are
+# numbered by the length of their codes. Returns [code, length] of every
+# entry, and the mincode/maxcode pairs of the lengths from 1 to 32.
+def huff_code(lengths)
+  codes = []
+  limits = []
+  first = 0
+  index = 0
+  (1..32).each do |len|
+    first <<= 1
+    count = lengths.count(len)
+    count.times { |i| codes << [(1 << len) - 1 - first - i, len] }
+    maxcode = count > 0 ? (1 << len) - 1 - first + index : 0
+    first += count
+    index += count
+    limits << [((1 << len) - first) & 0xffffffff, maxcode]
+  end
+  [codes, limits]
+end
+
+# Greedy encoder, the longest phrase wins, the entries start with [phrase, code, length]
+def huff_encode(text, entries)
+  bits = ''
+  pos = 0
+  while pos < text.bytesize
+    phrase, code, len = entries.select { |entry| text.byteslice(pos, entry[0].bytesize) == entry[0] }
+                               .max_by { |entry| [entry[0].bytesize, -entry[2]] }
+    bits << code.to_s(2).rjust(len, '0')
+    pos += phrase.bytesize
+  end
+  [bits].pack('B*')
+end
+
+# lorem.azw3 with its text record compressed with HUFF/CDIC, the dictionary
+# of 276 entries is split into two CDIC records.
+def fixture_huffcdic
+  data = File.binread(fixture_path('lorem.azw3'))
+  text = MOBI::Book.new(fixture_path('lorem.azw3')).text_record(0).b
+  offsets = Array.new(data.unpack1('@76n')) { |i| data.unpack1("@#{78 + 8 * i}N") } << data.bytesize
+  records = Array.new(offsets.size - 1) { |i| data[offsets[i]...offsets[i + 1]] }
+  phrases = HUFF_PHRASES.map { |phrase, len, packed| [phrase.b, len, packed] } +
+            Array.new(256) { |byte| [byte.chr, 9, false] }
+  phrases = phrases.sort_by.with_index { |(_, len), i| [len, i] }
+  codes, limits = huff_code(phrases.map { |_, len| len })
+  entries = phrases.zip(codes).map { |(phrase, _, packed), (code, len)| [phrase, code, len, packed] }
+  stored = entries.map do |phrase, _, _, packed|
+    next [phrase.bytesize | 0x8000].pack('n') + phrase unless packed
+    # shorter phrases only, so that the entry does not refer to itself
+    bits = huff_encode(phrase, entries.select { |entry| entry[0].bytesize < phrase.bytesize })
+    [bits.bytesize].pack('n') + bits
+  end
+  lengths = phrases.map { |_, len| len }
+  table1 = Array.new(256) do |top|
+    len = (1..8).find { |l| lengths.include?(l) && top >> (8 - l) >= limits[l - 1][0] }
+    next limits[len - 1][1] << 8 | 0x80 | len if len
+    codes.select { |code, l| l > 8 && code >> (l - 8) == top }.map(&:last).min
+  end
+  huff = ['HUFF', 24, 24, 24 + 1024].pack('a4N3').ljust(24, "\x00") + table1.pack('N*') + limits.flatten.pack('N*')
+  cdics = stored.each_slice(256).map do |slice|
+    offset = 2 * slice.size
+    table = slice.map { |entry| (offset += entry.bytesize) - entry.bytesize }
+    ['CDIC', 16, entries.size, 8].pack('a4N3') + table.pack('n*') + slice.join
+  end
+  records[1] = huff_encode(text, entries)
+  records[0][0, 2] = [17_480].pack('n')
+  records[0][112, 8] = [records.size, 1 + cdics.size].pack('NN')
+  records[0][242, 2] = [0].pack('n')
+  build_pdb(data, records + [huff] + cdics)
+end